@@ -0,0 +1,117 @@
+/**
+ * Slab backed bump allocator
+ */
+
+#include "arena.h"
+
+#define ARENA_ROUND(len) \
+    (((len) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+
+void cmdArenaInit(cmdArena *arena) {
+    memset(arena, 0, sizeof(cmdArena));
+}
+
+/**
+ * Free a list of slabs
+ */
+static void __free_slabs(cmdArenaSlab *slab) {
+    cmdArenaSlab *tmp;
+
+    for(; slab != NULL; slab = tmp) {
+        tmp = slab->next;
+        free(slab);
+    }
+}
+
+void cmdArenaFree(cmdArena *arena) {
+    __free_slabs(arena->slab);
+    __free_slabs(arena->spare);
+
+    cmdArenaInit(arena);
+}
+
+void cmdArenaReset(cmdArena *arena) {
+    cmdArenaSlab *slab, *tmp;
+
+    for(slab = arena->slab; slab != NULL; slab = tmp) {
+        tmp = slab->next;
+
+        // Big allocations were one offs, so there's no point keeping them
+        if(slab->size > ARENA_SLAB_SIZE) {
+            free(slab);
+            continue;
+        }
+
+        slab->used = 0;
+        slab->next = arena->spare;
+        arena->spare = slab;
+    }
+
+    arena->slab = NULL;
+    arena->slabs = 0;
+    arena->bytes = 0;
+    arena->allocs = 0;
+}
+
+/**
+ * Start a new slab big enough for at least len bytes.  Large allocations get
+ * a slab of their own which is linked behind the current one, so we don't
+ * abandon whatever room it has left.
+ */
+static cmdArenaSlab *__new_slab(cmdArena *arena, size_t len) {
+    cmdArenaSlab *slab;
+    size_t size = len > ARENA_SLAB_SIZE ? len : ARENA_SLAB_SIZE;
+
+    // Reuse a slab we kept, unless this needs an oversized one
+    if(size == ARENA_SLAB_SIZE && arena->spare) {
+        slab = arena->spare;
+        arena->spare = slab->next;
+    } else if((slab = malloc(sizeof(cmdArenaSlab) + size)) == NULL) {
+        return NULL;
+    } else {
+        arena->allocs++;
+    }
+
+    slab->size = size;
+    slab->used = 0;
+
+    if(arena->slab && len > ARENA_SLAB_SIZE/4) {
+        slab->next = arena->slab->next;
+        arena->slab->next = slab;
+    } else {
+        slab->next = arena->slab;
+        arena->slab = slab;
+    }
+
+    arena->slabs++;
+    arena->bytes += size;
+
+    return slab;
+}
+
+void *cmdArenaAlloc(cmdArena *arena, size_t len) {
+    cmdArenaSlab *slab = arena->slab;
+    void *ptr;
+
+    len = ARENA_ROUND(len);
+
+    // Start a new slab if this one is full
+    if(slab == NULL || slab->used + len > slab->size) {
+        if((slab = __new_slab(arena, len)) == NULL)
+            return NULL;
+    }
+
+    ptr = slab->data + slab->used;
+    slab->used += len;
+
+    return ptr;
+}
+
+void *cmdArenaCalloc(cmdArena *arena, size_t len) {
+    void *ptr;
+
+    if((ptr = cmdArenaAlloc(arena, len)) != NULL)
+        memset(ptr, 0, len);
+
+    return ptr;
+}
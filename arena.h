@@ -0,0 +1,73 @@
+#ifndef REDIS_CMD_ARENA_H
+#define REDIS_CMD_ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Size of each slab we carve allocations out of
+ */
+#define ARENA_SLAB_SIZE (1024*1024)
+
+/**
+ * Alignment of every allocation
+ */
+#define ARENA_ALIGN 8
+
+/**
+ * A single slab, with its bytes following the header
+ */
+typedef struct _cmdArenaSlab {
+    /**
+     * Previously filled slab
+     */
+    struct _cmdArenaSlab *next;
+
+    /**
+     * Usable size and how much of it has been handed out
+     */
+    size_t size;
+    size_t used;
+
+    char data[];
+} cmdArenaSlab;
+
+/**
+ * Bump allocator for objects that all live until their owner is freed.
+ * There is no way to free an individual allocation.
+ */
+typedef struct _cmdArena {
+    /**
+     * Slab we're currently allocating from
+     */
+    cmdArenaSlab *slab;
+
+    /**
+     * Number of slabs and total bytes we're allocating from
+     */
+    size_t slabs;
+    size_t bytes;
+
+    /**
+     * Empty slabs kept by a reset, which we use before asking for more
+     */
+    cmdArenaSlab *spare;
+
+    /**
+     * Slabs we've had to malloc since we were created or last reset
+     */
+    size_t allocs;
+} cmdArena;
+
+void cmdArenaInit(cmdArena *arena);
+void cmdArenaFree(cmdArena *arena);
+
+// Drop every allocation, keeping our slabs (other than oversized ones) to
+// allocate from again
+void cmdArenaReset(cmdArena *arena);
+
+// Allocate len bytes, or len zeroed bytes
+void *cmdArenaAlloc(cmdArena *arena, size_t len);
+void *cmdArenaCalloc(cmdArena *arena, size_t len);
+
+#endif
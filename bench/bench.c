@@ -0,0 +1,417 @@
+/**
+ * Microbenchmarks for our aggregation hot paths, and end to end throughput
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "../buffer.h"
+#include "../cmdhash.h"
+#include "../optimizer.h"
+#include "../resp.h"
+#include "workload.h"
+
+/**
+ * How much we feed the optimizer at a time, and how much output our
+ * buffers hold before draining, matching the command line tool
+ */
+#define BENCH_CHUNK_SIZE 65536
+#define BENCH_HWM (4*1024*1024)
+
+/**
+ * Our workload, both as protocol and already split into arguments
+ */
+typedef struct _benchInput {
+    char *buf;
+    size_t len;
+
+    uint64_t count;
+    int *argc;
+    const char **argv;
+    size_t *argvlen;
+} benchInput;
+
+typedef struct _benchOptions {
+    unsigned int ksize;
+    unsigned int msize;
+    unsigned int runs;
+} benchOptions;
+
+static const struct option g_bench_opts[] = {
+    { "commands", required_argument, NULL, 'n' },
+    { "keys", required_argument, NULL, 'k' },
+    { "members", required_argument, NULL, 'e' },
+    { "skew", required_argument, NULL, 's' },
+    { "mix", required_argument, NULL, 'x' },
+    { "seed", required_argument, NULL, 'S' },
+    { "key-size", required_argument, NULL, 'K' },
+    { "member-size", required_argument, NULL, 'M' },
+    { "runs", required_argument, NULL, 'r' },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 }
+};
+
+static double getTime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Output sink that throws everything away
+ */
+static int discardSink(void *arg, const char *buf, size_t len) {
+    (void)buf;
+
+    *(size_t*)arg += len;
+    return 0;
+}
+
+/**
+ * Print one result, from the fastest of our runs
+ */
+static void printResult(const char *name, uint64_t ops, size_t bytes, double secs) {
+    printf("%-28s %12llu %10.4f %12.0f %10.1f\n", name, (unsigned long long)ops, secs,
+           ops / secs, bytes / secs / (1024*1024));
+}
+
+/**
+ * Split our protocol into argument vectors up front, so the cmdHashAdd
+ * benchmark doesn't time parsing
+ */
+static int splitInput(benchInput *in) {
+    respScanner *s;
+    size_t args = 0, cap = in->count * 4;
+    uint64_t n = 0;
+    int i;
+
+    in->argc = malloc(sizeof(int) * in->count);
+    in->argv = malloc(sizeof(char*) * cap);
+    in->argvlen = malloc(sizeof(size_t) * cap);
+    if(!in->argc || !in->argv || !in->argvlen || (s = respScannerCreate()) == NULL)
+        return -1;
+
+    respScannerAttach(s, in->buf, in->len);
+
+    while(n < in->count && respScannerNext(s) == 1) {
+        in->argc[n++] = s->argc;
+
+        for(i=0;i<s->argc;i++) {
+            in->argv[args] = s->argv[i];
+            in->argvlen[args++] = s->argvlen[i];
+        }
+    }
+
+    respScannerFree(s);
+
+    return n == in->count ? 0 : -1;
+}
+
+/**
+ * Aggregate every command into a fresh cmdHash, which we hand back
+ */
+static cmdHash *benchHashAdd(benchInput *in, benchOptions *opt, double *secs) {
+    cmdHash *ht = cmdHashCreate(opt->ksize, opt->msize);
+    size_t args = 0;
+    double start;
+    uint64_t i;
+
+    if(!ht)
+        return NULL;
+
+    start = getTime();
+
+    for(i=0;i<in->count;i++) {
+        if(cmdHashAdd(ht, in->argc[i], in->argv + args, in->argvlen + args) < 0) {
+            cmdHashFree(ht);
+            return NULL;
+        }
+        args += in->argc[i];
+    }
+
+    *secs = getTime() - start;
+
+    return ht;
+}
+
+static int benchHash(benchInput *in, benchOptions *opt) {
+    double add = 0, get = 0, secs, start;
+    size_t bytes = 0, out;
+    unsigned int run, count = 0;
+    cmdBuffer *buf;
+    cmdHash *ht;
+
+    for(run=0;run<opt->runs;run++) {
+        if((ht = benchHashAdd(in, opt, &secs)) == NULL)
+            return -1;
+        if(!run || secs < add)
+            add = secs;
+
+        if((buf = cmdBufferCreate()) == NULL)
+            return -1;
+
+        out = 0;
+        cmdBufferSetSink(buf, discardSink, &out, BENCH_HWM);
+
+        start = getTime();
+        if(cmdHashGetCommands(ht, buf) < 0 || cmdBufferFlush(buf) < 0)
+            return -1;
+        secs = getTime() - start;
+
+        if(!run || secs < get) {
+            get = secs;
+            bytes = out;
+        }
+
+        count = cmdHashGetCount(ht);
+
+        cmdBufferFree(buf);
+        cmdHashFree(ht);
+    }
+
+    printResult("cmdHashAdd", in->count, in->len, add);
+    printResult("cmdHashGetCommands", count, bytes, get);
+
+    return 0;
+}
+
+static int benchBufferAppend(benchInput *in, benchOptions *opt) {
+    double best = 0, secs, start;
+    cmdBuffer *buf;
+    unsigned int run;
+    respScanner *s;
+    size_t out;
+
+    if((s = respScannerCreate()) == NULL)
+        return -1;
+
+    for(run=0;run<opt->runs;run++) {
+        if((buf = cmdBufferCreate()) == NULL)
+            return -1;
+
+        out = 0;
+        cmdBufferSetSink(buf, discardSink, &out, BENCH_HWM);
+        respScannerAttach(s, in->buf, in->len);
+
+        // Time appending each command's original bytes, as we do when
+        // passing commands through
+        start = getTime();
+        while(respScannerNext(s) == 1) {
+            if(cmdBufferAppend(buf, RESP_CMD_PTR(s), RESP_CMD_LEN(s), 1) < 0)
+                return -1;
+        }
+        if(cmdBufferFlush(buf) < 0)
+            return -1;
+        secs = getTime() - start;
+
+        if(!run || secs < best)
+            best = secs;
+
+        respScannerDetach(s);
+        cmdBufferFree(buf);
+    }
+
+    respScannerFree(s);
+
+    printResult("cmdBufferAppend", in->count, in->len, best);
+
+    return 0;
+}
+
+/**
+ * Optimize a buffer of protocol, the way an embedding program would
+ */
+static int benchOptimize(const char *name, const char *buf, size_t len, benchOptions *opt) {
+    double best = 0, secs, start;
+    cmdOptimizerStats st;
+    size_t pos, n, out;
+    cmdOptimizer *o;
+    unsigned int run;
+
+    if((o = cmdOptimizerCreate()) == NULL)
+        return -1;
+
+    for(run=0;run<opt->runs;run++) {
+        if(run && cmdOptimizerReset(o) < 0)
+            return -1;
+
+        start = getTime();
+
+        // Feed a chunk at a time, taking whatever output we have as we go
+        for(pos=0;pos<len;pos+=n) {
+            n = len - pos < BENCH_CHUNK_SIZE ? len - pos : BENCH_CHUNK_SIZE;
+
+            if(cmdOptimizerFeed(o, buf + pos, n) < 0)
+                return -1;
+
+            cmdOptimizerPeek(o, &out);
+            cmdOptimizerConsume(o, out);
+        }
+
+        if(cmdOptimizerFinish(o) < 0)
+            return -1;
+
+        cmdOptimizerPeek(o, &out);
+        cmdOptimizerConsume(o, out);
+
+        secs = getTime() - start;
+
+        if(!run || secs < best)
+            best = secs;
+    }
+
+    cmdOptimizerGetStats(o, &st);
+    printResult(name, st.commands_in, len, best);
+    cmdOptimizerFree(o);
+
+    return 0;
+}
+
+/**
+ * Read a whole buffer file into memory, decompressing it if need be
+ */
+static char *readFile(const char *path, size_t *len) {
+    size_t size = 0, pos = 0;
+    char *buf = NULL, *tmp;
+    gzFile in;
+    int n;
+
+    if((in = gzopen(path, "rb")) == NULL)
+        return NULL;
+
+    for(;;) {
+        if(pos + BENCH_CHUNK_SIZE > size) {
+            size = size ? size * 2 : 1024*1024;
+            if((tmp = realloc(buf, size)) == NULL) {
+                n = -1;
+                break;
+            }
+            buf = tmp;
+        }
+
+        if((n = gzread(in, buf + pos, BENCH_CHUNK_SIZE)) <= 0)
+            break;
+
+        pos += n;
+    }
+
+    gzclose(in);
+
+    if(n != 0) {
+        free(buf);
+        return NULL;
+    }
+
+    *len = pos;
+
+    return buf;
+}
+
+static void printUsage(char *cmd) {
+    printf("%s: [OPTIONS] [BUFFER FILE...]\n", cmd);
+    printf("   --commands    Number of commands to generate (default 1000000)\n");
+    printf("   --keys        Number of distinct keys (default 100000)\n");
+    printf("   --members     Number of distinct members or fields per key (default 1000)\n");
+    printf("   --skew        Zipf exponent for picking keys and members, 0 for uniform\n");
+    printf("   --mix         Command weights (default zincrby=60,sadd=30,pass=10)\n");
+    printf("   --seed        Random seed (default 1)\n");
+    printf("   --key-size    Initial key table size for cmdHashCreate (default 16384)\n");
+    printf("   --member-size Initial member table size for cmdHashCreate (default 4)\n");
+    printf("   --runs        Times to run each benchmark, keeping the fastest (default 3)\n");
+    printf("Buffer files given are optimized end to end as well.\n");
+}
+
+int main(int argc, char **argv) {
+    benchOptions opt = { 16384, 4, 3 };
+    benchInput in = { 0 };
+    benchWorkload w;
+    char *buf;
+    size_t len;
+    int o;
+
+    benchWorkloadDefaults(&w);
+    in.count = 1000000;
+
+    while((o = getopt_long(argc, argv, "n:k:e:s:x:S:K:M:r:h", g_bench_opts, NULL)) != -1) {
+        switch(o) {
+            case 'n':
+                in.count = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                w.keys = strtoull(optarg, NULL, 10);
+                break;
+            case 'e':
+                w.members = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                w.skew = atof(optarg);
+                break;
+            case 'x':
+                if(benchWorkloadParseMix(&w, optarg) < 0) {
+                    fprintf(stderr, "Error:  Invalid command mix '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                w.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'K':
+                opt.ksize = atoi(optarg);
+                break;
+            case 'M':
+                opt.msize = atoi(optarg);
+                break;
+            case 'r':
+                opt.runs = atoi(optarg);
+                break;
+            default:
+                printUsage(argv[0]);
+                exit(o == 'h' ? 0 : 1);
+        }
+    }
+
+    if(!in.count || !opt.ksize || !opt.msize || !opt.runs || benchWorkloadInit(&w) < 0) {
+        fprintf(stderr, "Error:  Need at least one command, key, member, run and command weight\n");
+        exit(1);
+    }
+
+    if((in.buf = benchWorkloadBuffer(&w, in.count, &in.len)) == NULL || splitInput(&in) < 0) {
+        fprintf(stderr, "Error:  Couldn't generate workload\n");
+        exit(1);
+    }
+
+    printf("%llu commands (%.1f MB), %llu keys, %llu members, skew %.2f\n\n",
+           (unsigned long long)in.count, in.len / (1024.0*1024), (unsigned long long)w.keys,
+           (unsigned long long)w.members, w.skew);
+    printf("%-28s %12s %10s %12s %10s\n", "benchmark", "ops", "seconds", "ops/s", "MB/s");
+
+    if(benchHash(&in, &opt) < 0 || benchBufferAppend(&in, &opt) < 0 ||
+       benchOptimize("end to end", in.buf, in.len, &opt) < 0)
+    {
+        fprintf(stderr, "Error:  Benchmark failed\n");
+        exit(1);
+    }
+
+    // Then whatever real files we were given
+    for(;optind<argc;optind++) {
+        if((buf = readFile(argv[optind], &len)) == NULL) {
+            fprintf(stderr, "Error:  Couldn't read '%s'\n", argv[optind]);
+            exit(1);
+        }
+
+        if(benchOptimize(argv[optind], buf, len, &opt) < 0) {
+            fprintf(stderr, "Error:  Couldn't optimize '%s'\n", argv[optind]);
+            exit(1);
+        }
+
+        free(buf);
+    }
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * Write a synthetic buffer file for benchmarking
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "workload.h"
+
+static const struct option g_gen_opts[] = {
+    { "commands", required_argument, NULL, 'n' },
+    { "keys", required_argument, NULL, 'k' },
+    { "members", required_argument, NULL, 'e' },
+    { "skew", required_argument, NULL, 's' },
+    { "mix", required_argument, NULL, 'x' },
+    { "seed", required_argument, NULL, 'S' },
+    { "gzip", no_argument, NULL, 'z' },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 }
+};
+
+static void printUsage(char *cmd) {
+    printf("%s: [OPTIONS] OUTFILE\n", cmd);
+    printf("   --commands Number of commands to write (default 1000000)\n");
+    printf("   --keys     Number of distinct keys (default 100000)\n");
+    printf("   --members  Number of distinct members or fields per key (default 1000)\n");
+    printf("   --skew     Zipf exponent for picking keys and members, 0 for uniform (default 0)\n");
+    printf("   --mix      Command weights (default zincrby=60,sadd=30,pass=10), out of\n");
+    printf("              zincrby, sadd, hincrby, incrby, pfadd and pass\n");
+    printf("   --seed     Random seed (default 1)\n");
+    printf("   --gzip     Compress the output\n");
+}
+
+int main(int argc, char **argv) {
+    unsigned long long count = 1000000, i;
+    char cmd[BENCH_MAX_CMD];
+    benchWorkload w;
+    int opt, gz = 0;
+    gzFile out;
+    size_t len;
+
+    benchWorkloadDefaults(&w);
+
+    while((opt = getopt_long(argc, argv, "n:k:e:s:x:S:zh", g_gen_opts, NULL)) != -1) {
+        switch(opt) {
+            case 'n':
+                count = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                w.keys = strtoull(optarg, NULL, 10);
+                break;
+            case 'e':
+                w.members = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                w.skew = atof(optarg);
+                break;
+            case 'x':
+                if(benchWorkloadParseMix(&w, optarg) < 0) {
+                    fprintf(stderr, "Error:  Invalid command mix '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                w.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'z':
+                gz = 1;
+                break;
+            default:
+                printUsage(argv[0]);
+                exit(opt == 'h' ? 0 : 1);
+        }
+    }
+
+    if(!argv[optind]) {
+        fprintf(stderr, "Error:  Must specify output file!\n");
+        exit(1);
+    }
+
+    if(benchWorkloadInit(&w) < 0) {
+        fprintf(stderr, "Error:  Need at least one key, member and command weight\n");
+        exit(1);
+    }
+
+    // zlib writes uncompressed files too, when asked to be transparent
+    if((out = gzopen(argv[optind], gz ? "wb" : "wbT")) == NULL) {
+        fprintf(stderr, "Error:  Couldn't open '%s'\n", argv[optind]);
+        exit(1);
+    }
+
+    for(i=0;i<count;i++) {
+        len = benchWorkloadNext(&w, cmd);
+
+        if(gzwrite(out, cmd, len) != (int)len) {
+            fprintf(stderr, "Error:  Couldn't write '%s'\n", argv[optind]);
+            exit(1);
+        }
+    }
+
+    if(gzclose(out) != Z_OK) {
+        fprintf(stderr, "Error:  Couldn't write '%s'\n", argv[optind]);
+        exit(1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,268 @@
+/**
+ * Synthetic Redis protocol workloads
+ */
+
+#include "workload.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static const char *g_cmd_names[BENCH_CMD_COUNT] = {
+    [BENCH_ZINCRBY] = "zincrby",
+    [BENCH_SADD]    = "sadd",
+    [BENCH_HINCRBY] = "hincrby",
+    [BENCH_INCRBY]  = "incrby",
+    [BENCH_PFADD]   = "pfadd",
+    [BENCH_PASS]    = "pass",
+};
+
+/**
+ * splitmix64, which is plenty for picking keys
+ */
+static inline uint64_t __rand(benchWorkload *w) {
+    uint64_t z = (w->rng += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+    return z ^ (z >> 31);
+}
+
+static inline double __rand_double(benchWorkload *w) {
+    return (__rand(w) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * log1p(x)/x and expm1(x)/x, without losing precision near zero
+ */
+static double __helper1(double x) {
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0/3 - 0.25 * x));
+}
+
+static double __helper2(double x) {
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0/3) * (1 + 0.25 * x));
+}
+
+/**
+ * The integral of x^-s, its inverse, and x^-s itself
+ */
+static double __h_integral(const benchZipf *z, double x) {
+    double lx = log(x);
+    return __helper2((1 - z->s) * lx) * lx;
+}
+
+static double __h_integral_inverse(const benchZipf *z, double x) {
+    double t = x * (1 - z->s);
+
+    if(t < -1)
+        t = -1;
+
+    return exp(__helper1(t) * x);
+}
+
+static double __h(const benchZipf *z, double x) {
+    return exp(-z->s * log(x));
+}
+
+static void __zipf_init(benchZipf *z, uint64_t n, double s) {
+    z->n = n;
+    z->s = s;
+
+    if(s <= 0)
+        return;
+
+    z->h_x1 = __h_integral(z, 1.5) - 1;
+    z->h_n = __h_integral(z, n + 0.5);
+    z->cut = 2 - __h_integral_inverse(z, __h_integral(z, 2.5) - __h(z, 2));
+}
+
+/**
+ * Pick a rank from 1 to n
+ */
+static uint64_t __zipf_next(benchWorkload *w, const benchZipf *z) {
+    double u, x;
+    uint64_t k;
+
+    if(z->s <= 0)
+        return 1 + __rand(w) % z->n;
+
+    for(;;) {
+        u = z->h_n + __rand_double(w) * (z->h_x1 - z->h_n);
+        x = __h_integral_inverse(z, u);
+
+        k = x + 0.5;
+        if(k < 1) {
+            k = 1;
+        } else if(k > z->n) {
+            k = z->n;
+        }
+
+        if(k - x <= z->cut || u >= __h_integral(z, k + 0.5) - __h(z, k))
+            return k;
+    }
+}
+
+void benchWorkloadDefaults(benchWorkload *w) {
+    memset(w, 0, sizeof(benchWorkload));
+
+    w->keys = 100000;
+    w->members = 1000;
+    w->seed = 1;
+
+    w->mix[BENCH_ZINCRBY] = 60;
+    w->mix[BENCH_SADD] = 30;
+    w->mix[BENCH_PASS] = 10;
+}
+
+int benchWorkloadParseMix(benchWorkload *w, const char *str) {
+    unsigned int mix[BENCH_CMD_COUNT] = {0};
+    const char *p = str, *eq;
+    char *end;
+    size_t len;
+    int i;
+
+    while(*p) {
+        if((eq = strchr(p, '=')) == NULL)
+            return -1;
+
+        len = eq - p;
+        for(i=0;i<BENCH_CMD_COUNT;i++) {
+            if(strlen(g_cmd_names[i]) == len && !strncasecmp(p, g_cmd_names[i], len))
+                break;
+        }
+        if(i == BENCH_CMD_COUNT)
+            return -1;
+
+        mix[i] = strtoul(eq + 1, &end, 10);
+        if(end == eq + 1 || (*end && *end != ','))
+            return -1;
+
+        p = *end ? end + 1 : end;
+    }
+
+    memcpy(w->mix, mix, sizeof(mix));
+
+    return 0;
+}
+
+int benchWorkloadInit(benchWorkload *w) {
+    int i;
+
+    if(!w->keys || !w->members)
+        return -1;
+
+    w->total = 0;
+    for(i=0;i<BENCH_CMD_COUNT;i++) {
+        w->total += w->mix[i];
+    }
+    if(!w->total)
+        return -1;
+
+    w->rng = w->seed;
+    __zipf_init(&w->key_dist, w->keys, w->skew);
+    __zipf_init(&w->member_dist, w->members, w->skew);
+
+    return 0;
+}
+
+/**
+ * Append one bulk string
+ */
+static inline char *__bulk(char *p, const char *str, int len) {
+    p += sprintf(p, "$%d\r\n", len);
+    memcpy(p, str, len);
+    p += len;
+    *p++ = '\r'; *p++ = '\n';
+
+    return p;
+}
+
+size_t benchWorkloadNext(benchWorkload *w, char *dst) {
+    static const char prefix[BENCH_CMD_COUNT] = "zshipk";
+    char key[32], member[32], value[32];
+    int klen, mlen, vlen, argc;
+    unsigned int pick;
+    benchCmd cmd;
+    char *p = dst;
+
+    // Pick what kind of command this is
+    pick = __rand(w) % w->total;
+    for(cmd=0;pick >= w->mix[cmd];cmd++) {
+        pick -= w->mix[cmd];
+    }
+
+    // Each kind of command has keys of its own, as it would in Redis
+    klen = sprintf(key, "%c:key:%llu", prefix[cmd],
+                   (unsigned long long)__zipf_next(w, &w->key_dist));
+    mlen = sprintf(member, "member:%llu", (unsigned long long)__zipf_next(w, &w->member_dist));
+    vlen = sprintf(value, "%llu", (unsigned long long)(1 + __rand(w) % 100));
+
+    argc = cmd == BENCH_ZINCRBY || cmd == BENCH_HINCRBY ? 4 : 3;
+    p += sprintf(p, "*%d\r\n", argc);
+
+    switch(cmd) {
+        case BENCH_ZINCRBY:
+            p = __bulk(p, "ZINCRBY", 7);
+            p = __bulk(p, key, klen);
+            p = __bulk(p, value, vlen);
+            p = __bulk(p, member, mlen);
+            break;
+        case BENCH_HINCRBY:
+            p = __bulk(p, "HINCRBY", 7);
+            p = __bulk(p, key, klen);
+            p = __bulk(p, member, mlen);
+            p = __bulk(p, value, vlen);
+            break;
+        case BENCH_SADD:
+            p = __bulk(p, "SADD", 4);
+            p = __bulk(p, key, klen);
+            p = __bulk(p, member, mlen);
+            break;
+        case BENCH_PFADD:
+            p = __bulk(p, "PFADD", 5);
+            p = __bulk(p, key, klen);
+            p = __bulk(p, member, mlen);
+            break;
+        case BENCH_INCRBY:
+            p = __bulk(p, "INCRBY", 6);
+            p = __bulk(p, key, klen);
+            p = __bulk(p, value, vlen);
+            break;
+        default:
+            p = __bulk(p, "SET", 3);
+            p = __bulk(p, key, klen);
+            p = __bulk(p, member, mlen);
+            break;
+    }
+
+    return p - dst;
+}
+
+char *benchWorkloadBuffer(benchWorkload *w, uint64_t count, size_t *len) {
+    size_t size = count * 64 + BENCH_MAX_CMD, pos = 0;
+    char *buf, *tmp;
+    uint64_t i;
+
+    if((buf = malloc(size)) == NULL)
+        return NULL;
+
+    for(i=0;i<count;i++) {
+        if(pos + BENCH_MAX_CMD > size) {
+            if((tmp = realloc(buf, size * 2)) == NULL) {
+                free(buf);
+                return NULL;
+            }
+            buf = tmp;
+            size *= 2;
+        }
+
+        pos += benchWorkloadNext(w, buf + pos);
+    }
+
+    *len = pos;
+
+    return buf;
+}
@@ -0,0 +1,84 @@
+#ifndef BENCH_WORKLOAD_H
+#define BENCH_WORKLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Longest command we'll generate, in the Redis protocol
+ */
+#define BENCH_MAX_CMD 256
+
+/**
+ * Kinds of command in our mix.  Everything we don't aggregate is
+ * represented by a SET, which just gets passed through.
+ */
+typedef enum _benchCmd {
+    BENCH_ZINCRBY,
+    BENCH_SADD,
+    BENCH_HINCRBY,
+    BENCH_INCRBY,
+    BENCH_PFADD,
+    BENCH_PASS,
+    BENCH_CMD_COUNT
+} benchCmd;
+
+/**
+ * Zipf distributed ranks from 1 to n, or uniform ones if the skew is zero.
+ * We sample by rejection-inversion, so nothing is kept per rank however
+ * many there are.
+ */
+typedef struct _benchZipf {
+    uint64_t n;
+    double s;
+
+    double h_x1;
+    double h_n;
+    double cut;
+} benchZipf;
+
+/**
+ * A stream of synthetic commands
+ */
+typedef struct _benchWorkload {
+    /**
+     * Distinct keys and members (per key), and how skewed our choice of
+     * each is
+     */
+    uint64_t keys;
+    uint64_t members;
+    double skew;
+
+    /**
+     * Relative weight of each kind of command
+     */
+    unsigned int mix[BENCH_CMD_COUNT];
+
+    uint64_t seed;
+
+    /**
+     * Generator state, set up by benchWorkloadInit
+     */
+    uint64_t rng;
+    unsigned int total;
+    benchZipf key_dist;
+    benchZipf member_dist;
+} benchWorkload;
+
+// Defaults: 100k keys of 1k members, no skew, and mostly ZINCRBY
+void benchWorkloadDefaults(benchWorkload *w);
+
+// Parse a mix like "zincrby=60,sadd=30,pass=10", returning -1 if it's bad
+int benchWorkloadParseMix(benchWorkload *w, const char *str);
+
+// Get ready to generate, once everything above is set
+int benchWorkloadInit(benchWorkload *w);
+
+// Write the next command to dst, which must have BENCH_MAX_CMD bytes free,
+// returning its length
+size_t benchWorkloadNext(benchWorkload *w, char *dst);
+
+// Generate count commands into a buffer we allocate, setting *len
+char *benchWorkloadBuffer(benchWorkload *w, uint64_t count, size_t *len);
+
+#endif
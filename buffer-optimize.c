@@ -8,275 +8,2826 @@
 #include "buffer-optimize.h"
 
 /**
- * Open our input and possibly output file
+ * Wall clock time in seconds, which unlike clock() doesn't count the time
+ * our other threads spend working.
  */
-int openFiles(optimizerContext *ctx) {
-    if((ctx->fd_in = gzopen(ctx->infile, "r")) == NULL)
+static double getTime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * The most memory we've had resident at once, in bytes
+ */
+static unsigned long long getPeakRss(void) {
+    struct rusage ru;
+
+    if(getrusage(RUSAGE_SELF, &ru) < 0)
+        return 0;
+
+#ifdef __APPLE__
+    return ru.ru_maxrss;
+#else
+    // Everyone else reports kilobytes
+    return (unsigned long long)ru.ru_maxrss * 1024;
+#endif
+}
+
+/**
+ * Print a string as a JSON string, escaping whatever needs it
+ */
+static void printJsonString(FILE *fp, const char *str) {
+    const unsigned char *p;
+
+    fputc('"', fp);
+
+    for(p = (const unsigned char*)str; *p; p++) {
+        if(*p == '"' || *p == '\\') {
+            fputc('\\', fp);
+            fputc(*p, fp);
+        } else if(*p < 0x20) {
+            fprintf(fp, "\\u%04x", *p);
+        } else {
+            fputc(*p, fp);
+        }
+    }
+
+    fputc('"', fp);
+}
+
+/**
+ * Report how far we've got, and how fast we've gone since our last report,
+ * as a line of JSON on stderr.
+ */
+static void reportProgress(optimizerContext *ctx, double now) {
+    respScanner *s = ctx->scanner;
+    unsigned long long bytes = ctx->bytes_in;
+    double secs = now - ctx->last_report;
+
+    // A mapped input is counted as we scan it
+    if(s && s->own)
+        bytes += s->pos;
+
+    flockfile(stderr);
+
+    fprintf(stderr, "{\"input\":");
+    printJsonString(stderr, ctx->infile);
+    fprintf(stderr, ",\"elapsed\":%f,\"commands_in\":%u,\"bytes_in\":%llu,\"bytes_out\":%llu"
+            ",\"commands_per_sec\":%.0f,\"bytes_per_sec\":%.0f,\"peak_rss\":%llu}\n",
+            now - ctx->start, ctx->cmd_count, bytes, (unsigned long long)ctx->bytes_out,
+            (ctx->cmd_count - ctx->last_count) / secs, (bytes - ctx->last_bytes) / secs,
+            getPeakRss());
+
+    funlockfile(stderr);
+
+    // If we were held up for a while, don't try to catch up
+    ctx->last_report = now;
+    ctx->last_bytes = bytes;
+    ctx->last_count = ctx->cmd_count;
+    ctx->next_report = now + ctx->progress;
+}
+
+/**
+ * Start timing a run from scratch
+ */
+static void startTiming(optimizerContext *ctx) {
+    ctx->start = getTime();
+
+    memset(ctx->phases, 0, sizeof(ctx->phases));
+    ctx->phase = PHASE_OTHER;
+    ctx->phase_start = ctx->start;
+    ctx->sampled = 0;
+    ctx->sampled_bytes = ctx->next_sample = 0;
+
+    ctx->bytes_in = ctx->bytes_out = 0;
+
+    ctx->last_report = ctx->start;
+    ctx->last_bytes = ctx->last_count = 0;
+    ctx->next_report = ctx->start + ctx->progress;
+}
+
+/**
+ * Move on to another phase, charging the time since the last switch to the
+ * one we were in.  Returns the phase we left, so a nested phase can go back
+ * to it.
+ */
+static optimizerPhase setPhase(optimizerContext *ctx, optimizerPhase phase) {
+    optimizerPhase prev = ctx->phase;
+    double now;
+
+    if(!ctx->timing)
+        return prev;
+
+    now = getTime();
+    ctx->phases[prev] += now - ctx->phase_start;
+    ctx->phase_start = now;
+    ctx->phase = phase;
+
+    // We switch phases often enough to check whether a report is due
+    if(ctx->progress && now >= ctx->next_report)
+        reportProgress(ctx, now);
+
+    return prev;
+}
+
+/**
+ * Map our input file if it's a regular, uncompressed file so we can parse it
+ * in place.  Returns 0 if we've mapped it, and 1 if it has to be read.
+ */
+int mapInput(optimizerContext *ctx) {
+    unsigned char magic[4];
+    struct stat st;
+    void *map;
+    ssize_t n;
+    int fd;
+
+    if((fd = open(ctx->infile, O_RDONLY)) < 0)
+        return 1;
+
+    // Leave empty, special, and compressed files to our codecs
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < 1 ||
+       ((n = pread(fd, magic, sizeof(magic), 0)) > 0 && cmdCodecDetect(magic, n) != CODEC_NONE))
+    {
+        close(fd);
+        return 1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED)
+        return 1;
+
+    // We'll read straight through, once
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, st.st_size, MADV_HUGEPAGE);
+#endif
+
+    ctx->map = map;
+    ctx->map_len = st.st_size;
+
+    return 0;
+}
+
+/**
+ * Open our input file, reading it on its own thread if we're pipelining and
+ * couldn't map it.
+ */
+int openInput(optimizerContext *ctx) {
+    // Map our input if we can, and fall back to reading it (decompressing
+    // it with whatever it was compressed with) if we can't.
+    if(ctx->no_mmap || mapInput(ctx) != 0) {
+        if((ctx->fd_in = codecReaderOpen(ctx->infile)) == NULL)
+            return -1;
+    }
+
+    // Pick up where we left off if we're resuming part way through, which
+    // means decompressing everything up to there to get to it.
+    if(ctx->map && ctx->input_start > ctx->map_len)
+        return -1;
+
+    if(!ctx->map && codecReaderSkip(ctx->fd_in, ctx->input_start) < 0)
+        return -1;
+
+    // There's nothing to decompress if our input is mapped
+    if(ctx->pipeline && !ctx->map && (ctx->reader = pipeReaderCreate(ctx->fd_in)) == NULL)
+        return -1;
+
+    // Success
+    return 0;
+}
+
+/**
+ * Close our input file.  Anything left of a command it ended part way
+ * through is dropped, so it can't run into whatever we read next.
+ */
+void closeInput(optimizerContext *ctx) {
+    // Stop our reader before closing the file under it
+    if(ctx->reader) {
+        pipeReaderFree(ctx->reader);
+        ctx->reader = NULL;
+        ctx->in_block = NULL;
+    }
+
+    if(ctx->fd_in) {
+        codecReaderClose(ctx->fd_in);
+        ctx->fd_in = NULL;
+    }
+
+    if(ctx->map) {
+        munmap(ctx->map, ctx->map_len);
+        ctx->map = NULL;
+        ctx->map_len = 0;
+    }
+
+    if(ctx->scanner)
+        respScannerReset(ctx->scanner);
+}
+
+/**
+ * Write output straight to whichever file one of our outputs has open
+ */
+static int writeRaw(void *arg, const char *buffer, size_t size) {
+    optimizerOutput *out = arg;
+    size_t written;
+
+    // Write either to Redis, our gzFile, gzip threads, zstd or lz4, or FILE*
+    if(out->ctx->replay) {
+        return cmdReplayWrite(out->ctx->replay, buffer, size);
+    } else if(out->pgz) {
+        return pgzWriterWrite(out->pgz, buffer, size);
+    } else if(out->enc) {
+        return codecWriterWrite(out->enc, buffer, size);
+    } else if(out->fd_out_gz) {
+        written = gzwrite(out->fd_out_gz, buffer, size);
+    } else {
+        written = fwrite(buffer, 1, size, out->fd_out);
+    }
+
+    if(written != size)
+        return -1;
+
+    // Success
+    return 0;
+}
+
+/**
+ * The file one of our outputs goes to.  When we split our output, each
+ * range of slots gets our output file's name with its number added ahead
+ * of any compressed extension, so out.resp.gz becomes out.resp.00.gz,
+ * out.resp.01.gz and so on.
+ */
+static int getOutputPath(optimizerContext *ctx, unsigned int idx, char *buf, size_t size) {
+    size_t len = strlen(ctx->outfile), ext;
+    int width, n;
+
+    if(!ctx->split)
+        return snprintf(buf, size, "%s", ctx->outfile) < (int)size ? 0 : -1;
+
+    ext = cmdCodecExtLen(ctx->outfile, len);
+    width = snprintf(NULL, 0, "%u", ctx->split - 1);
+
+    n = snprintf(buf, size, "%.*s.%0*u%s", (int)(len - ext), ctx->outfile,
+                 width, idx, ctx->outfile + len - ext);
+
+    return n < (int)size ? 0 : -1;
+}
+
+/**
+ * Start compressing what one of our outputs writes to its FILE*, with
+ * pgzip's threads or with zstd or lz4
+ */
+static int createEncoder(optimizerContext *ctx, optimizerOutput *out) {
+    unsigned int threads = ctx->compress_threads / ctx->output_count;
+
+    if(ctx->codec == CODEC_GZIP) {
+        out->pgz = pgzWriterCreate(out->fd_out, ctx->level, threads);
+        return out->pgz ? 0 : -1;
+    } else if(ctx->codec != CODEC_NONE) {
+        out->enc = codecWriterCreate(out->fd_out, ctx->codec, ctx->level, threads,
+                                     ctx->long_window);
+        return out->enc ? 0 : -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Open one of our output files.  Compression threads are shared between
+ * however many files we're writing, and if there's only one for each we
+ * leave gzip to zlib.
+ */
+static int openOutputFile(optimizerContext *ctx, optimizerOutput *out, const char *path) {
+    unsigned int threads = ctx->compress_threads / ctx->output_count;
+    char mode[4] = "w";
+
+    // When we resume, we carry on from what our checkpoint last wrote
+    if(ctx->resume)
+        mode[0] = 'a';
+
+    if(ctx->codec == CODEC_GZIP && threads < 2) {
+        if(ctx->level >= 0)
+            mode[1] = '0' + ctx->level;
+
+        if((out->fd_out_gz = gzopen(path, mode)) == NULL)
+            return -1;
+    } else {
+        if((out->fd_out = fopen(path, ctx->resume ? "a" : "w")) == NULL ||
+           createEncoder(ctx, out) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Open our output files (or connect to Redis) if we're writing anything,
+ * each on its own thread if we're pipelining.
+ */
+int openOutput(optimizerContext *ctx) {
+    char path[PATH_MAX];
+    unsigned int i;
+
+    // Replay into Redis rather than writing a file
+    if(*ctx->target) {
+        if((ctx->replay = cmdReplayCreate(ctx->target, ctx->replay_depth)) == NULL)
+            return -1;
+    }
+
+    for(i=0;i<ctx->output_count;i++) {
+        // We may not need to open our output file if we're just runing stats
+        if(*ctx->outfile && (getOutputPath(ctx, i, path, sizeof(path)) < 0 ||
+                             openOutputFile(ctx, &ctx->outputs[i], path) < 0))
+        {
+            return -1;
+        }
+
+        // No writer needed if we're just running stats
+        if(ctx->pipeline && (*ctx->outfile || ctx->replay) &&
+           (ctx->outputs[i].writer = pipeWriterCreate(writeRaw, &ctx->outputs[i])) == NULL)
+        {
+            return -1;
+        }
+    }
+
+    // Success
+    return 0;
+}
+
+/**
+ * Close our output files, or disconnect from Redis
+ */
+void closeOutput(optimizerContext *ctx) {
+    optimizerOutput *out;
+    unsigned int i;
+
+    for(i=0;i<ctx->output_count;i++) {
+        out = &ctx->outputs[i];
+
+        // Stop our writer and compression threads before closing the file
+        // under them
+        if(out->writer) {
+            pipeWriterFree(out->writer);
+            out->writer = NULL;
+        }
+
+        if(out->pgz) {
+            pgzWriterFree(out->pgz);
+            out->pgz = NULL;
+        }
+
+        if(out->enc) {
+            codecWriterFree(out->enc);
+            out->enc = NULL;
+        }
+
+        // Close our non gzip output file if open
+        if(out->fd_out) {
+            fclose(out->fd_out);
+            out->fd_out = NULL;
+        }
+
+        // Close our gzip output file if open
+        if(out->fd_out_gz) {
+            gzclose(out->fd_out_gz);
+            out->fd_out_gz = NULL;
+        }
+    }
+
+    // Disconnect from Redis
+    if(ctx->replay) {
+        cmdReplayFree(ctx->replay);
+        ctx->replay = NULL;
+    }
+}
+
+/**
+ * Where our output goes, for error messages and statistics
+ */
+static const char *getOutputName(optimizerContext *ctx) {
+    return *ctx->target ? ctx->target : ctx->outfile;
+}
+
+/**
+ * Read up to len bytes of input, either directly or from our reader stage
+ */
+static int readInput(optimizerContext *ctx, char *buf, size_t len) {
+    pipeBlock *block;
+    size_t n;
+
+    if(!ctx->reader)
+        return codecReaderRead(ctx->fd_in, buf, len);
+
+    // Move on to the next block once we've used this one up
+    if(ctx->in_block && ctx->in_pos == (size_t)ctx->in_block->len) {
+        pipeReaderRelease(ctx->reader, ctx->in_block);
+        ctx->in_block = NULL;
+    }
+
+    if(!ctx->in_block) {
+        block = pipeReaderNext(ctx->reader);
+
+        // End of input or an error
+        if(block->len <= 0) {
+            n = block->len;
+            pipeReaderRelease(ctx->reader, block);
+            return n;
+        }
+
+        ctx->in_block = block;
+        ctx->in_pos = 0;
+    }
+
+    block = ctx->in_block;
+    n = block->len - ctx->in_pos;
+    if(n > len)
+        n = len;
+
+    memcpy(buf, block->buf + ctx->in_pos, n);
+    ctx->in_pos += n;
+
+    return n;
+}
+
+/**
+ * Write one of our output files
+ */
+int writeFile(optimizerOutput *out, const char *buffer, size_t size) {
+    optimizerContext *ctx = out->ctx;
+    optimizerPhase prev = setPhase(ctx, PHASE_WRITE);
+    int rv;
+
+    // Our writer stage takes care of it if we have one
+    if(out->writer) {
+        rv = pipeWriterWrite(out->writer, buffer, size);
+    } else {
+        rv = writeRaw(out, buffer, size);
+    }
+
+    ctx->bytes_out += size;
+    setPhase(ctx, prev);
+
+    return rv;
+}
+
+/**
+ * Sink for our command buffers, so output goes to disk as we produce it
+ */
+static int writeOutput(void *arg, const char *buf, size_t len) {
+    return writeFile((optimizerOutput*)arg, buf, len);
+}
+
+/**
+ * Append a command to an output buffer.  The input is already in the Redis
+ * protocol, so unless it used integer arguments we can just copy its
+ * original bytes.
+ */
+static inline int appendCommand(cmdBuffer *out, respScanner *s) {
+    if(s->verbatim) {
+        return cmdBufferAppend(out, RESP_CMD_PTR(s), RESP_CMD_LEN(s), 1);
+    } else {
+        return cmdBufferAddArgv(out, s->argc, s->argv, s->argvlen);
+    }
+}
+
+/**
+ * Which output a key goes to when we're splitting our output
+ */
+static inline unsigned int getKeyOutput(optimizerContext *ctx, const char *key, size_t len) {
+    return ctx->slot_map[crc16KeySlot(key, len)];
+}
+
+/**
+ * Pass through a command like DEL or MSET, whose keys start at argument
+ * first and have step arguments each, as one command for each output's
+ * buffer with whichever of its keys go there.
+ */
+static int splitCommand(optimizerContext *ctx, cmdBuffer **bufs, respScanner *s,
+                        int first, int step)
+{
+    unsigned int *outputs = NULL, i;
+    int keys = (s->argc - first) / step, argc, k, rv = -1;
+    const char **argv = NULL;
+    size_t *argvlen = NULL;
+
+    if((outputs = malloc(sizeof(*outputs) * keys)) == NULL ||
+       (argv = malloc(sizeof(*argv) * s->argc)) == NULL ||
+       (argvlen = malloc(sizeof(*argvlen) * s->argc)) == NULL)
+    {
+        goto done;
+    }
+
+    for(k=0;k<keys;k++) {
+        i = first + k * step;
+        outputs[k] = getKeyOutput(ctx, s->argv[i], s->argvlen[i]);
+    }
+
+    // Every command starts out the same, then gets its own keys
+    memcpy(argv, s->argv, sizeof(*argv) * first);
+    memcpy(argvlen, s->argvlen, sizeof(*argvlen) * first);
+
+    for(i=0;i<ctx->output_count;i++) {
+        for(k=0,argc=first;k<keys;k++) {
+            if(outputs[k] != i)
+                continue;
+
+            memcpy(argv + argc, s->argv + first + k * step, sizeof(*argv) * step);
+            memcpy(argvlen + argc, s->argvlen + first + k * step, sizeof(*argvlen) * step);
+            argc += step;
+        }
+
+        if(argc > first && cmdBufferAddArgv(bufs[i], argc, argv, argvlen) < 0)
+            goto done;
+    }
+
+    rv = 0;
+
+done:
+    free(outputs);
+    free(argv);
+    free(argvlen);
+
+    return rv;
+}
+
+/**
+ * Append a command we aren't aggregating to our output, through bufs (one
+ * for each output).  When we're splitting our output it goes wherever its
+ * first key's slot does, unless it's something like DEL whose keys can go
+ * their own ways, and commands without keys go everywhere.
+ */
+static inline int passThrough(optimizerContext *ctx, cmdBuffer **bufs, respScanner *s) {
+    int key, first, step, i;
+    unsigned int out;
+
+    // Nothing gets written in stats mode, so just count it
+    if(ctx->stats) {
+        bufs[0]->cmd_count++;
+        return 0;
+    }
+
+    if(!ctx->slot_map)
+        return appendCommand(bufs[0], s);
+
+    if((key = cmdHashFirstKey(s->argc, s->argv, s->argvlen)) > 0) {
+        out = getKeyOutput(ctx, s->argv[key], s->argvlen[key]);
+
+        if(cmdHashGetKeyStep(s->argc, s->argv, s->argvlen, &first, &step) == 0) {
+            for(i=first+step;i<s->argc;i+=step) {
+                if(getKeyOutput(ctx, s->argv[i], s->argvlen[i]) != out)
+                    return splitCommand(ctx, bufs, s, first, step);
+            }
+        }
+
+        return appendCommand(bufs[out], s);
+    }
+
+    for(out=0;out<ctx->output_count;out++) {
+        if(appendCommand(bufs[out], s) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Aggregate a command if we can, either in our own cmdHash or by routing it
+ * to the shard that owns its key, and pass it through otherwise.
+ */
+static inline int processCommand(optimizerContext *ctx, respScanner *s) {
+    int rv;
+
+    if(ctx->shards) {
+        if(cmdHashGetType(s->argc, s->argv, s->argvlen) == TYPE_UNSUPPORTED)
+            return passThrough(ctx, ctx->cmd_buffers, s);
+
+        // Every command we aggregate has its key as the first argument
+        return cmdShardPoolAdd(ctx->shards, s->argv[1], s->argvlen[1],
+                               RESP_CMD_PTR(s), RESP_CMD_LEN(s));
+    }
+
+    // Either add it to our hash or to our pass-thru buffer, after anything
+    // it needs to stay behind
+    if((rv = cmdHashAdd(ctx->cmd_hash, s->argc, s->argv, s->argvlen))==TYPE_UNSUPPORTED) {
+        if(ctx->ordered && cmdHashBarrier(ctx->cmd_hash, s->argc, s->argv, s->argvlen) < 0)
+            return -1;
+
+        return passThrough(ctx, ctx->cmd_buffers, s);
+    }
+
+    return rv;
+}
+
+/**
+ * Time how long scanning the next stretch of our input takes on its own,
+ * without doing anything with the commands.  We don't count this towards
+ * parsing, since we'll scan it again for real.
+ */
+static void sampleParse(optimizerContext *ctx, respScanner *s) {
+    respScanner *p = ctx->sampler;
+    size_t len = s->len - s->pos;
+    double start;
+
+    if(len > PHASE_SAMPLE_SIZE)
+        len = PHASE_SAMPLE_SIZE;
+
+    setPhase(ctx, PHASE_OTHER);
+
+    respScannerAttach(p, s->buf + s->pos, len);
+
+    start = getTime();
+    while(respScannerNext(p) == 1)
+        ;
+    ctx->sampled += getTime() - start;
+    ctx->sampled_bytes += p->pos;
+
+    respScannerDetach(p);
+
+    setPhase(ctx, PHASE_PARSE);
+}
+
+/**
+ * Our aggregated commands are either in our own cmdHash, or spread across
+ * our shards.  Returns NULL once idx is past the last one.
+ */
+static cmdHash *getAggHash(optimizerContext *ctx, unsigned int idx) {
+    if(ctx->shards)
+        return idx < ctx->shards->count ? ctx->shards->shards[idx].cmd_hash : NULL;
+
+    return idx == 0 ? ctx->cmd_hash : NULL;
+}
+
+/**
+ * Split our memory budget between however many hashes we aggregate into
+ */
+static int setMemoryLimit(optimizerContext *ctx) {
+    unsigned int i;
+    cmdHash *ht;
+
+    for(i=0;(ht = getAggHash(ctx, i)) != NULL;i++) {
+        if(cmdHashSetMemoryLimit(ht, ctx->max_memory / ctx->threads, ctx->spill_dir) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Have every hash write what it holds in our order
+ */
+static int setOrder(optimizerContext *ctx) {
+    unsigned int i;
+    cmdHash *ht;
+
+    for(i=0;(ht = getAggHash(ctx, i)) != NULL;i++) {
+        if(cmdHashSetOrder(ht, ctx->order) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Have every hash write each key to the output its cluster slot goes to
+ */
+static int setSplit(optimizerContext *ctx) {
+    unsigned int i;
+    cmdHash *ht;
+
+    for(i=0;(ht = getAggHash(ctx, i)) != NULL;i++) {
+        if(cmdHashSetSplit(ht, ctx->cmd_buffers, ctx->slot_map) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Give every hash somewhere to write keys out ahead of an increment that
+ * would overflow them.  Shards have their own buffers, which we pass through
+ * once they've finished, and in stats mode we only count them.
+ */
+static int setOutput(optimizerContext *ctx) {
+    unsigned int i;
+    cmdBuffer *out;
+    cmdHash *ht;
+
+    for(i=0;(ht = getAggHash(ctx, i)) != NULL;i++) {
+        if(ctx->stats) {
+            out = NULL;
+        } else {
+            out = ctx->shards ? ctx->shards->shards[i].out : ctx->cmd_buffers[0];
+        }
+
+        if(cmdHashSetOutput(ht, out) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Pass through what our shards turned away, along with the keys they wrote
+ * out ahead of it, now that they've finished.  Then they can split what
+ * they're holding between our outputs along with everything else.
+ */
+static int passShardCommands(optimizerContext *ctx) {
+    respScanner *s = ctx->scanner;
+    cmdBuffer *out;
+    unsigned int i;
+    int rv = 0;
+
+    for(i=0;i<ctx->shards->count && rv == 0;i++) {
+        out = ctx->shards->shards[i].out;
+
+        respScannerAttach(s, out->buf, out->pos);
+        while((rv = respScannerNext(s)) == 1) {
+            if(passThrough(ctx, ctx->cmd_buffers, s) < 0) {
+                rv = -1;
+                break;
+            }
+        }
+        respScannerDetach(s);
+
+        if(cmdBufferReset(out) < 0)
+            rv = -1;
+    }
+
+    if(rv < 0)
+        return -1;
+
+    return ctx->slot_map && !ctx->stats ? setSplit(ctx) : 0;
+}
+
+/**
+ * Have every hash write its sorted sets as batched ZADDs
+ */
+static int setZaddBatch(optimizerContext *ctx) {
+    unsigned int i;
+    cmdHash *ht;
+
+    for(i=0;(ht = getAggHash(ctx, i)) != NULL;i++) {
+        if(cmdHashSetZaddBatch(ht, ctx->zadd_batch) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Write what every shard holds in a single order
+ */
+static int writeSortedShards(optimizerContext *ctx) {
+    cmdHash *hts[SHARD_MAX_THREADS];
+    unsigned int i;
+
+    for(i=0;i<ctx->shards->count;i++) {
+        hts[i] = ctx->shards->shards[i].cmd_hash;
+    }
+
+    return cmdHashGetCommandsSorted(hts, ctx->shards->count, ctx->cmd_buffers[0]);
+}
+
+/**
+ * Total number of aggregated commands we'll output
+ */
+static unsigned int getAggCount(optimizerContext *ctx) {
+    unsigned int i, count = 0;
+    cmdHash *ht;
+
+    for(i=0;(ht = getAggHash(ctx, i)) != NULL;i++) {
+        count += cmdHashGetCount(ht);
+    }
+
+    return count;
+}
+
+/**
+ * Total number of commands we've written, across every output
+ */
+static unsigned int getOutputCount(optimizerContext *ctx) {
+    unsigned int i, count = 0;
+
+    for(i=0;i<ctx->output_count;i++) {
+        count += ctx->cmd_buffers[i]->cmd_count;
+    }
+
+    return count;
+}
+
+/**
+ * Add up what every hash we aggregate into is holding
+ */
+static void getHashStats(optimizerContext *ctx, cmdHashStats *stats) {
+    cmdHashStats hs;
+    unsigned int i;
+    cmdHash *ht;
+
+    memset(stats, 0, sizeof(cmdHashStats));
+
+    for(i=0;(ht = getAggHash(ctx, i)) != NULL;i++) {
+        cmdHashGetStats(ht, &hs);
+
+        stats->keys += hs.keys;
+        stats->members += hs.members;
+        stats->strings += hs.strings;
+        stats->key_probes += hs.key_probes;
+        stats->member_probes += hs.member_probes;
+        stats->allocs += hs.allocs;
+        stats->memory += hs.memory;
+        stats->flushed += hs.flushed;
+        stats->spilled += hs.spilled;
+
+        if(hs.key_probe_max > stats->key_probe_max)
+            stats->key_probe_max = hs.key_probe_max;
+        if(hs.member_probe_max > stats->member_probe_max)
+            stats->member_probe_max = hs.member_probe_max;
+    }
+}
+
+/**
+ * Add commands from the first len bytes of a file to a sketch, returning
+ * how many bytes we read or -1 on an error.  Anything other than a regular
+ * file is skipped, since reading it here would leave nothing to optimize.
+ */
+static ssize_t sketchFile(const char *path, cmdHashSketch *sk, respScanner *s, size_t len) {
+    size_t total = 0;
+    struct stat st;
+    char *buf = NULL;
+    codecReader *in;
+    int n, rv = 0;
+
+    if(stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return 0;
+
+    if((in = codecReaderOpen(path)) == NULL)
+        return -1;
+
+    respScannerReset(s);
+
+    while(rv >= 0 && total < len && (buf = respScannerReserve(s, CHUNK_SIZE)) != NULL &&
+          (n = codecReaderRead(in, buf, len - total < CHUNK_SIZE ? len - total : CHUNK_SIZE)) > 0)
+    {
+        respScannerCommit(s, n);
+        total += n;
+
+        while((rv = respScannerNext(s)) == 1) {
+            cmdHashSketchAdd(sk, s->argc, s->argv, s->argvlen);
+        }
+    }
+
+    codecReaderClose(in);
+
+    if(buf == NULL)
+        rv = -1;
+
+    // We stop wherever we like, so a partial command at the end is fine,
+    // but a protocol error isn't
+    return rv < 0 ? -1 : (ssize_t)total;
+}
+
+/**
+ * Size our tables from a sketch of the first ctx->auto_size bytes of our
+ * input.  When we're merging, that's of as many of our inputs as it takes.
+ * Anything past what we sketch isn't counted, so our tables may still have
+ * to grow.
+ */
+static int sizeTables(optimizerContext *ctx) {
+    const char *path = ctx->infile;
+    size_t left = ctx->auto_size;
+    cmdHashSketch *sk;
+    unsigned int i;
+    respScanner *s;
+    ssize_t n = 0;
+    cmdHash *ht;
+
+    if((sk = malloc(sizeof(cmdHashSketch))) == NULL || (s = respScannerCreate()) == NULL) {
+        free(sk);
+        return -1;
+    }
+
+    cmdHashSketchInit(sk);
+
+    for(i=0;left && n >= 0 && i<(ctx->merge ? ctx->input_count : 1);i++) {
+        if(ctx->merge)
+            path = ctx->inputs[i];
+
+        if((n = sketchFile(path, sk, s, left)) > 0)
+            left -= n;
+    }
+
+    // Shards split our keys between them
+    for(i=0;n >= 0 && (ht = getAggHash(ctx, i)) != NULL;i++) {
+        if(cmdHashPresize(ht, sk, ctx->shards ? ctx->shards->count : 1) < 0)
+            n = -1;
+    }
+
+    respScannerFree(s);
+    free(sk);
+
+    return n < 0 ? -1 : 0;
+}
+
+/**
+ * Get everything one of our outputs has been handed onto disk, so a
+ * checkpoint can say how much of it there is.  Compressed outputs finish
+ * their gzip member, and whatever we write next starts another.
+ */
+static int syncOutput(optimizerContext *ctx, unsigned int idx, uint64_t *size) {
+    optimizerOutput *out = &ctx->outputs[idx];
+    char path[PATH_MAX];
+    struct stat st;
+
+    *size = 0;
+
+    if(cmdBufferFlush(ctx->cmd_buffers[idx]) < 0)
+        return -1;
+
+    // Neither our writer stage nor our gzip threads can carry on once
+    // they've finished, so they're replaced
+    if(out->writer) {
+        if(pipeWriterFinish(out->writer) < 0)
+            return -1;
+
+        pipeWriterFree(out->writer);
+        out->writer = NULL;
+    }
+
+    if(out->pgz) {
+        if(pgzWriterFinish(out->pgz) < 0)
+            return -1;
+
+        pgzWriterFree(out->pgz);
+        out->pgz = NULL;
+
+        if(createEncoder(ctx, out) < 0)
+            return -1;
+    }
+
+    if((out->enc && codecWriterFinish(out->enc) < 0) ||
+       (out->fd_out && fflush(out->fd_out) != 0) ||
+       (out->fd_out_gz && gzflush(out->fd_out_gz, Z_FINISH) != Z_OK))
+    {
+        return -1;
+    }
+
+    if(ctx->pipeline && (out->writer = pipeWriterCreate(writeRaw, out)) == NULL)
+        return -1;
+
+    // There's no file to measure if we're just running stats
+    if(!*ctx->outfile)
+        return 0;
+
+    if(getOutputPath(ctx, idx, path, sizeof(path)) < 0 || stat(path, &st) < 0)
+        return -1;
+
+    *size = st.st_size;
+
+    return 0;
+}
+
+/**
+ * Checkpoint what we've aggregated, along with how far into our current
+ * input we've got and how much of each output that accounts for, if it's
+ * time we did.
+ */
+static int checkpoint(optimizerContext *ctx, uint64_t offset) {
+    optimizerPhase prev;
+    cmdSnapshotHeader hdr;
+    uint64_t *sizes;
+    unsigned int i;
+    double now;
+    int rv = -1;
+
+    if((now = getTime()) < ctx->next_checkpoint)
+        return 0;
+
+    if((sizes = calloc(ctx->output_count, sizeof(*sizes))) == NULL)
+        return -1;
+
+    prev = setPhase(ctx, PHASE_WRITE);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.outputs = ctx->output_count;
+    hdr.inputs = ctx->input_count;
+    hdr.input = ctx->input_idx;
+    hdr.offset = offset;
+    hdr.commands_in = ctx->cmd_count;
+    hdr.flushed = ctx->cmd_hash->flushed;
+
+    for(i=0;i<ctx->output_count;i++) {
+        if(syncOutput(ctx, i, &sizes[i]) < 0)
+            goto done;
+
+        hdr.commands_out += ctx->cmd_buffers[i]->cmd_count;
+    }
+
+    if(cmdSnapshotSave(ctx->checkpoint, &hdr, sizes, ctx->cmd_hash) < 0)
+        goto done;
+
+    // The next one is due however long from when this one finished
+    ctx->next_checkpoint = getTime() + ctx->checkpoint_every;
+    rv = 0;
+
+done:
+    if(rv < 0)
+        fprintf(stderr, "Error:  Couldn't write checkpoint '%s'\n", ctx->checkpoint);
+
+    setPhase(ctx, prev);
+    free(sizes);
+
+    return rv;
+}
+
+/**
+ * Process a mapped input file.  The scanner works directly on the mapping,
+ * so the argument slices cmdHash sees point into the page cache.  We drop
+ * pages we're done with as we go so they don't count against our RSS.
+ */
+static int processMappedFile(optimizerContext *ctx) {
+    respScanner *s = ctx->scanner;
+    size_t page = sysconf(_SC_PAGESIZE), start = ctx->input_start, pos, sample = 0, check = 0;
+    size_t done = start & ~(page-1);
+    int rv;
+
+    // We start part way through if we're resuming
+    respScannerAttach(s, ctx->map + start, ctx->map_len - start);
+    setPhase(ctx, PHASE_PARSE);
+
+    while((rv = respScannerNext(s)) == 1) {
+        // Every so often, see how long scanning takes by itself
+        if(ctx->timing && s->pos >= sample) {
+            sampleParse(ctx, s);
+            sample = s->pos + PHASE_SAMPLE_EVERY;
+        }
+
+        if(processCommand(ctx, s) < 0) {
+            rv = -1;
+            break;
+        }
+
+        // Increment total commands processed
+        ctx->cmd_count++;
+
+        // See whether a checkpoint is due every so often
+        if(*ctx->checkpoint && s->pos >= check) {
+            check = s->pos + CHUNK_SIZE;
+
+            if(checkpoint(ctx, start + s->pos) < 0) {
+                rv = -1;
+                break;
+            }
+        }
+
+        // Release everything before this command, a page at a time
+        if(start + s->pos - done >= MAP_RELEASE_SIZE) {
+            pos = (start + s->start) & ~(page-1);
+            madvise(ctx->map + done, pos - done, MADV_DONTNEED);
+            done = pos;
+        }
+    }
+
+    setPhase(ctx, PHASE_OTHER);
+    ctx->bytes_in += s->pos;
+    respScannerDetach(s);
+
+    return rv;
+}
+
+/**
+ * Parse one range of a mapped input into its own hash and buffers.  Only
+ * the first range touches our context, timing itself and counting its
+ * commands as it goes, so progress reports can see it.
+ */
+static int parseRange(optimizerRange *r) {
+    optimizerContext *ctx = r->ctx;
+    respScanner *s = r->scanner;
+    unsigned int *count = r == ctx->ranges ? &ctx->cmd_count : &r->cmd_count;
+    size_t page = sysconf(_SC_PAGESIZE), sample = 0, done, pos;
+    int rv;
+
+    // Every range but the first has to find where its first command is
+    if(r != ctx->ranges)
+        r->start = respScannerResync(s, ctx->map, ctx->map_len, r->from);
+
+    done = r->start & ~(page-1);
+    respScannerAttach(s, ctx->map + r->start, ctx->map_len - r->start);
+
+    for(;;) {
+        // We've either run out of input or hit a protocol error, which is
+        // the next range's if it's past the end of ours
+        if((rv = respScannerNext(s)) != 1) {
+            r->end = r->start + s->pos;
+            r->err = rv < 0 && r->end < r->to;
+            break;
+        }
+
+        // Anything starting past the end of our range is the next one's
+        if(r->start + s->start >= r->to) {
+            r->end = r->start + s->start;
+            break;
+        }
+
+        if(r == ctx->ranges && ctx->timing && s->pos >= sample) {
+            sampleParse(ctx, s);
+            sample = s->pos + PHASE_SAMPLE_EVERY;
+        }
+
+        if((rv = cmdHashAdd(r->cmd_hash, s->argc, s->argv, s->argvlen)) == TYPE_UNSUPPORTED)
+            rv = passThrough(ctx, r->cmd_buffers, s);
+
+        if(rv < 0) {
+            r->end = r->start + s->start;
+            r->err = 1;
+            break;
+        }
+
+        // We'll be parsed again, so there's no point going on
+        if(r != ctx->ranges && r->cmd_hash->flushed) {
+            r->end = r->start + s->pos;
+            break;
+        }
+
+        (*count)++;
+
+        // Release everything before this command, a page at a time
+        if(r->start + s->pos - done >= MAP_RELEASE_SIZE) {
+            pos = (r->start + s->start) & ~(page-1);
+            madvise(ctx->map + done, pos - done, MADV_DONTNEED);
+            done = pos;
+        }
+    }
+
+    respScannerDetach(s);
+
+    return r->err ? -1 : 0;
+}
+
+static void *rangeWorker(void *arg) {
+    parseRange(arg);
+    return NULL;
+}
+
+/**
+ * Sink for a range's command buffers, which drain to a file until it's
+ * the range's turn to be added
+ */
+static int writeRangeFile(void *arg, const char *buf, size_t len) {
+    return fwrite(buf, 1, len, arg) == len ? 0 : -1;
+}
+
+/**
+ * Append what a range passed through to one of our buffers: first what it
+ * moved to its file, then what it still has in memory
+ */
+static int appendRangeOutput(cmdBuffer *out, cmdBuffer *buf, FILE *fd) {
+    long size;
+    char *map;
+    int rv;
+
+    if((size = ftell(fd)) < 0 || fflush(fd) != 0)
+        return -1;
+
+    if(size > 0) {
+        if((map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fd), 0)) == MAP_FAILED)
+            return -1;
+
+        rv = cmdBufferAppend(out, map, size, 0);
+        munmap(map, size);
+
+        if(rv < 0)
+            return -1;
+    }
+
+    return cmdBufferAppend(out, buf->buf, buf->pos, buf->cmd_count);
+}
+
+/**
+ * Add what a range parsed to what we have, as if we'd parsed it ourselves
+ * after everything before it.  Its hash is merged into ours, and what it
+ * passed through goes after what we've passed through.  Returns 1, having
+ * added nothing, if its hash can't be merged into ours as it is.
+ */
+static int addRange(optimizerContext *ctx, optimizerRange *r) {
+    unsigned int i;
+    int rv;
+
+    if((rv = cmdHashMerge(ctx->cmd_hash, r->cmd_hash)) != 0)
+        return rv;
+
+    for(i=0;i<ctx->output_count;i++) {
+        if(appendRangeOutput(ctx->cmd_buffers[i], r->cmd_buffers[i], r->files[i]) < 0)
+            return -1;
+    }
+
+    ctx->cmd_count += r->cmd_count;
+
+    return 0;
+}
+
+/**
+ * Parse a mapped input on count threads, each taking a range of it.  Every
+ * range after the first starts at the first thing after its offset that
+ * looks like a command, which we can only be sure of once the range before
+ * it has stopped at exactly that point.  Ranges are added to what we have in
+ * order, and any that didn't start where they should have (because they
+ * started inside a bulk string) we parse again ourselves, from where the
+ * one before it stopped.  So do any with an increment that would overflow
+ * a key, which only we can write out in the right place, and any holding
+ * keys our hash can't take as they are.
+ */
+static int processMappedRanges(optimizerContext *ctx, unsigned int count) {
+    size_t start = ctx->input_start, len = ctx->map_len - start, end;
+    optimizerRange *first = ctx->ranges, *r;
+    unsigned int i, o, started;
+    int rv = -1, again;
+
+    for(i=0;i<count;i++) {
+        r = &ctx->ranges[i];
+
+        r->from = r->start = start + len / count * i;
+        r->to = i == count - 1 ? ctx->map_len : start + len / count * (i + 1);
+        r->cmd_count = 0;
+        r->err = 0;
+
+        // Ranges before this one may hold some of a key an increment here
+        // would overflow, so we can't write it out ahead of it.  We only
+        // count it, and parse the range again ourselves.
+        if(i && ((r->cmd_hash = cmdHashCreate(ctx->ksize, ctx->msize)) == NULL ||
+                 cmdHashSetOutput(r->cmd_hash, NULL) < 0))
+        {
+            goto done;
+        }
+    }
+
+    setPhase(ctx, PHASE_PARSE);
+
+    // We parse the first range ourselves, along with any we couldn't start
+    // a thread for
+    for(started=1;started<count;started++) {
+        if(pthread_create(&ctx->ranges[started].thread, NULL, rangeWorker,
+                          &ctx->ranges[started]) != 0)
+        {
+            break;
+        }
+    }
+
+    parseRange(first);
+
+    for(i=1;i<started;i++) {
+        pthread_join(ctx->ranges[i].thread, NULL);
+    }
+
+    for(i=1,end=first->end;!first->err && i<count;i++) {
+        r = &ctx->ranges[i];
+
+        again = i >= started || r->start != end || r->cmd_hash->flushed;
+
+        // The range really is ours, so its errors are too
+        if(!again) {
+            setPhase(ctx, PHASE_AGGREGATE);
+            if(r->err || (again = addRange(ctx, r)) < 0)
+                goto done;
+            setPhase(ctx, PHASE_PARSE);
+        }
+
+        if(again) {
+            first->start = end;
+            first->to = r->to;
+            parseRange(first);
+
+            end = first->end;
+            continue;
+        }
+
+        end = r->end;
+    }
+
+    setPhase(ctx, PHASE_OTHER);
+
+    if(!first->err) {
+        ctx->bytes_in += end - start;
+        rv = 0;
+    }
+
+done:
+    for(i=1;i<count;i++) {
+        r = &ctx->ranges[i];
+
+        for(o=0;o<ctx->output_count;o++) {
+            cmdBufferReset(r->cmd_buffers[o]);
+
+            rewind(r->files[o]);
+            if(ftruncate(fileno(r->files[o]), 0) < 0)
+                rv = -1;
+        }
+
+        if(r->cmd_hash)
+            cmdHashFree(r->cmd_hash);
+        r->cmd_hash = NULL;
+    }
+
+    return rv;
+}
+
+/**
+ * Process a compressed (or unmappable) input file.  We read from it in
+ * chunks directly into our respScanner.
+ */
+static int processStream(optimizerContext *ctx) {
+    respScanner *s = ctx->scanner;
+    uint64_t offset = ctx->input_start;
+    char *buffer;
+    int read = 0, rv;
+
+    // While we can read data
+    while((buffer = respScannerReserve(s, CHUNK_SIZE)) != NULL) {
+        setPhase(ctx, PHASE_READ);
+        read = readInput(ctx, buffer, CHUNK_SIZE);
+        setPhase(ctx, PHASE_PARSE);
+
+        if(read <= 0)
+            break;
+
+        respScannerCommit(s, read);
+        ctx->bytes_in += read;
+        offset += read;
+
+        // Every so often, see how long scanning takes by itself
+        if(ctx->timing && ctx->bytes_in >= ctx->next_sample) {
+            sampleParse(ctx, s);
+            ctx->next_sample = ctx->bytes_in + PHASE_SAMPLE_EVERY;
+        }
+
+        // Process every complete command we have
+        while((rv = respScannerNext(s)) == 1) {
+            if(processCommand(ctx, s) < 0)
+                return -1;
+
+            // Increment total commands processed
+            ctx->cmd_count++;
+        }
+
+        // Protocol error
+        if(rv < 0)
+            return -1;
+
+        // We've handled everything but a trailing partial command
+        if(*ctx->checkpoint && checkpoint(ctx, offset - respScannerPending(s)) < 0)
+            return -1;
+    }
+
+    setPhase(ctx, PHASE_OTHER);
+
+    // Reallocation or read failure
+    if(!buffer || read < 0)
+        return -1;
+
+    // Success
+    return 0;
+}
+
+/**
+ * Process our input buffer, using our cmdHash object to aggregate commands
+ * that can be combined together (ZINCRBY, ZADD, SADD, PFADD and the INCRBY
+ * family of counters).  Our respScanner hands
+ * back each command as argument slices pointing into its buffer, or into the
+ * input file itself if we were able to map it.
+ *
+ * When we encounter anything we can't aggregate, we copy its raw
+ * Redis protocol bytes onto the end of our command buffer, which drains to
+ * our output file as it fills.
+ */
+int processBufferFile(optimizerContext *ctx) {
+    size_t count;
+
+    // Mapped files are parsed in place, anything else is read in chunks
+    if(!ctx->map)
+        return processStream(ctx);
+
+    // Big enough inputs are split between our parse threads
+    count = (ctx->map_len - ctx->input_start) / PARSE_MIN_RANGE;
+    if(count > ctx->parse_threads)
+        count = ctx->parse_threads;
+
+    return count > 1 ? processMappedRanges(ctx, count) : processMappedFile(ctx);
+}
+
+/**
+ * Append aggregated commands to our command buffer or just add the aggregated
+ * counts depending on stat mode.
+ */
+int appendAggCommands(optimizerContext *ctx) {
+    unsigned int i;
+    cmdHash *ht;
+
+    // Wait for our shards to aggregate everything we've sent them
+    setPhase(ctx, PHASE_AGGREGATE);
+    if(ctx->shards && cmdShardPoolFinish(ctx->shards) < 0)
+        return -1;
+    setPhase(ctx, PHASE_OTHER);
+
+    if(ctx->shards && passShardCommands(ctx) < 0)
+        return -1;
+
+    // Take stock of what we're holding before writing it out
+    if(ctx->stats_json)
+        getHashStats(ctx, &ctx->hash_stats);
+
+    if(!ctx->stats) {
+        // Stream aggregated and hashed commands through our command buffer
+        setPhase(ctx, PHASE_FORMAT);
+        if(ctx->shards && ctx->order != ORDER_TABLE) {
+            // Sorting shard by shard would leave us with one run per shard
+            if(writeSortedShards(ctx) < 0)
+                return -1;
+        } else {
+            for(i=0;(ht = getAggHash(ctx, i)) != NULL;i++) {
+                if(cmdHashGetCommands(ht, ctx->cmd_buffers[0])!=0)
+                    return -1;
+            }
+        }
+        setPhase(ctx, PHASE_OTHER);
+    } else {
+        // Just add the aggregated command count, no need to process
+        ctx->cmd_buffers[0]->cmd_count += getAggCount(ctx);
+    }
+
+    // Success
+    return 0;
+}
+
+/**
+ * Output statistics about our compression.  Workers may be printing their
+ * own at the same time, so each line goes out whole.
+ */
+void outputStats(optimizerContext *ctx) {
+    double pct=0.0, timing;
+
+    // Calculate how long the compression took
+    timing = ctx->end - ctx->start;
+
+    // Calculate compression ratio
+    if(ctx->cmd_count > 0) {
+        pct = 1-((double)getAggCount(ctx))/(double)ctx->cmd_count;
+    } 
+
+    flockfile(stdout);
+
+    // Output input file, or how many we merged
+    if(ctx->merge && ctx->input_count > 1) {
+        printf("%u inputs\t", ctx->input_count);
+    } else {
+        printf("%s\t", ctx->infile);
+    }
+
+    // Print output file (or where we replayed to) if we have one
+    if(*ctx->outfile) {
+        printf("%s\t", ctx->outfile);
+    } else if(*ctx->target) {
+        printf("%s\t", ctx->target);
+    }
+
+    // Print the rest of our statistics
+    printf("%d\t%d\t%2.2f\t%f\n",
+           ctx->cmd_count, getAggCount(ctx),
+           pct, timing);
+
+    funlockfile(stdout);
+}
+
+/**
+ * Time spent in each phase.  Parsing and aggregating were timed together,
+ * so we split them using how fast our samples scanned.
+ */
+static void getPhases(optimizerContext *ctx, double *phases) {
+    double parse = 0;
+
+    memcpy(phases, ctx->phases, sizeof(ctx->phases));
+
+    if(ctx->sampled_bytes) {
+        parse = ctx->sampled / ctx->sampled_bytes * ctx->bytes_in;
+        if(parse > phases[PHASE_PARSE])
+            parse = phases[PHASE_PARSE];
+    }
+
+    phases[PHASE_AGGREGATE] += phases[PHASE_PARSE] - parse;
+    phases[PHASE_PARSE] = parse;
+}
+
+/**
+ * Output our statistics as a single line of JSON, along with where our time
+ * went and how our hash tables held up.
+ */
+void outputStatsJson(optimizerContext *ctx) {
+    static const char *names[PHASE_COUNT] = {
+        [PHASE_OTHER] = "other", [PHASE_READ] = "read", [PHASE_PARSE] = "parse",
+        [PHASE_AGGREGATE] = "aggregate", [PHASE_FORMAT] = "format", [PHASE_WRITE] = "write"
+    };
+    const cmdHashStats *hs = &ctx->hash_stats;
+    double phases[PHASE_COUNT], pct = 0.0;
+    unsigned int agg = getAggCount(ctx);
+    int i;
+
+    if(ctx->cmd_count > 0)
+        pct = 1-((double)agg)/(double)ctx->cmd_count;
+
+    getPhases(ctx, phases);
+
+    flockfile(stdout);
+
+    if(ctx->merge && ctx->input_count > 1) {
+        printf("{\"inputs\":%u", ctx->input_count);
+    } else {
+        printf("{\"input\":");
+        printJsonString(stdout, ctx->infile);
+    }
+
+    if(*getOutputName(ctx)) {
+        printf(",\"output\":");
+        printJsonString(stdout, getOutputName(ctx));
+    }
+
+    printf(",\"commands_in\":%u,\"commands_aggregated\":%u,\"commands_out\":%u,\"ratio\":%.4f",
+           ctx->cmd_count, agg, getOutputCount(ctx), pct);
+    printf(",\"bytes_in\":%llu,\"bytes_out\":%llu,\"seconds\":%f",
+           (unsigned long long)ctx->bytes_in, (unsigned long long)ctx->bytes_out,
+           ctx->end - ctx->start);
+
+    printf(",\"phases\":{");
+    for(i=0;i<PHASE_COUNT;i++) {
+        printf("%s\"%s\":%f", i ? "," : "", names[i], phases[i]);
+    }
+    printf("}");
+
+    printf(",\"keys\":%llu,\"members\":%llu,\"strings\":%llu",
+           (unsigned long long)hs->keys, (unsigned long long)hs->members,
+           (unsigned long long)hs->strings);
+    printf(",\"key_probes\":{\"avg\":%.3f,\"max\":%u}",
+           hs->keys ? (double)hs->key_probes / hs->keys : 0.0, hs->key_probe_max);
+    printf(",\"member_probes\":{\"avg\":%.3f,\"max\":%u}",
+           hs->members ? (double)hs->member_probes / hs->members : 0.0, hs->member_probe_max);
+    printf(",\"allocs\":%llu,\"memory\":%zu,\"flushed\":%u,\"spilled_runs\":%u,\"peak_rss\":%llu}\n",
+           (unsigned long long)hs->allocs, hs->memory, hs->flushed, hs->spilled, getPeakRss());
+
+    funlockfile(stdout);
+}
+
+/**
+ * Parse a size with an optional K, M or G suffix, returning zero if it's
+ * not valid.
+ */
+static size_t parseSize(const char *str) {
+    unsigned long long val;
+    char *end;
+
+    val = strtoull(str, &end, 10);
+
+    switch(*end) {
+        case 'g': case 'G':
+            val *= 1024;
+            /* fallthrough */
+        case 'm': case 'M':
+            val *= 1024;
+            /* fallthrough */
+        case 'k': case 'K':
+            val *= 1024;
+            end++;
+            break;
+    }
+
+    return end == str || *end ? 0 : val;
+}
+
+/**
+ * Parse a sort order, returning ORDER_TABLE if it isn't one we know
+ */
+static cmdOrder parseOrder(const char *str) {
+    if(!strcasecmp(str, "slot"))
+        return ORDER_SLOT;
+    if(!strcasecmp(str, "key"))
+        return ORDER_KEY;
+    if(!strcasecmp(str, "seen"))
+        return ORDER_SEEN;
+
+    return ORDER_TABLE;
+}
+
+
+/**
+ * Simple usage output
+ */
+void printUsage(char *cmd) {
+    printf("%s: [OPTIONS] INFILE OUTFILE\n", cmd);
+    printf("%s: [OPTIONS] --output-dir DIR INFILE...\n", cmd);
+    printf("%s: [OPTIONS] --merge INFILE... OUTFILE\n", cmd);
+    printf("%s: [OPTIONS] --target HOST:PORT INFILE...\n", cmd);
+    printf("   --stat     Display statistics but don't write anything\n");
+    printf("   --stats-json   Print statistics as JSON, including time spent in each phase\n");
+    printf("   --progress     Report progress to stderr as JSON every this many seconds\n");
+    printf("   --gzip     Compress output file with gzip\n");
+    printf("   --compress Compress output file with gzip, zstd or lz4 (if built with them)\n");
+    printf("   --compress-level   Compression level (gzip 0-9, zstd 1-19, lz4 0-12)\n");
+    printf("   --compress-threads Number of threads to compress with (default: cores)\n");
+    printf("   --gzip-level, --gzip-threads  The same as the two above\n");
+    printf("   --zstd-long    Have zstd look for matches across a %d MB window\n",
+           1 << (CODEC_ZSTD_LONG_WINDOW - 20));
+    printf("   --max-memory   Spill to disk once aggregation uses this much (e.g. 4G)\n");
+    printf("   --spill-dir    Where to spill to (default $TMPDIR or /tmp)\n");
+    printf("   --flush-window Write out keys untouched for this many aggregated commands\n");
+    printf("   --ordered      Write aggregated keys out before any other command touching them\n");
+    printf("   --sort     Write aggregated keys by cluster slot, by key, or in the order\n");
+    printf("              they were first seen (slot, key or seen)\n");
+    printf("   --cluster-split  Split output by cluster slot into this many files, one for\n");
+    printf("                    each master of a cluster redis-cli would create\n");
+    printf("   --zadd-batch   Write sorted sets as ZADDs of up to this many arguments,\n");
+    printf("                  which is only correct when replaying into empty keys\n");
+    printf("   --target   Replay into this Redis server instead of writing a file\n");
+    printf("   --replay-depth Commands sent to --target before waiting on replies (default %d)\n",
+           REPLAY_DEPTH);
+    printf("   --output-dir   Write each input's output to a file of the same name in DIR\n");
+    printf("   --jobs     Number of inputs to optimize at once with --output-dir (default 1)\n");
+    printf("   --merge    Aggregate every input, in order, into one output\n");
+    printf("   --manifest Read more input files from this file, one per line\n");
+    printf("   --threads  Number of threads to aggregate with (default 1)\n");
+    printf("   --parse-threads  Number of threads to parse each uncompressed input on (default 1).\n");
+    printf("                    Each holds what it aggregates in memory until it's merged\n");
+    printf("   --checkpoint       Save what we've aggregated, and how far we've got, to this file\n");
+    printf("   --checkpoint-every Seconds between checkpoints (default %d)\n", CHECKPOINT_EVERY);
+    printf("   --resume           Carry on from the last --checkpoint, if there is one\n");
+    printf("   --load-state   Add what an earlier --save-state (or checkpoint) held to our output\n");
+    printf("   --save-state   Save aggregated commands to this file rather than writing them\n");
+    printf("   --key-buckets    Buckets each key table starts with (default %d)\n", KHASH_SIZE);
+    printf("   --member-buckets Buckets each key's member table starts with (default %d)\n",
+           MHASH_SIZE);
+    printf("   --auto-size      Size tables from a sketch of this much of each input (e.g. 256M)\n");
+    printf("   --pipeline Read and write on their own threads\n");
+    printf("   --no-mmap  Don't memory map uncompressed input files\n");
+    printf("   --version  Print version number\n");
+    printf("   --quiet    Don't output information about compression\n");
+    printf("   --help     This message\n");
+    printf("Input files may also be given as quoted patterns, like 'shards/*.aof'\n");
+}
+
+/**
+ * Add a file to our list of inputs
+ */
+static void addInput(optimizerContext *ctx, const char *path) {
+    char **inputs;
+
+    // Treat an empty name as no name at all
+    if(!*path)
+        return;
+
+    if(strlen(path) >= sizeof(ctx->infile)) {
+        fprintf(stderr, "Error:  Input file name '%s' is too long\n", path);
+        exit(1);
+    }
+
+    // Grow our list by doubling
+    if((ctx->input_count & (ctx->input_count - 1)) == 0) {
+        inputs = realloc(ctx->inputs, sizeof(char*) * (ctx->input_count ? ctx->input_count*2 : 1));
+        if(inputs == NULL) {
+            fprintf(stderr, "Error:  Out of memory adding input files\n");
+            exit(1);
+        }
+        ctx->inputs = inputs;
+    }
+
+    if((ctx->inputs[ctx->input_count] = strdup(path)) == NULL) {
+        fprintf(stderr, "Error:  Out of memory adding input files\n");
+        exit(1);
+    }
+
+    ctx->input_count++;
+}
+
+/**
+ * Add an input from the command line.  Patterns are expanded here so they
+ * can be quoted, and so aren't bound by the shell's argument limits.
+ */
+static void addInputArg(optimizerContext *ctx, const char *arg) {
+    struct stat st;
+    glob_t matches;
+    size_t i;
+
+    // A file that happens to have pattern characters in its name is just
+    // that file
+    if(!strpbrk(arg, "*?[") || stat(arg, &st) == 0) {
+        addInput(ctx, arg);
+        return;
+    }
+
+    if(glob(arg, 0, NULL, &matches) != 0) {
+        fprintf(stderr, "Error:  No input files match '%s'\n", arg);
+        exit(1);
+    }
+
+    for(i=0;i<matches.gl_pathc;i++) {
+        addInput(ctx, matches.gl_pathv[i]);
+    }
+
+    globfree(&matches);
+}
+
+/**
+ * Add every input listed in a manifest, one per line.  Blank lines and
+ * lines starting with '#' are skipped.
+ */
+static void addManifest(optimizerContext *ctx, const char *manifest) {
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *fp;
+
+    if((fp = fopen(manifest, "r")) == NULL) {
+        fprintf(stderr, "Error:  Couldn't open manifest '%s'\n", manifest);
+        exit(1);
+    }
+
+    while((len = getline(&line, &size, fp)) >= 0) {
+        // Trim trailing whitespace, including the newline
+        while(len > 0 && strchr(" \t\r\n", line[len-1]))
+            line[--len] = '\0';
+
+        if(*line != '#')
+            addInput(ctx, line);
+    }
+
+    if(ferror(fp)) {
+        fprintf(stderr, "Error:  Couldn't read manifest '%s'\n", manifest);
+        exit(1);
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+/**
+ * The name an input's output gets in our output directory, which is the
+ * input's own name without any compressed extension (we add our own if
+ * we're compressing).
+ */
+static size_t getOutputBase(const char *infile, const char **base) {
+    const char *slash = strrchr(infile, '/'), *name;
+    size_t len;
+
+    name = slash ? slash + 1 : infile;
+    len = strlen(name);
+
+    len -= cmdCodecExtLen(name, len);
+    *base = name;
+
+    return len;
+}
+
+/**
+ * Parse our command's arguments and set context
+ */
+void parseArgs(optimizerContext *ctx, int argc, char **argv) {
+    const char *manifest = NULL, *outfile = NULL, *base, *other, *ext;
+    const cmdCodecInfo *info;
+    int opt, opt_idx, i, j, last = argc, buckets = 0;
+    unsigned long long val;
+    size_t len, other_len;
+
+    while((opt = getopt_long(argc, argv, "qsSzvhpMogUWt:T:l:j:m:d:w:b:r:R:O:J:F:P:K:B:A:k:C:c:E:L:V:Z:", g_long_opts, &opt_idx)) != -1) {
+        switch(opt) {
+            case 'q':
+                // Don't print anything
+                ctx->quiet = 1;
+                break;
+            case 's':
+                // We just want statistics
+                ctx->stats = 1;
+                break;
+            case 'S':
+                // Statistics as JSON, with our timings
+                ctx->stats_json = 1;
+                break;
+            case 'P':
+                // Report progress as we go
+                if((ctx->progress = atof(optarg)) <= 0) {
+                    fprintf(stderr, "Error:  Progress interval must be more than zero seconds\n");
+                    exit(1);
+                }
+                break;
+            case 'z':
+                // gzip output buffer file
+                ctx->codec = CODEC_GZIP;
+                break;
+            case 'Z':
+                // Or compress it with something else
+                ctx->codec = cmdCodecByName(optarg);
+                if(ctx->codec == CODEC_COUNT || !cmdCodecGetInfo(ctx->codec)->available) {
+                    fprintf(stderr, "Error:  Unknown codec '%s' (or we weren't built with it)\n",
+                            optarg);
+                    exit(1);
+                }
+                break;
+            case 'W':
+                // Let zstd find matches further back
+                ctx->long_window = 1;
+                break;
+            case 'p':
+                // Separate reader and writer threads
+                ctx->pipeline = 1;
+                break;
+            case 'o':
+                // Commands we pass through act as barriers
+                ctx->ordered = 1;
+                break;
+            case 'M':
+                // Always read input through zlib
+                ctx->no_mmap = 1;
+                break;
+            case 'g':
+                // One output for all of our inputs
+                ctx->merge = 1;
+                break;
+            case 't':
+                // Aggregate on this many threads
+                ctx->threads = atoi(optarg);
+                if(ctx->threads < 1 || ctx->threads > SHARD_MAX_THREADS) {
+                    fprintf(stderr, "Error:  Thread count must be between 1 and %d\n",
+                            SHARD_MAX_THREADS);
+                    exit(1);
+                }
+                break;
+            case 'T':
+                // Parse each mapped input on this many threads
+                ctx->parse_threads = atoi(optarg);
+                if(ctx->parse_threads < 1 || ctx->parse_threads > SHARD_MAX_THREADS) {
+                    fprintf(stderr, "Error:  Parse thread count must be between 1 and %d\n",
+                            SHARD_MAX_THREADS);
+                    exit(1);
+                }
+                break;
+            case 'K':
+            case 'B':
+                // Start our tables this big
+                val = strtoull(optarg, NULL, 10);
+                if(val < 1 || val > MAX_BUCKETS) {
+                    fprintf(stderr, "Error:  Bucket counts must be between 1 and %u\n", MAX_BUCKETS);
+                    exit(1);
+                }
+                *(opt == 'K' ? &ctx->ksize : &ctx->msize) = val;
+                buckets = 1;
+                break;
+            case 'A':
+                // Size our tables from a sketch of our input
+                if((ctx->auto_size = parseSize(optarg)) == 0) {
+                    fprintf(stderr, "Error:  Invalid sketch size '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'k':
+                // Write aggregated keys in some order other than our tables'
+                if((ctx->order = parseOrder(optarg)) == ORDER_TABLE) {
+                    fprintf(stderr, "Error:  Sort order must be slot, key or seen\n");
+                    exit(1);
+                }
+                break;
+            case 'C':
+                // One output for each range of cluster slots
+                ctx->split = atoi(optarg);
+                if(ctx->split < 1 || ctx->split > MAX_SPLIT) {
+                    fprintf(stderr, "Error:  Cluster split must be between 1 and %d outputs\n",
+                            MAX_SPLIT);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                strncpy(ctx->checkpoint, optarg, sizeof(ctx->checkpoint)-1);
+                break;
+            case 'E':
+                // Checkpoint this often
+                if((ctx->checkpoint_every = atof(optarg)) <= 0) {
+                    fprintf(stderr, "Error:  Checkpoint interval must be more than zero seconds\n");
+                    exit(1);
+                }
+                break;
+            case 'U':
+                // Start from our last checkpoint
+                ctx->resume = 1;
+                break;
+            case 'L':
+                strncpy(ctx->load_state, optarg, sizeof(ctx->load_state)-1);
+                break;
+            case 'V':
+                strncpy(ctx->save_state, optarg, sizeof(ctx->save_state)-1);
+                break;
+            case 'J':
+                // Optimize this many inputs at once
+                ctx->jobs = atoi(optarg);
+                if(ctx->jobs < 1 || ctx->jobs > MAX_JOBS) {
+                    fprintf(stderr, "Error:  Job count must be between 1 and %d\n", MAX_JOBS);
+                    exit(1);
+                }
+                break;
+            case 'l':
+                // How hard to compress, which we check once we know what
+                // we're compressing with
+                if((ctx->level = atoi(optarg)) < 0) {
+                    fprintf(stderr, "Error:  Compression level can't be negative\n");
+                    exit(1);
+                }
+                break;
+            case 'j':
+                // Compress on this many threads
+                ctx->compress_threads = atoi(optarg);
+                if(ctx->compress_threads < 1 || ctx->compress_threads > PGZ_MAX_THREADS) {
+                    fprintf(stderr, "Error:  Compression thread count must be between 1 and %d\n",
+                            PGZ_MAX_THREADS);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                // Bound how much we aggregate in memory
+                if((ctx->max_memory = parseSize(optarg)) == 0) {
+                    fprintf(stderr, "Error:  Invalid memory size '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                strncpy(ctx->target, optarg, sizeof(ctx->target)-1);
+                break;
+            case 'R':
+                // Bound how far ahead of Redis' replies we get
+                if((ctx->replay_depth = strtoull(optarg, NULL, 10)) == 0) {
+                    fprintf(stderr, "Error:  Replay depth must be at least one command\n");
+                    exit(1);
+                }
+                break;
+            case 'd':
+                strncpy(ctx->spill_dir, optarg, sizeof(ctx->spill_dir)-1);
+                break;
+            case 'O':
+                strncpy(ctx->output_dir, optarg, sizeof(ctx->output_dir)-1);
+                break;
+            case 'F':
+                manifest = optarg;
+                break;
+            case 'w':
+                // Flush keys once they go cold
+                if((ctx->window = strtoull(optarg, NULL, 10)) == 0) {
+                    fprintf(stderr, "Error:  Flush window must be at least one command\n");
+                    exit(1);
+                }
+                break;
+            case 'b':
+                // Batch sorted set members into variadic ZADDs
+                ctx->zadd_batch = atoi(optarg);
+                if(ctx->zadd_batch < 4 || ctx->zadd_batch > ARG_MAX) {
+                    fprintf(stderr, "Error:  ZADD batch must be between 4 and %d arguments\n",
+                            ARG_MAX);
+                    exit(1);
+                }
+                break;
+            case 'v':
+                printf("buffer-optimize " BUFFER_OPTIMIZE_VERSION "\n");
+                exit(0);
+            case 'h':
+            case '?':
+                printUsage(argv[0]);
+                exit(0);
+        }
+    }
+
+    // quiet and stat mode make no sense together
+    if(ctx->quiet && (ctx->stats || ctx->stats_json)) {
+        fprintf(stderr, "Setting both quiet and stat mode doesn't make sense!\n");
+        exit(1);
+    }
+
+    // We either know how big our tables should be, or work it out
+    if(buckets && ctx->auto_size) {
+        fprintf(stderr, "Error:  --auto-size can't be used with --key-buckets or --member-buckets\n");
+        exit(1);
+    }
+
+    // Only keep track of where our time goes if we'll report it
+    ctx->timing = ctx->stats_json || ctx->progress > 0;
+
+    // Shards can't write to our output buffer from their own threads
+    if(ctx->window && ctx->threads > 1) {
+        fprintf(stderr, "Error:  --flush-window can't be used with --threads\n");
+        exit(1);
+    }
+
+    // A key flushed early would have its scores replaced if it came back
+    if(ctx->window && ctx->zadd_batch) {
+        fprintf(stderr, "Error:  --zadd-batch can't be used with --flush-window\n");
+        exit(1);
+    }
+
+    // Barriers flush single keys, which shards and spilled runs can't do,
+    // and a batched ZADD would replace the scores of a key that came back
+    if(ctx->ordered && (ctx->threads > 1 || ctx->max_memory || ctx->zadd_batch)) {
+        fprintf(stderr, "Error:  --ordered can't be used with --threads, --max-memory or --zadd-batch\n");
+        exit(1);
+    }
+
+    // Spilled runs are merged in hash order, and each shard counts the keys
+    // it sees on its own
+    if(ctx->order != ORDER_TABLE && ctx->max_memory) {
+        fprintf(stderr, "Error:  --sort can't be used with --max-memory\n");
+        exit(1);
+    }
+    if(ctx->order == ORDER_SEEN && ctx->threads > 1) {
+        fprintf(stderr, "Error:  --sort seen can't be used with --threads\n");
+        exit(1);
+    }
+
+    // Ranges are parsed into hashes of their own and merged once they're
+    // all done, so nothing can be flushed or spilled along the way, and
+    // there's no one point we've parsed up to for a checkpoint to record
+    if(ctx->parse_threads > 1 && (ctx->threads > 1 || ctx->window || ctx->ordered ||
+                                  ctx->max_memory || *ctx->checkpoint))
+    {
+        fprintf(stderr, "Error:  --parse-threads can't be used with --threads, --flush-window, "
+                        "--ordered, --max-memory or --checkpoint\n");
+        exit(1);
+    }
+
+    // Intervals and resuming are both about checkpoints
+    if((ctx->checkpoint_every || ctx->resume) && !*ctx->checkpoint) {
+        fprintf(stderr, "Error:  --checkpoint-every and --resume need --checkpoint\n");
+        exit(1);
+    }
+    if(!ctx->checkpoint_every)
+        ctx->checkpoint_every = CHECKPOINT_EVERY;
+
+    // Saved state is of a single cmdHash, and of an output we can cut back
+    // to what it accounts for
+    if((*ctx->checkpoint || *ctx->load_state || *ctx->save_state) &&
+       (ctx->threads > 1 || *ctx->target || *ctx->output_dir || ctx->jobs > 1))
+    {
+        fprintf(stderr, "Error:  Checkpoints and saved state can't be used with --threads, "
+                        "--target, --output-dir or --jobs\n");
+        exit(1);
+    }
+    // Keys from before a checkpoint come back in the order they were saved
+    if(*ctx->checkpoint && ctx->order == ORDER_SEEN) {
+        fprintf(stderr, "Error:  --sort seen can't be used with --checkpoint\n");
+        exit(1);
+    }
+
+    // Each codec has levels of its own
+    info = cmdCodecGetInfo(ctx->codec);
+    if(ctx->codec != CODEC_NONE && ctx->level != CODEC_DEFAULT_LEVEL &&
+       (ctx->level < info->min_level || ctx->level > info->max_level))
+    {
+        fprintf(stderr, "Error:  %s compression level must be between %d and %d\n",
+                info->name, info->min_level, info->max_level);
+        exit(1);
+    }
+    if(ctx->long_window && ctx->codec != CODEC_ZSTD) {
+        fprintf(stderr, "Error:  --zstd-long needs --compress zstd\n");
+        exit(1);
+    }
+
+    // Replaying goes straight to Redis, so there's nothing to compress
+    if(*ctx->target && (ctx->stats || ctx->codec != CODEC_NONE)) {
+        fprintf(stderr, "Error:  --target can't be used with --stat, --gzip or --compress\n");
+        exit(1);
+    }
+
+    // A server only holds its own slots, so there's nothing to split
+    if(ctx->split && *ctx->target) {
+        fprintf(stderr, "Error:  --cluster-split can't be used with --target\n");
+        exit(1);
+    }
+
+    // Outputs are either named for their inputs, or there's just one
+    if(ctx->merge && *ctx->output_dir) {
+        fprintf(stderr, "Error:  --merge can't be used with --output-dir\n");
+        exit(1);
+    }
+
+    // Merged inputs go through one context in order, so they can't be split
+    // between jobs (use --threads instead)
+    if(ctx->merge && ctx->jobs > 1) {
+        fprintf(stderr, "Error:  --jobs can't be used with --merge\n");
+        exit(1);
+    }
+
+    // Unless we're in stats mode, replaying, or naming outputs for their
+    // inputs, our output file comes after them
+    if(!ctx->stats && !*ctx->target && !*ctx->output_dir && argc - optind > (manifest ? 0 : 1))
+        outfile = argv[--last];
+
+    // Collect our input files
+    for(i=optind;i<last;i++) {
+        addInputArg(ctx, argv[i]);
+    }
+    if(manifest)
+        addManifest(ctx, manifest);
+
+    // We'll need an input file
+    if(!ctx->input_count) {
+        fprintf(stderr, "Error:  Must specify input file!\n");
+        exit(1);
+    }
+
+    // If we're not in stats mode or replaying, we'll need an output file
+    if(!ctx->stats && !*ctx->target && !*ctx->output_dir && (!outfile || !*outfile)) {
+        fprintf(stderr, "Error:  Must specificy output file!\n");
+        exit(1);
+    }
+
+    // Everything we replay goes to the same server, so it's one stream
+    if(*ctx->target && ctx->input_count > 1)
+        ctx->merge = 1;
+
+    // One output file can only take more than one input if we merge them
+    if(outfile && ctx->input_count > 1 && !ctx->merge) {
+        fprintf(stderr, "Error:  Use --merge or --output-dir with more than one input file\n");
+        exit(1);
+    }
+
+    // Saved state is all of one context's, which our own context handles
+    // the same way it merges inputs
+    if(*ctx->checkpoint || *ctx->load_state || *ctx->save_state)
+        ctx->merge = 1;
+
+    // Inputs with the same name would write over each other's output
+    if(*ctx->output_dir && !ctx->stats) {
+        for(i=0;i<(int)ctx->input_count;i++) {
+            len = getOutputBase(ctx->inputs[i], &base);
+
+            for(j=0;j<i;j++) {
+                other_len = getOutputBase(ctx->inputs[j], &other);
+
+                if(len == other_len && !memcmp(base, other, len)) {
+                    fprintf(stderr, "Error:  '%s' and '%s' would have the same output file\n",
+                            ctx->inputs[j], ctx->inputs[i]);
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    // Copy in our input file, which is the only one unless we're merging or
+    // have an output directory
+    strncpy(ctx->infile, ctx->inputs[0], sizeof(ctx->infile)-1);
+
+    // Copy in our output file if we have one
+    if(outfile) {
+        strncpy(ctx->outfile, outfile, sizeof(ctx->outfile)-1);
+
+        // Append our codec's extension if it's not already there
+        ext = cmdCodecGetInfo(ctx->codec)->ext;
+        len = strlen(ctx->outfile);
+        if(len < strlen(ext) || strcmp(ctx->outfile + len - strlen(ext), ext))
+            strncat(ctx->outfile, ext, sizeof(ctx->outfile)-len-1);
+    }
+}
+
+/**
+ * Set our defaults.  Everything we aggregate with is created later by
+ * setupContext, by whichever thread ends up using it.
+ */
+void initContext(optimizerContext *ctx) {
+    const char *tmpdir;
+    long cores;
+
+    // Zero out everything
+    memset(ctx, 0, sizeof(optimizerContext));
+
+    // Parse and aggregate on a single thread, one input at a time, unless
+    // told otherwise
+    ctx->threads = 1;
+    ctx->parse_threads = 1;
+    ctx->jobs = 1;
+
+    // Start with our usual table sizes
+    ctx->ksize = KHASH_SIZE;
+    ctx->msize = MHASH_SIZE;
+
+    // Spill to the usual place for temporary files
+    if((tmpdir = getenv("TMPDIR")) != NULL && *tmpdir)
+        strncpy(ctx->spill_dir, tmpdir, sizeof(ctx->spill_dir)-1);
+
+    // Compress at our codec's default level, using every core we have
+    ctx->level = CODEC_DEFAULT_LEVEL;
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    ctx->compress_threads = cores < 1 ? 1 : cores > PGZ_MAX_THREADS ? PGZ_MAX_THREADS : cores;
+}
+
+/**
+ * Create our outputs, and a command buffer for each of them that drains to
+ * it.  When we're splitting our output we also work out which of them each
+ * cluster slot goes to.
+ */
+static int createOutputs(optimizerContext *ctx) {
+    unsigned int i, count = ctx->split ? ctx->split : 1;
+
+    if((ctx->outputs = calloc(count, sizeof(optimizerOutput))) == NULL ||
+       (ctx->cmd_buffers = calloc(count, sizeof(cmdBuffer*))) == NULL)
+    {
+        return -1;
+    }
+
+    ctx->output_count = count;
+
+    if(ctx->split) {
+        if((ctx->slot_map = malloc(sizeof(uint16_t) * CLUSTER_SLOTS)) == NULL)
+            return -1;
+
+        crc16SlotRanges(ctx->slot_map, ctx->split);
+    }
+
+    for(i=0;i<ctx->output_count;i++) {
+        ctx->outputs[i].ctx = ctx;
+
+        if((ctx->cmd_buffers[i] = cmdBufferCreate()) == NULL)
+            return -1;
+
+        // Drain output to disk as we go, rather than holding all of it
+        if(!ctx->stats)
+            cmdBufferSetSink(ctx->cmd_buffers[i], writeOutput, &ctx->outputs[i], OUTPUT_HWM);
+    }
+
+    return 0;
+}
+
+/**
+ * Set up a range for each of our parse threads.  The first is parsed by our
+ * own thread, with our own scanner and buffers, while the rest get their
+ * own (and a hash of their own each time they're used).
+ */
+static int createRanges(optimizerContext *ctx) {
+    unsigned int i, o;
+    optimizerRange *r;
+
+    if((ctx->ranges = calloc(ctx->parse_threads, sizeof(optimizerRange))) == NULL)
+        return -1;
+
+    ctx->ranges[0].ctx = ctx;
+    ctx->ranges[0].scanner = ctx->scanner;
+    ctx->ranges[0].cmd_hash = ctx->cmd_hash;
+    ctx->ranges[0].cmd_buffers = ctx->cmd_buffers;
+
+    for(i=1;i<ctx->parse_threads;i++) {
+        r = &ctx->ranges[i];
+        r->ctx = ctx;
+
+        if((r->scanner = respScannerCreate()) == NULL ||
+           (r->cmd_buffers = calloc(ctx->output_count, sizeof(cmdBuffer*))) == NULL ||
+           (r->files = calloc(ctx->output_count, sizeof(FILE*))) == NULL)
+        {
+            return -1;
+        }
+
+        for(o=0;o<ctx->output_count;o++) {
+            if((r->cmd_buffers[o] = cmdBufferCreate()) == NULL ||
+               (r->files[o] = cmdSpillOpen(ctx->spill_dir)) == NULL)
+            {
+                return -1;
+            }
+
+            cmdBufferSetSink(r->cmd_buffers[o], writeRangeFile, r->files[o], PARSE_RANGE_HWM);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Create anything we aggregate with that we don't already have, and set it
+ * up the way our options ask.  Returns -1 (having said why) on failure.
+ */
+int setupContext(optimizerContext *ctx) {
+    // Make sure we can allocate our outputs' command buffers
+    if(!ctx->outputs && createOutputs(ctx) < 0) {
+        fprintf(stderr, "Error:  Can't create command buffer!\n");
         return -1;
+    }
 
-    // We may not need to open our output file if we're just runing stats
-    if(*ctx->outfile) {
-        if(ctx->gz) {
-            if((ctx->fd_out_gz = gzopen(ctx->outfile, "w")) == NULL)
-                return -1;
-        } else {
-            if((ctx->fd_out = fopen(ctx->outfile, "w")) == NULL)
-                return -1;
+    // Make sure we can allocate our cmdHash
+    if(!ctx->cmd_hash && (ctx->cmd_hash = cmdHashCreate(ctx->ksize, ctx->msize)) == NULL) {
+        fprintf(stderr, "Error:  Couldn't create cmdHash object\n");
+        return -1;
+    }
+
+    // Create our protocol scanner, and another to time scanning with
+    if((!ctx->scanner && (ctx->scanner = respScannerCreate()) == NULL) ||
+       (ctx->timing && !ctx->sampler && (ctx->sampler = respScannerCreate()) == NULL))
+    {
+        fprintf(stderr, "Error:  Couldn't create protocol scanner\n");
+        return -1;
+    }
+
+    // Give each of our parse threads a range to work on
+    if(ctx->parse_threads > 1 && !ctx->ranges && createRanges(ctx) < 0) {
+        fprintf(stderr, "Error:  Couldn't set up parse threads\n");
+        return -1;
+    }
+
+    // Write out cold keys as we go (when we're writing anything)
+    if(ctx->window && !ctx->stats &&
+       cmdHashSetWindow(ctx->cmd_hash, ctx->window, ctx->cmd_buffers[0]) < 0)
+    {
+        fprintf(stderr, "Error:  Couldn't set flush window\n");
+        return -1;
+    }
+
+    // Keep passed through commands in order with what we aggregate
+    if(ctx->ordered &&
+       cmdHashSetOrdered(ctx->cmd_hash, ctx->stats ? NULL : ctx->cmd_buffers[0]) < 0)
+    {
+        fprintf(stderr, "Error:  Couldn't set up ordered mode\n");
+        return -1;
+    }
+
+    // Spread aggregation across shards if we have more than one thread
+    if(ctx->threads > 1 && !ctx->shards) {
+        if((ctx->shards = cmdShardPoolCreate(ctx->threads, ctx->ksize, ctx->msize)) == NULL) {
+            fprintf(stderr, "Error:  Couldn't start aggregation threads\n");
+            return -1;
         }
     }
 
+    // Write keys out ahead of any increment that would overflow them
+    if(setOutput(ctx) < 0) {
+        fprintf(stderr, "Error:  Couldn't set up our output\n");
+        return -1;
+    }
+
+    // Bound our memory use if we've been asked to
+    if(ctx->max_memory && setMemoryLimit(ctx) < 0) {
+        fprintf(stderr, "Error:  Couldn't set up spilling to '%s'\n", ctx->spill_dir);
+        return -1;
+    }
+
+    // Batch sorted set members if we've been asked to
+    if(ctx->zadd_batch && setZaddBatch(ctx) < 0) {
+        fprintf(stderr, "Error:  Couldn't set ZADD batch size\n");
+        return -1;
+    }
+
+    if(ctx->order != ORDER_TABLE && setOrder(ctx) < 0) {
+        fprintf(stderr, "Error:  Couldn't set sort order\n");
+        return -1;
+    }
+
+    // Split what we write between our outputs by cluster slot.  Shards
+    // write to their own buffers until they've finished.
+    if(ctx->slot_map && !ctx->stats && !ctx->shards && setSplit(ctx) < 0) {
+        fprintf(stderr, "Error:  Couldn't split output by cluster slot\n");
+        return -1;
+    }
+
     // Success
     return 0;
 }
 
 /**
- * Write our output file
+ * Get ready for our next input.  What we aggregated is dropped, but our
+ * buffers and tables keep the size they grew to, and our settings stay.
  */
-int writeFile(optimizerContext *ctx, char *buffer, size_t size) {
-    size_t written;
+int resetContext(optimizerContext *ctx) {
+    unsigned int i;
 
-    // Write either to our gzFile or FILE*
-    if(ctx->gz) {
-        written = gzwrite(ctx->fd_out_gz, buffer, size);
-    } else {
-        written = fwrite(buffer, 1, size, ctx->fd_out);
+    ctx->cmd_count = 0;
+
+    for(i=0;i<ctx->output_count;i++) {
+        if(cmdBufferReset(ctx->cmd_buffers[i]) < 0)
+            return -1;
     }
 
-    if(written != size)
+    if(cmdHashReset(ctx->cmd_hash) < 0)
         return -1;
 
-    // Success
+    // Our shards' threads stopped when they finished, so start new ones
+    if(ctx->shards) {
+        cmdShardPoolFree(ctx->shards);
+        ctx->shards = NULL;
+
+        return setupContext(ctx);
+    }
+
     return 0;
 }
 
 /**
- * Process our input buffer, using our cmdHash object to aggregate ZINCRBY
- * and SADD commands that can be combined together.  We read from the input file
- * in chunks, passing data to a redisReader object for parsing.  
- *
- * When we encounter anything except for a ZINCRBY command, we append it to 
- * our Redis command buffer in the raw Redis protocol.
+ * Free our context
  */
-int processBufferFile(optimizerContext *ctx) {
-    unsigned int read;
-    char buffer[CHUNK_SIZE];
-    redisReply *reply;
+void freeContext(optimizerContext *ctx) {
+    unsigned int i, o;
 
-    // While we can read data
-    while((read = gzread(ctx->fd_in, buffer, sizeof(buffer))) > 0) {
-        // Feed the reader
-        redisReaderFeed(ctx->reader, buffer, read);
-
-        // Process replies
-        do {
-            // Read the next available reply
-            if(redisReaderGetReply(ctx->reader, (void**)&reply) == REDIS_ERR) {
-                return -1;
-            }
+    // Stop our pipeline stages and close our files
+    closeInput(ctx);
+    closeOutput(ctx);
 
-            // If we have a reply, process it
-            if(reply) {
-                // Either add it to our hash or to our pass-thru buffer
-                if(cmdHashAdd(ctx->cmd_hash, reply)==TYPE_UNSUPPORTED) {
-                    cmdBufferAddReply(ctx->cmd_buffer, reply);
-                }
+    // Free our protocol scanners
+    if(ctx->scanner)
+        respScannerFree(ctx->scanner);
+    if(ctx->sampler)
+        respScannerFree(ctx->sampler);
 
-                // Increment total commands processed
-                ctx->cmd_count++;
+    // Free what our parse threads' ranges have of their own
+    for(i=1;ctx->ranges && i<ctx->parse_threads;i++) {
+        if(ctx->ranges[i].scanner)
+            respScannerFree(ctx->ranges[i].scanner);
 
-                // Clean up reply
-                freeReplyObject(reply);
-            }
-        } while(reply);
+        for(o=0;ctx->ranges[i].cmd_buffers && o<ctx->output_count;o++) {
+            if(ctx->ranges[i].cmd_buffers[o])
+                cmdBufferFree(ctx->ranges[i].cmd_buffers[o]);
+        }
+        free(ctx->ranges[i].cmd_buffers);
+
+        for(o=0;ctx->ranges[i].files && o<ctx->output_count;o++) {
+            if(ctx->ranges[i].files[o])
+                fclose(ctx->ranges[i].files[o]);
+        }
+        free(ctx->ranges[i].files);
     }
+    free(ctx->ranges);
 
-    // Success
-    return 0;
+    // Free our outputs and their command buffers
+    for(i=0;ctx->cmd_buffers && i<ctx->output_count;i++) {
+        if(ctx->cmd_buffers[i])
+            cmdBufferFree(ctx->cmd_buffers[i]);
+    }
+    free(ctx->cmd_buffers);
+    free(ctx->outputs);
+    free(ctx->slot_map);
+
+    // Free our ZINCRBY hash
+    if(ctx->cmd_hash)
+        cmdHashFree(ctx->cmd_hash);
+
+    // Stop and free our shards
+    if(ctx->shards)
+        cmdShardPoolFree(ctx->shards);
 }
 
 /**
- * Append aggregated commands to our command buffer or just add the aggregated
- * counts depending on stat mode.
+ * Write out whatever each of our outputs still has buffered, and wait for
+ * it to be written
  */
-int appendAggCommands(optimizerContext *ctx) {
-    char *cmd;
-    size_t size;
+static int flushOutputs(optimizerContext *ctx) {
+    optimizerOutput *out;
+    unsigned int i;
 
-    if(!ctx->stats) {
-        // Get aggregated and hashed commands
-        if(cmdHashGetCommands(ctx->cmd_hash, &cmd, &size)!=0)
-            return -1;
+    for(i=0;i<ctx->output_count;i++) {
+        out = &ctx->outputs[i];
 
-        // Append it to our overall command buffer
-        if(cmdBufferAppend(ctx->cmd_buffer, cmd, size, cmdHashGetCount(ctx->cmd_hash))<0)
+        if(cmdBufferFlush(ctx->cmd_buffers[i])<0 ||
+           (out->writer && pipeWriterFinish(out->writer)<0) ||
+           (out->pgz && pgzWriterFinish(out->pgz)<0) ||
+           (out->enc && codecWriterFinish(out->enc)<0))
+        {
             return -1;
-    } else {
-        // Just add the aggregated command count, no need to process
-        ctx->cmd_buffer->cmd_count += cmdHashGetCount(ctx->cmd_hash);
+        }
     }
 
-    // Success
     return 0;
 }
 
 /**
- * Output statistics about our compression
+ * Save what we've aggregated, for a later run to load and add to
  */
-void outputStats(optimizerContext *ctx) {
-    double pct=0.0, timing;
+static int saveState(optimizerContext *ctx) {
+    optimizerPhase prev = setPhase(ctx, PHASE_WRITE);
+    cmdSnapshotHeader hdr;
+    int rv;
 
-    // Calculate how long the compression took
-    timing = ((double)(ctx->end-ctx->start)) / CLOCKS_PER_SEC;
+    // Take stock of what we're holding, as we would before writing it out
+    if(ctx->stats_json)
+        getHashStats(ctx, &ctx->hash_stats);
 
-    // Calculate compression ratio
-    if(ctx->cmd_count > 0) {
-        pct = 1-((double)cmdHashGetCount(ctx->cmd_hash))/(double)ctx->cmd_count;
-    } 
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.inputs = hdr.input = ctx->input_count;
+    hdr.commands_in = ctx->cmd_count;
+    hdr.flushed = ctx->cmd_hash->flushed;
 
-    // Output input file
-    printf("%s\t", ctx->infile);
+    rv = cmdSnapshotSave(ctx->save_state, &hdr, NULL, ctx->cmd_hash);
+    setPhase(ctx, prev);
 
-    // Print output file if we have one
-    if(*ctx->outfile) {
-        printf("%s\t", ctx->outfile);
+    return rv;
+}
+
+/**
+ * Pick up where our last checkpoint left off: with what we'd aggregated,
+ * at the same place in the same input, and with each of our outputs cut
+ * back to what that accounted for.  If there's no checkpoint yet we just
+ * start from the beginning.  Returns -1 (having said why) if we can't.
+ */
+static int resumeCheckpoint(optimizerContext *ctx) {
+    cmdSnapshotHeader hdr;
+    char path[PATH_MAX];
+    uint64_t *sizes;
+    struct stat st;
+    unsigned int i;
+    int rv = -1;
+
+    if(access(ctx->checkpoint, F_OK) < 0) {
+        ctx->resume = 0;
+        return 0;
     }
 
-    // Print the rest of our statistics
-    printf("%d\t%d\t%2.2f\t%f\n",
-           ctx->cmd_count, cmdHashGetCount(ctx->cmd_hash),
-           pct, timing);
+    if((sizes = calloc(ctx->output_count, sizeof(*sizes))) == NULL ||
+       cmdSnapshotLoad(ctx->checkpoint, &hdr, sizes, ctx->output_count, ctx->cmd_hash) < 0)
+    {
+        fprintf(stderr, "Error:  Couldn't load checkpoint '%s'\n", ctx->checkpoint);
+        goto done;
+    }
+
+    if(hdr.outputs != ctx->output_count || hdr.inputs != ctx->input_count ||
+       hdr.input >= ctx->input_count)
+    {
+        fprintf(stderr, "Error:  Checkpoint '%s' has different inputs or outputs\n",
+                ctx->checkpoint);
+        goto done;
+    }
+
+    // Anything written since the checkpoint is about to be written again
+    for(i=0;*ctx->outfile && i<ctx->output_count;i++) {
+        if(getOutputPath(ctx, i, path, sizeof(path)) < 0 || stat(path, &st) < 0 ||
+           (uint64_t)st.st_size < sizes[i] || truncate(path, sizes[i]) < 0)
+        {
+            fprintf(stderr, "Error:  Output '%s' doesn't have what checkpoint '%s' wrote\n",
+                    path, ctx->checkpoint);
+            goto done;
+        }
+    }
+
+    ctx->input_idx = hdr.input;
+    ctx->input_start = hdr.offset;
+    ctx->cmd_count = hdr.commands_in;
+    // Keys loaded in parts may already have written some of them
+    ctx->cmd_buffers[0]->cmd_count += hdr.commands_out;
+    ctx->cmd_hash->flushed += hdr.flushed;
+    rv = 0;
+
+done:
+    free(sizes);
+
+    return rv;
 }
 
 /**
- * Simple usage output
+ * Write out everything we've aggregated once our input is done, and print
+ * our statistics.  Returns -1 (having said why) if we couldn't.
  */
-void printUsage(char *cmd) {
-    printf("%s: [OPTIONS] INFILE OUTFILE\n", cmd);
-    printf("   --stat     Display statistics but don't write anything\n");
-    printf("   --gzip     Compress output file with gzip\n");
-    printf("   --version  Print version number\n");
-    printf("   --quiet    Don't output information about compression\n");
-    printf("   --help     This message\n");
+static int finishOutput(optimizerContext *ctx) {
+    // Save our aggregated commands for later, append them, or just add to
+    // overall counts
+    if(*ctx->save_state) {
+        if(saveState(ctx)<0) {
+            fprintf(stderr, "Error:  Couldn't save state to '%s'\n", ctx->save_state);
+            return -1;
+        }
+    } else if(appendAggCommands(ctx)<0) {
+        fprintf(stderr, "Error appending aggregated commands!\n");
+        return -1;
+    }
+
+    // If we're not in stats mode, attempt to write the file if it's not empty
+    if(!ctx->stats) {
+        if(!ctx->cmd_count) {
+            fprintf(stderr, "Error:  Not writing empty command buffer!\n");
+            return -1;
+        }
+
+        setPhase(ctx, PHASE_WRITE);
+
+        if(flushOutputs(ctx)<0 || (ctx->replay && cmdReplayFinish(ctx->replay)<0)) {
+            fprintf(stderr, "Error writing buffer file '%s'\n", getOutputName(ctx));
+            return -1;
+        }
+
+        setPhase(ctx, PHASE_OTHER);
+    }
+
+    // Redis may have refused some of what we replayed
+    if(ctx->replay && ctx->replay->errors) {
+        fprintf(stderr, "Warning:  %llu commands failed on '%s' (first error: %s)\n",
+                (unsigned long long)ctx->replay->errors, ctx->target, ctx->replay->error);
+    }
+
+    // Time the process
+    setPhase(ctx, PHASE_OTHER);
+    ctx->end = getTime();
+
+    // If we're not in quiet mode, output statistics
+    if(ctx->stats_json && !ctx->quiet) {
+        outputStatsJson(ctx);
+    } else if(!ctx->quiet) {
+        outputStats(ctx);
+    }
+
+    // Success
+    return 0;
 }
 
 /**
- * Parse our command's arguments and set context
+ * Optimize ctx->infile into its own output
  */
-void parseArgs(optimizerContext *ctx, int argc, char **argv) {
-    int opt, opt_idx;
+static int optimizeFile(optimizerContext *ctx) {
+    int rv = -1;
 
-    while((opt = getopt_long(argc, argv, "qszvh", g_long_opts, &opt_idx)) != -1) {
-        switch(opt) {
-            case 'q':
-                // Don't print anything
-                ctx->quiet = 1;
-                break;
-            case 's':
-                // We just want statistics
-                ctx->stats = 1;
-                break;
-            case 'z':
-                // gzip output buffer file
-                ctx->gz = 1;
-                break;
-            case 'v':
-                printf("buffer-optimize " BUFFER_OPTIMIZE_VERSION "\n");
-                exit(0);
-            case 'h':
-            case '?':
-                printUsage(argv[0]);
-                exit(0);
-        }
+    // Start timing
+    startTiming(ctx);
+
+    if(ctx->auto_size && sizeTables(ctx) < 0) {
+        fprintf(stderr, "Error:  Couldn't sketch '%s' to size our tables\n", ctx->infile);
+    } else if(openInput(ctx) < 0) {
+        fprintf(stderr, "Error:  Couldn't open input file '%s'\n", ctx->infile);
+    } else if(openOutput(ctx) < 0) {
+        fprintf(stderr, "Error:  Couldn't open output '%s'\n", getOutputName(ctx));
+    } else if(processBufferFile(ctx) < 0) {
+        fprintf(stderr, "Error processing file '%s'\n", ctx->infile);
+    } else {
+        rv = finishOutput(ctx);
     }
 
-    // quiet and stat mode make no sense together
-    if(ctx->quiet && ctx->stats) {
-        fprintf(stderr, "Setting both quiet and stat mode doesn't make sense!\n");
-        exit(1);
+    closeInput(ctx);
+    closeOutput(ctx);
+
+    return rv;
+}
+
+/**
+ * Aggregate every input, in order, into a single output.  It's one stream
+ * as far as what we pass through is concerned, so nothing gets reordered.
+ */
+static int optimizeMerged(optimizerContext *ctx) {
+    cmdSnapshotHeader hdr;
+    unsigned int i;
+    int rv = -1;
+
+    // Start timing
+    startTiming(ctx);
+
+    if(ctx->auto_size && sizeTables(ctx) < 0) {
+        fprintf(stderr, "Error:  Couldn't sketch our inputs to size our tables\n");
+        return -1;
     }
 
-    // We'll need an input file
-    if(!argv[optind] || !*argv[optind]) {
-        fprintf(stderr, "Error:  Must specify input file!\n");
-        exit(1);
+    // Carry on from our last checkpoint, which already holds any state we
+    // were given, or start with that state
+    if(ctx->resume && resumeCheckpoint(ctx) < 0)
+        return -1;
+
+    if(!ctx->resume && *ctx->load_state &&
+       cmdSnapshotLoad(ctx->load_state, &hdr, NULL, 0, ctx->cmd_hash) < 0)
+    {
+        fprintf(stderr, "Error:  Couldn't load state from '%s'\n", ctx->load_state);
+        return -1;
     }
 
-    // If we're not in stats mode, we'll need an output file
-    if(!ctx->stats && (!argv[optind+1] || !*argv[optind+1])) {
-        fprintf(stderr, "Error:  Must specificy output file!\n");
-        exit(1);
+    if(openOutput(ctx) < 0) {
+        fprintf(stderr, "Error:  Couldn't open output '%s'\n", getOutputName(ctx));
+        closeOutput(ctx);
+        return -1;
     }
 
-    // Copy in our input and output files
-    strncpy(ctx->infile, argv[optind], sizeof(ctx->infile));
+    ctx->next_checkpoint = getTime() + ctx->checkpoint_every;
 
-    // Copy in our output file if not in stats mode
-    if(!ctx->stats) {
-        strncpy(ctx->outfile, argv[optind+1], sizeof(ctx->outfile));
+    for(i=ctx->input_idx;i<ctx->input_count;i++) {
+        strncpy(ctx->infile, ctx->inputs[i], sizeof(ctx->infile)-1);
+        ctx->input_idx = i;
 
-        // Append .gz extension if it's not already there
-        if(ctx->gz &&!IS_GZ_FILE(ctx->outfile, strlen(ctx->outfile)))
-        {
-            strncat(ctx->outfile, ".gz", sizeof(ctx->outfile));
+        if(openInput(ctx) < 0) {
+            fprintf(stderr, "Error:  Couldn't open input file '%s'\n", ctx->infile);
+            break;
+        } else if(processBufferFile(ctx) < 0) {
+            fprintf(stderr, "Error processing file '%s'\n", ctx->infile);
+            break;
         }
+
+        // Only the input we resumed in starts part way through
+        ctx->input_start = 0;
+        closeInput(ctx);
     }
+
+    if(i == ctx->input_count)
+        rv = finishOutput(ctx);
+
+    // We're done, so there's nothing to resume
+    if(rv == 0 && *ctx->checkpoint)
+        unlink(ctx->checkpoint);
+
+    closeInput(ctx);
+    closeOutput(ctx);
+
+    return rv;
 }
 
+/**
+ * Name ctx->infile's output after it, in our output directory.  We refuse
+ * to write over the input itself.
+ */
+static int setOutfile(optimizerContext *ctx) {
+    char in[PATH_MAX], out[PATH_MAX];
+    const char *base;
+    size_t len;
 
-void initContext(optimizerContext *ctx) {
-    // Zero out everything
-    memset(ctx, 0, sizeof(optimizerContext));
+    len = getOutputBase(ctx->infile, &base);
 
-    // Make sure we can allocate our command buffer object
-    if((ctx->cmd_buffer = cmdBufferCreate()) == NULL) {
-        fprintf(stderr, "Error:  Can't create command buffer!\n");
-        exit(1);
+    if(snprintf(ctx->outfile, sizeof(ctx->outfile), "%s/%.*s%s", ctx->output_dir,
+                (int)len, base, cmdCodecGetInfo(ctx->codec)->ext)
+       >= (int)sizeof(ctx->outfile))
+    {
+        fprintf(stderr, "Error:  Output file name for '%s' is too long\n", ctx->infile);
+        return -1;
     }
 
-    // Make sure we can allocate our cmdHash
-    if((ctx->cmd_hash = cmdHashCreate(KHASH_SIZE, MHASH_SIZE)) == NULL) {
-        fprintf(stderr, "Error:  Couldn't create cmdHash object\n");
-        exit(1);
+    if(realpath(ctx->infile, in) && realpath(ctx->outfile, out) && !strcmp(in, out)) {
+        fprintf(stderr, "Error:  Won't write over input file '%s'\n", ctx->infile);
+        return -1;
     }
 
-    // Create our redisReader object
-    if((ctx->reader = redisReaderCreate()) == NULL) {
-        fprintf(stderr, "Error:  Couldn't create redisReader\n");
-        exit(1);
+    return 0;
+}
+
+/**
+ * Worker thread.  Optimizes inputs one at a time, each to its own output,
+ * until there are none left.
+ */
+static void *optimizerWorker(void *arg) {
+    optimizerPool *pool = arg;
+    optimizerContext ctx = *pool->options;
+    unsigned int idx;
+    int rv, used = 0;
+
+    for(;;) {
+        pthread_mutex_lock(&pool->lock);
+        idx = pool->next < ctx.input_count ? pool->next++ : ctx.input_count;
+        pthread_mutex_unlock(&pool->lock);
+
+        if(idx == ctx.input_count)
+            break;
+
+        strncpy(ctx.infile, ctx.inputs[idx], sizeof(ctx.infile)-1);
+
+        // Our context is only set up once, and reset between inputs
+        rv = used++ ? resetContext(&ctx) : setupContext(&ctx);
+
+        if(rv == 0 && *ctx.output_dir)
+            rv = setOutfile(&ctx);
+        if(rv == 0)
+            rv = optimizeFile(&ctx);
+
+        if(rv < 0) {
+            pthread_mutex_lock(&pool->lock);
+            pool->failed++;
+            pthread_mutex_unlock(&pool->lock);
+        }
     }
+
+    freeContext(&ctx);
+
+    return NULL;
 }
 
 /**
- * Free our context
+ * Optimize each of our inputs to its own output, on up to ctx->jobs
+ * threads.  A failed input doesn't stop the rest, but makes us fail too.
  */
-void freeContext(optimizerContext *ctx) {
-    // Free our redisReader
-    if(ctx->reader)
-        redisReaderFree(ctx->reader);
+static int optimizeFiles(optimizerContext *ctx) {
+    pthread_t threads[MAX_JOBS];
+    optimizerPool pool;
+    unsigned int jobs, started;
 
-    // Free our command buffer
-    if(ctx->cmd_buffer) 
-        cmdBufferFree(ctx->cmd_buffer);
+    memset(&pool, 0, sizeof(pool));
+    pool.options = ctx;
+    pthread_mutex_init(&pool.lock, NULL);
 
-    // Free our ZINCRBY hash
-    if(ctx->cmd_hash)
-        cmdHashFree(ctx->cmd_hash);
+    jobs = ctx->jobs < ctx->input_count ? ctx->jobs : ctx->input_count;
 
-    // Close our input file
-    if(ctx->fd_in)
-        gzclose(ctx->fd_in);
+    // Start our workers, or just be the only one
+    for(started=0;jobs > 1 && started<jobs;started++) {
+        if(pthread_create(&threads[started], NULL, optimizerWorker, &pool) != 0)
+            break;
+    }
+
+    if(!started)
+        optimizerWorker(&pool);
+
+    while(started) {
+        pthread_join(threads[--started], NULL);
+    }
 
-    // Close our non gzip output file if open
-    if(ctx->fd_out)
-        fclose(ctx->fd_out);
+    pthread_mutex_destroy(&pool.lock);
 
-    // Close our gzip output file if open
-    if(ctx->fd_out_gz)
-        gzclose(ctx->fd_out_gz);
+    return pool.failed ? -1 : 0;
 }
-    
+
 int main(int argc, char **argv) {
     optimizerContext ctx;
+    unsigned int i;
+    int rv;
 
     // Initialize our context object
     initContext(&ctx);
@@ -284,52 +2835,19 @@ int main(int argc, char **argv) {
     // Parse our arguments
     parseArgs(&ctx, argc, argv);
 
-    // Start timing
-    ctx.start = clock();
-
-    // Open our input and possibly output file
-    if(openFiles(&ctx) < 0) {
-        fprintf(stderr, "Error:  Couldn't open input or output file!\n");
-        freeContext(&ctx);
-        exit(1);
-    }
-
-    // Process the command buffer
-    if(processBufferFile(&ctx)<0) {
-        fprintf(stderr, "Error processing file '%s'\n", ctx.infile);
-        freeContext(&ctx);
-        exit(1);
-    }
-
-    // Append our aggregated commands or just add to overall counts
-    if(appendAggCommands(&ctx)<0) {
-        fprintf(stderr, "Error appending aggregated commands!\n");
+    if(ctx.merge) {
+        // Merged inputs all share our own context
+        rv = setupContext(&ctx) < 0 ? -1 : optimizeMerged(&ctx);
         freeContext(&ctx);
-        exit(1);
-    }
-
-    // If we're not in stats mode, attempt to write the file if it's not empty
-    if(!ctx.stats) {
-        if(ctx.cmd_count>0 && writeFile(&ctx,ctx.cmd_buffer->buf,ctx.cmd_buffer->pos)<0) {
-            fprintf(stderr, "Error writing buffer file '%s'\n", ctx.outfile);
-            exit(1);
-        } else if(!ctx.cmd_count) {
-            fprintf(stderr, "Error:  Not writing empty command buffer!\n");
-            exit(1);
-        }
+    } else {
+        // Everything else gets a context per worker
+        rv = optimizeFiles(&ctx);
     }
 
-    // Time the process
-    ctx.end = clock();
-
-    // If we're not in quiet mode, output statistics
-    if(!ctx.quiet) {
-        outputStats(&ctx);
+    for(i=0;i<ctx.input_count;i++) {
+        free(ctx.inputs[i]);
     }
+    free(ctx.inputs);
 
-    // Cleanup (free buffers, close files, etc)
-    freeContext(&ctx);
-
-    // Success
-    return 0;
+    return rv < 0 ? 1 : 0;
 }
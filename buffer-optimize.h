@@ -8,31 +8,152 @@
 #include <zlib.h>
 #include <time.h>
 #include <getopt.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include "cmdhash.h"
 #include "buffer.h"
+#include "resp.h"
+#include "shard.h"
+#include "pipeline.h"
+#include "pgzip.h"
+#include "replay.h"
+#include "crc16.h"
+#include "snapshot.h"
+#include "spill.h"
+#include "codec.h"
 
 #define BUFFER_OPTIMIZE_VERSION "0.1.0"
 
+/** 
+ * Initial hash sizes to use, unless we're told otherwise or size them from
+ * our input.  Both tables grow as needed, so the member table for each key
+ * starts out tiny.
+ */
+#define KHASH_SIZE 16384
+#define MHASH_SIZE 4
+
 /**
- * Simple macro to detect a .gz extension
+ * Most buckets we'll be asked to start a table with
  */
-#define IS_GZ_FILE(f, l) \
-    (f[l-3]=='.' && f[l-2]=='g' && f[l-1]=='z')
+#define MAX_BUCKETS TABLE_MAX_SIZE
 
-/** 
- * Hash sizes to use
+/**
+ * How much data to read from our input file at a time.  Data is read
+ * straight into the scanner's buffer, and only a trailing partial command
+ * is ever moved, so this can be fairly large.
+ */
+#define CHUNK_SIZE 65536
+
+/**
+ * How much of a mapped input we parse before releasing those pages
+ */
+#define MAP_RELEASE_SIZE (64*1024*1024)
+
+/**
+ * Smallest stretch of a mapped input we'll give a parse thread of its own,
+ * and how much of what each one passes through it buffers in memory before
+ * moving it to a file of its own
+ */
+#define PARSE_MIN_RANGE (1024*1024)
+#define PARSE_RANGE_HWM (1024*1024)
+
+/**
+ * How much output we buffer before writing it out
+ */
+#define OUTPUT_HWM (4*1024*1024)
+
+/**
+ * Most inputs we'll optimize at once with --jobs
+ */
+#define MAX_JOBS 256
+
+/**
+ * Most outputs we'll split our commands between by cluster slot
+ */
+#define MAX_SPLIT 1024
+
+/**
+ * How often we checkpoint by default, in seconds
+ */
+#define CHECKPOINT_EVERY 300
+
+/**
+ * Where our time goes.  Parsing and aggregation are interleaved command by
+ * command, and timing each command would cost more than some of them take,
+ * so we time them together.  Every PHASE_SAMPLE_EVERY bytes of input we
+ * time a scan of the next PHASE_SAMPLE_SIZE on its own, and split the total
+ * by how fast that went.
+ */
+typedef enum _optimizerPhase {
+    PHASE_OTHER,
+    PHASE_READ,
+    PHASE_PARSE,
+    PHASE_AGGREGATE,
+    PHASE_FORMAT,
+    PHASE_WRITE,
+    PHASE_COUNT
+} optimizerPhase;
+
+#define PHASE_SAMPLE_EVERY (1024*1024)
+#define PHASE_SAMPLE_SIZE 65536
+
+/**
+ * One of the files we write, whichever way it's written.  We have one,
+ * unless we're splitting our output between ranges of cluster slots.
  */
-#define KHASH_SIZE 22016
-#define MHASH_SIZE 512
+typedef struct _optimizerOutput {
+    struct _optimizerContext *ctx;
+
+    FILE *fd_out;
+    gzFile fd_out_gz;
+    pgzWriter *pgz;
+    codecWriter *enc;
+
+    /**
+     * Our writer stage, in pipeline mode
+     */
+    pipeWriter *writer;
+} optimizerOutput;
 
 /**
- * How much data to read from our input file at a time.  This
- * is set to 1024 bytes because hiredis will attempt to memmove
- * the buffer if it processes more than this amount of data,
- * which will slow down performance.
+ * A byte range of a mapped input, which we parse on a thread of its own
+ * with --parse-threads.  A range takes every command that starts between
+ * from and to, starting with the first one it can find after from, and has
+ * its own hash and buffers for what it aggregates and passes through.  The
+ * first range is parsed by our own thread, into our own hash and buffers.
  */
-#define CHUNK_SIZE 1024
+typedef struct _optimizerRange {
+    struct _optimizerContext *ctx;
+    pthread_t thread;
+
+    size_t from, to;
+
+    /**
+     * Where our first command starts, and where we stopped parsing, which
+     * has to be where the next range starts for us to have all of ours
+     */
+    size_t start, end;
+
+    respScanner *scanner;
+    cmdHash *cmd_hash;
+    cmdBuffer **cmd_buffers;
+
+    /**
+     * Files each of our cmd_buffers drains to once it fills, so we don't
+     * hold everything we pass through until it's our turn to be added
+     */
+    FILE **files;
+
+    unsigned int cmd_count;
+    int err;
+} optimizerRange;
 
 typedef struct _optimizerContext {
     /*
@@ -41,16 +162,53 @@ typedef struct _optimizerContext {
     char infile[1024];
     char outfile[1024];
 
+    /**
+     * Every input we were given, and the directory each one's output goes
+     * into when we write one per input.
+     */
+    char **inputs;
+    unsigned int input_count;
+    char output_dir[1024];
+
+    /**
+     * Aggregate every input into a single output
+     */
+    unsigned short merge;
+
+    /**
+     * Number of inputs we optimize at once when writing one output per input
+     */
+    unsigned int jobs;
+
     /**
      * Input FD
      */
-    gzFile fd_in;
+    codecReader *fd_in;
 
     /**
-     * Output FD if any
+     * Our input file mapped into memory, if it's uncompressed
      */
-    FILE *fd_out;
-    gzFile fd_out_gz;
+    char *map;
+    size_t map_len;
+
+    /**
+     * Where our output goes, and the buffer commands bound for each output
+     * collect in.  When we split our output by cluster slot, slot_map says
+     * which output each slot's keys go to.
+     */
+    optimizerOutput *outputs;
+    cmdBuffer **cmd_buffers;
+    unsigned int output_count;
+    unsigned int split;
+    uint16_t *slot_map;
+
+    /**
+     * Redis server we replay into instead of writing a file, and how many
+     * commands may be waiting on replies.
+     */
+    char target[256];
+    cmdReplay *replay;
+    unsigned long long replay_depth;
 
     /**
      * Do we just want statistics
@@ -63,9 +221,103 @@ typedef struct _optimizerContext {
     unsigned short quiet;
 
     /**
-     * Do we want the output to be gzipped
+     * Print our statistics as JSON, and report our progress to stderr
+     * every this many seconds if it's nonzero
      */
-    unsigned short gz;
+    unsigned short stats_json;
+    double progress;
+
+    /**
+     * What we compress our output with, if anything
+     */
+    cmdCodec codec;
+
+    /**
+     * Compression level, how many threads compress with, and whether zstd
+     * looks back over a long window
+     */
+    int level;
+    unsigned int compress_threads;
+    unsigned short long_window;
+
+    /**
+     * Memory budget for aggregation (zero for none), and where we spill
+     * to once we pass it.
+     */
+    size_t max_memory;
+    char spill_dir[1024];
+
+    /**
+     * Flush keys once this many aggregated commands go by without them
+     */
+    unsigned long long window;
+
+    /**
+     * Keep commands we pass through in order with the keys they touch
+     */
+    unsigned short ordered;
+
+    /**
+     * Most arguments in each batched ZADD, if we're batching them
+     */
+    unsigned int zadd_batch;
+
+    /**
+     * Order we write aggregated keys in
+     */
+    cmdOrder order;
+
+    /**
+     * Number of aggregation threads
+     */
+    unsigned int threads;
+
+    /**
+     * Number of threads we parse each mapped input on, and their ranges
+     */
+    unsigned int parse_threads;
+    optimizerRange *ranges;
+
+    /**
+     * Buckets our key tables and each key's member table start with, or
+     * how much of our input to sketch to size them if auto_size is set
+     */
+    unsigned int ksize;
+    unsigned int msize;
+    size_t auto_size;
+
+    /**
+     * Do we want reading and writing on their own threads
+     */
+    unsigned short pipeline;
+
+    /**
+     * Don't memory map our input even when we could
+     */
+    unsigned short no_mmap;
+
+    /**
+     * Snapshot we checkpoint what we've aggregated to every checkpoint_every
+     * seconds, and when the next one is due.  If we're resuming we start
+     * from the last one.
+     */
+    char checkpoint[1024];
+    double checkpoint_every;
+    double next_checkpoint;
+    unsigned short resume;
+
+    /**
+     * State to add to what we aggregate before we start, and to save what
+     * we've aggregated to rather than writing it out
+     */
+    char load_state[1024];
+    char save_state[1024];
+
+    /**
+     * Which of our inputs we're on, and how far into it we started
+     */
+    unsigned int input_idx;
+    uint64_t input_start;
 
     /**
      * Total input commands processed
@@ -75,30 +327,120 @@ typedef struct _optimizerContext {
     /**
      * Timing information
      */
-    clock_t start;
-    clock_t end;
+    double start;
+    double end;
+
+    /**
+     * Time spent in each phase, which we only keep track of if we're going
+     * to report it, along with the phase we're in and when we entered it.
+     * Our sampler scans stretches of input just to time them, and we keep
+     * how many bytes it's scanned, how long that took, and where the next
+     * one starts.
+     */
+    int timing;
+    double phases[PHASE_COUNT];
+    optimizerPhase phase;
+    double phase_start;
+    respScanner *sampler;
+    double sampled;
+    uint64_t sampled_bytes;
+    uint64_t next_sample;
 
     /**
-     * Our redisReader
+     * Protocol bytes we've read and written
      */
-    redisReader *reader;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
 
     /**
-     * Redis output buffer
+     * When our next progress report is due, and where we were at the last
+     * one
      */
-    cmdBuffer *cmd_buffer;
+    double next_report;
+    double last_report;
+    uint64_t last_bytes;
+    unsigned int last_count;
+
+    /**
+     * What our hashes held before we wrote them out
+     */
+    cmdHashStats hash_stats;
+
+    /**
+     * Our protocol scanner
+     */
+    respScanner *scanner;
 
     /**
      * ZINCRBY hash object
      */
     cmdHash *cmd_hash;
 
+    /**
+     * Aggregation shards, if we're using more than one thread
+     */
+    cmdShardPool *shards;
+
+    /**
+     * Reader stage in pipeline mode, and the input block we're currently
+     * consuming.
+     */
+    pipeReader *reader;
+    pipeBlock *in_block;
+    size_t in_pos;
+
 } optimizerContext;
 
+/**
+ * Hands out inputs to the workers optimizing them one output at a time.
+ * Each worker copies our options into a context of its own, and reuses it
+ * from one input to the next.
+ */
+typedef struct _optimizerPool {
+    const optimizerContext *options;
+
+    pthread_mutex_t lock;
+    unsigned int next;
+    unsigned int failed;
+} optimizerPool;
+
 static const struct option g_long_opts[] = {
     { "gzip", no_argument, NULL, 'z' },
     { "stat", no_argument, NULL, 's' },
     { "quiet", no_argument, NULL, 'q' },
+    { "stats-json", no_argument, NULL, 'S' },
+    { "progress", required_argument, NULL, 'P' },
+    { "compress", required_argument, NULL, 'Z' },
+    { "compress-level", required_argument, NULL, 'l' },
+    { "compress-threads", required_argument, NULL, 'j' },
+    { "gzip-level", required_argument, NULL, 'l' },
+    { "gzip-threads", required_argument, NULL, 'j' },
+    { "zstd-long", no_argument, NULL, 'W' },
+    { "max-memory", required_argument, NULL, 'm' },
+    { "spill-dir", required_argument, NULL, 'd' },
+    { "flush-window", required_argument, NULL, 'w' },
+    { "zadd-batch", required_argument, NULL, 'b' },
+    { "ordered", no_argument, NULL, 'o' },
+    { "target", required_argument, NULL, 'r' },
+    { "replay-depth", required_argument, NULL, 'R' },
+    { "output-dir", required_argument, NULL, 'O' },
+    { "manifest", required_argument, NULL, 'F' },
+    { "merge", no_argument, NULL, 'g' },
+    { "jobs", required_argument, NULL, 'J' },
+    { "threads", required_argument, NULL, 't' },
+    { "parse-threads", required_argument, NULL, 'T' },
+    { "key-buckets", required_argument, NULL, 'K' },
+    { "member-buckets", required_argument, NULL, 'B' },
+    { "auto-size", required_argument, NULL, 'A' },
+    { "sort", required_argument, NULL, 'k' },
+    { "cluster-split", required_argument, NULL, 'C' },
+    { "checkpoint", required_argument, NULL, 'c' },
+    { "checkpoint-every", required_argument, NULL, 'E' },
+    { "resume", no_argument, NULL, 'U' },
+    { "load-state", required_argument, NULL, 'L' },
+    { "save-state", required_argument, NULL, 'V' },
+    { "pipeline", no_argument, NULL, 'p' },
+    { "no-mmap", no_argument, NULL, 'M' },
     { "version", no_argument, NULL, 'v' },
     { "help", no_argument, NULL, 'h' },
     { 0, 0, 0, 0 }
@@ -36,42 +36,32 @@ int cmdBufferFree(cmdBuffer *buffer) {
     return 0;
 }
 
-int cmdBufferAddReply(cmdBuffer *buffer, redisReply *reply) {
-    if(!buffer || !reply)  
+int cmdBufferReset(cmdBuffer *buffer) {
+    if(!buffer)
         return -1;
 
-    char **argv, *cmd, intargv[reply->elements][33];
-    size_t argvlen[reply->elements];
-    unsigned int len;
-    int i, retval;
+    buffer->pos = 0;
+    buffer->cmd_count = 0;
+
+    return 0;
+}
 
-    if((argv = malloc(sizeof(char*)*reply->elements)) == NULL) 
+int cmdBufferAddArgv(cmdBuffer *buffer, int argc, const char **argv,
+                     const size_t *argvlen)
+{
+    if(!buffer || !argv || !argvlen)
         return -1;
 
-    for(i=0;i<reply->elements;i++) {
-        switch(reply->element[i]->type) {
-            case REDIS_REPLY_STRING:
-                argv[i] = reply->element[i]->str;
-                argvlen[i] = reply->element[i]->len;
-                break;
-            case REDIS_REPLY_INTEGER:
-                argvlen[i] = snprintf(intargv[i], sizeof(intargv[i]), "%lld",
-                                      reply->integer);
-                argv[i] = (char*)intargv[i];
-                break;
-        }
-    }
+    char *cmd;
+    int len, retval;
 
     // Format the command
-    if((len = redisFormatCommandArgv(&cmd, reply->elements, (const char **)argv, (const size_t*)argvlen))<0)
+    if((len = redisFormatCommandArgv(&cmd, argc, argv, argvlen))<0)
         return -1;
 
     // Append the command
     retval = cmdBufferAppend(buffer, cmd, len, 1);
 
-    // Free our allocated argv array
-    free(argv);
-
     // Free command that hiredis allocated
     free(cmd);
 
@@ -97,10 +87,89 @@ static inline int cmdBufferGrow(cmdBuffer *buffer, size_t addlen) {
     return 0;
 }
 
+void cmdBufferSetSink(cmdBuffer *buffer, cmdBufferSink sink, void *arg,
+                      size_t hwm)
+{
+    buffer->sink = sink;
+    buffer->sink_arg = arg;
+    buffer->hwm = hwm;
+}
+
+int cmdBufferFlush(cmdBuffer *buffer) {
+    if(!buffer->sink || !buffer->pos)
+        return 0;
+
+    if(buffer->sink(buffer->sink_arg, buffer->buf, buffer->pos) < 0)
+        return -1;
+
+    buffer->pos = 0;
+
+    return 0;
+}
+
+char *cmdBufferReserve(cmdBuffer *buffer, size_t len) {
+    // Drain first rather than growing past our high water mark
+    if(buffer->sink && buffer->pos + len > buffer->hwm &&
+       cmdBufferFlush(buffer) < 0)
+    {
+        return NULL;
+    }
+
+    if(buffer->pos + len > buffer->size && cmdBufferGrow(buffer, len)!=0)
+        return NULL;
+
+    return buffer->buf + buffer->pos;
+}
+
+void cmdBufferCommit(cmdBuffer *buffer, size_t len, unsigned int cmd_count) {
+    buffer->pos += len;
+    buffer->cmd_count += cmd_count;
+}
+
+int cmdBufferAddHeader(cmdBuffer *buffer, unsigned int argc) {
+    char *p;
+
+    if((p = cmdBufferReserve(buffer, DTOA_MAX_LEN + 3)) == NULL)
+        return -1;
+
+    *p = '*';
+    p += 1 + dtoaUint(argc, p + 1);
+    *p++ = '\r'; *p++ = '\n';
+
+    cmdBufferCommit(buffer, p - (buffer->buf + buffer->pos), 1);
+
+    return 0;
+}
+
+int cmdBufferAddBulk(cmdBuffer *buffer, const char *str, size_t len) {
+    char *p;
+
+    if((p = cmdBufferReserve(buffer, BULK_SPACE(len))) == NULL)
+        return -1;
+
+    p = cmdBufferWriteBulk(p, str, len);
+    cmdBufferCommit(buffer, p - (buffer->buf + buffer->pos), 0);
+
+    return 0;
+}
+
 // Append redis protocl string into our buffer
-int cmdBufferAppend(cmdBuffer *buffer, char *str, size_t len, 
+int cmdBufferAppend(cmdBuffer *buffer, const char *str, size_t len, 
                     unsigned int cmd_count) 
 {
+    // Add to our command count
+    buffer->cmd_count += cmd_count;
+
+    // If we have a sink, drain rather than growing
+    if(buffer->sink && buffer->pos + len > buffer->hwm) {
+        if(cmdBufferFlush(buffer) < 0)
+            return -1;
+
+        // Too big to be worth buffering at all
+        if(len >= buffer->hwm)
+            return buffer->sink(buffer->sink_arg, str, len);
+    }
+
     // Reallocate if necissary
     if(buffer->pos + len > buffer->size && cmdBufferGrow(buffer, len)!=0)
         return -1;
@@ -109,8 +178,5 @@ int cmdBufferAppend(cmdBuffer *buffer, char *str, size_t len,
     memcpy(buffer->buf+buffer->pos, str, len);
     buffer->pos += len;
 
-    // Add to our command count
-    buffer->cmd_count += cmd_count;
-
     return 0;
 }
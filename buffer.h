@@ -5,6 +5,8 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "dtoa.h"
+
 /*
  * Initial allocation size
  */
@@ -16,6 +18,16 @@
 #define BUF_MAX_PREALLOC (1024*1024)
 
 
+/**
+ * Worst case space a bulk string of len bytes needs ($<len>\r\n<str>\r\n)
+ */
+#define BULK_SPACE(len) ((len) + DTOA_MAX_LEN + 5)
+
+/**
+ * Where a buffer with a sink sends its contents once it fills up
+ */
+typedef int (*cmdBufferSink)(void *arg, const char *buf, size_t len);
+
 /**
  * Our buffer structure
  */
@@ -39,18 +51,62 @@ typedef struct _cmdBuffer {
      * The toal number of commands in this buffer
      */
     unsigned int cmd_count;
+
+    /**
+     * Optional sink we drain into once we reach our high water mark, so
+     * the buffer never has to hold all of our output at once.
+     */
+    cmdBufferSink sink;
+    void *sink_arg;
+    size_t hwm;
 } cmdBuffer;
 
 // Allocation, deallocation
 cmdBuffer *cmdBufferCreate(void);
 int cmdBufferFree(cmdBuffer *buffer);
 
-// Feed a redisReply directly into our command buffer this will append to the
-// command in the Redis protocol to the end of our bufer  end of our buffer.
-int cmdBufferAddReply(cmdBuffer *buffer, redisReply *reply);
+// Drop everything we hold without sending it anywhere, keeping our
+// allocation and sink
+int cmdBufferReset(cmdBuffer *buffer);
+
+// Feed a parsed command directly into our command buffer.  This will append
+// the command in the Redis protocol to the end of our buffer.
+int cmdBufferAddArgv(cmdBuffer *buffer, int argc, const char **argv,
+                     const size_t *argvlen);
 
 // Append data directly into the buffer (which should already be in the Redis
 // protocol.
-int cmdBufferAppend(cmdBuffer *buffer, char *str, size_t len, unsigned int cmd_count);
+int cmdBufferAppend(cmdBuffer *buffer, const char *str, size_t len, unsigned int cmd_count);
+
+// Get a pointer to at least len contiguous writable bytes at the end of the
+// buffer (draining to our sink first if we would pass our high water mark),
+// then commit however much of it was actually written.
+char *cmdBufferReserve(cmdBuffer *buffer, size_t len);
+void cmdBufferCommit(cmdBuffer *buffer, size_t len, unsigned int cmd_count);
+
+// Write a multibulk header, which counts as one command, or one bulk string
+int cmdBufferAddHeader(cmdBuffer *buffer, unsigned int argc);
+int cmdBufferAddBulk(cmdBuffer *buffer, const char *str, size_t len);
+
+/**
+ * Write a bulk string to p, which must have BULK_SPACE(len) bytes free,
+ * returning where it ends.
+ */
+static inline char *cmdBufferWriteBulk(char *p, const char *str, size_t len) {
+    *p++ = '$';
+    p += dtoaUint(len, p);
+    *p++ = '\r'; *p++ = '\n';
+    memcpy(p, str, len);
+    p += len;
+    *p++ = '\r'; *p++ = '\n';
+
+    return p;
+}
+
+// Drain into sink whenever we hold at least hwm bytes
+void cmdBufferSetSink(cmdBuffer *buffer, cmdBufferSink sink, void *arg, size_t hwm);
+
+// Send everything we're holding to our sink
+int cmdBufferFlush(cmdBuffer *buffer);
 
 #endif
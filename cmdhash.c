@@ -1,128 +1,208 @@
 //
 // cmdhash.c
 //
-// Simple hash table with an outer and inner linked list used to
-// aggregate ZINCRBY commands together.
+// Simple hash table of keys, each with its own hash table of members, used
+// to aggregate commutative commands (ZINCRBY, SADD, INCRBY and friends)
+// together.
 //
 // Author:  Mike Grunder
 //
 //
 
 #include "cmdhash.h"
+#include "crc16.h"
+#include "dtoa.h"
+#include "hash.h"
+#include "spill.h"
+#include <ctype.h>
+#include <limits.h>
 #include <math.h>
 
 /**
- * Free our command buffer
+ * How each type of aggregate is written back out
  */
-static void __flush_buffer(cmdHash *ht) {
-    if(ht->_buf) {
-        // Free buffer, reset size/len
-        free(ht->_buf);
-        ht->_buf = NULL;
-        ht->_size = 0;
-        ht->_len = 0;
-    }
-}
-
-/*
- * Free member pointers
- */
-static void __free_member_list(cmdHashContainer *c, cmdMemberList **members) {
-    cmdMemberList *list, *tmp;
-    int i;
-
-    for(i=0;i<c->msize;i++) {
-        if(!members[i])
-            continue;
-
-        list = members[i];
-        while(list != NULL) {
-            free(list->member);
-
-            tmp = list->next;
-            free(list);
-            list = tmp;
-        }
-    }
-}
-
-/**
- * Free a key bucket and all associated members
- */
-static void __free_key_bucket(cmdHashContainer *c, cmdKeyList *key) {
-    cmdKeyList *tmp;
-
-    while(key != NULL) {
-        __free_member_list(c, key->bucket);
-
-        free(key->key);
-        free(key->bucket);
-
-        tmp = key->next;
-        free(key);
-        key = tmp;
-    }
-}
+typedef enum _cmdLayout {
+    LAYOUT_SET,     // NAME key member [member ...]
+    LAYOUT_SCORE,   // NAME key score member
+    LAYOUT_FIELD,   // NAME key field value
+    LAYOUT_VALUE    // NAME key value
+} cmdLayout;
+
+typedef struct _cmdTypeInfo {
+    /**
+     * Command we write, and the command for members flagged MEMBER_SET
+     */
+    const char *name;
+    const char *set_name;
+
+    cmdLayout layout;
+
+    /**
+     * Whether values are integers rather than doubles
+     */
+    int integer;
+
+    /**
+     * The other form of the same counter, which can't hold our keys too
+     */
+    cmdType sibling;
+} cmdTypeInfo;
+
+static const cmdTypeInfo g_types[TYPE_COUNT] = {
+    [TYPE_ZINCRBY]      = { CMD_ZINCRBY, CMD_ZADD, LAYOUT_SCORE, 0, TYPE_UNSUPPORTED },
+    [TYPE_SADD]         = { CMD_SADD, NULL, LAYOUT_SET, 0, TYPE_UNSUPPORTED },
+    [TYPE_PFADD]        = { CMD_PFADD, NULL, LAYOUT_SET, 0, TYPE_UNSUPPORTED },
+    [TYPE_INCRBY]       = { CMD_INCRBY, NULL, LAYOUT_VALUE, 1, TYPE_INCRBYFLOAT },
+    [TYPE_INCRBYFLOAT]  = { CMD_INCRBYFLOAT, NULL, LAYOUT_VALUE, 0, TYPE_INCRBY },
+    [TYPE_HINCRBY]      = { CMD_HINCRBY, NULL, LAYOUT_FIELD, 1, TYPE_HINCRBYFLOAT },
+    [TYPE_HINCRBYFLOAT] = { CMD_HINCRBYFLOAT, NULL, LAYOUT_FIELD, 0, TYPE_HINCRBY },
+};
 
 static cmdHashContainer *__container_create(unsigned int ksize,
-                                            unsigned int msize)
+                                            unsigned int msize, int integer,
+                                            cmdIntern *intern)
 {
     cmdHashContainer *c;
 
     if((c = malloc(sizeof(cmdHashContainer)))==NULL)
         return NULL;
 
-    if((c->bucket = calloc(ksize, sizeof(cmdKeyList*)))==NULL) {
+    if(cmdTableInit(&c->keytable, ksize) < 0) {
         free(c);
         return NULL;
     }
 
-    // Set key/member bucket sizes
+    // Set initial key/member table sizes
     c->ksize = ksize;
     c->msize = msize;
+    c->integer = integer;
+    c->intern = intern;
+
+    // No lookups yet
+    c->last = c->head = c->tail = NULL;
+    c->heap = 0;
+    c->heap_bytes = 0;
 
     // Initialize counts
     c->keys = 0;
     c->members = 0;
+    c->str_len = 0;
+
+    // Counting our key table's slots
+    c->allocs = 1;
+
+    // Our keys and members will come from here
+    cmdArenaInit(&c->arena);
+
+    c->table_bytes = cmdTableMemory(&c->keytable);
 
     return c;
 }
 
+/**
+ * Free a key's member table, along with the key and its members if they
+ * came from the heap rather than our arena.
+ */
+static void __key_release(cmdHashContainer *c, cmdKeyList *key) {
+    cmdMemberList *mem;
+    cmdTableIter it;
+
+    if(c->heap) {
+        cmdTableIterInit(&it, &key->members);
+        while((mem = cmdTableNext(&it)) != NULL) {
+            c->heap_bytes -= sizeof(cmdMemberList);
+            c->str_len -= cmdInternLookup(c->intern, mem->id)->len;
+            cmdInternRelease(c->intern, mem->id);
+            free(mem);
+        }
+    }
+
+    cmdTableFree(&key->members);
+
+    if(c->heap) {
+        c->heap_bytes -= sizeof(cmdKeyList) + key->len + 1;
+        free(key);
+    }
+}
 
 /**
  * Free a command container pointer
  */
 static void __container_free(cmdHashContainer *c) {
-    int i;
-
-    for(i=0;i<c->ksize;i++) {
-        if(c->bucket[i]==NULL)
-            continue;
+    cmdTableIter it;
+    cmdKeyList *key;
 
-        __free_key_bucket(c, c->bucket[i]);
+    // Each key has its own member table
+    cmdTableIterInit(&it, &c->keytable);
+    while((key = cmdTableNext(&it)) != NULL) {
+        __key_release(c, key);
     }
 
-    // Free bucket pointer and container itself
-    free(c->bucket);
+    // Release every key and member in one go
+    cmdArenaFree(&c->arena);
+
+    // Free key table and container itself
+    cmdTableFree(&c->keytable);
     free(c);
 }
 
-#define GET_BUCKET(str, len, size) \
-    djb2((unsigned const char *)str, len) % size \
+/**
+ * Drop every key and member, leaving the container as if it were new
+ */
+static int __container_reset(cmdHashContainer *c) {
+    cmdTableIter it;
+    cmdKeyList *key;
+
+    cmdTableIterInit(&it, &c->keytable);
+    while((key = cmdTableNext(&it)) != NULL) {
+        __key_release(c, key);
+    }
+
+    // What we allocated before spilling still counts
+    c->allocs += c->arena.allocs;
+
+    cmdArenaFree(&c->arena);
+    cmdArenaInit(&c->arena);
 
-static inline int djb2(unsigned const char *str, size_t len) {
-    unsigned long hash = 5381;
-    int i=0, c;
+    cmdTableFree(&c->keytable);
+    if(cmdTableInit(&c->keytable, c->ksize) < 0)
+        return -1;
+    c->allocs++;
+
+    c->last = c->head = c->tail = NULL;
+    c->keys = c->members = c->str_len = 0;
+    c->heap_bytes = 0;
+    c->table_bytes = cmdTableMemory(&c->keytable);
+
+    return 0;
+}
+
+/**
+ * Drop every key and member, keeping our key table and arena slabs for
+ * whatever we aggregate next
+ */
+static void __container_clear(cmdHashContainer *c) {
+    cmdTableIter it;
+    cmdKeyList *key;
 
-    while(i<len) {
-        c = str[i];
-        hash = ((hash << 5) + hash) + c;
-        i++;
+    cmdTableIterInit(&it, &c->keytable);
+    while((key = cmdTableNext(&it)) != NULL) {
+        __key_release(c, key);
     }
 
-    return hash;
+    cmdArenaReset(&c->arena);
+    cmdTableClear(&c->keytable);
+
+    c->last = c->head = c->tail = NULL;
+    c->keys = c->members = c->str_len = 0;
+    c->allocs = 0;
+    c->heap_bytes = 0;
+    c->table_bytes = cmdTableMemory(&c->keytable);
 }
 
+#define GET_HASH(str, len) \
+    wyhash(str, len, WYHASH_SEED)
+
 /**
  * Create a command hash object
  */
@@ -134,18 +214,31 @@ cmdHash *cmdHashCreate(unsigned int ksize, unsigned int msize)
 
     // Our return value
     cmdHash *ht;
+    int i;
 
     if((ht = calloc(1,sizeof(cmdHash)))==NULL)
         return NULL;
 
-    if((ht->s_cmds = __container_create(ksize,msize))==NULL) {
-        free(ht);
-        return NULL;
-    }
+    cmdInternInit(&ht->intern);
 
-    if((ht->z_cmds = __container_create(ksize,msize))==NULL) {
-        __container_free(ht->s_cmds);
-        return NULL;
+    for(i=0;i<TYPE_COUNT;i++) {
+        // Counters only ever have the one member
+        ht->cmds[i] = __container_create(ksize,
+            g_types[i].layout == LAYOUT_VALUE ? 1 : msize, g_types[i].integer,
+            &ht->intern);
+
+        if(ht->cmds[i] == NULL) {
+            cmdHashFree(ht);
+            return NULL;
+        }
+
+        // Keys we pass through only need their names
+        if(TYPE_CLASS(i) == i &&
+           (ht->passed[i] = __container_create(1, 1, 0, &ht->intern)) == NULL)
+        {
+            cmdHashFree(ht);
+            return NULL;
+        }
     }
 
     // Return our hash table
@@ -156,15 +249,24 @@ cmdHash *cmdHashCreate(unsigned int ksize, unsigned int msize)
  * Free our command hash object
  */
 int cmdHashFree(cmdHash *ht) {
+    int i;
+
     if(ht == NULL)
         return -1;
 
-    // Free ZINCRBY and SADD hashes
-    __container_free(ht->s_cmds);
-    __container_free(ht->z_cmds);
+    // Free every container we managed to create
+    for(i=0;i<TYPE_COUNT;i++) {
+        if(ht->cmds[i])
+            __container_free(ht->cmds[i]);
+        if(ht->passed[i])
+            __container_free(ht->passed[i]);
+    }
+
+    // Our members are gone, so their strings can go too
+    cmdInternFree(&ht->intern);
 
-    // Free our buffer
-    if(ht->_buf) free(ht->_buf);
+    // Remove any runs we spilled
+    cmdSpillFree(ht->spill);
 
     // Free our hash table
     free(ht);
@@ -172,54 +274,131 @@ int cmdHashFree(cmdHash *ht) {
     return 0;
 }
     
+int cmdHashReset(cmdHash *ht) {
+    int i;
+
+    if(ht == NULL)
+        return -1;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        __container_clear(ht->cmds[i]);
+        if(ht->passed[i])
+            __container_clear(ht->passed[i]);
+    }
+
+    cmdInternClear(&ht->intern);
+
+    if(ht->spill)
+        cmdSpillReset(ht->spill);
+
+    ht->tick = 0;
+    ht->flushed = 0;
+    ht->seen = 0;
+
+    return 0;
+}
+
+/**
+ * Table match functions for members and keys.  Members are matched by the
+ * id of their interned string, which we're handed in place of a length.
+ */
+static int __match_member(const void *item, const char *str, size_t id) {
+    const cmdMemberList *m = item;
+    (void)str;
+    return m->id == id;
+}
+
+static int __match_key(const void *item, const char *str, size_t len) {
+    const cmdKeyList *k = item;
+    return k->len == len && !memcmp(k->key, str, len);
+}
+
+/**
+ * Find a key, or a member a key already has, without adding it if it's new
+ */
+static inline cmdKeyList *__have_key(cmdHashContainer *c, const char *key,
+                                     size_t len, uint64_t hash)
+{
+    return cmdTableFind(&c->keytable, hash, __match_key, key, len);
+}
+
+/**
+ * Whether we pass every command for a key through, as one an increment
+ * would have overflowed
+ */
+static inline int __passed(const cmdHash *ht, cmdType type, const char *key,
+                           size_t len)
+{
+    cmdHashContainer *c = ht->passed[TYPE_CLASS(type)];
+
+    return c->keys && __have_key(c, key, len, GET_HASH(key, len)) != NULL;
+}
+
+static inline cmdMemberList *__have_member(cmdHashContainer *c, cmdKeyList *key,
+                                           const char *member, size_t len,
+                                           uint64_t hash)
+{
+    const cmdInternStr *str;
+
+    if((str = cmdInternFind(c->intern, hash, member, len)) == NULL)
+        return NULL;
+
+    return cmdTableFind(&key->members, hash, __match_member, NULL, str->id);
+}
+
 /**
- * Find or create a member hash in a given key hash bucket
+ * Find or create a member in a given key's member table
  */
 static inline cmdMemberList *__find_member(cmdHashContainer *c, cmdKeyList *key,
                                         const char *member, size_t len)
 {
-    unsigned int num = GET_BUCKET(member, len, c->msize);
-    cmdMemberList *item, *tail = NULL;
+    uint64_t hash = GET_HASH(member, len);
+    cmdMemberList *item;
+    cmdInternStr *str;
+    size_t before, after;
 
-    // Create bucket array itself if this is a new entry
-    if(key->bucket == NULL) {
-        if((key->bucket = calloc(c->msize, sizeof(cmdMemberList*))) == NULL)
-            return NULL;
-    }
-    
-    if(key->bucket[num] == NULL) {
-        if((key->bucket[num] = calloc(1, sizeof(cmdMemberList)))==NULL)
-            return NULL;
+    // Find our one copy of the string, after which we only need its id
+    if((str = cmdInternGet(c->intern, hash, member, len)) == NULL)
+        return NULL;
 
-        // This is a new bucket, use it
-        item = key->bucket[num];
+    // Look for our item
+    item = cmdTableFind(&key->members, hash, __match_member, NULL, str->id);
+    if(item != NULL)
+        return item;
+
+    // It's new, so allocate it and take a reference to the string
+    if(c->heap) {
+        item = malloc(sizeof(cmdMemberList));
+        c->heap_bytes += sizeof(cmdMemberList);
+        c->allocs++;
     } else {
-        // Bucket has data, look for our item
-        for(item = key->bucket[num]; item != NULL; item = item->next) {
-            // Keep track of our last non null item
-            tail = item;
+        item = cmdArenaAlloc(&c->arena, sizeof(cmdMemberList));
+    }
 
-            // Compare
-            if(len == item->len && !strncmp(member, item->member, len)) {
-                // Increment hit count
-                item->hits++;
+    if(item == NULL)
+        return NULL;
 
-                return item; // Found it
-            }
-        }
+    str->refs++;
+    item->id = str->id;
+    item->flags = 0;
+    item->value = 0;
 
-        // It's new, allocate
-        if((item = calloc(1, sizeof(cmdMemberList))) == NULL)
-            return NULL;
+    before = cmdTableMemory(&key->members);
 
-        // Append this item
-        tail->next = item;
-    }
-    
-    // Make a copy of our key
-    if((item->member = strndup(member, len)) == NULL)
+    // The first member sizes this key's table
+    if(!key->members.slots && cmdTableInit(&key->members, c->msize) < 0)
+        return NULL;
+
+    if(cmdTableInsert(&key->members, hash, item) < 0)
         return NULL;
 
+    // Our table only ever grows by allocating new slots
+    after = cmdTableMemory(&key->members);
+    if(after > before)
+        c->allocs++;
+
+    c->table_bytes += after - before;
+
     // Increment overall string length
     c->str_len += len;
     
@@ -229,9 +408,6 @@ static inline cmdMemberList *__find_member(cmdHashContainer *c, cmdKeyList *key,
     // Increment overall member count
     c->members++;
 
-    // Set length
-    item->len = len;
-
     // Return our item
     return item;
 }
@@ -242,370 +418,1733 @@ static inline cmdMemberList *__find_member(cmdHashContainer *c, cmdKeyList *key,
 static inline cmdKeyList *__find_key(cmdHashContainer *c, const char *key,
                                   size_t len) 
 {
-    unsigned int num = GET_BUCKET(key, len, c->ksize);
-    cmdKeyList *list, *tail = NULL;
+    cmdKeyList *list = c->last;
+    uint64_t hash;
+    size_t before, after;
 
-    // Create bucket if it doesn't exist
-    if(c->bucket[num] == NULL) {
-        if((c->bucket[num] = calloc(1, sizeof(cmdKeyList)))==NULL)
-            return NULL;
+    // Same key as last time, no need to hash it
+    if(list && __match_key(list, key, len))
+        return list;
 
-        // Bucket is new, we'll put it here
-        list = c->bucket[num];
-    } else {
-        // Look for it if it's not totally new
-        for(list = c->bucket[num]; list != NULL; list = list->next) {
-            tail = list;
-            if(list->len == len && !strncmp(list->key, key, len)) {
-                return list;
-            }
-        }
+    hash = GET_HASH(key, len);
 
-        // Allocate our item
-        if((list = calloc(1, sizeof(cmdKeyList))) == NULL)
-            return NULL;
-        
-        // Append this item
-        tail->next = list;
+    // Look for it
+    if((list = cmdTableFind(&c->keytable, hash, __match_key, key, len)) != NULL) {
+        c->last = list;
+        return list;
     }
 
-    // Make a copy of our key
-    if((list->key = strndup(key, len)) == NULL) {
-        free(list);
-        return NULL;
+    // Allocate our item with a copy of the key
+    if(c->heap) {
+        list = calloc(1, sizeof(cmdKeyList)+len+1);
+        c->heap_bytes += sizeof(cmdKeyList)+len+1;
+        c->allocs++;
+    } else {
+        list = cmdArenaCalloc(&c->arena, sizeof(cmdKeyList)+len+1);
     }
 
-    // Increment key count
-    c->keys++;
+    if(list == NULL)
+        return NULL;
 
-    // Set our length
+    memcpy(list->key, key, len);
+    list->hash = hash;
     list->len = len;
 
+    before = cmdTableMemory(&c->keytable);
+    if(cmdTableInsert(&c->keytable, hash, list) < 0)
+        return NULL;
+
+    after = cmdTableMemory(&c->keytable);
+    if(after > before)
+        c->allocs++;
+
+    c->table_bytes += after - before;
+
+    c->last = list;
+
+    // Increment key count
+    c->keys++;
+
     // Return it
     return list;
 }
 
 /**
- * Append a ZINCRBY command to our hash
+ * Move a key to the front of its container's recency list
  */
-static int __hash_zincrby_cmd(cmdHash *ht, redisReply *r) {
-    cmdKeyList *k;
-    cmdMemberList *m;
-
-    // Find or create the key
-    if((k = __find_key(ht->z_cmds, r->element[1]->str, r->element[1]->len))==NULL)
-        return -1;
-
-    // Find or create the member
-    if((m = __find_member(ht->z_cmds, k, r->element[3]->str, r->element[3]->len))==NULL)
-        return -1;
-
-    // Increment our score
-    m->score += strtod(r->element[2]->str, NULL);
-
-    // Success
-    return 0;
+static inline void __touch(cmdHash *ht, cmdHashContainer *c, cmdKeyList *key) {
+    key->touched = ht->tick;
+
+    if(c->head == key)
+        return;
+
+    // Unlink it if it's already in the list
+    if(key->prev)
+        key->prev->next = key->next;
+    if(key->next)
+        key->next->prev = key->prev;
+    if(c->tail == key)
+        c->tail = key->prev;
+
+    key->prev = NULL;
+    key->next = c->head;
+    if(c->head)
+        c->head->prev = key;
+
+    c->head = key;
+    if(!c->tail)
+        c->tail = key;
 }
 
 /**
- * Append an SADD command to our hash
+ * Every command we can aggregate, the container it goes into and how its
+ * arguments are laid out.  Commands that take a key and any number of
+ * members or score/member pairs give their smallest argc and the step
+ * their arguments repeat by.
  */
-static int __hash_sadd_cmd(cmdHash *ht, redisReply *r) {
-    cmdKeyList *k;
-    cmdMemberList *m;
-    int i;
+typedef struct _cmdAggregator {
+    const char *name;
+    size_t len;
+    cmdType type;
+    int argc;
+    int step;
+
+    /**
+     * Argument holding the (first) increment, or zero if it's implied, and
+     * what increments are multiplied by.
+     */
+    int arg;
+    int sign;
+
+    /**
+     * Whether scores replace what we have (ZADD) rather than adding to it
+     */
+    int set;
+} cmdAggregator;
+
+#define AGG(cmd, type, argc, step, arg, sign, set) \
+    { cmd, sizeof(cmd)-1, type, argc, step, arg, sign, set }
+
+static const cmdAggregator g_aggregators[] = {
+    AGG("ZINCRBY", TYPE_ZINCRBY, 4, 0, 2, 1, 0),
+    AGG("ZADD", TYPE_ZINCRBY, 4, 2, 2, 1, 1),
+    AGG("SADD", TYPE_SADD, 3, 1, 0, 1, 0),
+    AGG("PFADD", TYPE_PFADD, 3, 1, 0, 1, 0),
+    AGG("INCRBY", TYPE_INCRBY, 3, 0, 2, 1, 0),
+    AGG("DECRBY", TYPE_INCRBY, 3, 0, 2, -1, 0),
+    AGG("INCR", TYPE_INCRBY, 2, 0, 0, 1, 0),
+    AGG("DECR", TYPE_INCRBY, 2, 0, 0, -1, 0),
+    AGG("INCRBYFLOAT", TYPE_INCRBYFLOAT, 3, 0, 2, 1, 0),
+    AGG("HINCRBY", TYPE_HINCRBY, 4, 0, 3, 1, 0),
+    AGG("HINCRBYFLOAT", TYPE_HINCRBYFLOAT, 4, 0, 3, 1, 0),
+};
 
-    // Find or create this key
-    if((k = __find_key(ht->s_cmds, r->element[1]->str, r->element[1]->len))==NULL)
-        return -1;
+#define AGGREGATOR_COUNT (sizeof(g_aggregators)/sizeof(*g_aggregators))
+
+static inline const cmdAggregator *__get_aggregator(int argc, const char **argv,
+                                                    const size_t *argvlen)
+{
+    const cmdAggregator *a;
+    size_t i;
 
-    // Find or create every member being added
-    for(i=2;i<r->elements;i++) {
-        // Find or create the member
-        m = __find_member(ht->s_cmds, k, r->element[i]->str, r->element[i]->len);
+    for(i=0;i<AGGREGATOR_COUNT;i++) {
+        a = &g_aggregators[i];
 
-        // We had a failure if we couldn't find or create it
-        if(m == NULL)
-            return -1;
+        if(argvlen[0] != a->len || strncasecmp(argv[0], a->name, a->len))
+            continue;
+
+        // Anything with the wrong number of arguments gets Redis' error
+        if(a->step ? argc < a->argc || (argc - a->argc) % a->step :
+                     argc != a->argc)
+        {
+            return NULL;
+        }
+
+        return a;
     }
 
-    // Success
-    return 0;
+    return NULL;
 }
 
 /**
- * Determine if we can add this command to the hash
+ * Parse an integer the way Redis does.  No whitespace, sign other than '-',
+ * leading zeros or anything that doesn't fit in 64 bits.
  */
-static inline cmdType __get_type(redisReply *r) {
-    // Check for ZINCRBY
-    if(r->elements==4 && !strncasecmp(r->element[0]->str,"ZINCRBY",sizeof("ZINCRBY")))
-       return TYPE_ZINCRBY;
+static int __parse_ll(const char *str, size_t len, long long *out) {
+    unsigned long long v = 0, limit = LLONG_MAX;
+    size_t i = 0;
+    int neg = 0;
 
-    // Check for SADD
-    if(r->elements>2 && !strncasecmp(r->element[0]->str,"SADD",sizeof("SADD")))
-       return TYPE_SADD; 
+    if(len == 0 || len > 20)
+        return -1;
 
-   // Not a supported command
-   return TYPE_UNSUPPORTED;
-}
+    if(str[0] == '-') {
+        if(len == 1)
+            return -1;
 
-int cmdHashAdd(cmdHash *ht, redisReply *r) {
-    // Add based on command content
-    switch(__get_type(r)) {
-        case TYPE_ZINCRBY:
-            return __hash_zincrby_cmd(ht,r);
-            break;
-        case TYPE_SADD:
-            return __hash_sadd_cmd(ht,r);
-            break;
-        default:
-            return TYPE_UNSUPPORTED;
-            break;
+        neg = 1;
+        i = 1;
+        limit++;
     }
-}
 
-/**
- * Internal helper to reallocate our buffer
- */
-static inline int __realloc_buffer(cmdHash *ht, size_t addlen) {
-    size_t len = ht->_len, newlen = len+addlen;
-    char *newbuf;
+    if(str[i] == '0' && (len > i+1 || neg))
+        return -1;
 
-    // Aggressive allocation up to a point
-    if(newlen < BUF_MAX_PREALLOC) {
-        newlen *= 2;
-    } else {
-        newlen += BUF_MAX_PREALLOC;
+    for(;i<len;i++) {
+        if(str[i] < '0' || str[i] > '9')
+            return -1;
+        if(v > (limit - (str[i]-'0'))/10)
+            return -1;
+
+        v = v*10 + (str[i]-'0');
     }
 
-    // Reallocate buffer
-    newbuf = realloc(ht->_buf, newlen);
+    *out = neg ? -(long long)(v-1)-1 : (long long)v;
 
-    // Check for allocation failure
-    if(newbuf == NULL)
-        return -1;
-    
-    // Success
-    ht->_size = newlen;
-    ht->_buf = newbuf;
     return 0;
-};
+}
 
 /**
- * Internal helpper to append (and reallocate if necissary) our buffer
+ * Powers of ten that are exact as doubles
  */
-static inline int __append_buffer(cmdHash *ht, char *buf, size_t len) {
-    // Attempt a realloc if we need one
-    if(ht->_len + len > ht->_size && __realloc_buffer(ht, len) != 0)
-        return -1;
-
-    memcpy(ht->_buf+ht->_len, buf, len);
-    ht->_len+=len;
-
-    return 0;
-}
+static const double g_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+    1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
 /**
- * Append a ZINCRBY command for every member relating to a given key
+ * Most digits a fixed point number can have for its digits to be exact as
+ * a double (which they are up to 2^53)
  */
-static inline int __append_zincrby_key_cmds(cmdHash *ht, cmdKeyList *key) {
-    cmdMemberList *mem;
-    char *cmd;
-    size_t len;
-    int i, ovr;
-
-    for(i=0;i<ht->z_cmds->msize;i++) {
-        mem = key->bucket[i];
-        while(mem != NULL) {
-            // Construct our ZINCRBY command
-            len = redisFormatCommand(&cmd, "ZINCRBY %b %f %b", key->key,
-                                     key->len, mem->score, mem->member,
-                                     mem->len);
+#define FIXED_MAX_DIGITS 15
 
-            // Would this overflow our buffer
-            ovr = ht->_len + len > ht->_size;
+/**
+ * Parse the plain fixed point numbers scores and increments nearly always
+ * are ("5", "-0.25") without strtod, or return -1 for anything else.  Both
+ * our digits and the power of ten we divide them by are exact, so one
+ * division rounds the same way strtod would.
+ */
+static inline int __parse_fixed(const char *str, size_t len, double *out) {
+    unsigned int digits = 0, frac = 0, dot = 0;
+    uint64_t v = 0;
+    size_t i = 0;
+    int neg = 0;
+
+    if(str[0] == '-') {
+        neg = 1;
+        i = 1;
+    }
 
-            if(len < 0 || (ovr && __realloc_buffer(ht, len)<0)) {
-                __flush_buffer(ht);
+    for(;i<len;i++) {
+        if(str[i] >= '0' && str[i] <= '9') {
+            if(++digits > FIXED_MAX_DIGITS)
                 return -1;
-            }
 
-            // Append this command
-            __append_buffer(ht, cmd, len);
-            free(cmd);
-
-            // Move on
-            mem = mem->next;
+            v = v*10 + (str[i]-'0');
+            frac += dot;
+        } else if(str[i] == '.' && !dot) {
+            dot = 1;
+        } else {
+            return -1;
         }
     }
 
-    // Success
+    if(!digits)
+        return -1;
+
+    *out = frac ? (double)v / g_pow10[frac] : (double)v;
+    if(neg)
+        *out = -*out;
+
     return 0;
 }
 
 /**
- * Append all ZINCRBY commands we've got hashed
+ * Parse a double, which has to use every byte we're given.  Arguments are
+ * CRLF terminated in the input, so strtod stops on its own.
  */
-static inline int __append_zincrby_cmds(cmdHash *ht) {
-    cmdKeyList *key;
-    int i;
+static int __parse_double(const char *str, size_t len, double *out) {
+    char *end;
 
-    // Iterate zincrby buckets
-    for(i=0;i<ht->z_cmds->ksize;i++) {
-        key = ht->z_cmds->bucket[i];
-        while(key != NULL) {
-            if(__append_zincrby_key_cmds(ht, key)<0)
-                return -1;
+    if(len == 0 || isspace((unsigned char)str[0]))
+        return -1;
 
-            // Move on
-            key=key->next;
-        }
-    }
+    if(__parse_fixed(str, len, out) == 0)
+        return 0;
+
+    *out = strtod(str, &end);
+    if(end != str + len || isnan(*out))
+        return -1;
 
-    // Success
     return 0;
 }
 
+typedef union _cmdIncr {
+    double score;
+    long long value;
+} cmdIncr;
+
 /**
- * Append an SADD command for however many members it contains
+ * Read the increment (or score) starting at argv[i]
  */
-static inline int __append_sadd_key_cmd(cmdHash *ht, cmdKeyList *key) 
+static int __read_incr(const cmdAggregator *a, int i, const char **argv,
+                       const size_t *argvlen, cmdIncr *incr)
 {
-    cmdMemberList *mem;
-    char **argv, *cmd = NULL;
-    size_t *argvlen;
-    unsigned int len, args, more = key->count;
-    int i, idx = 2;
-    
-    // Only allocate up to the maximum multibulk argument count
-    args = key->count+2 > ARG_MAX ? ARG_MAX: key->count+2;
-
-    // Allocate argument array
-    if(!(argv = malloc(sizeof(char*)*args))) {
-        return -1;
-    }
-    // Allocate size array
-    if(!(argvlen = malloc(sizeof(size_t)*args))) {
-        free(argv);
-        return -1;
-    }
+    if(g_types[a->type].integer) {
+        if(!a->arg) {
+            incr->value = a->sign;
+            return 0;
+        }
 
-    // "SADD"
-    argv[0] = "SADD";
-    argvlen[0] = sizeof("SADD")-1;
+        if(__parse_ll(argv[i], argvlen[i], &incr->value) < 0)
+            return -1;
 
-    // <key>
-    argv[1] = key->key;
-    argvlen[1] = key->len;
+        // DECRBY can't negate the smallest integer
+        if(a->sign < 0) {
+            if(incr->value == LLONG_MIN)
+                return -1;
+            incr->value = -incr->value;
+        }
 
-    // Iterate our buckets
-    for(i=0;i<ht->s_cmds->msize;i++) {
-        mem = key->bucket[i];
-        while(mem != NULL) {
-            // Add this member
-            argv[idx] = mem->member;
-            argvlen[idx] = mem->len;
+        return 0;
+    }
 
-            // Move forward, decrement how many are left
-            idx++; more--;
-            mem = mem->next;
+    if(__parse_double(argv[i], argvlen[i], &incr->score) < 0)
+        return -1;
 
-            // If we have hit our maximum argument count, or there are no
-            // more commands, append it.
-            if(idx >= ARG_MAX || !more) {
-                len = redisFormatCommandArgv(&cmd, idx, (const char**)argv, (const size_t*)argvlen);
-                if(len < 1 || !cmd || __append_buffer(ht,cmd,len)<0) {
-                    if(cmd) free(cmd);
-                    return -1;
-                }
-                free(cmd);
-                idx = 2;
-            }
-        }
-    }
+    // Only sorted set scores may be infinite
+    if(a->type != TYPE_ZINCRBY && isinf(incr->score))
+        return -1;
 
-    // Free our argument arrays
-    free(argv);
-    free(argvlen);
-    
-    // Return success/failure
     return 0;
 }
 
 /**
- * Append all SADD commands we have hashed
+ * Make sure every increment or score in a command is one Redis would take
  */
-static inline int __append_sadd_cmds(cmdHash *ht) {
-    cmdKeyList *key;
+static int __check_cmd(const cmdAggregator *a, int argc, const char **argv,
+                       const size_t *argvlen)
+{
+    cmdIncr incr;
     int i;
 
-    // Iterate sadd buckets
-    for(i=0;i<ht->s_cmds->ksize;i++) {
-        key = ht->s_cmds->bucket[i];
-        while(key!=NULL) {
-            // Add SADD members for this key
-            if(__append_sadd_key_cmd(ht, key)<0)
-                return -1;
-
-            // Move on
-            key=key->next;
-        }
+    for(i=a->arg;i>0 && i<argc;i+=a->step ? a->step : argc) {
+        if(__read_incr(a, i, argv, argvlen, &incr) < 0)
+            return -1;
     }
 
-    // Success
     return 0;
 }
 
 /**
- * Get our aggregated command buffer
+ * Fold an increment into a member.  Fails without changing anything if the
+ * result is one Redis would refuse (integer overflow, NaN, or an infinite
+ * float counter).
  */
-int cmdHashGetCommands(cmdHash *ht, char **ret, size_t *len) {
-    if(!ht || !ret || !len)
-        return -1;
+static inline int __apply(const cmdAggregator *a, cmdMemberList *m,
+                          const cmdIncr *incr)
+{
+    long long value;
+    double score;
+
+    if(a->set) {
+        m->flags |= MEMBER_SET;
+        m->score = incr->score;
+        return 0;
+    }
 
-    // Flush our buffer if we've already created one
-    __flush_buffer(ht);
+    if(g_types[a->type].integer) {
+        if(__builtin_add_overflow(m->value, incr->value, &value))
+            return -1;
 
-    // Initial buffer allocation
-    if((ht->_buf = malloc(BUF_INIT_ALLOC)) == NULL)
-       return -1; 
+        m->value = value;
+        return 0;
+    }
 
-    // Add ZINCRBY commands
-    if(__append_zincrby_cmds(ht) < 0)
+    score = m->score + incr->score;
+    if(isnan(score) || (a->type != TYPE_ZINCRBY && isinf(score)))
         return -1;
 
-    // Append SADD commands
-    if(__append_sadd_cmds(ht) < 0)
-       return -1;
+    m->score = score;
 
-    // Set our return pointers
-    *ret = ht->_buf;
-    *len = ht->_len;
-
-    // Success
     return 0;
 }
 
 /**
- * Our total command count is the number of ZINCRBY members and SADD keys.
+ * Find or create a key, keeping our recency list up to date if we need it
+ * (which we do whenever keys can be dropped one at a time).
+ */
+static inline cmdKeyList *__get_key(cmdHash *ht, cmdHashContainer *c,
+                                    const char *key, size_t len)
+{
+    cmdKeyList *k;
+
+    if((k = __find_key(c, key, len)) == NULL)
+        return NULL;
+
+    if(!k->seen)
+        k->seen = ++ht->seen;
+    if(c->heap)
+        __touch(ht, c, k);
+
+    return k;
+}
+
+static int __key_overflow(cmdHash *ht, const cmdAggregator *a,
+                          cmdHashContainer *c, cmdKeyList *k, int argc,
+                          const char **argv, const size_t *argvlen);
+static int __sibling_room(cmdHash *ht, cmdType type, const char *key,
+                          size_t len);
+
+/**
+ * Aggregate a command into its container.  Returns TYPE_UNSUPPORTED if
+ * it has a value Redis would reject, or the other form of its counter holds
+ * the key and we can't write that out first, so it can be passed through
+ * instead.
+ */
+static int __hash_cmd(cmdHash *ht, const cmdAggregator *a, int argc,
+                      const char **argv, const size_t *argvlen)
+{
+    cmdHashContainer *c = ht->cmds[a->type];
+    cmdMemberList *m;
+    cmdKeyList *k;
+    cmdIncr incr;
+    int i;
+
+    // Once we've written a key out ahead of an overflow, Redis does its sums
+    if(__passed(ht, a->type, argv[1], argvlen[1]))
+        return TYPE_UNSUPPORTED;
+
+    // Whatever the other form of this counter holds for the key comes first
+    if((i = __sibling_room(ht, a->type, argv[1], argvlen[1])) != 0)
+        return i < 0 ? -1 : TYPE_UNSUPPORTED;
+
+    switch(g_types[a->type].layout) {
+        case LAYOUT_SET:
+            if((k = __get_key(ht, c, argv[1], argvlen[1])) == NULL)
+                return -1;
+
+            // Find or create every member being added
+            for(i=2;i<argc;i++) {
+                if((m = __find_member(c, k, argv[i], argvlen[i])) == NULL)
+                    return -1;
+
+                m->hits++;
+            }
+
+            return 0;
+        case LAYOUT_SCORE:
+            // Check every score of a ZADD before we change anything
+            if(argc > 4 && __check_cmd(a, argc, argv, argvlen) < 0)
+                return TYPE_UNSUPPORTED;
+            if(__read_incr(a, 2, argv, argvlen, &incr) < 0)
+                return TYPE_UNSUPPORTED;
+            if((k = __get_key(ht, c, argv[1], argvlen[1])) == NULL)
+                return -1;
+
+            for(i=2;i<argc;i+=2) {
+                if(i > 2)
+                    __read_incr(a, i, argv, argvlen, &incr);
+                if((m = __find_member(c, k, argv[i+1], argvlen[i+1])) == NULL)
+                    return -1;
+                if(__apply(a, m, &incr) < 0)
+                    return __key_overflow(ht, a, c, k, argc, argv, argvlen);
+            }
+
+            return 0;
+        case LAYOUT_FIELD:
+            if(__read_incr(a, 3, argv, argvlen, &incr) < 0)
+                return TYPE_UNSUPPORTED;
+            if((k = __get_key(ht, c, argv[1], argvlen[1])) == NULL)
+                return -1;
+            if((m = __find_member(c, k, argv[2], argvlen[2])) == NULL)
+                return -1;
+
+            if(__apply(a, m, &incr) < 0)
+                return __key_overflow(ht, a, c, k, argc, argv, argvlen);
+
+            return 0;
+        case LAYOUT_VALUE:
+            if(__read_incr(a, a->arg, argv, argvlen, &incr) < 0)
+                return TYPE_UNSUPPORTED;
+            if((k = __get_key(ht, c, argv[1], argvlen[1])) == NULL)
+                return -1;
+
+            // A counter is a key with a single, empty, member
+            if((m = __find_member(c, k, "", 0)) == NULL)
+                return -1;
+
+            if(__apply(a, m, &incr) < 0)
+                return __key_overflow(ht, a, c, k, argc, argv, argvlen);
+
+            return 0;
+    }
+
+    return TYPE_UNSUPPORTED;
+}
+
+cmdType cmdHashGetType(int argc, const char **argv, const size_t *argvlen) {
+    const cmdAggregator *a;
+
+    if((a = __get_aggregator(argc, argv, argvlen)) == NULL ||
+       __check_cmd(a, argc, argv, argvlen) < 0)
+    {
+        return TYPE_UNSUPPORTED;
+    }
+
+    return a->type;
+}
+
+static int __flush_cold(cmdHash *ht);
+static int __flush_key(cmdHash *ht, cmdHashContainer *c, cmdKeyList *key,
+                       cmdType type);
+static int __merge(cmdHash *ht, cmdBuffer *out, const cmdKeyList *key,
+                   cmdType type, unsigned int *count);
+
+/**
+ * Number of keys we're holding across every container
+ */
+static inline unsigned int __held_keys(cmdHash *ht) {
+    unsigned int keys = 0;
+    int i;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        keys += ht->cmds[i]->keys;
+    }
+
+    return keys;
+}
+
+/**
+ * Write everything we're holding to a new run and start over
+ */
+static int __spill(cmdHash *ht) {
+    int i;
+
+    if(cmdSpillWrite(ht->spill, ht) < 0)
+        return -1;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        if(__container_reset(ht->cmds[i]) < 0)
+            return -1;
+    }
+
+    cmdInternReset(&ht->intern);
+
+    return 0;
+}
+
+/**
+ * Get a key out of the way of something it can't be combined with, so that
+ * can come after it.  Once we've spilled we start over from an empty hash,
+ * since runs are merged back in order and keys that can't be combined are
+ * written in parts.  Otherwise we write the key out now.  Returns 1 if we
+ * can do neither.
+ */
+static int __make_room(cmdHash *ht, cmdHashContainer *c, cmdKeyList *k,
+                       cmdType type)
+{
+    if(ht->spill)
+        return __spill(ht);
+    if(ht->has_out)
+        return __flush_key(ht, c, k, type);
+
+    return 1;
+}
+
+/**
+ * An increment would take a key past what Redis allows, so it has to reach
+ * Redis on its own, after what the key already holds.  We write the key out
+ * now, first what we spilled of it and then what we're holding, and from
+ * then on only Redis knows what it holds, so we pass this and every later
+ * command for it through.  Without an output we can only spill to start
+ * the key over, where it can't overflow, or pass the increment through
+ * ahead of the key.
+ */
+static int __key_overflow(cmdHash *ht, const cmdAggregator *a,
+                          cmdHashContainer *c, cmdKeyList *k, int argc,
+                          const char **argv, const size_t *argvlen)
+{
+    unsigned int count;
+
+    if(!ht->has_out) {
+        if(!ht->spill)
+            return TYPE_UNSUPPORTED;
+        if(__spill(ht) < 0)
+            return -1;
+
+        return __hash_cmd(ht, a, argc, argv, argvlen);
+    }
+
+    if(ht->spill) {
+        if(__merge(ht, ht->out, k, a->type, &count) < 0)
+            return -1;
+
+        ht->flushed += count;
+    }
+
+    if(__flush_key(ht, c, k, a->type) < 0 ||
+       __find_key(ht->passed[TYPE_CLASS(a->type)], argv[1], argvlen[1]) == NULL)
+    {
+        return -1;
+    }
+
+    return TYPE_UNSUPPORTED;
+}
+
+/**
+ * Get a key out of the container of the other form of a counter, before we
+ * add to it in this one.  Returns 1 if we can't.
+ */
+static int __sibling_room(cmdHash *ht, cmdType type, const char *key,
+                          size_t len)
+{
+    cmdType sibling = g_types[type].sibling;
+    cmdKeyList *k;
+
+    if(sibling == TYPE_UNSUPPORTED || !ht->cmds[sibling]->keys)
+        return 0;
+
+    k = __have_key(ht->cmds[sibling], key, len, GET_HASH(key, len));
+
+    return k ? __make_room(ht, ht->cmds[sibling], k, sibling) : 0;
+}
+
+int cmdHashAdd(cmdHash *ht, int argc, const char **argv,
+               const size_t *argvlen)
+{
+    const cmdAggregator *a;
+    int rv;
+
+    // Add based on command content
+    if((a = __get_aggregator(argc, argv, argvlen)) == NULL)
+        return TYPE_UNSUPPORTED;
+
+    if((rv = __hash_cmd(ht, a, argc, argv, argvlen)) != 0)
+        return rv;
+
+    // Every so often, drop keys that have gone cold
+    if(ht->window && !(++ht->tick % WINDOW_CHECK))
+        rv = __flush_cold(ht);
+
+    // Move what we have to disk if we're over budget
+    if(rv == 0 && ht->max_memory && cmdHashMemory(ht) > ht->max_memory)
+        rv = __spill(ht);
+
+    return rv;
+}
+
+/**
+ * Lay out a command's multibulk header, name, and the length line of its
+ * key, which are the same for every command we write for that key.
+ */
+#define PREFIX_SPACE(nlen) ((nlen) + 3*DTOA_MAX_LEN + 11)
+
+static inline size_t __key_prefix(char *buf, int argc, const char *name,
+                                  size_t klen)
+{
+    size_t nlen = strlen(name);
+    char *p = buf;
+
+    *p++ = '*';
+    p += dtoaUint(argc, p);
+    *p++ = '\r'; *p++ = '\n';
+    *p++ = '$';
+    p += dtoaUint(nlen, p);
+    *p++ = '\r'; *p++ = '\n';
+    memcpy(p, name, nlen);
+    p += nlen;
+    *p++ = '\r'; *p++ = '\n';
+    *p++ = '$';
+    p += dtoaUint(klen, p);
+    *p++ = '\r'; *p++ = '\n';
+
+    return p - buf;
+}
+
+static inline int __format_value(char *buf, int integer,
+                                 const cmdMemberList *mem)
+{
+    if(!integer)
+        return dtoaDouble(mem->score, buf);
+
+    if(mem->value >= 0)
+        return dtoaUint(mem->value, buf);
+
+    *buf = '-';
+    return 1 + dtoaUint(-(unsigned long long)mem->value, buf+1);
+}
+
+/**
+ * Write one command for every member of a key in a container that holds
+ * values (scores, hash fields or counters).  HINCRBY can only take a single
+ * field, so a hash gets one command per field.
+ */
+static int __append_value_cmds(const cmdIntern *in, cmdBuffer *out,
+                               cmdKeyList *key, cmdType type)
+{
+    const cmdTypeInfo *ti = &g_types[type];
+    const cmdInternStr *str;
+    char pre[PREFIX_SPACE(16)], set[PREFIX_SPACE(16)], val[DTOA_MAX_LEN], *p;
+    int argc = ti->layout == LAYOUT_VALUE ? 3 : 4, vlen;
+    size_t plen, slen = 0;
+    cmdMemberList *mem;
+    cmdTableIter it;
+
+    plen = __key_prefix(pre, argc, ti->name, key->len);
+    if(ti->set_name)
+        slen = __key_prefix(set, argc, ti->set_name, key->len);
+
+    cmdTableIterInit(&it, &key->members);
+    while((mem = cmdTableNext(&it)) != NULL) {
+        vlen = __format_value(val, ti->integer, mem);
+        str = cmdInternLookup(in, mem->id);
+
+        p = cmdBufferReserve(out, PREFIX_SPACE(16) + key->len + 2 +
+                                  BULK_SPACE(vlen) + BULK_SPACE(str->len));
+        if(!p)
+            return -1;
+
+        if(mem->flags & MEMBER_SET) {
+            memcpy(p, set, slen);
+            p += slen;
+        } else {
+            memcpy(p, pre, plen);
+            p += plen;
+        }
+
+        memcpy(p, key->key, key->len);
+        p += key->len;
+        *p++ = '\r'; *p++ = '\n';
+
+        switch(ti->layout) {
+            case LAYOUT_SCORE:
+                p = cmdBufferWriteBulk(p, val, vlen);
+                p = cmdBufferWriteBulk(p, str->str, str->len);
+                break;
+            case LAYOUT_FIELD:
+                p = cmdBufferWriteBulk(p, str->str, str->len);
+                p = cmdBufferWriteBulk(p, val, vlen);
+                break;
+            default:
+                p = cmdBufferWriteBulk(p, val, vlen);
+                break;
+        }
+
+        cmdBufferCommit(out, p - (out->buf + out->pos), 1);
+    }
+
+    // Success
+    return 0;
+}
+
+/**
+ * Append a command adding every member of a key, splitting it every max
+ * members.  Sets (and HyperLogLogs) just list their members, while batched
+ * sorted sets give each member's score before it.
+ */
+static int __append_variadic_cmds(const cmdIntern *in, cmdBuffer *out,
+                                  cmdKeyList *key, const char *name,
+                                  unsigned int max, int scores)
+{
+    size_t nlen = strlen(name);
+    const cmdInternStr *str;
+    unsigned int args = 0, more = key->count;
+    char val[DTOA_MAX_LEN], *p;
+    cmdMemberList *mem;
+    cmdTableIter it;
+    int vlen = 0;
+
+    // Iterate our members
+    cmdTableIterInit(&it, &key->members);
+    while((mem = cmdTableNext(&it)) != NULL) {
+        // Start a new command with however many members it will hold
+        if(!args) {
+            args = more > max ? max : more;
+
+            p = cmdBufferReserve(out, DTOA_MAX_LEN + 3 + BULK_SPACE(nlen) +
+                                      BULK_SPACE(key->len));
+            if(!p)
+                return -1;
+
+            *p = '*';
+            p += 1 + dtoaUint(2 + (scores ? args*2 : args), p+1);
+            *p++ = '\r'; *p++ = '\n';
+            p = cmdBufferWriteBulk(p, name, nlen);
+            p = cmdBufferWriteBulk(p, key->key, key->len);
+
+            cmdBufferCommit(out, p - (out->buf + out->pos), 1);
+        }
+
+        if(scores)
+            vlen = dtoaDouble(mem->score, val);
+
+        str = cmdInternLookup(in, mem->id);
+
+        // Add this member
+        if((p = cmdBufferReserve(out, BULK_SPACE(vlen) + BULK_SPACE(str->len))) == NULL)
+            return -1;
+
+        if(scores)
+            p = cmdBufferWriteBulk(p, val, vlen);
+
+        p = cmdBufferWriteBulk(p, str->str, str->len);
+        cmdBufferCommit(out, p - (out->buf + out->pos), 0);
+
+        // Move forward, decrement how many are left
+        args--; more--;
+    }
+
+    // Success
+    return 0;
+}
+
+/**
+ * Write every command a key aggregates to
+ */
+static inline int __append_key_cmds(const cmdHash *ht,
+                                    const cmdHashContainer *c,
+                                    cmdBuffer *out, cmdKeyList *key,
+                                    cmdType type)
+{
+    if(ht->split)
+        out = ht->split[ht->split_map[crc16KeySlot(key->key, key->len)]];
+
+    if(g_types[type].layout == LAYOUT_SET)
+        return __append_variadic_cmds(c->intern, out, key, g_types[type].name,
+                                      ARG_MAX-2, 0);
+
+    if(type == TYPE_ZINCRBY && ht->zadd_batch)
+        return __append_variadic_cmds(c->intern, out, key, CMD_ZADD,
+                                      (ht->zadd_batch-2)/2, 1);
+
+    return __append_value_cmds(c->intern, out, key, type);
+}
+
+/**
+ * How many commands a key aggregates to.  A set can be split into more
+ * than one if it has more members than ARG_MAX allows, and batched sorted
+ * sets are split the same way.
+ */
+static inline unsigned int __key_cmd_count(const cmdHash *ht, cmdKeyList *key,
+                                           cmdType type)
+{
+    unsigned int max;
+
+    if(g_types[type].layout == LAYOUT_SET) {
+        max = ARG_MAX-2;
+    } else if(type == TYPE_ZINCRBY && ht->zadd_batch) {
+        max = (ht->zadd_batch-2)/2;
+    } else {
+        return key->count;
+    }
+
+    return (key->count + max-1) / max;
+}
+
+/**
+ * Drop a key and its members from a container
+ */
+static int __remove_key(cmdHashContainer *c, cmdKeyList *key) {
+    size_t before;
+
+    // Unlink it from our recency list
+    if(key->prev) {
+        key->prev->next = key->next;
+    } else if(c->head == key) {
+        c->head = key->next;
+    }
+
+    if(key->next) {
+        key->next->prev = key->prev;
+    } else if(c->tail == key) {
+        c->tail = key->prev;
+    }
+
+    before = cmdTableMemory(&c->keytable);
+    if(cmdTableRemove(&c->keytable, key->hash, key) < 0)
+        return -1;
+    c->table_bytes += cmdTableMemory(&c->keytable) - before;
+    c->table_bytes -= cmdTableMemory(&key->members);
+
+    if(c->last == key)
+        c->last = NULL;
+
+    c->keys--;
+    c->members -= key->count;
+
+    __key_release(c, key);
+
+    return 0;
+}
+
+/**
+ * Write a key's commands out ahead of everything else we're holding, and
+ * drop it.  With nowhere to write them we just count them.
+ */
+static int __flush_key(cmdHash *ht, cmdHashContainer *c, cmdKeyList *key,
+                       cmdType type)
+{
+    if(ht->out && __append_key_cmds(ht, c, ht->out, key, type) < 0)
+        return -1;
+
+    ht->flushed += __key_cmd_count(ht, key, type);
+
+    return __remove_key(c, key);
+}
+
+/**
+ * Write out and drop every key in a container that hasn't been touched
+ * within our window, starting from the least recently touched.
+ */
+static int __flush_container(cmdHash *ht, cmdHashContainer *c, cmdType type) {
+    cmdKeyList *key;
+
+    while((key = c->tail) != NULL && ht->tick - key->touched > ht->window) {
+        if(__flush_key(ht, c, key, type) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int __flush_cold(cmdHash *ht) {
+    int i;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        if(__flush_container(ht, ht->cmds[i], i) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Where the keys are in commands we don't aggregate.  They run from argument
+ * first to last (counting back from the end if it's negative) every step
+ * arguments, and a first of zero means the command has no keys at all.  We
+ * don't know where the keys are in anything that isn't listed, so it's
+ * treated as touching all of them, and so is anything with a first of -1,
+ * which acts on the whole server rather than on any one key.  Commands that
+ * are just the same thing done to each of their keys are divisible, and can
+ * be split into one command per key.
+ */
+typedef struct _cmdKeySpec {
+    const char *name;
+    size_t len;
+    int first;
+    int last;
+    int step;
+    int divisible;
+} cmdKeySpec;
+
+#define SPEC(cmd, first, last, step, divisible) \
+    { cmd, sizeof(cmd)-1, first, last, step, divisible }
+#define KEYS(cmd, first, last, step) SPEC(cmd, first, last, step, 0)
+#define EACH(cmd, step) SPEC(cmd, 1, -1, step, 1)
+#define KEY(cmd) KEYS(cmd, 1, 1, 1)
+#define NO_KEYS(cmd) KEYS(cmd, 0, 0, 0)
+#define GLOBAL(cmd) KEYS(cmd, -1, 0, 0)
+
+static const cmdKeySpec g_key_specs[] = {
+    // Strings and keyspace commands
+    KEY("SET"), KEY("SETNX"), KEY("SETEX"), KEY("PSETEX"), KEY("GET"),
+    KEY("GETSET"), KEY("GETDEL"), KEY("GETEX"), KEY("APPEND"),
+    KEY("SETRANGE"), KEY("GETRANGE"), KEY("STRLEN"), KEY("SETBIT"),
+    KEY("GETBIT"), KEY("INCR"), KEY("DECR"), KEY("INCRBY"), KEY("DECRBY"),
+    KEY("INCRBYFLOAT"), KEY("EXPIRE"), KEY("PEXPIRE"), KEY("EXPIREAT"),
+    KEY("PEXPIREAT"), KEY("PERSIST"), KEY("TTL"), KEY("PTTL"), KEY("TYPE"),
+    KEY("DUMP"), KEY("RESTORE"), KEY("MOVE"),
+    EACH("DEL", 1), EACH("UNLINK", 1), EACH("EXISTS", 1), EACH("TOUCH", 1),
+    EACH("MGET", 1), EACH("MSET", 2), KEYS("MSETNX", 1, -1, 2),
+    KEYS("RENAME", 1, 2, 1), KEYS("RENAMENX", 1, 2, 1), KEYS("COPY", 1, 2, 1),
+
+    // Hashes
+    KEY("HSET"), KEY("HSETNX"), KEY("HMSET"), KEY("HDEL"), KEY("HGET"),
+    KEY("HMGET"), KEY("HGETALL"), KEY("HINCRBY"), KEY("HINCRBYFLOAT"),
+    KEY("HLEN"), KEY("HEXISTS"),
+
+    // Lists
+    KEY("LPUSH"), KEY("RPUSH"), KEY("LPUSHX"), KEY("RPUSHX"), KEY("LPOP"),
+    KEY("RPOP"), KEY("LSET"), KEY("LREM"), KEY("LTRIM"), KEY("LINSERT"),
+    KEY("LRANGE"), KEY("LINDEX"), KEY("LLEN"),
+    KEYS("RPOPLPUSH", 1, 2, 1), KEYS("LMOVE", 1, 2, 1),
+
+    // Sets
+    KEY("SADD"), KEY("SREM"), KEY("SPOP"), KEY("SMEMBERS"), KEY("SISMEMBER"),
+    KEY("SCARD"), KEYS("SMOVE", 1, 2, 1),
+    KEYS("SUNION", 1, -1, 1), KEYS("SINTER", 1, -1, 1),
+    KEYS("SDIFF", 1, -1, 1), KEYS("SUNIONSTORE", 1, -1, 1),
+    KEYS("SINTERSTORE", 1, -1, 1), KEYS("SDIFFSTORE", 1, -1, 1),
+
+    // Sorted sets and HyperLogLogs
+    KEY("ZADD"), KEY("ZINCRBY"), KEY("ZREM"), KEY("ZREMRANGEBYSCORE"),
+    KEY("ZREMRANGEBYRANK"), KEY("ZREMRANGEBYLEX"), KEY("ZPOPMIN"),
+    KEY("ZPOPMAX"), KEY("ZSCORE"), KEY("ZRANK"), KEY("ZREVRANK"),
+    KEY("ZRANGE"), KEY("ZCARD"), KEY("PFADD"), KEYS("PFCOUNT", 1, -1, 1),
+    KEYS("PFMERGE", 1, -1, 1),
+
+    // Commands that don't touch any keys
+    NO_KEYS("PING"), NO_KEYS("ECHO"), NO_KEYS("AUTH"), NO_KEYS("HELLO"),
+    NO_KEYS("CLIENT"), NO_KEYS("INFO"), NO_KEYS("TIME"), NO_KEYS("PUBLISH"),
+
+    // Commands that don't touch any one key, but could affect all of them
+    GLOBAL("SELECT"), GLOBAL("SWAPDB"), GLOBAL("FLUSHDB"), GLOBAL("FLUSHALL"),
+    GLOBAL("MULTI"), GLOBAL("EXEC"), GLOBAL("DISCARD"),
+};
+
+#define KEY_SPEC_COUNT (sizeof(g_key_specs)/sizeof(*g_key_specs))
+
+/**
+ * Write out and drop every key we're holding.  Every key is in its
+ * container's recency list when they come from the heap, so this only
+ * costs as much as the keys we have.
+ */
+static int __flush_all(cmdHash *ht) {
+    cmdKeyList *key;
+    int i;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        while((key = ht->cmds[i]->head) != NULL) {
+            if(__flush_key(ht, ht->cmds[i], key, i) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Flush a key from every container that has it
+ */
+static int __flush_named_key(cmdHash *ht, const char *name, size_t len) {
+    uint64_t hash = GET_HASH(name, len);
+    cmdKeyList *key;
+    int i;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        key = cmdTableFind(&ht->cmds[i]->keytable, hash, __match_key, name, len);
+        if(key && __flush_key(ht, ht->cmds[i], key, i) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Find which arguments of a command are keys, if we know
+ */
+static const cmdKeySpec *__get_key_spec(const char *name, size_t len) {
+    size_t i;
+
+    for(i=0;i<KEY_SPEC_COUNT;i++) {
+        if(len == g_key_specs[i].len &&
+           !strncasecmp(name, g_key_specs[i].name, g_key_specs[i].len))
+        {
+            return &g_key_specs[i];
+        }
+    }
+
+    return NULL;
+}
+
+int cmdHashFirstKey(int argc, const char **argv, const size_t *argvlen) {
+    const cmdKeySpec *spec = __get_key_spec(argv[0], argvlen[0]);
+
+    if(spec == NULL)
+        return argc > 1 ? 1 : 0;
+
+    return spec->first > 0 && spec->first < argc ? spec->first : 0;
+}
+
+int cmdHashGetKeyStep(int argc, const char **argv, const size_t *argvlen,
+                      int *first, int *step)
+{
+    const cmdKeySpec *spec = __get_key_spec(argv[0], argvlen[0]);
+
+    if(spec == NULL || !spec->divisible || (argc - spec->first) % spec->step)
+        return -1;
+
+    *first = spec->first;
+    *step = spec->step;
+
+    return 0;
+}
+
+int cmdHashBarrier(cmdHash *ht, int argc, const char **argv,
+                   const size_t *argvlen)
+{
+    const cmdKeySpec *spec;
+    int i, last;
+
+    // Nothing to keep in order with
+    if(!__held_keys(ht))
+        return 0;
+
+    if((spec = __get_key_spec(argv[0], argvlen[0])) == NULL || spec->first < 0)
+        return __flush_all(ht);
+
+    last = spec->last < 0 ? argc + spec->last : spec->last;
+    for(i=spec->first;i>0 && i<=last && i<argc;i+=spec->step) {
+        if(__flush_named_key(ht, argv[i], argvlen[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Where merged keys are rebuilt, one at a time, before they're written
+ */
+typedef struct _cmdMergeState {
+    const cmdHash *ht;
+    cmdHashContainer *c;
+    cmdBuffer *out;
+} cmdMergeState;
+
+static int __merge_sink(void *arg, const cmdSpillRecord *rec, const char *key,
+                        const cmdSpillMember *m, const char *member)
+{
+    cmdMergeState *ms = arg;
+    cmdMemberList *mem;
+    cmdKeyList *k;
+    unsigned int count;
+
+    if((k = __find_key(ms->c, key, rec->len)) == NULL)
+        return -1;
+
+    // Add this member with the value the runs merged to
+    if(m) {
+        if((mem = __find_member(ms->c, k, member, m->len)) == NULL)
+            return -1;
+
+        mem->flags = m->flags;
+        mem->value = m->value;
+
+        return 0;
+    }
+
+    // That's the whole key, so write it out
+    if(ms->out && __append_key_cmds(ms->ht, ms->c, ms->out, k, rec->type) < 0)
+        return -1;
+
+    count = __key_cmd_count(ms->ht, k, rec->type);
+
+    if(__remove_key(ms->c, k) < 0)
+        return -1;
+
+    return count;
+}
+
+/**
+ * Merge our runs, writing what they hold to out (or just counting it).
+ * Given a key, we merge just that one.
+ */
+static int __merge(cmdHash *ht, cmdBuffer *out, const cmdKeyList *key,
+                   cmdType type, unsigned int *count)
+{
+    cmdMergeState ms;
+    cmdIntern in;
+    int rv;
+
+    // Keys come and go one at a time, so they (and their member strings)
+    // have to be on the heap
+    cmdInternInit(&in);
+    in.heap = 1;
+
+    if((ms.c = __container_create(1, ht->cmds[0]->msize, 0, &in)) == NULL)
+        return -1;
+
+    ms.c->heap = 1;
+    ms.ht = ht;
+    ms.out = out;
+
+    if(key) {
+        rv = cmdSpillMergeKey(ht->spill, type, key->hash, key->key, key->len,
+                              __merge_sink, &ms, count);
+    } else {
+        rv = cmdSpillMerge(ht->spill, __merge_sink, &ms, count);
+    }
+
+    __container_free(ms.c);
+    cmdInternFree(&in);
+
+    return rv;
+}
+
+/**
+ * Save the keys we pass through as empty records, flagged SPILL_PASSED
+ */
+static int __save_passed(cmdHash *ht, FILE *fd) {
+    cmdSpillRecord rec;
+    cmdKeyList *key;
+    cmdTableIter it;
+    int i;
+
+    memset(&rec, 0, sizeof(rec));
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        if(!ht->passed[i])
+            continue;
+
+        cmdTableIterInit(&it, &ht->passed[i]->keytable);
+        while((key = cmdTableNext(&it)) != NULL) {
+            rec.hash = key->hash;
+            rec.type = i;
+            rec.len = key->len;
+            rec.flags = SPILL_PASSED | (g_types[i].integer ? SPILL_INTEGER : 0);
+
+            fwrite(&rec, sizeof(rec), 1, fd);
+            fwrite(key->key, 1, key->len, fd);
+        }
+    }
+
+    return ferror(fd) ? -1 : 0;
+}
+
+int cmdHashSave(cmdHash *ht, FILE *fd) {
+    int rv;
+
+    if(!ht->spill || !ht->spill->count) {
+        rv = cmdSpillWriteHash(fd, ht);
+    } else if(__held_keys(ht) && __spill(ht) < 0) {
+        rv = -1;
+    } else {
+        // Once we've spilled, what we're holding is the merge of our runs
+        rv = cmdSpillMergeTo(ht->spill, fd);
+    }
+
+    return rv < 0 ? -1 : __save_passed(ht, fd);
+}
+
+/**
+ * Combine a member of a later hash with ours, the way __apply would have if
+ * its commands had come after ours
+ */
+static inline int __merge_member(cmdType type, cmdMemberList *mem,
+                                 const cmdMemberList *m)
+{
+    long long value;
+    double score;
+
+    if(g_types[type].layout == LAYOUT_SET) {
+        mem->hits += m->hits;
+        return 0;
+    }
+
+    if(m->flags & MEMBER_SET) {
+        mem->flags |= MEMBER_SET;
+        mem->score = m->score;
+        return 0;
+    }
+
+    if(g_types[type].integer) {
+        if(__builtin_add_overflow(mem->value, m->value, &value))
+            return -1;
+
+        mem->value = value;
+        return 0;
+    }
+
+    score = mem->score + m->score;
+    if(isnan(score) || (type != TYPE_ZINCRBY && isinf(score)))
+        return -1;
+
+    mem->score = score;
+
+    return 0;
+}
+
+/**
+ * Add a saved member's value to one we're holding, the way a later run's
+ * would be if we merged them
+ */
+static inline int __load_member(cmdType type, cmdMemberList *mem,
+                                const cmdSpillMember *m)
+{
+    cmdMemberList part;
+
+    part.flags = m->flags;
+    if(g_types[type].layout == LAYOUT_SET) {
+        part.hits = m->value;
+    } else {
+        part.value = m->value;
+    }
+
+    return __merge_member(type, mem, &part);
+}
+
+/**
+ * Whether every member of a saved record can be added to a key we already
+ * hold.  A key that couldn't be combined is saved in parts, which have to
+ * come back as parts too.
+ */
+static int __load_fits(cmdHashContainer *c, cmdKeyList *k, cmdType type,
+                       const char *buf, uint32_t count)
+{
+    cmdMemberList *mem, tmp;
+    cmdSpillMember m;
+    size_t pos = 0;
+    uint32_t i;
+
+    for(i=0;i<count;i++) {
+        memcpy(&m, buf + pos, sizeof(m));
+        pos += sizeof(m);
+
+        mem = __have_member(c, k, buf + pos, m.len, GET_HASH(buf + pos, m.len));
+        if(mem) {
+            tmp = *mem;
+            if(__load_member(type, &tmp, &m) < 0)
+                return 0;
+        }
+
+        pos += m.len;
+    }
+
+    return 1;
+}
+
+int cmdHashLoad(cmdHash *ht, const char *buf, size_t len) {
+    cmdHashContainer *c;
+    cmdMemberList *mem;
+    cmdSpillRecord rec;
+    cmdSpillMember m;
+    size_t pos = 0, end, p;
+    const char *key;
+    cmdKeyList *k;
+    uint32_t i;
+
+    while(pos < len) {
+        // Records aren't aligned, so they're copied out of the buffer
+        if(len - pos < sizeof(rec))
+            return -1;
+
+        memcpy(&rec, buf + pos, sizeof(rec));
+        pos += sizeof(rec);
+
+        if(rec.type >= TYPE_COUNT || rec.len > len - pos || rec.size > len - pos - rec.len ||
+           !(rec.flags & SPILL_INTEGER) != !g_types[rec.type].integer)
+        {
+            return -1;
+        }
+
+        c = ht->cmds[rec.type];
+        key = buf + pos;
+        pos += rec.len;
+        end = pos + rec.size;
+
+        // Make sure every member is there before we add any of them
+        for(i=0,p=pos;i<rec.count;i++) {
+            if(end - p < sizeof(m))
+                return -1;
+
+            memcpy(&m, buf + p, sizeof(m));
+            p += sizeof(m);
+
+            if(m.len > end - p)
+                return -1;
+            p += m.len;
+        }
+
+        if(p != end)
+            return -1;
+
+        // A key we were passing through carries on that way
+        if(rec.flags & SPILL_PASSED) {
+            if(__find_key(ht->passed[TYPE_CLASS(rec.type)], key, rec.len) == NULL)
+                return -1;
+
+            pos = end;
+            continue;
+        }
+
+        // Get a key out of the way of a part it can't be combined with
+        if(__sibling_room(ht, rec.type, key, rec.len) != 0)
+            return -1;
+
+        if((k = __have_key(c, key, rec.len, GET_HASH(key, rec.len))) != NULL &&
+           !__load_fits(c, k, rec.type, buf + pos, rec.count) &&
+           __make_room(ht, c, k, rec.type) != 0)
+        {
+            return -1;
+        }
+
+        if((k = __get_key(ht, c, key, rec.len)) == NULL)
+            return -1;
+
+        for(i=0;i<rec.count;i++) {
+            memcpy(&m, buf + pos, sizeof(m));
+            pos += sizeof(m);
+
+            if((mem = __find_member(c, k, buf + pos, m.len)) == NULL ||
+               __load_member(rec.type, mem, &m) < 0)
+            {
+                return -1;
+            }
+
+            pos += m.len;
+        }
+
+        // Move what we have to disk if we're over budget
+        if(ht->max_memory && cmdHashMemory(ht) > ht->max_memory && __spill(ht) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * A key we're about to write, and the container it's in.  Its type is kept
+ * in the bottom bits of what we sort by.
+ */
+typedef struct _cmdSortEntry {
+    uint64_t sort;
+    cmdKeyList *key;
+    cmdHashContainer *c;
+} cmdSortEntry;
+
+#define SORT_TYPE_BITS 3
+#define SORT_TYPE_MASK ((1 << SORT_TYPE_BITS) - 1)
+
+/**
+ * What we sort a key by.  Slots take the top 14 bits, with as much of the
+ * key's hash as fits below them so a key's commands stay together.
+ */
+static inline uint64_t __sort_key(cmdOrder order, const cmdKeyList *key,
+                                  cmdType type)
+{
+    switch(order) {
+        case ORDER_SLOT:
+            return (uint64_t)crc16KeySlot(key->key, key->len) << 50 |
+                   (key->hash >> 17) << SORT_TYPE_BITS | type;
+        case ORDER_SEEN:
+            return (uint64_t)key->seen << SORT_TYPE_BITS | type;
+        default:
+            return (key->hash & ~(uint64_t)SORT_TYPE_MASK) | type;
+    }
+}
+
+/**
+ * LSD radix sort on a byte at a time, skipping any byte that's the same
+ * for every entry (like the top bytes of first seen counts)
+ */
+static int __radix_sort(cmdSortEntry *entries, size_t n) {
+    cmdSortEntry *src = entries, *dst, *tmp;
+    size_t counts[8][256], pos, c;
+    unsigned int d, b;
+    size_t i;
+
+    if(n < 2)
+        return 0;
+
+    if((tmp = malloc(sizeof(cmdSortEntry) * n)) == NULL)
+        return -1;
+
+    memset(counts, 0, sizeof(counts));
+    for(i=0;i<n;i++) {
+        for(d=0;d<8;d++) {
+            counts[d][(entries[i].sort >> (d*8)) & 0xff]++;
+        }
+    }
+
+    dst = tmp;
+    for(d=0;d<8;d++) {
+        if(counts[d][(src[0].sort >> (d*8)) & 0xff] == n)
+            continue;
+
+        for(b=0,pos=0;b<256;b++) {
+            c = counts[d][b];
+            counts[d][b] = pos;
+            pos += c;
+        }
+
+        for(i=0;i<n;i++) {
+            dst[counts[d][(src[i].sort >> (d*8)) & 0xff]++] = src[i];
+        }
+
+        dst = src;
+        src = src == entries ? tmp : entries;
+    }
+
+    if(src != entries)
+        memcpy(entries, src, sizeof(cmdSortEntry) * n);
+
+    free(tmp);
+
+    return 0;
+}
+
+int cmdHashGetCommandsSorted(cmdHash **hts, unsigned int count, cmdBuffer *out) {
+    cmdSortEntry *entries;
+    size_t n = 0, i;
+    cmdKeyList *key;
+    cmdTableIter it;
+    unsigned int h;
+    int t, rv = 0;
+
+    for(h=0;h<count;h++) {
+        if(hts[h]->spill && hts[h]->spill->count)
+            return -1;
+
+        n += __held_keys(hts[h]);
+    }
+
+    if(!n)
+        return 0;
+
+    if((entries = malloc(sizeof(cmdSortEntry) * n)) == NULL)
+        return -1;
+
+    for(h=0,i=0;h<count;h++) {
+        for(t=0;t<TYPE_COUNT;t++) {
+            cmdTableIterInit(&it, &hts[h]->cmds[t]->keytable);
+            while((key = cmdTableNext(&it)) != NULL) {
+                entries[i].sort = __sort_key(hts[0]->order, key, t);
+                entries[i].key = key;
+                entries[i++].c = hts[h]->cmds[t];
+            }
+        }
+    }
+
+    if(__radix_sort(entries, n) < 0) {
+        free(entries);
+        return -1;
+    }
+
+    for(i=0;i<n && rv == 0;i++) {
+        rv = __append_key_cmds(hts[0], entries[i].c, out, entries[i].key,
+                               entries[i].sort & SORT_TYPE_MASK);
+    }
+
+    free(entries);
+
+    return rv;
+}
+
+/**
+ * Whether every member of one of src's keys can be added to dst's
+ */
+static int __merge_fits(cmdHashContainer *c, cmdKeyList *k, cmdType type,
+                        const cmdHash *src, cmdKeyList *key)
+{
+    const cmdInternStr *str;
+    cmdMemberList *m, *mem, tmp;
+    cmdTableIter it;
+
+    cmdTableIterInit(&it, &key->members);
+    while((m = cmdTableNext(&it)) != NULL) {
+        str = cmdInternLookup(&src->intern, m->id);
+
+        if((mem = __have_member(c, k, str->str, str->len, str->hash)) != NULL) {
+            tmp = *mem;
+            if(__merge_member(type, &tmp, m) < 0)
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Whether everything src holds can be added to dst as it is.  None of its
+ * keys can be ones dst passes through, or that dst can't take its part of
+ * (a counter would overflow, or a score come out as one Redis rejects).
+ */
+static int __merge_fits_all(cmdHash *dst, cmdHash *src) {
+    cmdHashContainer *c, *passed;
+    cmdKeyList *key, *k;
+    cmdTableIter it;
+    int t;
+
+    for(t=0;t<TYPE_COUNT;t++) {
+        c = dst->cmds[t];
+        passed = dst->passed[TYPE_CLASS(t)];
+
+        // Set members only ever add up
+        if(g_types[t].layout == LAYOUT_SET || !src->cmds[t]->keys)
+            continue;
+
+        cmdTableIterInit(&it, &src->cmds[t]->keytable);
+        while((key = cmdTableNext(&it)) != NULL) {
+            if(passed->keys && __have_key(passed, key->key, key->len, key->hash))
+                return 0;
+
+            k = __have_key(c, key->key, key->len, key->hash);
+            if(k && !__merge_fits(c, k, t, src, key))
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Add one of src's keys, and every member it has, to dst, getting a key the
+ * other form of its counter holds out of the way first
+ */
+static int __merge_key(cmdHash *dst, cmdHash *src, cmdType type,
+                       cmdKeyList *key)
+{
+    cmdHashContainer *c = dst->cmds[type];
+    const cmdInternStr *str;
+    cmdMemberList *m, *mem;
+    cmdTableIter it;
+    cmdKeyList *k;
+
+    if(__sibling_room(dst, type, key->key, key->len) != 0)
+        return -1;
+
+    if((k = __get_key(dst, c, key->key, key->len)) == NULL)
+        return -1;
+
+    cmdTableIterInit(&it, &key->members);
+    while((m = cmdTableNext(&it)) != NULL) {
+        str = cmdInternLookup(&src->intern, m->id);
+
+        if((mem = __find_member(c, k, str->str, str->len)) == NULL ||
+           __merge_member(type, mem, m) < 0)
+        {
+            return -1;
+        }
+    }
+
+    // Move what we have to disk if we're over budget
+    if(dst->max_memory && cmdHashMemory(dst) > dst->max_memory && __spill(dst) < 0)
+        return -1;
+
+    return 0;
+}
+
+int cmdHashMerge(cmdHash *dst, cmdHash *src) {
+    cmdSortEntry *entries;
+    size_t n, i;
+    cmdKeyList *key;
+    cmdTableIter it;
+    int t, rv = 0;
+
+    if(src->spill && src->spill->count)
+        return -1;
+
+    // Only parsing src's commands after ours can get these right
+    if(!__merge_fits_all(dst, src))
+        return 1;
+
+    dst->flushed += src->flushed;
+
+    // Keys only have to come in any particular order if we're going to
+    // write them in the order they were first seen
+    if(dst->order != ORDER_SEEN) {
+        for(t=0;t<TYPE_COUNT;t++) {
+            cmdTableIterInit(&it, &src->cmds[t]->keytable);
+            while((key = cmdTableNext(&it)) != NULL) {
+                if(__merge_key(dst, src, t, key) < 0)
+                    return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    if(!(n = __held_keys(src)))
+        return 0;
+
+    if((entries = malloc(sizeof(cmdSortEntry) * n)) == NULL)
+        return -1;
+
+    for(t=0,i=0;t<TYPE_COUNT;t++) {
+        cmdTableIterInit(&it, &src->cmds[t]->keytable);
+        while((key = cmdTableNext(&it)) != NULL) {
+            entries[i].sort = __sort_key(ORDER_SEEN, key, t);
+            entries[i].key = key;
+            entries[i++].c = src->cmds[t];
+        }
+    }
+
+    // Keys new to dst are seen after everything it has, in src's order
+    if(__radix_sort(entries, n) < 0)
+        rv = -1;
+
+    for(i=0;i<n && rv == 0;i++) {
+        rv = __merge_key(dst, src, entries[i].sort & SORT_TYPE_MASK, entries[i].key);
+    }
+
+    free(entries);
+
+    return rv;
+}
+
+/**
+ * Write our aggregated commands to a command buffer, which may drain to its
+ * sink as we go rather than holding them all.
+ */
+int cmdHashGetCommands(cmdHash *ht, cmdBuffer *out) {
+    unsigned int count;
+    cmdKeyList *key;
+    cmdTableIter it;
+    int i;
+
+    if(!ht || !out)
+        return -1;
+
+    // Once we've spilled, everything comes out of a merge of our runs
+    if(ht->spill && ht->spill->count) {
+        if(__held_keys(ht) && __spill(ht) < 0)
+            return -1;
+
+        return __merge(ht, out, NULL, 0, &count);
+    }
+
+    if(ht->order != ORDER_TABLE)
+        return cmdHashGetCommandsSorted(&ht, 1, out);
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        cmdTableIterInit(&it, &ht->cmds[i]->keytable);
+        while((key = cmdTableNext(&it)) != NULL) {
+            if(__append_key_cmds(ht, ht->cmds[i], out, key, i) < 0)
+                return -1;
+        }
+    }
+
+    // Success
+    return 0;
+}
+
+/**
+ * Our total command count is one per member of each key, except for sets,
+ * which are one per key (or more if we have to split them).
  */
 unsigned int cmdHashGetCount(cmdHash *ht) {
     if(ht == NULL) return -1;
     
     cmdKeyList *key;
-    int i, tot;
+    cmdTableIter it;
+    unsigned int tot;
+    int i;
+
+    // Merge our runs (without writing anything) to count what they hold
+    if(ht->spill && ht->spill->count) {
+        if(__held_keys(ht) && __spill(ht) < 0)
+            return -1;
+        if(!ht->spill->merged && __merge(ht, NULL, NULL, 0, &tot) < 0)
+            return -1;
+
+        return ht->flushed + ht->spill->merged_count;
+    }
 
-    // Start with our ZINCRBY commands
-    tot = ht->z_cmds->members;
+    // Start with anything we've already flushed
+    tot = ht->flushed;
 
-    // The number of actual SADD commands can be greater than the 
-    // unique keys, if we have to break some of them into multiple
-    // commands due to the 1024*1024 argument max
-    for(i=0;i<ht->s_cmds->ksize;i++) {
-        key = ht->s_cmds->bucket[i];
-        while(key != NULL) {
-            tot += ceil((double)key->count/(ARG_MAX-2));
-            key=key->next;
+    for(i=0;i<TYPE_COUNT;i++) {
+        if(g_types[i].layout != LAYOUT_SET &&
+           (i != TYPE_ZINCRBY || !ht->zadd_batch))
+        {
+            tot += ht->cmds[i]->members;
+            continue;
+        }
+
+        cmdTableIterInit(&it, &ht->cmds[i]->keytable);
+        while((key = cmdTableNext(&it)) != NULL) {
+            tot += __key_cmd_count(ht, key, i);
         }
     }
 
@@ -613,7 +2152,253 @@ unsigned int cmdHashGetCount(cmdHash *ht) {
     return tot;
 }
 
+size_t cmdHashMemory(cmdHash *ht) {
+    cmdHashContainer *c;
+    size_t tot = 0;
+    int i;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        c = ht->cmds[i];
+        tot += c->arena.bytes + c->table_bytes + c->heap_bytes;
+
+        // Most containers never fill their first slab, and the pages we
+        // haven't handed out yet aren't really ours
+        if(c->arena.slab)
+            tot -= c->arena.slab->size - c->arena.slab->used;
+    }
+
+    return tot + cmdInternMemory(&ht->intern);
+}
+
+void cmdHashGetStats(cmdHash *ht, cmdHashStats *stats) {
+    cmdHashContainer *c;
+    cmdTableIter it;
+    cmdKeyList *key;
+    int i;
+
+    memset(stats, 0, sizeof(cmdHashStats));
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        c = ht->cmds[i];
+
+        stats->keys += c->keys;
+        stats->members += c->members;
+        stats->allocs += c->allocs + c->arena.allocs;
+        stats->key_probes += cmdTableProbes(&c->keytable, &stats->key_probe_max);
+
+        cmdTableIterInit(&it, &c->keytable);
+        while((key = cmdTableNext(&it)) != NULL) {
+            stats->member_probes += cmdTableProbes(&key->members, &stats->member_probe_max);
+        }
+    }
+
+    stats->strings = ht->intern.count - ht->intern.nfree;
+    stats->allocs += ht->intern.allocs + ht->intern.arena.allocs;
+    stats->memory = cmdHashMemory(ht);
+    stats->flushed = ht->flushed;
+    stats->spilled = ht->spill ? ht->spill->written : 0;
+}
+
+void cmdHashSketchInit(cmdHashSketch *sk) {
+    int i;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        cmdHllInit(&sk->keys[i]);
+        cmdHllInit(&sk->members[i]);
+    }
+}
+
+cmdType cmdHashSketchAdd(cmdHashSketch *sk, int argc, const char **argv,
+                         const size_t *argvlen)
+{
+    const cmdAggregator *a;
+    int i, first, step;
+    uint64_t hash;
+
+    if((a = __get_aggregator(argc, argv, argvlen)) == NULL)
+        return TYPE_UNSUPPORTED;
+
+    hash = GET_HASH(argv[1], argvlen[1]);
+    cmdHllAdd(&sk->keys[a->type], hash);
+
+    switch(g_types[a->type].layout) {
+        case LAYOUT_SET:
+            first = 2;
+            step = 1;
+            break;
+        case LAYOUT_SCORE:
+            first = 3;
+            step = 2;
+            break;
+        case LAYOUT_FIELD:
+            first = 2;
+            step = argc;
+            break;
+        default:
+            // Counters only ever have the one member
+            return a->type;
+    }
+
+    // Members are counted per key, so seed their hash with the key's
+    for(i=first;i<argc;i+=step) {
+        cmdHllAdd(&sk->members[a->type], wyhash(argv[i], argvlen[i], hash));
+    }
+
+    return a->type;
+}
+
+/**
+ * Slots a table needs to hold count items without growing
+ */
+static inline uint64_t __slots_for(uint64_t count) {
+    return (count * 100 + TABLE_MAX_LOAD - 1) / TABLE_MAX_LOAD;
+}
+
+int cmdHashPresize(cmdHash *ht, const cmdHashSketch *sk, unsigned int share) {
+    uint64_t keys, members, ksize, msize;
+    cmdHashContainer *c;
+    int i;
+
+    if(share < 1)
+        return -1;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        c = ht->cmds[i];
+
+        if(c->keys)
+            return -1;
+
+        keys = (cmdHllCount(&sk->keys[i]) + share - 1) / share;
+        members = (cmdHllCount(&sk->members[i]) + share - 1) / share;
+
+        ksize = __slots_for(keys);
+        if(ksize > TABLE_MAX_SIZE)
+            ksize = TABLE_MAX_SIZE;
+
+        // Give each key room for the average number of members
+        msize = keys ? __slots_for((members + keys - 1) / keys) : TABLE_MIN_SIZE;
+        if(msize > __slots_for(PRESIZE_MAX_MEMBERS))
+            msize = __slots_for(PRESIZE_MAX_MEMBERS);
+
+        cmdTableFree(&c->keytable);
+        if(cmdTableInit(&c->keytable, ksize) < 0)
+            return -1;
+
+        c->ksize = ksize;
+        if(g_types[i].layout != LAYOUT_VALUE)
+            c->msize = msize;
+
+        c->allocs++;
+        c->table_bytes = cmdTableMemory(&c->keytable);
+    }
+
+    return 0;
+}
+
+int cmdHashSetWindow(cmdHash *ht, uint64_t window, cmdBuffer *out) {
+    int i;
+
+    // Keys that came from our arena can't be freed one at a time
+    if(!window || !out)
+        return -1;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        if(ht->cmds[i]->keys)
+            return -1;
+    }
+
+    ht->window = window;
+    ht->out = out;
+    ht->has_out = 1;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        ht->cmds[i]->heap = 1;
+    }
+    ht->intern.heap = 1;
+
+    return 0;
+}
+
+int cmdHashSetOrdered(cmdHash *ht, cmdBuffer *out) {
+    int i;
+
+    // Spilled keys can't be flushed on their own
+    if(ht->spill || ht->zadd_batch || __held_keys(ht))
+        return -1;
+
+    ht->ordered = 1;
+    ht->out = out;
+    ht->has_out = 1;
+
+    for(i=0;i<TYPE_COUNT;i++) {
+        ht->cmds[i]->heap = 1;
+    }
+    ht->intern.heap = 1;
+
+    return 0;
+}
+
+int cmdHashSetOutput(cmdHash *ht, cmdBuffer *out) {
+    ht->out = out;
+    ht->has_out = 1;
 
+    return 0;
+}
+
+int cmdHashSetZaddBatch(cmdHash *ht, unsigned int args) {
+    // We need room for the key and at least one score and member.  Keys we
+    // flush early can come back, and a second ZADD would replace the first.
+    if(args < 4 || args > ARG_MAX || ht->window || ht->ordered)
+        return -1;
+
+    ht->zadd_batch = args;
+
+    return 0;
+}
+
+int cmdHashSetOrder(cmdHash *ht, cmdOrder order) {
+    if(ht->spill || order < ORDER_TABLE || order > ORDER_SEEN)
+        return -1;
+
+    ht->order = order;
+
+    return 0;
+}
+
+int cmdHashSetSplit(cmdHash *ht, cmdBuffer **outs, const uint16_t *map) {
+    if(!outs || !map)
+        return -1;
 
+    ht->split = outs;
+    ht->split_map = map;
 
+    return 0;
+}
+
+/**
+ * Leave keys we've written out, and now pass through, out of our merges
+ */
+static int __skip_passed(void *arg, const cmdSpillRecord *rec, const char *key) {
+    cmdHashContainer *c = ((cmdHash *)arg)->passed[TYPE_CLASS(rec->type)];
+
+    return c->keys && __have_key(c, key, rec->len, rec->hash) != NULL;
+}
+
+int cmdHashSetMemoryLimit(cmdHash *ht, size_t bytes, const char *dir) {
+    // Merged runs come out in the order they were sorted in
+    if(ht->ordered || ht->order != ORDER_TABLE)
+        return -1;
+
+    // Anything smaller would spill on nearly every command
+    ht->max_memory = bytes < SPILL_MIN_MEMORY ? SPILL_MIN_MEMORY : bytes;
+
+    if(!ht->spill) {
+        if((ht->spill = cmdSpillCreate(dir, ht->max_memory)) == NULL)
+            return -1;
 
+        ht->spill->skip = __skip_passed;
+        ht->spill->skip_arg = ht;
+    }
+
+    return 0;
+}
@@ -6,55 +6,107 @@
 #include <string.h>
 #include <stdio.h>
 
+#include "arena.h"
+#include "buffer.h"
+#include "hll.h"
+#include "intern.h"
+#include "table.h"
+
 #define CMD_ZINCRBY "ZINCRBY"
+#define CMD_ZADD    "ZADD"
 #define CMD_SADD    "SADD"
+#define CMD_PFADD   "PFADD"
+#define CMD_INCRBY  "INCRBY"
+#define CMD_INCRBYFLOAT "INCRBYFLOAT"
+#define CMD_HINCRBY "HINCRBY"
+#define CMD_HINCRBYFLOAT "HINCRBYFLOAT"
 
 #define ARG_MAX 1024*1024
 
 /**
- * Initial buffer allocation size
+ * How many aggregated commands go by between looking for cold keys
  */
-#define BUF_INIT_ALLOC 32768
+#define WINDOW_CHECK 1024
 
 /**
- * Maximum preallocation size
+ * Most members we'll size each key's table for up front.  We go by the
+ * average across keys, which a handful of huge keys can push well past
+ * what the rest need.
  */
-#define BUF_MAX_PREALLOC (1024*1024)
+#define PRESIZE_MAX_MEMBERS 1024
+
+struct _cmdSpill;
 
 /**
- * For now we'll support ZINCRBY and SADD
+ * The kinds of aggregate we keep, each in its own container.  Some of them
+ * are fed by more than one command: ZADD and ZINCRBY both go into sorted
+ * set scores, and INCR, DECR and DECRBY are all INCRBY.
  */
 typedef enum _cmdType {
     TYPE_ZINCRBY,
     TYPE_SADD,
+    TYPE_PFADD,
+    TYPE_INCRBY,
+    TYPE_INCRBYFLOAT,
+    TYPE_HINCRBY,
+    TYPE_HINCRBYFLOAT,
     TYPE_UNSUPPORTED
 } cmdType;
 
 /**
- * Leaf linked list to store members for SADD
- * aggregation or members and scores for
- * ZINCRBY commands.
+ * Number of containers each cmdHash has
+ */
+#define TYPE_COUNT TYPE_UNSUPPORTED
+
+/**
+ * The float form of a counter holds the same keys in Redis as the integer
+ * form before it, which refuses to increment a key holding a float.  A key
+ * is only ever held by one of the two, and runs sort the pair as one type.
+ */
+#define TYPE_CLASS(t) \
+    ((t) == TYPE_INCRBYFLOAT || (t) == TYPE_HINCRBYFLOAT ? (t) - 1 : (t))
+
+/**
+ * Orders we can write aggregated keys in.  By default it's wherever our
+ * tables happen to have put them.  Otherwise it's by Redis Cluster slot,
+ * by key (every key's commands together, the same way from one run to the
+ * next), or in the order keys were first seen.  Commands for the same key
+ * in different containers stay together in the first two, ordered by type.
+ */
+typedef enum _cmdOrder {
+    ORDER_TABLE,
+    ORDER_SLOT,
+    ORDER_KEY,
+    ORDER_SEEN
+} cmdOrder;
+
+/**
+ * Member flags.  A member that has been ZADDed has an absolute score that
+ * later ZINCRBYs add to, rather than an increment.
+ */
+#define MEMBER_SET 1
+
+/**
+ * Leaf node to store members for SADD and PFADD, scores for sorted sets,
+ * fields of hashes, or the value of a counter (as a member with an empty
+ * name).  The member itself is interned, and we just keep its id.
  */
 typedef struct _cmdMemberList {
     /**
-     * Member and member length
+     * Member id and flags
      */
-    char *member;
-    size_t len;
+    uint32_t id;
+    uint32_t flags;
 
     /**
-     * Score for ZINCRBY type commands, and
-     * a hit count for SADD commands.
+     * Score or float increment, integer increment, or a hit count for
+     * set members.
      */
     union {
         double score;
+        long long value;
         unsigned int hits;
     };
-
-    /**
-     * Pointer to next element
-     */
-    struct _cmdMemberList *next;
 } cmdMemberList;
 
 /**
@@ -62,25 +114,34 @@ typedef struct _cmdMemberList {
  */
 typedef struct _cmdKeyList {
     /**
-     * Key and length
+     * Key hash and length
      */
-    char *key;
+    uint64_t hash;
     size_t len;
 
     /**
-     * Number of members for this key
+     * Number of members for this key, and when (counting keys across every
+     * container) it was first seen
      */
     unsigned int count;
+    uint32_t seen;
 
     /**
-     * Member hash table
+     * Neighbours in our container's recency list, and the tick this key
+     * was last touched at (only maintained when keys come from the heap).
      */
-    cmdMemberList **bucket;
+    struct _cmdKeyList *prev, *next;
+    uint64_t touched;
 
     /**
-     * Next key
+     * Member hash table, sized for this key's members
      */
-    struct _cmdKeyList *next;
+    cmdTable members;
+
+    /**
+     * Key itself, stored inline after the node
+     */
+    char key[];
 } cmdKeyList;
 
 /**
@@ -89,10 +150,15 @@ typedef struct _cmdKeyList {
  */
 typedef struct _cmdHashContainer {
     /**
-     * Size of the key and member hash tables
+     * Initial size of the key and member hash tables
      */
     unsigned int ksize, msize;
 
+    /**
+     * Whether our members hold integers rather than doubles
+     */
+    int integer;
+
     /**
      * Key, member count
      */
@@ -104,40 +170,251 @@ typedef struct _cmdHashContainer {
      */
     unsigned int str_len;
 
+    /**
+     * Calls we've made to the allocator (other than our arena's, which
+     * counts its own) since we were created or cleared
+     */
+    uint64_t allocs;
+
     /**
      * Command hash itself
      */
-    cmdKeyList **bucket;
+    cmdTable keytable;
+
+    /**
+     * Bytes of slots in our key table and every key's member table
+     */
+    size_t table_bytes;
+
+    /**
+     * The last key we looked up, since the same key often appears in a
+     * run of consecutive commands.
+     */
+    cmdKeyList *last;
+
+    /**
+     * Arena that every key and member is allocated from, so they can all
+     * be released at once.
+     */
+    cmdArena arena;
+
+    /**
+     * Where our member strings are, which we share with every other
+     * container in our cmdHash
+     */
+    cmdIntern *intern;
+
+    /**
+     * When cold keys are flushed the arena can't give their memory back, so
+     * keys and members come from the heap instead.  We track those bytes
+     * along with most (head) and least (tail) recently touched keys.
+     */
+    int heap;
+    size_t heap_bytes;
+    cmdKeyList *head, *tail;
 } cmdHashContainer;
 
 /**
- * Our command hash object which can be used to aggregate
- * ZINCRBY and SADD commands.
+ * Our command hash object which can be used to aggregate any of the
+ * commands in cmdType.
  */
 typedef struct _cmdHash {
     /**
-     * Aggregated SADD commands, with info
+     * One container for each type of aggregate
+     */
+    cmdHashContainer *cmds[TYPE_COUNT];
+
+    /**
+     * Every distinct member string any of our containers holds
      */
-    cmdHashContainer *s_cmds;
+    cmdIntern intern;
 
     /**
-     * Aggregated ZINCRBY commands, with info
+     * How much memory we may hold before spilling what we have to disk,
+     * and the runs we've spilled so far.
      */
-    cmdHashContainer *z_cmds;
+    size_t max_memory;
+    struct _cmdSpill *spill;
 
     /**
-     * Internal buffer storage for protocol generation
+     * Keys that go this many aggregated commands without being touched are
+     * written to out and dropped.  Commands written that way are counted in
+     * flushed.
      */
-    char *_buf;
-    size_t _size;
-    size_t _len;
+    uint64_t window;
+    uint64_t tick;
+    cmdBuffer *out;
+    unsigned int flushed;
+
+    /**
+     * Most arguments in each variadic ZADD we write sorted set members as,
+     * or zero to write a ZINCRBY for each of them.
+     */
+    unsigned int zadd_batch;
+
+    /**
+     * Whether commands we don't aggregate act as barriers, flushing the
+     * keys they touch ahead of themselves (to out, when it's set).
+     */
+    int ordered;
+
+    /**
+     * Set once we've been given an out (even a NULL one, to just count what
+     * we'd write), so keys can be written out ahead of an increment that
+     * would overflow them, rather than having it passed through first.
+     */
+    int has_out;
+
+    /**
+     * Keys we've written out ahead of an increment that would overflow
+     * them, by TYPE_CLASS.  Only Redis knows what they hold from then on,
+     * so every later command for them is passed through as it is.
+     */
+    cmdHashContainer *passed[TYPE_COUNT];
+
+    /**
+     * Order we write what we're holding in, and how many keys we've seen
+     */
+    cmdOrder order;
+    uint32_t seen;
+
+    /**
+     * Buffers we split what we write between by cluster slot, and which of
+     * them each slot goes to, if we're splitting our output
+     */
+    cmdBuffer **split;
+    const uint16_t *split_map;
 } cmdHash;
 
+/**
+ * A snapshot of what a cmdHash is holding, and how well its tables are
+ * doing.  Strings are the distinct member strings every member shares, and
+ * probe counts are the slots we'd look at to find every key (or
+ * every member of every key), so dividing by keys (or members) gives the
+ * average, and the max is the longest run any one of them sits at the end
+ * of.  These cover what we hold right now, so they don't include keys
+ * we've already flushed or spilled.
+ */
+typedef struct _cmdHashStats {
+    uint64_t keys;
+    uint64_t members;
+    uint64_t strings;
+
+    uint64_t key_probes;
+    uint32_t key_probe_max;
+    uint64_t member_probes;
+    uint32_t member_probe_max;
+
+    uint64_t allocs;
+    size_t memory;
+
+    unsigned int flushed;
+    unsigned int spilled;
+} cmdHashStats;
+
+/**
+ * Estimates of how many distinct keys each container will see, and how
+ * many distinct members across all of those keys.
+ */
+typedef struct _cmdHashSketch {
+    cmdHll keys[TYPE_COUNT];
+    cmdHll members[TYPE_COUNT];
+} cmdHashSketch;
+
 cmdHash *cmdHashCreate(unsigned int ksize, unsigned int msize);
 
 int cmdHashFree(cmdHash *ht);
-int cmdHashAdd(cmdHash  *ht, redisReply *reply);
-int cmdHashGetCommands(cmdHash *ht, char **ret, size_t *len);
+
+// Drop everything we've aggregated (and any runs we've spilled), keeping
+// our tables and arenas at the size they grew to, along with our settings
+int cmdHashReset(cmdHash *ht);
+
+int cmdHashAdd(cmdHash *ht, int argc, const char **argv,
+               const size_t *argvlen);
+cmdType cmdHashGetType(int argc, const char **argv, const size_t *argvlen);
+int cmdHashGetCommands(cmdHash *ht, cmdBuffer *out);
 unsigned cmdHashGetCount(cmdHash *ht);
 
+// Approximate bytes held for our aggregated commands
+size_t cmdHashMemory(cmdHash *ht);
+
+// Add a command to a sketch, without aggregating it.  Returns the type of
+// aggregate it would go into, or TYPE_UNSUPPORTED.
+void cmdHashSketchInit(cmdHashSketch *sk);
+cmdType cmdHashSketchAdd(cmdHashSketch *sk, int argc, const char **argv,
+                         const size_t *argvlen);
+
+// Size each container's key table, and the member table each of its keys
+// starts with, for its share (one in share) of what a sketch estimates.
+// This must be done before anything is added.
+int cmdHashPresize(cmdHash *ht, const cmdHashSketch *sk, unsigned int share);
+
+// Take a snapshot of our statistics.  This walks every table, so it's meant
+// for the end of a run rather than the middle of one.
+void cmdHashGetStats(cmdHash *ht, cmdHashStats *stats);
+
+// Write out and drop keys once window aggregated commands have gone by
+// without touching them.  This must be set before anything is added.
+int cmdHashSetWindow(cmdHash *ht, uint64_t window, cmdBuffer *out);
+
+// Keep commands we don't aggregate in order with the ones we do, by
+// calling cmdHashBarrier before passing each of them through.  Flushed keys
+// are written to out, or just counted if it's NULL.
+int cmdHashSetOrdered(cmdHash *ht, cmdBuffer *out);
+int cmdHashBarrier(cmdHash *ht, int argc, const char **argv,
+                   const size_t *argvlen);
+
+// Write keys out to out (or just count them if it's NULL) when an increment
+// would overflow them, so the increment, and every command for the key
+// after it, can be passed through behind them.  Without this, a memory
+// limit to spill with starts the key over, and failing that the increment
+// is passed through first.
+int cmdHashSetOutput(cmdHash *ht, cmdBuffer *out);
+
+// Index of the first key a command touches, or zero if it doesn't touch
+// any.  Commands we don't know are taken to have their key first.
+int cmdHashFirstKey(int argc, const char **argv, const size_t *argvlen);
+
+// Where the keys are in a command that's the same thing done to each of
+// them (like DEL or MSET), so it can be split into one command per key
+// along with the arguments that follow it.  Returns -1 for anything else.
+int cmdHashGetKeyStep(int argc, const char **argv, const size_t *argvlen,
+                      int *first, int *step);
+
+// Write sorted set members as ZADDs of up to args arguments each, which is
+// only right if their keys don't already exist wherever we're replayed.  It
+// can't be used along with a flush window.
+int cmdHashSetZaddBatch(cmdHash *ht, unsigned int args);
+
+// Write what we're holding in a given order, rather than wherever our tables
+// put it.  Keys flushed along the way still come out as they're flushed.
+// This can't be used along with a memory limit.
+int cmdHashSetOrder(cmdHash *ht, cmdOrder order);
+
+// Write what several hashes (with the same settings, and keys that don't
+// overlap) are holding in their order, as if it were all in one.
+int cmdHashGetCommandsSorted(cmdHash **hts, unsigned int count, cmdBuffer *out);
+
+// Write each key to the buffer its cluster slot maps to (in a map of
+// CLUSTER_SLOTS entries), rather than whichever one we're writing to.
+// Buffers flushed keys go to are split the same way.
+int cmdHashSetSplit(cmdHash *ht, cmdBuffer **outs, const uint16_t *map);
+
+// Save what we're holding to a file, as the sorted records a spilled run
+// holds, and add what a buffer of those records holds to what we have.
+// Loaded values are combined with ours as if they'd come after them.
+int cmdHashSave(cmdHash *ht, FILE *fd);
+int cmdHashLoad(cmdHash *ht, const char *buf, size_t len);
+
+// Add everything src is holding to dst, as if src's commands had come after
+// dst's.  src can't have spilled, and is left as it was.  If dst passes one
+// of src's keys through, or can't take src's part of one (a counter would
+// overflow, or a score come out as one Redis rejects), we return 1 without
+// adding anything, and src's commands have to be added one by one instead.
+int cmdHashMerge(cmdHash *dst, cmdHash *src);
+
+// Spill what we're holding to a sorted run file in dir whenever it passes
+// bytes.  Runs are merged back together when we get our commands.
+int cmdHashSetMemoryLimit(cmdHash *ht, size_t bytes, const char *dir);
+
 #endif
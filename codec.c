@@ -0,0 +1,540 @@
+/**
+ * Reading and writing our buffer files compressed with gzip, zstd or lz4
+ */
+
+#include "codec.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+static const cmdCodecInfo g_codecs[CODEC_COUNT] = {
+    [CODEC_NONE] = { "none", "",     0, 0,  1 },
+    [CODEC_GZIP] = { "gzip", ".gz",  0, 9,  1 },
+#ifdef HAVE_ZSTD
+    [CODEC_ZSTD] = { "zstd", ".zst", 1, 19, 1 },
+#else
+    [CODEC_ZSTD] = { "zstd", ".zst", 1, 19, 0 },
+#endif
+#ifdef HAVE_LZ4
+    [CODEC_LZ4]  = { "lz4",  ".lz4", 0, 12, 1 },
+#else
+    [CODEC_LZ4]  = { "lz4",  ".lz4", 0, 12, 0 },
+#endif
+};
+
+const cmdCodecInfo *cmdCodecGetInfo(cmdCodec codec) {
+    return &g_codecs[codec];
+}
+
+cmdCodec cmdCodecByName(const char *name) {
+    cmdCodec i;
+
+    for(i=0;i<CODEC_COUNT;i++) {
+        if(!strcasecmp(name, g_codecs[i].name))
+            break;
+    }
+
+    return i;
+}
+
+cmdCodec cmdCodecDetect(const unsigned char *magic, size_t len) {
+    if(len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return CODEC_GZIP;
+
+    // Both frame formats start with a little endian magic number
+    if(len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+       magic[3] == 0xfd)
+    {
+        return CODEC_ZSTD;
+    }
+
+    if(len >= 4 && magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d &&
+       magic[3] == 0x18)
+    {
+        return CODEC_LZ4;
+    }
+
+    return CODEC_NONE;
+}
+
+size_t cmdCodecExtLen(const char *name, size_t len) {
+    size_t ext;
+    int i;
+
+    for(i=CODEC_GZIP;i<CODEC_COUNT;i++) {
+        ext = strlen(g_codecs[i].ext);
+
+        if(len > ext && !memcmp(name + len - ext, g_codecs[i].ext, ext))
+            return ext;
+    }
+
+    return 0;
+}
+
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+/**
+ * Read the next stretch of compressed input, returning how much we read
+ */
+static ssize_t __fill(codecReader *r) {
+    ssize_t n;
+
+    do {
+        n = read(r->fd, r->buf, CODEC_READ_SIZE);
+    } while(n < 0 && errno == EINTR);
+
+    if(n > 0) {
+        r->len = n;
+        r->pos = 0;
+    }
+
+    return n;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static ssize_t __zstd_read(codecReader *r, char *buf, size_t len) {
+    ZSTD_outBuffer out = { buf, len, 0 };
+    ZSTD_inBuffer in;
+    size_t rv, before;
+    ssize_t n;
+
+    for(;;) {
+        in.src = r->buf;
+        in.size = r->len;
+        in.pos = r->pos;
+        before = out.pos;
+
+        // This may just flush output it's holding from last time
+        rv = ZSTD_decompressStream(r->dctx, &out, &in);
+        if(ZSTD_isError(rv))
+            return -1;
+
+        if(in.pos > r->pos || out.pos > before)
+            r->partial = rv != 0;
+
+        r->pos = in.pos;
+
+        // Frames end part way through our input, and the next one starts
+        // wherever they do
+        if(out.pos == out.size)
+            break;
+        if(r->pos < r->len)
+            continue;
+
+        if((n = __fill(r)) < 0)
+            return -1;
+        if(n == 0)
+            break;
+    }
+
+    return out.pos || !r->partial ? (ssize_t)out.pos : -1;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static ssize_t __lz4_read(codecReader *r, char *buf, size_t len) {
+    size_t rv, dst, src, done = 0;
+    ssize_t n;
+
+    for(;;) {
+        dst = len - done;
+        src = r->len - r->pos;
+
+        rv = LZ4F_decompress(r->dctx, buf + done, &dst, r->buf + r->pos, &src, NULL);
+        if(LZ4F_isError(rv))
+            return -1;
+
+        if(src || dst)
+            r->partial = rv != 0;
+
+        r->pos += src;
+        done += dst;
+
+        if(done == len)
+            break;
+        if(r->pos < r->len)
+            continue;
+
+        if((n = __fill(r)) < 0)
+            return -1;
+        if(n == 0)
+            break;
+    }
+
+    return done || !r->partial ? (ssize_t)done : -1;
+}
+#endif
+
+codecReader *codecReaderOpen(const char *path) {
+    unsigned char magic[4];
+    codecReader *r;
+    ssize_t n;
+#ifdef HAVE_LZ4
+    LZ4F_dctx *dctx;
+#endif
+
+    if((r = calloc(1, sizeof(codecReader))) == NULL)
+        return NULL;
+
+    if((r->fd = open(path, O_RDONLY)) < 0) {
+        free(r);
+        return NULL;
+    }
+
+    // Pipes and the like can't be peeked at, so they're left to zlib
+    n = pread(r->fd, magic, sizeof(magic), 0);
+    r->codec = cmdCodecDetect(magic, n > 0 ? n : 0);
+
+    if(r->codec == CODEC_NONE || r->codec == CODEC_GZIP) {
+        // zlib owns our descriptor from here on
+        if((r->gz = gzdopen(r->fd, "r")) == NULL) {
+            codecReaderClose(r);
+            return NULL;
+        }
+
+        r->fd = -1;
+
+        return r;
+    }
+
+    if((r->buf = malloc(CODEC_READ_SIZE)) == NULL) {
+        codecReaderClose(r);
+        return NULL;
+    }
+
+    switch(r->codec) {
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD:
+            // Long distance matching can look back further than zstd
+            // decodes by default
+            if((r->dctx = ZSTD_createDCtx()) != NULL)
+                ZSTD_DCtx_setParameter(r->dctx, ZSTD_d_windowLogMax, sizeof(size_t) == 4 ? 30 : 31);
+            break;
+#endif
+#ifdef HAVE_LZ4
+        case CODEC_LZ4:
+            if(!LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+                r->dctx = dctx;
+            break;
+#endif
+        default:
+            // We weren't built with whatever it was compressed with
+            break;
+    }
+
+    if(r->dctx == NULL) {
+        codecReaderClose(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+ssize_t codecReaderRead(codecReader *r, char *buf, size_t len) {
+    switch(r->codec) {
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD:
+            return __zstd_read(r, buf, len);
+#endif
+#ifdef HAVE_LZ4
+        case CODEC_LZ4:
+            return __lz4_read(r, buf, len);
+#endif
+        default:
+            return gzread(r->gz, buf, len > INT32_MAX ? INT32_MAX : len);
+    }
+}
+
+int codecReaderSkip(codecReader *r, uint64_t len) {
+    char *buf;
+    ssize_t n = 0;
+
+    if(!len)
+        return 0;
+
+    if((buf = malloc(CODEC_READ_SIZE)) == NULL)
+        return -1;
+
+    // Everything has to be decompressed to get past it anyway, and this way
+    // we know if there wasn't that much
+    while(len && (n = codecReaderRead(r, buf, len < CODEC_READ_SIZE ? len : CODEC_READ_SIZE)) > 0)
+        len -= n;
+
+    free(buf);
+
+    return len ? -1 : 0;
+}
+
+void codecReaderClose(codecReader *r) {
+    if(!r)
+        return;
+
+    if(r->gz)
+        gzclose(r->gz);
+    if(r->fd >= 0)
+        close(r->fd);
+
+#ifdef HAVE_ZSTD
+    if(r->codec == CODEC_ZSTD)
+        ZSTD_freeDCtx(r->dctx);
+#endif
+#ifdef HAVE_LZ4
+    if(r->codec == CODEC_LZ4 && r->dctx)
+        LZ4F_freeDecompressionContext(r->dctx);
+#endif
+
+    free(r->buf);
+    free(r);
+}
+
+#ifdef HAVE_ZSTD
+static int __zstd_create(codecWriter *w, int level, unsigned int threads, int long_window) {
+    ZSTD_CCtx *c;
+
+    if((w->cctx = c = ZSTD_createCCtx()) == NULL)
+        return -1;
+
+    w->out_size = ZSTD_CStreamOutSize();
+
+    if(ZSTD_isError(ZSTD_CCtx_setParameter(c, ZSTD_c_compressionLevel,
+                                           level < 0 ? ZSTD_CLEVEL_DEFAULT : level)) ||
+       ZSTD_isError(ZSTD_CCtx_setParameter(c, ZSTD_c_checksumFlag, 1)))
+    {
+        return -1;
+    }
+
+    // A zstd built without threads refuses workers, and compresses on
+    // whichever thread writes to us instead
+    if(threads > 1)
+        ZSTD_CCtx_setParameter(c, ZSTD_c_nbWorkers, threads);
+
+    if(long_window &&
+       (ZSTD_isError(ZSTD_CCtx_setParameter(c, ZSTD_c_enableLongDistanceMatching, 1)) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(c, ZSTD_c_windowLog, CODEC_ZSTD_LONG_WINDOW))))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Compress data (or finish our frame), writing out whatever zstd gives us
+ */
+static int __zstd_write(codecWriter *w, const char *buf, size_t len, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer in = { buf, len, 0 };
+    ZSTD_outBuffer out;
+    size_t rv;
+
+    do {
+        out.dst = w->out;
+        out.size = w->out_size;
+        out.pos = 0;
+
+        rv = ZSTD_compressStream2(w->cctx, &out, &in, mode);
+
+        if(ZSTD_isError(rv) || (out.pos && fwrite(w->out, 1, out.pos, w->fd) != out.pos))
+            return -1;
+    } while(mode == ZSTD_e_end ? rv != 0 : in.pos < in.size);
+
+    return 0;
+}
+#endif
+
+#ifdef HAVE_LZ4
+/**
+ * How much we hand lz4 at a time, which bounds how much output each call
+ * can produce
+ */
+#define LZ4_CHUNK_SIZE (1024*1024)
+
+typedef struct _codecLz4 {
+    LZ4F_cctx *cctx;
+    LZ4F_preferences_t prefs;
+} codecLz4;
+
+static int __lz4_create(codecWriter *w, int level) {
+    codecLz4 *z;
+
+    if((w->cctx = z = calloc(1, sizeof(codecLz4))) == NULL)
+        return -1;
+
+    if(LZ4F_isError(LZ4F_createCompressionContext(&z->cctx, LZ4F_VERSION))) {
+        z->cctx = NULL;
+        return -1;
+    }
+
+    z->prefs.compressionLevel = level < 0 ? 0 : level;
+    z->prefs.frameInfo.blockSizeID = LZ4F_max1MB;
+    z->prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+
+    // Room for the most any one call can write, a frame header included
+    w->out_size = LZ4F_compressBound(LZ4_CHUNK_SIZE, &z->prefs) + LZ4F_HEADER_SIZE_MAX;
+
+    return 0;
+}
+
+static int __lz4_write(codecWriter *w, const char *buf, size_t len) {
+    codecLz4 *z = w->cctx;
+    size_t n, rv;
+
+    if(!w->started) {
+        rv = LZ4F_compressBegin(z->cctx, w->out, w->out_size, &z->prefs);
+        if(LZ4F_isError(rv) || fwrite(w->out, 1, rv, w->fd) != rv)
+            return -1;
+    }
+
+    while(len) {
+        n = len < LZ4_CHUNK_SIZE ? len : LZ4_CHUNK_SIZE;
+
+        rv = LZ4F_compressUpdate(z->cctx, w->out, w->out_size, buf, n, NULL);
+        if(LZ4F_isError(rv) || (rv && fwrite(w->out, 1, rv, w->fd) != rv))
+            return -1;
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int __lz4_finish(codecWriter *w) {
+    codecLz4 *z = w->cctx;
+    size_t rv;
+
+    rv = LZ4F_compressEnd(z->cctx, w->out, w->out_size, NULL);
+
+    return LZ4F_isError(rv) || fwrite(w->out, 1, rv, w->fd) != rv ? -1 : 0;
+}
+#endif
+
+codecWriter *codecWriterCreate(FILE *fd, cmdCodec codec, int level,
+                               unsigned int threads, int long_window)
+{
+    codecWriter *w;
+    int rv = -1;
+
+    // Which of these we use depends on the codecs we were built with
+    (void)level;
+    (void)threads;
+    (void)long_window;
+
+    if((w = calloc(1, sizeof(codecWriter))) == NULL)
+        return NULL;
+
+    w->codec = codec;
+    w->fd = fd;
+
+    switch(codec) {
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD:
+            rv = __zstd_create(w, level, threads, long_window);
+            break;
+#endif
+#ifdef HAVE_LZ4
+        case CODEC_LZ4:
+            rv = __lz4_create(w, level);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    if(rv < 0 || (w->out = malloc(w->out_size)) == NULL) {
+        codecWriterFree(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+int codecWriterWrite(codecWriter *w, const char *buf, size_t len) {
+    // Without zstd or lz4 there's nothing to write with
+    (void)buf;
+    (void)len;
+
+    if(w->err)
+        return -1;
+
+    switch(w->codec) {
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD:
+            w->err = __zstd_write(w, buf, len, ZSTD_e_continue) < 0;
+            break;
+#endif
+#ifdef HAVE_LZ4
+        case CODEC_LZ4:
+            w->err = __lz4_write(w, buf, len) < 0;
+            break;
+#endif
+        default:
+            w->err = 1;
+            break;
+    }
+
+    w->started = 1;
+
+    return w->err ? -1 : 0;
+}
+
+int codecWriterFinish(codecWriter *w) {
+    // There's no frame to finish if we haven't written anything
+    if(w->err || !w->started)
+        return w->err ? -1 : 0;
+
+    switch(w->codec) {
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD:
+            w->err = __zstd_write(w, NULL, 0, ZSTD_e_end) < 0;
+            break;
+#endif
+#ifdef HAVE_LZ4
+        case CODEC_LZ4:
+            w->err = __lz4_finish(w) < 0;
+            break;
+#endif
+        default:
+            w->err = 1;
+            break;
+    }
+
+    w->started = 0;
+
+    return w->err ? -1 : 0;
+}
+
+void codecWriterFree(codecWriter *w) {
+#ifdef HAVE_LZ4
+    codecLz4 *z;
+#endif
+
+    if(!w)
+        return;
+
+#ifdef HAVE_ZSTD
+    if(w->codec == CODEC_ZSTD)
+        ZSTD_freeCCtx(w->cctx);
+#endif
+#ifdef HAVE_LZ4
+    if(w->codec == CODEC_LZ4 && (z = w->cctx) != NULL) {
+        if(z->cctx)
+            LZ4F_freeCompressionContext(z->cctx);
+        free(z);
+    }
+#endif
+
+    free(w->out);
+    free(w);
+}
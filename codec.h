@@ -0,0 +1,135 @@
+#ifndef REDIS_CMD_CODEC_H
+#define REDIS_CMD_CODEC_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+/**
+ * Compression formats we read and write.  gzip is always there (and zlib
+ * reads uncompressed files too), while zstd and lz4 are only built in with
+ * HAVE_ZSTD and HAVE_LZ4.
+ */
+typedef enum _cmdCodec {
+    CODEC_NONE,
+    CODEC_GZIP,
+    CODEC_ZSTD,
+    CODEC_LZ4,
+    CODEC_COUNT
+} cmdCodec;
+
+/**
+ * How much compressed input we read at a time
+ */
+#define CODEC_READ_SIZE (128*1024)
+
+/**
+ * Pick a codec's default level
+ */
+#define CODEC_DEFAULT_LEVEL -1
+
+/**
+ * Log2 of the window zstd's long distance matching looks back over, which
+ * is what zstd --long uses
+ */
+#define CODEC_ZSTD_LONG_WINDOW 27
+
+/**
+ * What we know about each codec: its name, the extension its files get,
+ * the levels it takes, and whether we were built with it.
+ */
+typedef struct _cmdCodecInfo {
+    const char *name;
+    const char *ext;
+    int min_level;
+    int max_level;
+    int available;
+} cmdCodecInfo;
+
+/**
+ * Decompresses a file whichever codec it was written with, going by the
+ * magic bytes it starts with rather than its name
+ */
+typedef struct _codecReader {
+    cmdCodec codec;
+
+    /**
+     * zlib reads gzip and uncompressed files itself.  Otherwise we read
+     * compressed input from fd into buf, and decompress it with dctx.
+     */
+    gzFile gz;
+    int fd;
+    void *dctx;
+    unsigned char *buf;
+    size_t len, pos;
+
+    /**
+     * Set while we're part way through a frame, so we can tell a file
+     * that's been cut short from one that's simply ended
+     */
+    int partial;
+} codecReader;
+
+/**
+ * Compresses to a FILE* with zstd or lz4.  gzip output has writers of its
+ * own (zlib's, or pgzip's threads).
+ */
+typedef struct _codecWriter {
+    cmdCodec codec;
+    FILE *fd;
+    void *cctx;
+
+    /**
+     * Where compressed output collects before it's written
+     */
+    unsigned char *out;
+    size_t out_size;
+
+    /**
+     * Whether we've written anything since we last finished a frame
+     */
+    int started;
+
+    int err;
+} codecWriter;
+
+const cmdCodecInfo *cmdCodecGetInfo(cmdCodec codec);
+
+// Look a codec up by name, returning CODEC_COUNT if there's no such codec
+cmdCodec cmdCodecByName(const char *name);
+
+// The codec a file starting with these bytes was written with, or
+// CODEC_NONE if it doesn't look compressed
+cmdCodec cmdCodecDetect(const unsigned char *magic, size_t len);
+
+// Length of any compressed file extension name ends with
+size_t cmdCodecExtLen(const char *name, size_t len);
+
+// Open a file, working out how to decompress it
+codecReader *codecReaderOpen(const char *path);
+
+// Read up to len decompressed bytes, returning how many we read, 0 at the
+// end of our input, or -1 on an error
+ssize_t codecReaderRead(codecReader *r, char *buf, size_t len);
+
+// Skip over len decompressed bytes, returning -1 if there aren't that many
+int codecReaderSkip(codecReader *r, uint64_t len);
+
+void codecReaderClose(codecReader *r);
+
+// Start compressing to fd.  threads and long_window only apply to zstd.
+codecWriter *codecWriterCreate(FILE *fd, cmdCodec codec, int level,
+                               unsigned int threads, int long_window);
+
+// Compress data, writing it out as our buffer fills
+int codecWriterWrite(codecWriter *w, const char *buf, size_t len);
+
+// Finish the frame we're writing, so everything so far can be read back.
+// Anything we write after this starts another frame.
+int codecWriterFinish(codecWriter *w);
+
+// Free everything (without writing anything more)
+void codecWriterFree(codecWriter *w);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef REDIS_CMD_CRC16_H
+#define REDIS_CMD_CRC16_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Number of hash slots in a Redis Cluster
+ */
+#define CLUSTER_SLOTS 16384
+
+uint16_t crc16(const char *buf, size_t len);
+
+// The cluster slot a key lives in, honouring {hash tags}
+unsigned int crc16KeySlot(const char *key, size_t len);
+
+// Map every slot to one of count ranges, split the way redis-cli splits
+// slots between the masters of a cluster it creates.  The map needs room
+// for CLUSTER_SLOTS entries.
+void crc16SlotRanges(uint16_t *map, unsigned int count);
+
+#endif
@@ -0,0 +1,373 @@
+/**
+ * Shortest round-trip double formatting (Grisu2, after Florian Loitsch's
+ * "Printing Floating-Point Numbers Quickly and Accurately with Integers")
+ */
+
+#include "dtoa.h"
+
+/**
+ * IEEE 754 double layout
+ */
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS    (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT     (-DP_EXPONENT_BIAS)
+#define DP_EXPONENT_MASK    0x7FF0000000000000ULL
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_HIDDEN_BIT       0x0010000000000000ULL
+
+/**
+ * Integral values below this are printed exactly as integers
+ */
+#define DTOA_INT_LIMIT 9007199254740992.0
+
+/**
+ * A do-it-yourself floating point number, f * 2^e
+ */
+typedef struct _diyFp {
+    uint64_t f;
+    int e;
+} diyFp;
+
+/**
+ * Normalized 64 bit approximations of 10^k for k = -348, -340, ..., 340
+ */
+static const uint64_t g_pow10_f[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const int16_t g_pow10_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const uint64_t g_pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+static const char g_digits[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static inline diyFp __diyfp(uint64_t f, int e) {
+    diyFp r = { f, e };
+    return r;
+}
+
+static inline diyFp __diyfp_from_double(double d) {
+    uint64_t u;
+    int biased;
+
+    memcpy(&u, &d, sizeof(u));
+    biased = (int)((u & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+
+    // Subnormals have no hidden bit
+    if(biased)
+        return __diyfp((u & DP_SIGNIFICAND_MASK) + DP_HIDDEN_BIT,
+                       biased - DP_EXPONENT_BIAS);
+
+    return __diyfp(u & DP_SIGNIFICAND_MASK, DP_MIN_EXPONENT + 1);
+}
+
+static inline diyFp __diyfp_mul(diyFp x, diyFp y) {
+    unsigned __int128 p = (unsigned __int128)x.f * y.f;
+    uint64_t h = (uint64_t)(p >> 64), l = (uint64_t)p;
+
+    // Round to nearest
+    h += l >> 63;
+
+    return __diyfp(h, x.e + y.e + 64);
+}
+
+static inline diyFp __diyfp_normalize(diyFp x) {
+    int s = __builtin_clzll(x.f);
+    return __diyfp(x.f << s, x.e - s);
+}
+
+/**
+ * The boundaries m- and m+ halfway to v's neighbours, sharing m+'s exponent
+ */
+static inline void __boundaries(diyFp v, diyFp *minus, diyFp *plus) {
+    diyFp pl = __diyfp_normalize(__diyfp((v.f << 1) + 1, v.e - 1)), mi;
+
+    // The gap below a power of two is half the size of the one above it
+    if(v.f == DP_HIDDEN_BIT) {
+        mi = __diyfp((v.f << 2) - 1, v.e - 2);
+    } else {
+        mi = __diyfp((v.f << 1) - 1, v.e - 1);
+    }
+
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+
+    *minus = mi;
+    *plus = pl;
+}
+
+/**
+ * Find a cached 10^-k that brings a number with binary exponent e into
+ * the range [-60, -32] once multiplied.
+ */
+static inline diyFp __cached_power(int e, int *k) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk, idx;
+
+    if(dk - ik > 0.0)
+        ik++;
+
+    idx = (ik >> 3) + 1;
+    *k = -(-348 + idx * 8);
+
+    return __diyfp(g_pow10_f[idx], g_pow10_e[idx]);
+}
+
+static inline int __count_digits(uint32_t n) {
+    int d = 1;
+
+    while(d < 10 && n >= g_pow10[d])
+        d++;
+
+    return d;
+}
+
+/**
+ * Nudge the last digit down while that keeps us inside the rounding
+ * interval and closer to the real value.
+ */
+static inline void __grisu_round(char *buf, int len, uint64_t delta,
+                                 uint64_t rest, uint64_t ten_kappa,
+                                 uint64_t wp_w)
+{
+    while(rest < wp_w && delta - rest >= ten_kappa &&
+          (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w))
+    {
+        buf[len-1]--;
+        rest += ten_kappa;
+    }
+}
+
+static inline void __digit_gen(diyFp w, diyFp mp, uint64_t delta, char *buf,
+                               int *len, int *k)
+{
+    diyFp one = __diyfp(1ULL << -mp.e, mp.e);
+    uint64_t wp_w = mp.f - w.f, p2 = mp.f & (one.f - 1), rest;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e), d;
+    int kappa = __count_digits(p1);
+
+    *len = 0;
+
+    // Integral part
+    while(kappa > 0) {
+        d = p1 / (uint32_t)g_pow10[kappa-1];
+        p1 %= (uint32_t)g_pow10[kappa-1];
+        if(d || *len)
+            buf[(*len)++] = '0' + d;
+        kappa--;
+
+        rest = ((uint64_t)p1 << -one.e) + p2;
+        if(rest <= delta) {
+            *k += kappa;
+            __grisu_round(buf, *len, delta, rest,
+                          (uint64_t)g_pow10[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+
+    // Fractional part
+    for(;;) {
+        p2 *= 10;
+        delta *= 10;
+        d = (uint32_t)(p2 >> -one.e);
+        if(d || *len)
+            buf[(*len)++] = '0' + d;
+        p2 &= one.f - 1;
+        kappa--;
+
+        if(p2 < delta) {
+            *k += kappa;
+            wp_w *= -kappa < 20 ? g_pow10[-kappa] : 0;
+            __grisu_round(buf, *len, delta, p2, one.f, wp_w);
+            return;
+        }
+    }
+}
+
+/**
+ * Shortest digits of a positive, finite v such that v = digits * 10^k
+ */
+static inline int __grisu2(double v, char *buf, int *k) {
+    diyFp d = __diyfp_from_double(v), w, mi, pl, c;
+    int len;
+
+    __boundaries(d, &mi, &pl);
+    c = __cached_power(pl.e, k);
+
+    w = __diyfp_mul(__diyfp_normalize(d), c);
+    pl = __diyfp_mul(pl, c);
+    mi = __diyfp_mul(mi, c);
+
+    // Stay strictly inside the interval to make up for rounding in mul
+    mi.f++;
+    pl.f--;
+
+    __digit_gen(w, pl, pl.f - mi.f, buf, &len, k);
+
+    return len;
+}
+
+static inline int __write_exponent(int k, char *buf) {
+    char *p = buf;
+
+    if(k < 0) {
+        *p++ = '-';
+        k = -k;
+    }
+
+    if(k >= 100) {
+        *p++ = '0' + k / 100;
+        k %= 100;
+        memcpy(p, g_digits + k*2, 2);
+        p += 2;
+    } else if(k >= 10) {
+        memcpy(p, g_digits + k*2, 2);
+        p += 2;
+    } else {
+        *p++ = '0' + k;
+    }
+
+    return p - buf;
+}
+
+/**
+ * Lay out len digits scaled by 10^k the way %.17g would, minus the noise
+ */
+static inline int __prettify(char *buf, int len, int k) {
+    int kk = len + k, off, i;
+
+    if(k >= 0 && kk <= 21) {
+        // 1234e7 -> 12340000000
+        for(i = len; i < kk; i++)
+            buf[i] = '0';
+        return kk;
+    } else if(kk > 0 && kk <= 21) {
+        // 1234e-2 -> 12.34
+        memmove(buf + kk + 1, buf + kk, len - kk);
+        buf[kk] = '.';
+        return len + 1;
+    } else if(kk > -6 && kk <= 0) {
+        // 1234e-6 -> 0.001234
+        off = 2 - kk;
+        memmove(buf + off, buf, len);
+        buf[0] = '0';
+        buf[1] = '.';
+        for(i = 2; i < off; i++)
+            buf[i] = '0';
+        return len + off;
+    } else if(len == 1) {
+        // 1e30
+        buf[1] = 'e';
+        return 2 + __write_exponent(kk - 1, buf + 2);
+    }
+
+    // 1234e30 -> 1.234e33
+    memmove(buf + 2, buf + 1, len - 1);
+    buf[1] = '.';
+    buf[len + 1] = 'e';
+    return len + 2 + __write_exponent(kk - 1, buf + len + 2);
+}
+
+int dtoaUint(uint64_t v, char *buf) {
+    char tmp[DTOA_MAX_LEN], *p = tmp + sizeof(tmp);
+    int len;
+
+    // Two digits at a time from the right
+    while(v >= 100) {
+        p -= 2;
+        memcpy(p, g_digits + (v % 100) * 2, 2);
+        v /= 100;
+    }
+
+    if(v >= 10) {
+        p -= 2;
+        memcpy(p, g_digits + v * 2, 2);
+    } else {
+        *--p = '0' + v;
+    }
+
+    len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+
+    return len;
+}
+
+int dtoaDouble(double v, char *buf) {
+    char *p = buf;
+    int len, k;
+
+    // NaN is the only value that isn't equal to itself
+    if(v != v) {
+        memcpy(buf, "nan", 3);
+        return 3;
+    }
+
+    if(v < 0) {
+        *p++ = '-';
+        v = -v;
+    }
+
+    if(v == 0) {
+        // Drop the sign of negative zero
+        buf[0] = '0';
+        return 1;
+    } else if(v > 1.7976931348623157e308) {
+        memcpy(p, "inf", 3);
+        return (p - buf) + 3;
+    } else if(v < DTOA_INT_LIMIT && v == (double)(uint64_t)v) {
+        // Scores are very often whole numbers
+        return (p - buf) + dtoaUint((uint64_t)v, p);
+    }
+
+    len = __grisu2(v, p, &k);
+
+    return (p - buf) + __prettify(p, len, k);
+}
@@ -0,0 +1,25 @@
+#ifndef REDIS_DTOA_H
+#define REDIS_DTOA_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Largest string dtoaDouble will write (sign, 17 digits, point, exponent),
+ * and dtoaUint (twenty digits), rounded up.
+ */
+#define DTOA_MAX_LEN 32
+
+/**
+ * Write the shortest decimal string that strtod parses back to exactly v,
+ * using Grisu2 with a fast path for integral values.  Returns the number of
+ * bytes written to buf, which is not NUL terminated.
+ */
+int dtoaDouble(double v, char *buf);
+
+/**
+ * Write the decimal digits of v to buf, returning how many there were
+ */
+int dtoaUint(uint64_t v, char *buf);
+
+#endif
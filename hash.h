@@ -0,0 +1,94 @@
+#ifndef REDIS_CMD_HASH_FUNC_H
+#define REDIS_CMD_HASH_FUNC_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * 64-bit hash function based on wyhash (public domain, Wang Yi).  It
+ * consumes input eight bytes at a time using 64x64->128 bit multiplies,
+ * which is much faster than a byte at a time hash on long keys.
+ */
+
+#define WYHASH_SEED 0x9e3779b97f4a7c15ULL
+
+static const uint64_t _wyp[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static inline void _wymum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = *a;
+    r *= *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t _wymix(uint64_t a, uint64_t b) {
+    _wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t _wyr8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t _wyr4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t _wyr3(const uint8_t *p, size_t k) {
+    return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k-1];
+}
+
+static inline uint64_t wyhash(const void *key, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t a, b, see1, see2;
+    size_t i = len;
+
+    seed ^= _wymix(seed ^ _wyp[0], _wyp[1]);
+
+    if(__builtin_expect(len <= 16, 1)) {
+        if(__builtin_expect(len >= 4, 1)) {
+            a = (_wyr4(p) << 32) | _wyr4(p + ((len >> 3) << 2));
+            b = (_wyr4(p+len-4) << 32) | _wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if(__builtin_expect(len > 0, 1)) {
+            a = _wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if(__builtin_expect(i > 48, 0)) {
+            see1 = seed;
+            see2 = seed;
+            do {
+                seed = _wymix(_wyr8(p) ^ _wyp[1], _wyr8(p+8) ^ seed);
+                see1 = _wymix(_wyr8(p+16) ^ _wyp[2], _wyr8(p+24) ^ see1);
+                see2 = _wymix(_wyr8(p+32) ^ _wyp[3], _wyr8(p+40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while(__builtin_expect(i > 48, 1));
+            seed ^= see1 ^ see2;
+        }
+        while(__builtin_expect(i > 16, 0)) {
+            seed = _wymix(_wyr8(p) ^ _wyp[1], _wyr8(p+8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = _wyr8(p+i-16);
+        b = _wyr8(p+i-8);
+    }
+
+    a ^= _wyp[1];
+    b ^= seed;
+    _wymum(&a, &b);
+
+    return _wymix(a ^ _wyp[0] ^ len, b ^ _wyp[1]);
+}
+
+#endif
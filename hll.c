@@ -0,0 +1,26 @@
+/**
+ * HyperLogLog cardinality estimates
+ */
+
+#include "hll.h"
+
+#include <math.h>
+
+uint64_t cmdHllCount(const cmdHll *h) {
+    double m = HLL_REGISTERS, alpha = 0.7213 / (1 + 1.079 / m), sum = 0, est;
+    unsigned int i, zeros = 0;
+
+    for(i=0;i<HLL_REGISTERS;i++) {
+        sum += ldexp(1.0, -h->reg[i]);
+        if(!h->reg[i])
+            zeros++;
+    }
+
+    est = alpha * m * m / sum;
+
+    // Small counts are better served by counting empty registers
+    if(est <= 2.5 * m && zeros)
+        est = m * log(m / zeros);
+
+    return est + 0.5;
+}
@@ -0,0 +1,43 @@
+#ifndef REDIS_CMD_HLL_H
+#define REDIS_CMD_HLL_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Registers are picked by the top HLL_BITS of each hash.  4096 of them
+ * estimate to within a couple of percent, which is plenty for sizing
+ * tables.
+ */
+#define HLL_BITS 12
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+/**
+ * HyperLogLog estimate of how many distinct hashes we've been given.  It
+ * takes the same (well mixed, 64-bit) hashes our tables do, so nothing is
+ * hashed twice.
+ */
+typedef struct _cmdHll {
+    uint8_t reg[HLL_REGISTERS];
+} cmdHll;
+
+static inline void cmdHllInit(cmdHll *h) {
+    memset(h, 0, sizeof(cmdHll));
+}
+
+static inline void cmdHllAdd(cmdHll *h, uint64_t hash) {
+    uint32_t idx = hash >> (64 - HLL_BITS);
+    uint8_t rank;
+
+    // Leading zeros in what's left, plus one.  The bit we set keeps that
+    // bounded when everything else is zero.
+    rank = __builtin_clzll((hash << HLL_BITS) | (1ULL << (HLL_BITS - 1))) + 1;
+
+    if(rank > h->reg[idx])
+        h->reg[idx] = rank;
+}
+
+// Estimated number of distinct hashes added
+uint64_t cmdHllCount(const cmdHll *h);
+
+#endif
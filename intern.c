@@ -0,0 +1,182 @@
+/**
+ * Interned member strings, each stored once and referred to by id
+ */
+
+#include "intern.h"
+
+void cmdInternInit(cmdIntern *in) {
+    memset(in, 0, sizeof(cmdIntern));
+    cmdArenaInit(&in->arena);
+}
+
+/**
+ * Free every string we still hold when they came from the heap
+ */
+static void __free_strs(cmdIntern *in) {
+    uint32_t i;
+
+    if(!in->heap)
+        return;
+
+    for(i=0;i<in->count;i++) {
+        free(in->strs[i]);
+    }
+}
+
+void cmdInternFree(cmdIntern *in) {
+    __free_strs(in);
+
+    cmdTableFree(&in->table);
+    cmdArenaFree(&in->arena);
+    free(in->strs);
+    free(in->free);
+
+    cmdInternInit(in);
+}
+
+void cmdInternClear(cmdIntern *in) {
+    __free_strs(in);
+
+    cmdTableClear(&in->table);
+    cmdArenaReset(&in->arena);
+
+    in->count = in->nfree = 0;
+    in->heap_bytes = 0;
+    in->allocs = 0;
+}
+
+void cmdInternReset(cmdIntern *in) {
+    uint64_t allocs = in->allocs + in->arena.allocs;
+    int heap = in->heap;
+
+    cmdInternFree(in);
+
+    in->heap = heap;
+    in->allocs = allocs;
+}
+
+static int __match_str(const void *item, const char *str, size_t len) {
+    const cmdInternStr *s = item;
+    return s->len == len && !memcmp(s->str, str, len);
+}
+
+/**
+ * Pick an id for a new string, reusing a freed one if we can
+ */
+static int __next_id(cmdIntern *in, uint32_t *id) {
+    cmdInternStr **strs;
+    uint32_t size;
+
+    if(in->nfree) {
+        *id = in->free[--in->nfree];
+        return 0;
+    }
+
+    if(in->count == in->size) {
+        if(in->size >= UINT32_MAX / 2)
+            return -1;
+
+        size = in->size ? in->size * 2 : 1024;
+        if((strs = realloc(in->strs, sizeof(*strs) * size)) == NULL)
+            return -1;
+
+        in->strs = strs;
+        in->size = size;
+        in->allocs++;
+    }
+
+    *id = in->count++;
+
+    return 0;
+}
+
+cmdInternStr *cmdInternFind(cmdIntern *in, uint64_t hash, const char *str,
+                            size_t len)
+{
+    return cmdTableFind(&in->table, hash, __match_str, str, len);
+}
+
+cmdInternStr *cmdInternGet(cmdIntern *in, uint64_t hash, const char *str,
+                           size_t len)
+{
+    cmdInternStr *s;
+    size_t before;
+    uint32_t id;
+
+    if((s = cmdTableFind(&in->table, hash, __match_str, str, len)) != NULL)
+        return s;
+
+    if(len > UINT32_MAX || __next_id(in, &id) < 0)
+        return NULL;
+
+    in->strs[id] = NULL;
+
+    if(in->heap) {
+        s = malloc(sizeof(cmdInternStr)+len+1);
+        in->heap_bytes += sizeof(cmdInternStr)+len+1;
+        in->allocs++;
+    } else {
+        s = cmdArenaAlloc(&in->arena, sizeof(cmdInternStr)+len+1);
+    }
+
+    if(s == NULL)
+        return NULL;
+
+    memcpy(s->str, str, len);
+    s->str[len] = '\0';
+    s->hash = hash;
+    s->len = len;
+    s->id = id;
+    s->refs = 0;
+
+    in->strs[id] = s;
+
+    before = cmdTableMemory(&in->table);
+    if(cmdTableInsert(&in->table, hash, s) < 0)
+        return NULL;
+    if(cmdTableMemory(&in->table) > before)
+        in->allocs++;
+
+    return s;
+}
+
+void cmdInternRelease(cmdIntern *in, uint32_t id) {
+    cmdInternStr *s = in->strs[id];
+    uint32_t *ids, size;
+
+    // Strings in our arena live as long as it does
+    if(--s->refs || !in->heap)
+        return;
+
+    if(in->nfree == in->free_size) {
+        size = in->free_size ? in->free_size * 2 : 1024;
+
+        // Without room to remember the id we just keep the string
+        if((ids = realloc(in->free, sizeof(*ids) * size)) == NULL)
+            return;
+
+        in->free = ids;
+        in->free_size = size;
+        in->allocs++;
+    }
+
+    cmdTableRemove(&in->table, s->hash, s);
+
+    in->free[in->nfree++] = id;
+    in->strs[id] = NULL;
+    in->heap_bytes -= sizeof(cmdInternStr) + s->len + 1;
+
+    free(s);
+}
+
+size_t cmdInternMemory(const cmdIntern *in) {
+    size_t tot = in->arena.bytes + in->heap_bytes + cmdTableMemory(&in->table);
+
+    tot += sizeof(*in->strs) * in->size + sizeof(*in->free) * in->free_size;
+
+    // Pages of our current slab we haven't handed out yet aren't really ours
+    if(in->arena.slab)
+        tot -= in->arena.slab->size - in->arena.slab->used;
+
+    return tot;
+}
@@ -0,0 +1,91 @@
+#ifndef REDIS_CMD_INTERN_H
+#define REDIS_CMD_INTERN_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "table.h"
+
+/**
+ * One distinct string, which every member with those bytes refers to by id
+ */
+typedef struct _cmdInternStr {
+    uint64_t hash;
+    uint32_t len;
+    uint32_t id;
+
+    /**
+     * How many members refer to us.  We're only freed once this drops to
+     * zero when strings come from the heap.
+     */
+    uint32_t refs;
+
+    char str[];
+} cmdInternStr;
+
+/**
+ * Table of the distinct member strings we've seen, so each is stored once
+ * however many keys (in however many containers) it turns up in, and
+ * members can be told apart by comparing 32 bit ids.
+ */
+typedef struct _cmdIntern {
+    /**
+     * Strings by hash, for lookups, and by id
+     */
+    cmdTable table;
+    cmdInternStr **strs;
+    uint32_t count, size;
+
+    /**
+     * Ids of strings we've freed, which we hand out again before new ones
+     */
+    uint32_t *free;
+    uint32_t nfree, free_size;
+
+    /**
+     * Strings come from our arena, unless members can be dropped one at a
+     * time, in which case they come from the heap so we can free each of
+     * them once nothing refers to it.
+     */
+    cmdArena arena;
+    int heap;
+    size_t heap_bytes;
+
+    /**
+     * Calls we've made to the allocator (other than our arena's)
+     */
+    uint64_t allocs;
+} cmdIntern;
+
+void cmdInternInit(cmdIntern *in);
+void cmdInternFree(cmdIntern *in);
+
+// Drop every string, keeping our tables and arena slabs, or giving all of
+// our memory back (but keeping our settings and allocation count)
+void cmdInternClear(cmdIntern *in);
+void cmdInternReset(cmdIntern *in);
+
+// Find a string we already have, or NULL if we don't
+cmdInternStr *cmdInternFind(cmdIntern *in, uint64_t hash, const char *str,
+                            size_t len);
+
+// Find a string, adding it if it's new.  Returns NULL if we're out of
+// memory or ids.  Callers take a reference by incrementing refs.
+cmdInternStr *cmdInternGet(cmdIntern *in, uint64_t hash, const char *str,
+                           size_t len);
+
+// Drop a reference to a string
+void cmdInternRelease(cmdIntern *in, uint32_t id);
+
+// Bytes we're holding for our strings and tables
+size_t cmdInternMemory(const cmdIntern *in);
+
+static inline const cmdInternStr *cmdInternLookup(const cmdIntern *in,
+                                                  uint32_t id)
+{
+    return in->strs[id];
+}
+
+#endif
@@ -0,0 +1,261 @@
+/**
+ * Streaming optimizer over caller supplied buffers (libbufferoptimize)
+ */
+
+#include "optimizer.h"
+#include "buffer.h"
+#include "cmdhash.h"
+#include "resp.h"
+
+/**
+ * Initial hash sizes, the same as the command line tool uses
+ */
+#define OPTIMIZER_KHASH_SIZE 16384
+#define OPTIMIZER_MHASH_SIZE 4
+
+struct _cmdOptimizer {
+    respScanner *scanner;
+    cmdHash *cmd_hash;
+
+    /**
+     * Our output, and how much of it has already been consumed
+     */
+    cmdBuffer *out;
+    size_t out_pos;
+
+    /**
+     * Whether commands we pass through act as barriers
+     */
+    int ordered;
+
+    /**
+     * Set once we've been told there's no more input, or hit an error
+     */
+    int finished;
+    int err;
+
+    /**
+     * Counts for our stats
+     */
+    uint64_t commands_in;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t passed;
+};
+
+cmdOptimizer *cmdOptimizerCreate(void) {
+    cmdOptimizer *o;
+
+    if((o = calloc(1, sizeof(cmdOptimizer))) == NULL)
+        return NULL;
+
+    if((o->scanner = respScannerCreate()) == NULL ||
+       (o->cmd_hash = cmdHashCreate(OPTIMIZER_KHASH_SIZE, OPTIMIZER_MHASH_SIZE)) == NULL ||
+       (o->out = cmdBufferCreate()) == NULL ||
+       cmdHashSetOutput(o->cmd_hash, o->out) < 0)
+    {
+        cmdOptimizerFree(o);
+        return NULL;
+    }
+
+    return o;
+}
+
+void cmdOptimizerFree(cmdOptimizer *o) {
+    if(!o)
+        return;
+
+    if(o->scanner)
+        respScannerFree(o->scanner);
+    if(o->cmd_hash)
+        cmdHashFree(o->cmd_hash);
+    if(o->out)
+        cmdBufferFree(o->out);
+
+    free(o);
+}
+
+int cmdOptimizerSetWindow(cmdOptimizer *o, uint64_t window) {
+    if(o->bytes_in)
+        return -1;
+
+    return cmdHashSetWindow(o->cmd_hash, window, o->out);
+}
+
+int cmdOptimizerSetOrdered(cmdOptimizer *o) {
+    if(o->bytes_in || cmdHashSetOrdered(o->cmd_hash, o->out) < 0)
+        return -1;
+
+    o->ordered = 1;
+
+    return 0;
+}
+
+int cmdOptimizerSetZaddBatch(cmdOptimizer *o, unsigned int args) {
+    if(o->bytes_in)
+        return -1;
+
+    return cmdHashSetZaddBatch(o->cmd_hash, args);
+}
+
+int cmdOptimizerSetMemoryLimit(cmdOptimizer *o, size_t bytes, const char *dir) {
+    if(o->bytes_in)
+        return -1;
+
+    return cmdHashSetMemoryLimit(o->cmd_hash, bytes, dir);
+}
+
+/**
+ * Move output that hasn't been consumed yet to the front of our buffer, so
+ * it doesn't grow without bound while the caller keeps up
+ */
+static void __compact(cmdOptimizer *o) {
+    cmdBuffer *out = o->out;
+
+    if(!o->out_pos)
+        return;
+
+    memmove(out->buf, out->buf + o->out_pos, out->pos - o->out_pos);
+    out->pos -= o->out_pos;
+    o->out_pos = 0;
+}
+
+/**
+ * Aggregate a command if we can, and pass it through (after anything it
+ * needs to stay behind) if we can't
+ */
+static inline int __process(cmdOptimizer *o, respScanner *s) {
+    int rv;
+
+    if((rv = cmdHashAdd(o->cmd_hash, s->argc, s->argv, s->argvlen)) != TYPE_UNSUPPORTED)
+        return rv;
+
+    if(o->ordered && cmdHashBarrier(o->cmd_hash, s->argc, s->argv, s->argvlen) < 0)
+        return -1;
+
+    o->passed++;
+
+    if(s->verbatim) {
+        return cmdBufferAppend(o->out, RESP_CMD_PTR(s), RESP_CMD_LEN(s), 1);
+    } else {
+        return cmdBufferAddArgv(o->out, s->argc, s->argv, s->argvlen);
+    }
+}
+
+/**
+ * Process every complete command our scanner has.  Returns 0 once it
+ * needs more input, and -1 on an error.
+ */
+static int __process_all(cmdOptimizer *o, respScanner *s) {
+    int rv;
+
+    while((rv = respScannerNext(s)) == 1) {
+        if(__process(o, s) < 0)
+            return -1;
+
+        o->commands_in++;
+    }
+
+    return rv;
+}
+
+int cmdOptimizerFeed(cmdOptimizer *o, const char *buf, size_t len) {
+    respScanner *s = o->scanner;
+    size_t left;
+    int rv;
+
+    if(o->err || o->finished)
+        return -1;
+
+    __compact(o);
+    o->bytes_in += len;
+
+    // Unless we're holding part of a command already, scan the caller's
+    // buffer in place and only copy whatever partial command it ends with
+    if(!respScannerPending(s)) {
+        respScannerAttach(s, buf, len);
+        rv = __process_all(o, s);
+        left = s->len - s->pos;
+        respScannerDetach(s);
+
+        if(rv < 0) {
+            o->err = 1;
+            return -1;
+        }
+
+        buf += len - left;
+        len = left;
+    }
+
+    if(len && (respScannerFeed(s, buf, len) < 0 || __process_all(o, s) < 0)) {
+        o->err = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+int cmdOptimizerFinish(cmdOptimizer *o) {
+    if(o->err || o->finished)
+        return -1;
+
+    // Our input can't end in the middle of a command
+    if(respScannerPending(o->scanner)) {
+        o->err = 1;
+        return -1;
+    }
+
+    __compact(o);
+    o->finished = 1;
+
+    if(cmdHashGetCommands(o->cmd_hash, o->out) < 0) {
+        o->err = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+const char *cmdOptimizerPeek(cmdOptimizer *o, size_t *len) {
+    *len = o->out->pos - o->out_pos;
+
+    return o->out->buf + o->out_pos;
+}
+
+void cmdOptimizerConsume(cmdOptimizer *o, size_t len) {
+    cmdBuffer *out = o->out;
+
+    if(len > out->pos - o->out_pos)
+        len = out->pos - o->out_pos;
+
+    o->out_pos += len;
+    o->bytes_out += len;
+
+    // Start from the front again once everything has been consumed
+    if(o->out_pos == out->pos)
+        out->pos = o->out_pos = 0;
+}
+
+void cmdOptimizerGetStats(cmdOptimizer *o, cmdOptimizerStats *stats) {
+    stats->commands_in = o->commands_in;
+    stats->bytes_in = o->bytes_in;
+    stats->commands_out = o->out->cmd_count;
+    stats->bytes_out = o->bytes_out;
+    stats->bytes_pending = o->out->pos - o->out_pos;
+    stats->passed = o->passed;
+    stats->aggregated = cmdHashGetCount(o->cmd_hash);
+    stats->memory = cmdHashMemory(o->cmd_hash);
+}
+
+int cmdOptimizerReset(cmdOptimizer *o) {
+    respScannerReset(o->scanner);
+
+    if(cmdHashReset(o->cmd_hash) < 0 || cmdBufferReset(o->out) < 0)
+        return -1;
+
+    o->out_pos = 0;
+    o->finished = o->err = 0;
+    o->commands_in = o->bytes_in = o->bytes_out = o->passed = 0;
+
+    return 0;
+}
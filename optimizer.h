@@ -0,0 +1,85 @@
+#ifndef REDIS_CMD_OPTIMIZER_H
+#define REDIS_CMD_OPTIMIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Streaming optimizer for embedding in other programs (libbufferoptimize).
+ * Redis protocol is fed in as it arrives, in pieces of any size, and the
+ * optimized protocol is pulled back out.  Nothing touches the filesystem
+ * unless a memory limit is set, in which case we spill like the command
+ * line tool does.
+ *
+ * Commands we can't aggregate come out as soon as they're fed in, as do
+ * keys flushed by a window or an ordered barrier.  Everything else comes
+ * out once cmdOptimizerFinish is called.
+ *
+ * Unlike our other objects this one is opaque, so callers only need this
+ * header.
+ */
+typedef struct _cmdOptimizer cmdOptimizer;
+
+/**
+ * What we've done so far
+ */
+typedef struct _cmdOptimizerStats {
+    /**
+     * Commands and bytes fed in
+     */
+    uint64_t commands_in;
+    uint64_t bytes_in;
+
+    /**
+     * Commands written to our output so far, and how many bytes of it have
+     * been consumed and are still waiting to be.
+     */
+    uint64_t commands_out;
+    uint64_t bytes_out;
+    size_t bytes_pending;
+
+    /**
+     * Commands we passed through rather than aggregating, and how many
+     * aggregated commands we'll write in total
+     */
+    uint64_t passed;
+    uint64_t aggregated;
+
+    /**
+     * Approximate bytes held for our aggregates
+     */
+    size_t memory;
+} cmdOptimizerStats;
+
+// Allocation, deallocation
+cmdOptimizer *cmdOptimizerCreate(void);
+void cmdOptimizerFree(cmdOptimizer *o);
+
+// Options, which must be set before anything is fed in.  These behave like
+// --flush-window, --ordered, --zadd-batch and --max-memory/--spill-dir.
+int cmdOptimizerSetWindow(cmdOptimizer *o, uint64_t window);
+int cmdOptimizerSetOrdered(cmdOptimizer *o);
+int cmdOptimizerSetZaddBatch(cmdOptimizer *o, unsigned int args);
+int cmdOptimizerSetMemoryLimit(cmdOptimizer *o, size_t bytes, const char *dir);
+
+// Feed in protocol data, which need not end on a command boundary.  Returns
+// -1 on a protocol error, after which only Reset or Free may be called.
+int cmdOptimizerFeed(cmdOptimizer *o, const char *buf, size_t len);
+
+// No more input is coming, so write out everything we've aggregated.
+// Returns -1 if our input ended part way through a command.
+int cmdOptimizerFinish(cmdOptimizer *o);
+
+// Get a pointer to the output we have waiting (setting *len to its size),
+// then consume however much of it was used.  The pointer is only valid
+// until the next Feed, Finish or Reset.
+const char *cmdOptimizerPeek(cmdOptimizer *o, size_t *len);
+void cmdOptimizerConsume(cmdOptimizer *o, size_t len);
+
+void cmdOptimizerGetStats(cmdOptimizer *o, cmdOptimizerStats *stats);
+
+// Drop everything to start on a new stream with the same options, keeping
+// what we've allocated
+int cmdOptimizerReset(cmdOptimizer *o);
+
+#endif
@@ -0,0 +1,288 @@
+/**
+ * Parallel gzip compression of our output, along the lines of pigz
+ */
+
+#include "pgzip.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Deflate one block.  Every block but the last ends with a sync flush, so
+ * the next one starts on a byte boundary.
+ */
+static int __deflate_job(z_stream *strm, pgzJob *job) {
+    int rv;
+
+    if(deflateReset(strm) != Z_OK)
+        return -1;
+
+    // Prime with the tail of the previous block so we don't lose any ratio
+    if(job->dict_len &&
+       deflateSetDictionary(strm, job->buf, job->dict_len) != Z_OK)
+    {
+        return -1;
+    }
+
+    strm->next_in = job->buf + job->dict_len;
+    strm->avail_in = job->len;
+    strm->next_out = job->out;
+    strm->avail_out = job->out_size;
+
+    rv = deflate(strm, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+
+    if(job->last ? rv != Z_STREAM_END :
+       rv != Z_OK || strm->avail_in || !strm->avail_out)
+    {
+        return -1;
+    }
+
+    job->out_len = job->out_size - strm->avail_out;
+
+    return 0;
+}
+
+/**
+ * Worker thread.  Takes queued jobs in order until we're told to stop and
+ * there are none left.
+ */
+static void *__worker_main(void *arg) {
+    pgzWriter *z = arg;
+    z_stream strm;
+    pgzJob *job;
+    int ok;
+
+    // Raw deflate, as we write the gzip header and trailer ourselves
+    memset(&strm, 0, sizeof(strm));
+    ok = deflateInit2(&strm, z->level, Z_DEFLATED, -MAX_WBITS, 8,
+                      Z_DEFAULT_STRATEGY) == Z_OK;
+
+    pthread_mutex_lock(&z->lock);
+    for(;;) {
+        while(!z->stop && z->taken == z->queued)
+            pthread_cond_wait(&z->work, &z->lock);
+
+        if(z->taken == z->queued)
+            break;
+
+        job = &z->jobs[z->taken++ % z->count];
+        pthread_mutex_unlock(&z->lock);
+
+        job->err = !ok || __deflate_job(&strm, job) < 0;
+        job->crc = crc32(0L, job->buf + job->dict_len, job->len);
+
+        pthread_mutex_lock(&z->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&z->done);
+    }
+    pthread_mutex_unlock(&z->lock);
+
+    if(ok)
+        deflateEnd(&strm);
+
+    return NULL;
+}
+
+/**
+ * Write finished jobs out in order, waiting for them if we haven't written
+ * everything before upto yet.
+ */
+static void __drain(pgzWriter *z, uint64_t upto) {
+    pgzJob *job;
+
+    pthread_mutex_lock(&z->lock);
+    while(z->written < z->queued) {
+        job = &z->jobs[z->written % z->count];
+
+        if(!job->done) {
+            if(z->written >= upto)
+                break;
+
+            pthread_cond_wait(&z->done, &z->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&z->lock);
+
+        // Once anything has failed we just recycle jobs
+        if(job->err)
+            z->err = 1;
+        if(!z->err && fwrite(job->out, 1, job->out_len, z->fd) != job->out_len)
+            z->err = 1;
+
+        z->crc = crc32_combine(z->crc, job->crc, job->len);
+        z->total += job->len;
+
+        pthread_mutex_lock(&z->lock);
+        job->done = 0;
+        z->written++;
+    }
+    pthread_mutex_unlock(&z->lock);
+}
+
+/**
+ * Hand the job we've been filling to the workers and move on to the next
+ * one, priming it with the tail of this one.
+ */
+static void __submit(pgzWriter *z, int last) {
+    pgzJob *job = &z->jobs[z->queued % z->count], *next;
+    size_t dict;
+
+    job->last = last;
+
+    pthread_mutex_lock(&z->lock);
+    z->queued++;
+    pthread_cond_signal(&z->work);
+    pthread_mutex_unlock(&z->lock);
+
+    // Write whatever is ready, waiting for everything if this was the last
+    // job, or for the oldest one if we need its slot.
+    if(last) {
+        __drain(z, z->queued);
+        return;
+    }
+
+    __drain(z, z->queued >= z->count ? z->queued - z->count + 1 : 0);
+
+    next = &z->jobs[z->queued % z->count];
+    dict = job->dict_len + job->len;
+    if(dict > PGZ_DICT_SIZE)
+        dict = PGZ_DICT_SIZE;
+
+    memcpy(next->buf, job->buf + job->dict_len + job->len - dict, dict);
+    next->dict_len = dict;
+    next->len = 0;
+}
+
+pgzWriter *pgzWriterCreate(FILE *fd, int level, unsigned int threads) {
+    unsigned char hdr[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+    pgzWriter *z;
+    unsigned int i;
+
+    if(threads < 1 || threads > PGZ_MAX_THREADS)
+        return NULL;
+
+    if((z = calloc(1, sizeof(pgzWriter))) == NULL)
+        return NULL;
+
+    z->fd = fd;
+    z->level = level;
+    z->crc = crc32(0L, Z_NULL, 0);
+
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->work, NULL);
+    pthread_cond_init(&z->done, NULL);
+
+    z->count = threads * PGZ_JOBS_PER_THREAD;
+    if((z->jobs = calloc(z->count, sizeof(pgzJob))) == NULL) {
+        pgzWriterFree(z);
+        return NULL;
+    }
+
+    for(i=0;i<z->count;i++) {
+        z->jobs[i].out_size = compressBound(PGZ_BLOCK_SIZE) + 16;
+        z->jobs[i].buf = malloc(PGZ_DICT_SIZE + PGZ_BLOCK_SIZE);
+        z->jobs[i].out = malloc(z->jobs[i].out_size);
+
+        if(!z->jobs[i].buf || !z->jobs[i].out) {
+            pgzWriterFree(z);
+            return NULL;
+        }
+    }
+
+    for(i=0;i<threads;i++) {
+        if(pthread_create(&z->threads[i], NULL, __worker_main, z) != 0) {
+            pgzWriterFree(z);
+            return NULL;
+        }
+        z->started++;
+    }
+
+    // Let readers know how hard we tried
+    if(level == 1) {
+        hdr[8] = 4;
+    } else if(level == 9) {
+        hdr[8] = 2;
+    }
+
+    if(fwrite(hdr, 1, sizeof(hdr), fd) != sizeof(hdr)) {
+        pgzWriterFree(z);
+        return NULL;
+    }
+
+    return z;
+}
+
+int pgzWriterWrite(pgzWriter *z, const char *buf, size_t len) {
+    pgzJob *job;
+    size_t n;
+
+    while(len) {
+        job = &z->jobs[z->queued % z->count];
+
+        n = PGZ_BLOCK_SIZE - job->len;
+        if(n > len)
+            n = len;
+
+        memcpy(job->buf + job->dict_len + job->len, buf, n);
+        job->len += n;
+        buf += n;
+        len -= n;
+
+        if(job->len == PGZ_BLOCK_SIZE)
+            __submit(z, 0);
+    }
+
+    return z->err ? -1 : 0;
+}
+
+int pgzWriterFinish(pgzWriter *z) {
+    unsigned char trailer[8];
+    int i;
+
+    if(z->finished)
+        return z->err ? -1 : 0;
+
+    // Our last (possibly empty) block carries the final block marker
+    __submit(z, 1);
+    z->finished = 1;
+
+    // CRC and length mod 2^32, both little endian
+    for(i=0;i<4;i++) {
+        trailer[i] = (z->crc >> (i*8)) & 0xff;
+        trailer[i+4] = (z->total >> (i*8)) & 0xff;
+    }
+
+    if(!z->err && fwrite(trailer, 1, sizeof(trailer), z->fd) != sizeof(trailer))
+        z->err = 1;
+
+    return z->err ? -1 : 0;
+}
+
+void pgzWriterFree(pgzWriter *z) {
+    unsigned int i;
+
+    if(!z)
+        return;
+
+    pthread_mutex_lock(&z->lock);
+    z->stop = 1;
+    pthread_cond_broadcast(&z->work);
+    pthread_mutex_unlock(&z->lock);
+
+    for(i=0;i<z->started;i++)
+        pthread_join(z->threads[i], NULL);
+
+    if(z->jobs) {
+        for(i=0;i<z->count;i++) {
+            free(z->jobs[i].buf);
+            free(z->jobs[i].out);
+        }
+        free(z->jobs);
+    }
+
+    pthread_mutex_destroy(&z->lock);
+    pthread_cond_destroy(&z->work);
+    pthread_cond_destroy(&z->done);
+    free(z);
+}
@@ -0,0 +1,95 @@
+#ifndef REDIS_CMD_PGZIP_H
+#define REDIS_CMD_PGZIP_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+
+/**
+ * How much input each job deflates, and how much of the previous block's
+ * input it is primed with.
+ */
+#define PGZ_BLOCK_SIZE (256*1024)
+#define PGZ_DICT_SIZE 32768
+
+/**
+ * Maximum number of compression threads, and jobs in flight per thread
+ */
+#define PGZ_MAX_THREADS 64
+#define PGZ_JOBS_PER_THREAD 2
+
+/**
+ * One block of input and its compressed output.  The block's input starts
+ * dict_len bytes into buf, after the tail of the block before it.
+ */
+typedef struct _pgzJob {
+    unsigned char *buf;
+    size_t dict_len;
+    size_t len;
+
+    unsigned char *out;
+    size_t out_size;
+    size_t out_len;
+
+    uLong crc;
+    int last;
+    int err;
+    int done;
+} pgzJob;
+
+/**
+ * Parallel gzip writer.  Output is split into blocks which are raw deflated
+ * on a pool of threads, each ending on a byte boundary (with a sync flush)
+ * so they can simply be concatenated into one gzip member.  Blocks are
+ * written in order and their CRCs combined as they go out.
+ */
+typedef struct _pgzWriter {
+    FILE *fd;
+    int level;
+
+    /**
+     * Ring of jobs.  Jobs [written, queued) are with the workers, job
+     * queued is the one we're filling, and taken is the next one a worker
+     * will pick up.
+     */
+    pgzJob *jobs;
+    unsigned int count;
+    uint64_t written;
+    uint64_t queued;
+    uint64_t taken;
+
+    /**
+     * Worker threads
+     */
+    pthread_t threads[PGZ_MAX_THREADS];
+    unsigned int started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    int stop;
+
+    /**
+     * Running CRC and length of everything written
+     */
+    uLong crc;
+    uint64_t total;
+
+    int finished;
+    int err;
+} pgzWriter;
+
+// Write a gzip header to fd and start threads compressing at level
+pgzWriter *pgzWriterCreate(FILE *fd, int level, unsigned int threads);
+
+// Queue data to be compressed and written
+int pgzWriterWrite(pgzWriter *z, const char *buf, size_t len);
+
+// Compress and write anything left, followed by the gzip trailer
+int pgzWriterFinish(pgzWriter *z);
+
+// Stop our threads and free everything (without writing anything more)
+void pgzWriterFree(pgzWriter *z);
+
+#endif
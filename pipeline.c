@@ -0,0 +1,233 @@
+/**
+ * Reader and writer pipeline stages, so decompression, parsing and
+ * compression can all run at the same time.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+/**
+ * Allocate a stage's blocks and queue them all as empty
+ */
+static int __blocks_init(pipeBlock *blocks, cmdRing *full, cmdRing *empty) {
+    int i;
+
+    if(cmdRingInit(full, PIPE_BLOCKS) < 0)
+        return -1;
+
+    if(cmdRingInit(empty, PIPE_BLOCKS) < 0) {
+        cmdRingFree(full);
+        return -1;
+    }
+
+    for(i=0;i<PIPE_BLOCKS;i++) {
+        if((blocks[i].buf = malloc(PIPE_BLOCK_SIZE)) == NULL)
+            return -1;
+
+        blocks[i].size = PIPE_BLOCK_SIZE;
+        blocks[i].len = 0;
+
+        cmdRingTryPush(empty, &blocks[i]);
+    }
+
+    return 0;
+}
+
+static void __blocks_free(pipeBlock *blocks, cmdRing *full, cmdRing *empty) {
+    int i;
+
+    for(i=0;i<PIPE_BLOCKS;i++) {
+        free(blocks[i].buf);
+    }
+
+    cmdRingFree(full);
+    cmdRingFree(empty);
+}
+
+/**
+ * Reader thread.  Fills empty blocks until we hit the end of our input, an
+ * error, or are told to stop.
+ */
+static void *__reader_main(void *arg) {
+    pipeReader *r = arg;
+    pipeBlock *block;
+
+    for(;;) {
+        if((block = cmdRingPop(&r->empty, &r->stop)) == NULL)
+            break;
+
+        block->len = codecReaderRead(r->fd, block->buf, block->size);
+
+        if(cmdRingPush(&r->full, block, &r->stop) < 0)
+            break;
+
+        // End of input or an error, and either way we're done
+        if(block->len <= 0)
+            break;
+    }
+
+    return NULL;
+}
+
+pipeReader *pipeReaderCreate(codecReader *fd) {
+    pipeReader *r;
+
+    if((r = calloc(1, sizeof(pipeReader))) == NULL)
+        return NULL;
+
+    if(__blocks_init(r->blocks, &r->full, &r->empty) < 0) {
+        __blocks_free(r->blocks, &r->full, &r->empty);
+        free(r);
+        return NULL;
+    }
+
+    r->fd = fd;
+    atomic_init(&r->stop, 0);
+
+    if(pthread_create(&r->thread, NULL, __reader_main, r) != 0) {
+        __blocks_free(r->blocks, &r->full, &r->empty);
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+pipeBlock *pipeReaderNext(pipeReader *r) {
+    // The thread always finishes by queueing an EOF or error block, so
+    // there's no need to check for it stopping here.
+    return cmdRingPop(&r->full, NULL);
+}
+
+void pipeReaderRelease(pipeReader *r, pipeBlock *block) {
+    cmdRingPush(&r->empty, block, NULL);
+}
+
+void pipeReaderFree(pipeReader *r) {
+    if(!r)
+        return;
+
+    atomic_store(&r->stop, 1);
+    pthread_join(r->thread, NULL);
+
+    __blocks_free(r->blocks, &r->full, &r->empty);
+    free(r);
+}
+
+/**
+ * Writer thread.  Writes full blocks until it gets an empty one, which
+ * marks the end of our output.
+ */
+static void *__writer_main(void *arg) {
+    pipeWriter *w = arg;
+    pipeBlock *block;
+
+    for(;;) {
+        block = cmdRingPop(&w->full, NULL);
+
+        if(block->len == 0)
+            break;
+
+        // Once a write has failed we just recycle blocks
+        if(!atomic_load(&w->err) &&
+           w->sink(w->sink_arg, block->buf, block->len) < 0)
+        {
+            atomic_store(&w->err, 1);
+        }
+
+        block->len = 0;
+        cmdRingPush(&w->empty, block, NULL);
+    }
+
+    return NULL;
+}
+
+pipeWriter *pipeWriterCreate(pipeSink sink, void *arg) {
+    pipeWriter *w;
+
+    if((w = calloc(1, sizeof(pipeWriter))) == NULL)
+        return NULL;
+
+    if(__blocks_init(w->blocks, &w->full, &w->empty) < 0) {
+        __blocks_free(w->blocks, &w->full, &w->empty);
+        free(w);
+        return NULL;
+    }
+
+    w->sink = sink;
+    w->sink_arg = arg;
+    atomic_init(&w->err, 0);
+
+    if(pthread_create(&w->thread, NULL, __writer_main, w) != 0) {
+        __blocks_free(w->blocks, &w->full, &w->empty);
+        free(w);
+        return NULL;
+    }
+
+    w->running = 1;
+
+    return w;
+}
+
+int pipeWriterWrite(pipeWriter *w, const char *buf, size_t len) {
+    size_t n;
+
+    while(len) {
+        // Grab an empty block if we need one
+        if(!w->cur)
+            w->cur = cmdRingPop(&w->empty, NULL);
+
+        n = w->cur->size - w->cur->len;
+        if(n > len)
+            n = len;
+
+        memcpy(w->cur->buf + w->cur->len, buf, n);
+        w->cur->len += n;
+        buf += n;
+        len -= n;
+
+        // Hand it to the writer once it's full
+        if((size_t)w->cur->len == w->cur->size) {
+            cmdRingPush(&w->full, w->cur, NULL);
+            w->cur = NULL;
+        }
+    }
+
+    return atomic_load(&w->err) ? -1 : 0;
+}
+
+int pipeWriterFinish(pipeWriter *w) {
+    // Nothing to do if we've already finished
+    if(!w->running)
+        return atomic_load(&w->err) ? -1 : 0;
+
+    // Queue whatever is in our partial block
+    if(w->cur && w->cur->len) {
+        cmdRingPush(&w->full, w->cur, NULL);
+        w->cur = NULL;
+    }
+
+    // An empty block tells the thread we're done
+    if(!w->cur)
+        w->cur = cmdRingPop(&w->empty, NULL);
+
+    cmdRingPush(&w->full, w->cur, NULL);
+    w->cur = NULL;
+
+    pthread_join(w->thread, NULL);
+    w->running = 0;
+
+    return atomic_load(&w->err) ? -1 : 0;
+}
+
+void pipeWriterFree(pipeWriter *w) {
+    if(!w)
+        return;
+
+    pipeWriterFinish(w);
+
+    __blocks_free(w->blocks, &w->full, &w->empty);
+    free(w);
+}
@@ -0,0 +1,96 @@
+#ifndef REDIS_CMD_PIPELINE_H
+#define REDIS_CMD_PIPELINE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include "codec.h"
+#include "ring.h"
+
+/**
+ * Size and number of blocks in flight between each pair of stages
+ */
+#define PIPE_BLOCK_SIZE (1024*1024)
+#define PIPE_BLOCKS 8
+
+/**
+ * A block of data passed between stages.  A reader block with a len of
+ * zero marks the end of input, and a negative len a read error.
+ */
+typedef struct _pipeBlock {
+    char *buf;
+    size_t size;
+    ssize_t len;
+} pipeBlock;
+
+/**
+ * Where the writer stage sends each block
+ */
+typedef int (*pipeSink)(void *arg, const char *buf, size_t len);
+
+/**
+ * Reader stage, which decompresses our input on its own thread
+ */
+typedef struct _pipeReader {
+    pthread_t thread;
+    codecReader *fd;
+
+    /**
+     * Blocks waiting to be parsed, and blocks we can read into
+     */
+    cmdRing full;
+    cmdRing empty;
+    pipeBlock blocks[PIPE_BLOCKS];
+
+    /**
+     * Set to make the thread give up early
+     */
+    atomic_int stop;
+} pipeReader;
+
+/**
+ * Writer stage, which compresses and writes our output on its own thread
+ */
+typedef struct _pipeWriter {
+    pthread_t thread;
+    int running;
+    pipeSink sink;
+    void *sink_arg;
+
+    /**
+     * Blocks waiting to be written, blocks we can fill, and the one we're
+     * filling right now.
+     */
+    cmdRing full;
+    cmdRing empty;
+    pipeBlock blocks[PIPE_BLOCKS];
+    pipeBlock *cur;
+
+    /**
+     * Set by the thread if a write fails
+     */
+    atomic_int err;
+} pipeWriter;
+
+// Start reading fd on a new thread
+pipeReader *pipeReaderCreate(codecReader *fd);
+
+// Wait for the next block of input, which must be released when we're done
+pipeBlock *pipeReaderNext(pipeReader *r);
+void pipeReaderRelease(pipeReader *r, pipeBlock *block);
+
+// Stop the thread (if it's still running) and free everything
+void pipeReaderFree(pipeReader *r);
+
+// Start a thread handing our output to sink
+pipeWriter *pipeWriterCreate(pipeSink sink, void *arg);
+
+// Queue data to be written
+int pipeWriterWrite(pipeWriter *w, const char *buf, size_t len);
+
+// Write anything still queued and wait for the thread to finish
+int pipeWriterFinish(pipeWriter *w);
+
+void pipeWriterFree(pipeWriter *w);
+
+#endif
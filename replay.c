@@ -0,0 +1,268 @@
+/**
+ * Replay our output directly into a Redis server
+ */
+
+#include "replay.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * Note the first error Redis sends us, and count the rest
+ */
+static void __reply_error(cmdReplay *r, const redisReply *reply) {
+    if(!r->errors++)
+        snprintf(r->error, sizeof(r->error), "%.*s", (int)reply->len, reply->str);
+}
+
+/**
+ * Reply thread.  Reads until every command we've sent has been answered
+ * and we've been told nothing more is coming.
+ */
+static void *__replay_main(void *arg) {
+    cmdReplay *r = arg;
+    char buf[REPLAY_READ_SIZE];
+    redisReply *reply;
+    ssize_t n;
+
+    for(;;) {
+        pthread_mutex_lock(&r->lock);
+
+        while(r->replies == r->sent && !r->done && !r->err)
+            pthread_cond_wait(&r->cond, &r->lock);
+
+        if(r->err || (r->replies == r->sent && r->done)) {
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+
+        pthread_mutex_unlock(&r->lock);
+
+        if((n = read(r->ctx->fd, buf, sizeof(buf))) <= 0) {
+            if(n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+
+        if(redisReaderFeed(r->reader, buf, n) != REDIS_OK)
+            break;
+
+        pthread_mutex_lock(&r->lock);
+
+        for(;;) {
+            if(redisReaderGetReply(r->reader, (void**)&reply) != REDIS_OK) {
+                r->err = 1;
+                break;
+            }
+            if(reply == NULL)
+                break;
+
+            if(reply->type == REDIS_REPLY_ERROR)
+                __reply_error(r, reply);
+
+            freeReplyObject(reply);
+            r->replies++;
+        }
+
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+
+    // Wake up the writer if we stopped because the connection went away
+    pthread_mutex_lock(&r->lock);
+    if(r->replies != r->sent)
+        r->err = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    return NULL;
+}
+
+/**
+ * Connect to host:port (or just host, on the default port)
+ */
+static redisContext *__connect(const char *target) {
+    char host[256];
+    const char *colon;
+    int port = 6379;
+    size_t len;
+
+    if((colon = strrchr(target, ':')) != NULL) {
+        len = colon - target;
+        port = atoi(colon + 1);
+    } else {
+        len = strlen(target);
+    }
+
+    if(len == 0 || len >= sizeof(host) || port < 1 || port > 65535)
+        return NULL;
+
+    memcpy(host, target, len);
+    host[len] = '\0';
+
+    return redisConnect(host, port);
+}
+
+cmdReplay *cmdReplayCreate(const char *target, uint64_t depth) {
+    cmdReplay *r;
+    socklen_t optlen;
+    int sndbuf = 0;
+
+    if((r = calloc(1, sizeof(cmdReplay))) == NULL)
+        return NULL;
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    r->depth = depth ? depth : REPLAY_DEPTH;
+
+    if((r->ctx = __connect(target)) == NULL || r->ctx->err) {
+        if(r->ctx)
+            fprintf(stderr, "Error:  Can't connect to '%s': %s\n", target, r->ctx->errstr);
+        cmdReplayFree(r);
+        return NULL;
+    }
+
+    // Batch writes up to whatever the kernel will take in one go
+    optlen = sizeof(sndbuf);
+    getsockopt(r->ctx->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen);
+    r->batch = sndbuf > REPLAY_MIN_BATCH ? (size_t)sndbuf : REPLAY_MIN_BATCH;
+
+    if((r->reader = redisReaderCreate()) == NULL ||
+       (r->scanner = respScannerCreate()) == NULL)
+    {
+        cmdReplayFree(r);
+        return NULL;
+    }
+
+    if(pthread_create(&r->thread, NULL, __replay_main, r) != 0) {
+        cmdReplayFree(r);
+        return NULL;
+    }
+
+    r->running = 1;
+
+    return r;
+}
+
+/**
+ * Write count commands worth of protocol, once few enough are in flight
+ */
+static int __send(cmdReplay *r, const char *buf, size_t len, uint64_t count) {
+    ssize_t n;
+    int err;
+
+    pthread_mutex_lock(&r->lock);
+
+    // A batch bigger than our depth just waits for everything else
+    while(!r->err && r->sent - r->replies &&
+          r->sent - r->replies + count > r->depth)
+    {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+
+    // Count them first, so replies never outnumber what we've sent
+    r->sent += count;
+    pthread_cond_broadcast(&r->cond);
+    err = r->err;
+
+    pthread_mutex_unlock(&r->lock);
+
+    if(err)
+        return -1;
+
+    while(len) {
+        // A closed connection is an error, not a SIGPIPE
+        if((n = send(r->ctx->fd, buf, len, MSG_NOSIGNAL)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int cmdReplayWrite(cmdReplay *r, const char *buf, size_t len) {
+    respScanner *s = r->scanner;
+    uint64_t count = 0;
+    size_t start;
+    int rv;
+
+    if(respScannerFeed(s, buf, len) < 0)
+        return -1;
+
+    // Send whole commands, a batch at a time
+    start = s->pos;
+    while((rv = respScannerNext(s)) == 1) {
+        count++;
+
+        if(s->end - start >= r->batch || count >= r->depth) {
+            if(__send(r, s->buf + start, s->end - start, count) < 0)
+                return -1;
+
+            start = s->end;
+            count = 0;
+        }
+    }
+
+    if(rv < 0)
+        return -1;
+
+    // Anything left over waits for the rest of its command
+    return count ? __send(r, s->buf + start, s->pos - start, count) : 0;
+}
+
+int cmdReplayFinish(cmdReplay *r) {
+    // A partial command at the end will never be answered
+    if(respScannerPending(r->scanner))
+        return -1;
+
+    pthread_mutex_lock(&r->lock);
+    r->done = 1;
+    pthread_cond_broadcast(&r->cond);
+
+    while(!r->err && r->replies < r->sent)
+        pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_join(r->thread, NULL);
+    r->running = 0;
+
+    return r->err ? -1 : 0;
+}
+
+void cmdReplayFree(cmdReplay *r) {
+    if(!r)
+        return;
+
+    // Stop our reply thread without waiting on anything else
+    if(r->running) {
+        pthread_mutex_lock(&r->lock);
+        r->err = 1;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+
+        shutdown(r->ctx->fd, SHUT_RDWR);
+        pthread_join(r->thread, NULL);
+    }
+
+    if(r->scanner)
+        respScannerFree(r->scanner);
+    if(r->reader)
+        redisReaderFree(r->reader);
+    if(r->ctx)
+        redisFree(r->ctx);
+
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+
+    free(r);
+}
@@ -0,0 +1,83 @@
+#ifndef REDIS_CMD_REPLAY_H
+#define REDIS_CMD_REPLAY_H
+
+#include <hiredis/hiredis.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "resp.h"
+
+/**
+ * Default number of commands we let go unanswered before waiting
+ */
+#define REPLAY_DEPTH 16384
+
+/**
+ * Smallest write we batch commands up to (we use the socket's send buffer
+ * size if it's larger), and how much we read replies in at a time.
+ */
+#define REPLAY_MIN_BATCH (64*1024)
+#define REPLAY_READ_SIZE (64*1024)
+
+/**
+ * Longest Redis error we keep to report
+ */
+#define REPLAY_ERR_LEN 128
+
+/**
+ * Streams our output straight into a Redis server.  Our output is already
+ * in the Redis protocol, so it's written to the connection as is, batched
+ * on command boundaries up to the size of the socket's send buffer.  A
+ * second thread reads and counts replies, and writes wait whenever depth
+ * commands are still waiting on one.
+ */
+typedef struct _cmdReplay {
+    redisContext *ctx;
+    redisReader *reader;
+
+    /**
+     * Finds command boundaries in what we're given to write
+     */
+    respScanner *scanner;
+
+    /**
+     * Most bytes we write at once, and most commands in flight
+     */
+    size_t batch;
+    uint64_t depth;
+
+    /**
+     * Reply thread, and the counts it shares with us
+     */
+    pthread_t thread;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t sent;
+    uint64_t replies;
+    int done;
+
+    /**
+     * Commands Redis refused, and the first error it sent back
+     */
+    uint64_t errors;
+    char error[REPLAY_ERR_LEN];
+
+    /**
+     * Set if the connection fails
+     */
+    int err;
+} cmdReplay;
+
+// Connect to host:port and start reading replies
+cmdReplay *cmdReplayCreate(const char *target, uint64_t depth);
+
+// Send protocol data, which need not end on a command boundary
+int cmdReplayWrite(cmdReplay *r, const char *buf, size_t len);
+
+// Wait for every reply, returning -1 if anything couldn't be sent
+int cmdReplayFinish(cmdReplay *r);
+
+void cmdReplayFree(cmdReplay *r);
+
+#endif
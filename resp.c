@@ -0,0 +1,319 @@
+/**
+ * Zero-copy streaming scanner for Redis protocol commands
+ */
+
+#include "resp.h"
+
+#include <limits.h>
+
+respScanner *respScannerCreate(void) {
+    respScanner *s;
+
+    if((s = calloc(1, sizeof(respScanner))) == NULL)
+        return NULL;
+
+    // Allocate our input buffer
+    if((s->buf = malloc(RESP_INIT_ALLOC)) == NULL) {
+        free(s);
+        return NULL;
+    }
+
+    // Allocate our argument vectors
+    s->argv = malloc(sizeof(char*)*RESP_INIT_ARGS);
+    s->argvlen = malloc(sizeof(size_t)*RESP_INIT_ARGS);
+    if(!s->argv || !s->argvlen) {
+        respScannerFree(s);
+        return NULL;
+    }
+
+    s->size = RESP_INIT_ALLOC;
+    s->argcap = RESP_INIT_ARGS;
+
+    return s;
+}
+
+void respScannerFree(respScanner *s) {
+    if(!s)
+        return;
+
+    respScannerDetach(s);
+
+    free(s->buf);
+    free(s->argv);
+    free(s->argvlen);
+    free(s);
+}
+
+/**
+ * Make room for len more bytes, discarding consumed commands.  Arguments of
+ * a partially parsed command are rebased to their new location.
+ */
+char *respScannerReserve(respScanner *s, size_t len) {
+    size_t shift = s->pos, newsize;
+    char *oldbuf = s->buf, *newbuf;
+    int i;
+
+    // Discard everything we've already consumed
+    if(shift) {
+        memmove(s->buf, s->buf+shift, s->len-shift);
+        s->len -= shift;
+        s->cur -= shift;
+        s->pos = 0;
+    }
+
+    // Grow if we still don't have room
+    if(s->len + len > s->size) {
+        newsize = s->size;
+        while(newsize < s->len + len)
+            newsize *= 2;
+
+        if((newbuf = realloc(s->buf, newsize)) == NULL)
+            return NULL;
+
+        s->buf = newbuf;
+        s->size = newsize;
+    }
+
+    // Rebase any arguments we've already parsed
+    for(i=0;i<s->argc && s->want;i++) {
+        s->argv[i] = s->buf + (s->argv[i] - oldbuf) - shift;
+    }
+
+    return s->buf + s->len;
+}
+
+void respScannerCommit(respScanner *s, size_t len) {
+    s->len += len;
+}
+
+int respScannerFeed(respScanner *s, const char *buf, size_t len) {
+    char *dst;
+
+    if((dst = respScannerReserve(s, len)) == NULL)
+        return -1;
+
+    memcpy(dst, buf, len);
+    respScannerCommit(s, len);
+
+    return 0;
+}
+
+void respScannerAttach(respScanner *s, const char *buf, size_t len) {
+    if(!s->own)
+        s->own = s->buf;
+
+    // We never write through buf while attached
+    s->buf = (char*)buf;
+    s->len = len;
+    s->pos = s->cur = 0;
+    s->want = 0;
+}
+
+void respScannerDetach(respScanner *s) {
+    if(!s->own)
+        return;
+
+    s->buf = s->own;
+    s->own = NULL;
+    s->len = s->pos = s->cur = 0;
+    s->want = 0;
+}
+
+void respScannerReset(respScanner *s) {
+    respScannerDetach(s);
+
+    s->len = s->pos = s->cur = 0;
+    s->want = 0;
+    s->argc = 0;
+}
+
+/**
+ * Parse a CRLF terminated integer starting at p (just past the type byte).
+ * Returns 1 and sets *val and *next on success, 0 if the line is incomplete
+ * and -1 if it is malformed or bigger than max either way.
+ */
+static inline int __read_int(const char *p, const char *end, long long max,
+                             long long *val, const char **next)
+{
+    const char *cr;
+    long long v = 0;
+    int neg = 0;
+
+    if((cr = memchr(p, '\r', end-p)) == NULL)
+        return end-p > RESP_MAX_LINE ? -1 : 0;
+
+    // Need the LF too
+    if(cr+1 >= end)
+        return 0;
+    if(cr[1] != '\n' || cr == p || cr-p > RESP_MAX_LINE)
+        return -1;
+
+    if(*p == '-') {
+        neg = 1;
+        if(++p == cr)
+            return -1;
+    }
+
+    for(;p<cr;p++) {
+        if(*p < '0' || *p > '9')
+            return -1;
+
+        // Check before we multiply, so a long run of digits can't wrap
+        if(v > (max - (*p-'0')) / 10)
+            return -1;
+
+        v = v*10 + (*p-'0');
+    }
+
+    *val = neg ? -v : v;
+    *next = cr+2;
+
+    return 1;
+}
+
+/**
+ * Append an argument slice, growing our vectors if we need to
+ */
+static inline int __push_arg(respScanner *s, const char *str, size_t len) {
+    const char **argv;
+    size_t *argvlen;
+    int cap;
+
+    if(s->argc == s->argcap) {
+        cap = s->argcap*2;
+
+        if((argv = realloc(s->argv, sizeof(char*)*cap)) == NULL)
+            return -1;
+        s->argv = argv;
+
+        if((argvlen = realloc(s->argvlen, sizeof(size_t)*cap)) == NULL)
+            return -1;
+        s->argvlen = argvlen;
+
+        s->argcap = cap;
+    }
+
+    s->argv[s->argc] = str;
+    s->argvlen[s->argc] = len;
+    s->argc++;
+
+    return 0;
+}
+
+int respScannerNext(respScanner *s) {
+    const char *end = s->buf + s->len, *p, *next;
+    long long n;
+    int rv;
+
+    for(;;) {
+        // Start a new command if we aren't in the middle of one
+        if(!s->want) {
+            if(s->pos == s->len)
+                return 0;
+
+            p = s->buf + s->pos;
+            if(*p != '*')
+                return -1;
+
+            if((rv = __read_int(p+1, end, INT_MAX, &n, &next)) <= 0)
+                return rv;
+
+            s->cur = next - s->buf;
+
+            // Skip empty or null multibulk entirely
+            if(n <= 0) {
+                s->pos = s->cur;
+                continue;
+            }
+
+            s->want = n;
+            s->argc = 0;
+            s->verbatim = 1;
+        }
+
+        // Parse as many arguments as we have data for
+        while(s->argc < s->want) {
+            p = s->buf + s->cur;
+            if(p >= end)
+                return 0;
+
+            if(*p == '$') {
+                if((rv = __read_int(p+1, end, RESP_MAX_BULK, &n, &next)) <= 0)
+                    return rv;
+                if(n < 0)
+                    return -1;
+
+                // Wait until we have the whole bulk and its CRLF
+                if(end - next < n + 2)
+                    return 0;
+                if(next[n] != '\r' || next[n+1] != '\n')
+                    return -1;
+
+                if(__push_arg(s, next, n) < 0)
+                    return -1;
+
+                s->cur = (next - s->buf) + n + 2;
+            } else if(*p == ':') {
+                if((rv = __read_int(p+1, end, LLONG_MAX, &n, &next)) <= 0)
+                    return rv;
+
+                // The integer's digits are the argument
+                if(__push_arg(s, p+1, next-p-3) < 0)
+                    return -1;
+
+                s->cur = next - s->buf;
+                s->verbatim = 0;
+            } else {
+                return -1;
+            }
+        }
+
+        // We have a complete command
+        s->start = s->pos;
+        s->end = s->cur;
+        s->pos = s->cur;
+        s->want = 0;
+
+        return 1;
+    }
+}
+
+size_t respScannerPending(respScanner *s) {
+    return s->len - s->pos;
+}
+
+/**
+ * Whether p looks like the start of a command with at least one bulk
+ * string argument
+ */
+static inline int __is_header(const char *p, const char *end) {
+    const char *q = p + 1;
+
+    while(q < end && *q >= '0' && *q <= '9' && q - p <= RESP_MAX_LINE)
+        q++;
+
+    return q > p + 1 && p[1] != '0' && end - q >= 3 &&
+           q[0] == '\r' && q[1] == '\n' && q[2] == '$';
+}
+
+size_t respScannerResync(respScanner *s, const char *buf, size_t len, size_t from) {
+    const char *p = buf + from, *end = buf + len;
+    int i, rv = 0;
+
+    for(;p < end && (p = memchr(p, '*', end - p)) != NULL;p++) {
+        // Every command but the first follows the CRLF ending the last one
+        if(p - buf < 2 || p[-1] != '\n' || p[-2] != '\r' || !__is_header(p, end))
+            continue;
+
+        // Running out of input is fine, but a protocol error isn't
+        respScannerAttach(s, p, end - p);
+        for(i=0;i<RESP_RESYNC_CHECK && (rv = respScannerNext(s)) == 1;i++)
+            ;
+        respScannerDetach(s);
+
+        if(rv >= 0)
+            return p - buf;
+    }
+
+    return len;
+}
@@ -0,0 +1,124 @@
+#ifndef REDIS_RESP_SCANNER_H
+#define REDIS_RESP_SCANNER_H
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Initial scanner buffer and argument vector allocation sizes
+ */
+#define RESP_INIT_ALLOC 65536
+#define RESP_INIT_ARGS  16
+
+/**
+ * Largest bulk string we'll accept (matches Redis' proto-max-bulk-len)
+ */
+#define RESP_MAX_BULK (512*1024*1024)
+
+/**
+ * Longest length/integer line we'll look through before giving up
+ */
+#define RESP_MAX_LINE 32
+
+/**
+ * How many commands have to parse from a place that looks like the start
+ * of one before we'll take it as one
+ */
+#define RESP_RESYNC_CHECK 16
+
+/**
+ * Streaming tokenizer for multibulk Redis commands.  Rather than building
+ * a reply tree, each command is returned as argc/argv/argvlen slices that
+ * point directly into the scanner's input buffer.  Every argument slice is
+ * followed by CRLF in the buffer, so strtod/strtoll can be used on it
+ * directly without copying.
+ *
+ * Slices are only valid until the next call to respScannerReserve or
+ * respScannerFeed, which may move or reallocate the buffer.
+ */
+typedef struct _respScanner {
+    /**
+     * Input buffer, allocated size, and how much of it holds data
+     */
+    char *buf;
+    size_t size;
+    size_t len;
+
+    /**
+     * Our own buffer while we're attached to someone else's
+     */
+    char *own;
+
+    /**
+     * Start of the first unconsumed command, and where parsing of it
+     * will resume if it was incomplete.
+     */
+    size_t pos;
+    size_t cur;
+
+    /**
+     * Number of arguments the current command has (zero if we haven't
+     * started one yet).
+     */
+    long long want;
+
+    /**
+     * Arguments of the last (or in progress) command
+     */
+    int argc;
+    int argcap;
+    const char **argv;
+    size_t *argvlen;
+
+    /**
+     * Offsets of the last command's original bytes in our buffer, and
+     * whether those bytes can be copied to the output verbatim (they can't
+     * if any argument was sent as an integer rather than a bulk string).
+     */
+    size_t start;
+    size_t end;
+    int verbatim;
+} respScanner;
+
+/**
+ * The original protocol bytes of the last command parsed
+ */
+#define RESP_CMD_PTR(s) ((s)->buf + (s)->start)
+#define RESP_CMD_LEN(s) ((s)->end - (s)->start)
+
+// Allocation, deallocation
+respScanner *respScannerCreate(void);
+void respScannerFree(respScanner *s);
+
+// Get a pointer to at least len writable bytes at the end of our buffer so
+// callers can read input directly into it, then commit what was written.
+char *respScannerReserve(respScanner *s, size_t len);
+void respScannerCommit(respScanner *s, size_t len);
+
+// Copy data into the scanner
+int respScannerFeed(respScanner *s, const char *buf, size_t len);
+
+// Scan a caller owned buffer of complete commands in place, rather than
+// our own.  Reserve and Feed may not be used until we're detached again.
+void respScannerAttach(respScanner *s, const char *buf, size_t len);
+void respScannerDetach(respScanner *s);
+
+// Drop anything buffered, keeping our allocations for the next stream
+void respScannerReset(respScanner *s);
+
+// Parse the next command.  Returns 1 if one is available in s->argc, s->argv
+// and s->argvlen, 0 if more input is needed, and -1 on a protocol error.
+int respScannerNext(respScanner *s);
+
+// Number of bytes buffered that don't yet form a complete command
+size_t respScannerPending(respScanner *s);
+
+// Find the first command in buf that starts at or after from, by looking for
+// a multibulk header (*<n>\r\n$) just after a CRLF and checking that what
+// follows parses.  Returns len if there isn't one.  s is attached to buf to
+// check, and detached again.  A bulk string can hold anything, so this can
+// still be fooled, and callers should make sure whatever parsed up to here
+// ends where we say the next command starts.
+size_t respScannerResync(respScanner *s, const char *buf, size_t len, size_t from);
+
+#endif
@@ -0,0 +1,106 @@
+/**
+ * Lock free single producer, single consumer ring
+ */
+
+#include <sched.h>
+#include <time.h>
+
+#include "ring.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RING_PAUSE() __builtin_ia32_pause()
+#else
+#define RING_PAUSE()
+#endif
+
+int cmdRingInit(cmdRing *r, size_t size) {
+    size_t n = 2;
+
+    while(n < size)
+        n <<= 1;
+
+    if((r->items = calloc(n, sizeof(void*))) == NULL)
+        return -1;
+
+    r->mask = n-1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+
+    return 0;
+}
+
+void cmdRingFree(cmdRing *r) {
+    free(r->items);
+    r->items = NULL;
+}
+
+int cmdRingTryPush(cmdRing *r, void *item) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    if(tail - head > r->mask)
+        return -1;
+
+    r->items[tail & r->mask] = item;
+    atomic_store_explicit(&r->tail, tail+1, memory_order_release);
+
+    return 0;
+}
+
+void *cmdRingTryPop(cmdRing *r) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    void *item;
+
+    if(head == tail)
+        return NULL;
+
+    item = r->items[head & r->mask];
+    atomic_store_explicit(&r->head, head+1, memory_order_release);
+
+    return item;
+}
+
+/**
+ * Back off a little more each time we find the ring unusable
+ */
+static inline void __ring_wait(unsigned int *spins) {
+    struct timespec ts = { 0, RING_SLEEP_US*1000 };
+
+    if(*spins < RING_SPIN) {
+        RING_PAUSE();
+    } else if(*spins < RING_SPIN + RING_YIELD) {
+        sched_yield();
+    } else {
+        nanosleep(&ts, NULL);
+    }
+
+    (*spins)++;
+}
+
+int cmdRingPush(cmdRing *r, void *item, atomic_int *stop) {
+    unsigned int spins = 0;
+
+    while(cmdRingTryPush(r, item) < 0) {
+        if(stop && atomic_load(stop))
+            return -1;
+
+        __ring_wait(&spins);
+    }
+
+    return 0;
+}
+
+void *cmdRingPop(cmdRing *r, atomic_int *stop) {
+    unsigned int spins = 0;
+    void *item;
+
+    while((item = cmdRingTryPop(r)) == NULL) {
+        if(stop && atomic_load(stop))
+            return NULL;
+
+        __ring_wait(&spins);
+    }
+
+    return item;
+}
@@ -0,0 +1,46 @@
+#ifndef REDIS_CMD_RING_H
+#define REDIS_CMD_RING_H
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/**
+ * How many times we spin on a full or empty ring before yielding, and how
+ * long we sleep (in microseconds) once yielding doesn't help either.
+ */
+#define RING_SPIN 128
+#define RING_YIELD 16
+#define RING_SLEEP_US 50
+
+/**
+ * Bounded single producer, single consumer ring of pointers.  Exactly one
+ * thread may push and exactly one other thread may pop.  Neither side ever
+ * takes a lock; a side that has to wait spins, then yields, then sleeps.
+ */
+typedef struct _cmdRing {
+    void **items;
+    size_t mask;
+
+    /**
+     * Next slot to pop and next slot to push, on separate cache lines
+     * so the two threads don't fight over them.
+     */
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+} cmdRing;
+
+// Create a ring holding at least size items, and free it
+int cmdRingInit(cmdRing *r, size_t size);
+void cmdRingFree(cmdRing *r);
+
+// Non blocking push/pop.  Push returns -1 if the ring is full, and pop
+// returns NULL if it is empty.
+int cmdRingTryPush(cmdRing *r, void *item);
+void *cmdRingTryPop(cmdRing *r);
+
+// Blocking push/pop.  If stop is not NULL and becomes nonzero while we're
+// waiting, we give up, returning -1 or NULL.
+int cmdRingPush(cmdRing *r, void *item, atomic_int *stop);
+void *cmdRingPop(cmdRing *r, atomic_int *stop);
+
+#endif
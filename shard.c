@@ -0,0 +1,316 @@
+/**
+ * Sharded multi-threaded aggregation
+ */
+
+#include "shard.h"
+#include "hash.h"
+
+/**
+ * Which shard a key belongs to.  We use the high bits of the hash, since the
+ * low bits pick the key's slot inside the shard's own table.
+ */
+#define SHARD_FOR(hash, count) \
+    ((uint32_t)((hash) >> 32) % (count))
+
+static void __batch_free(cmdShardBatch *batch) {
+    cmdShardBatch *tmp;
+
+    while(batch) {
+        tmp = batch->next;
+        free(batch->buf);
+        free(batch);
+        batch = tmp;
+    }
+}
+
+/**
+ * Get an empty batch with room for at least len bytes, reusing one the
+ * shard has finished with if we can.
+ */
+static cmdShardBatch *__batch_get(cmdShard *sh, size_t len) {
+    cmdShardBatch *batch;
+    size_t size = len > SHARD_BATCH_SIZE ? len : SHARD_BATCH_SIZE;
+
+    pthread_mutex_lock(&sh->lock);
+    if((batch = sh->free) != NULL)
+        sh->free = batch->next;
+    pthread_mutex_unlock(&sh->lock);
+
+    // Reuse it if it's big enough
+    if(batch && batch->size >= len) {
+        batch->next = NULL;
+        batch->len = 0;
+        return batch;
+    }
+
+    if(batch) {
+        batch->next = NULL;
+        __batch_free(batch);
+    }
+
+    if((batch = calloc(1, sizeof(cmdShardBatch))) == NULL)
+        return NULL;
+
+    if((batch->buf = malloc(size)) == NULL) {
+        free(batch);
+        return NULL;
+    }
+
+    batch->size = size;
+
+    return batch;
+}
+
+/**
+ * Hand the batch we've been filling to the shard's thread
+ */
+static int __shard_push(cmdShard *sh) {
+    cmdShardBatch *batch = sh->fill;
+    int err;
+
+    sh->fill = NULL;
+
+    pthread_mutex_lock(&sh->lock);
+
+    // Don't let the producer get too far ahead
+    while(sh->pending >= SHARD_MAX_PENDING && !sh->err)
+        pthread_cond_wait(&sh->cond, &sh->lock);
+
+    if(sh->tail) {
+        sh->tail->next = batch;
+    } else {
+        sh->head = batch;
+    }
+    sh->tail = batch;
+    sh->pending++;
+    err = sh->err;
+
+    pthread_cond_broadcast(&sh->cond);
+    pthread_mutex_unlock(&sh->lock);
+
+    return err ? -1 : 0;
+}
+
+/**
+ * Aggregate every command in a batch into the shard's cmdHash, keeping any
+ * it turns away (after the key they overflow) in the order they came in
+ */
+static int __shard_process(cmdShard *sh, cmdShardBatch *batch) {
+    respScanner *s = sh->scanner;
+    int rv, added;
+
+    respScannerAttach(s, batch->buf, batch->len);
+
+    while((rv = respScannerNext(s)) == 1) {
+        added = cmdHashAdd(sh->cmd_hash, s->argc, s->argv, s->argvlen);
+        if(added == TYPE_UNSUPPORTED)
+            added = cmdBufferAppend(sh->out, RESP_CMD_PTR(s), RESP_CMD_LEN(s), 1);
+
+        if(added != 0) {
+            rv = -1;
+            break;
+        }
+    }
+
+    respScannerDetach(s);
+
+    return rv;
+}
+
+/**
+ * Shard thread, which aggregates batches until told there are no more
+ */
+static void *__shard_main(void *arg) {
+    cmdShard *sh = arg;
+    cmdShardBatch *batch;
+
+    for(;;) {
+        pthread_mutex_lock(&sh->lock);
+
+        while(!sh->head && !sh->done)
+            pthread_cond_wait(&sh->cond, &sh->lock);
+
+        // Nothing left and nothing else coming
+        if(!sh->head) {
+            pthread_mutex_unlock(&sh->lock);
+            break;
+        }
+
+        batch = sh->head;
+        if((sh->head = batch->next) == NULL)
+            sh->tail = NULL;
+        batch->next = NULL;
+        sh->pending--;
+
+        pthread_cond_broadcast(&sh->cond);
+        pthread_mutex_unlock(&sh->lock);
+
+        // Once we've failed just drain the queue
+        if(!sh->err && __shard_process(sh, batch) < 0) {
+            pthread_mutex_lock(&sh->lock);
+            sh->err = 1;
+            pthread_cond_broadcast(&sh->cond);
+            pthread_mutex_unlock(&sh->lock);
+        }
+
+        // Give the batch back to the producer
+        pthread_mutex_lock(&sh->lock);
+        batch->next = sh->free;
+        sh->free = batch;
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    return NULL;
+}
+
+cmdShardPool *cmdShardPoolCreate(unsigned int count, unsigned int ksize,
+                                 unsigned int msize)
+{
+    cmdShardPool *pool;
+    cmdShard *sh;
+    unsigned int i;
+
+    if(count < 1 || count > SHARD_MAX_THREADS)
+        return NULL;
+
+    if((pool = calloc(1, sizeof(cmdShardPool))) == NULL)
+        return NULL;
+
+    if((pool->shards = calloc(count, sizeof(cmdShard))) == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    // Create each shard then start its thread
+    for(i=0;i<count;i++) {
+        sh = &pool->shards[i];
+
+        pthread_mutex_init(&sh->lock, NULL);
+        pthread_cond_init(&sh->cond, NULL);
+
+        // Split the initial key table size between our shards
+        sh->cmd_hash = cmdHashCreate(ksize/count ? ksize/count : 1, msize);
+        sh->scanner = respScannerCreate();
+        sh->out = cmdBufferCreate();
+
+        if(!sh->cmd_hash || !sh->scanner || !sh->out ||
+           cmdHashSetOutput(sh->cmd_hash, sh->out) < 0 ||
+           pthread_create(&sh->thread, NULL, __shard_main, sh) != 0)
+        {
+            // Only clean up what we actually started
+            if(sh->cmd_hash) cmdHashFree(sh->cmd_hash);
+            if(sh->scanner) respScannerFree(sh->scanner);
+            if(sh->out) cmdBufferFree(sh->out);
+            pthread_mutex_destroy(&sh->lock);
+            pthread_cond_destroy(&sh->cond);
+
+            pool->count = i;
+            cmdShardPoolFree(pool);
+            return NULL;
+        }
+
+        sh->started = 1;
+        pool->count++;
+    }
+
+    return pool;
+}
+
+int cmdShardPoolAdd(cmdShardPool *pool, const char *key, size_t keylen,
+                    const char *cmd, size_t len)
+{
+    uint64_t hash = wyhash(key, keylen, WYHASH_SEED);
+    cmdShard *sh = &pool->shards[SHARD_FOR(hash, pool->count)];
+
+    // Send off what we have if this command won't fit
+    if(sh->fill && sh->fill->len + len > sh->fill->size) {
+        if(__shard_push(sh) < 0)
+            return -1;
+    }
+
+    if(!sh->fill && (sh->fill = __batch_get(sh, len)) == NULL)
+        return -1;
+
+    memcpy(sh->fill->buf + sh->fill->len, cmd, len);
+    sh->fill->len += len;
+
+    return 0;
+}
+
+/**
+ * Tell every thread there's nothing else coming and wait for it
+ */
+static void __pool_stop(cmdShardPool *pool) {
+    cmdShard *sh;
+    unsigned int i;
+
+    for(i=0;i<pool->count;i++) {
+        sh = &pool->shards[i];
+
+        pthread_mutex_lock(&sh->lock);
+        sh->done = 1;
+        pthread_cond_broadcast(&sh->cond);
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    for(i=0;i<pool->count;i++) {
+        sh = &pool->shards[i];
+
+        if(sh->started) {
+            pthread_join(sh->thread, NULL);
+            sh->started = 0;
+        }
+    }
+}
+
+int cmdShardPoolFinish(cmdShardPool *pool) {
+    cmdShard *sh;
+    unsigned int i;
+    int err = 0;
+
+    // Send every partial batch
+    for(i=0;i<pool->count;i++) {
+        sh = &pool->shards[i];
+
+        if(sh->fill && sh->fill->len && __shard_push(sh) < 0)
+            err = 1;
+    }
+
+    __pool_stop(pool);
+
+    // Threads are done, so we can read this without the lock
+    for(i=0;i<pool->count;i++) {
+        err |= pool->shards[i].err;
+    }
+
+    return err ? -1 : 0;
+}
+
+void cmdShardPoolFree(cmdShardPool *pool) {
+    cmdShard *sh;
+    unsigned int i;
+
+    if(!pool)
+        return;
+
+    // Make sure nothing is still running
+    __pool_stop(pool);
+
+    for(i=0;i<pool->count;i++) {
+        sh = &pool->shards[i];
+
+        __batch_free(sh->fill);
+        __batch_free(sh->head);
+        __batch_free(sh->free);
+
+        cmdHashFree(sh->cmd_hash);
+        respScannerFree(sh->scanner);
+        cmdBufferFree(sh->out);
+
+        pthread_mutex_destroy(&sh->lock);
+        pthread_cond_destroy(&sh->cond);
+    }
+
+    free(pool->shards);
+    free(pool);
+}
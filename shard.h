@@ -0,0 +1,100 @@
+#ifndef REDIS_CMD_SHARD_H
+#define REDIS_CMD_SHARD_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "cmdhash.h"
+#include "resp.h"
+
+/**
+ * How many bytes of commands we collect for a shard before handing them
+ * to its thread, and how many batches may be waiting on a shard before
+ * we block.
+ */
+#define SHARD_BATCH_SIZE (256*1024)
+#define SHARD_MAX_PENDING 8
+
+/**
+ * Maximum number of aggregation threads
+ */
+#define SHARD_MAX_THREADS 256
+
+/**
+ * A batch of complete commands in the Redis protocol
+ */
+typedef struct _cmdShardBatch {
+    struct _cmdShardBatch *next;
+
+    char *buf;
+    size_t size;
+    size_t len;
+} cmdShardBatch;
+
+/**
+ * One aggregation thread, and the cmdHash that only it touches
+ */
+typedef struct _cmdShard {
+    pthread_t thread;
+    int started;
+
+    /**
+     * The shard's own hash and scanner
+     */
+    cmdHash *cmd_hash;
+    respScanner *scanner;
+
+    /**
+     * Commands we couldn't aggregate after all (an increment that would
+     * overflow), each behind the key it had to be written after.  It's
+     * left to the caller to pass these through once we've finished.
+     */
+    cmdBuffer *out;
+
+    /**
+     * Batch currently being filled by the producer
+     */
+    cmdShardBatch *fill;
+
+    /**
+     * Queue of full batches, and batches the thread has finished with
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    cmdShardBatch *head, *tail;
+    cmdShardBatch *free;
+    unsigned int pending;
+
+    /**
+     * Set when no more batches are coming, or if aggregation failed
+     */
+    int done;
+    int err;
+} cmdShard;
+
+/**
+ * A set of shards.  Commands are routed by key hash, so every key lives in
+ * exactly one shard and per key ordering is preserved.
+ */
+typedef struct _cmdShardPool {
+    unsigned int count;
+    cmdShard *shards;
+} cmdShardPool;
+
+// Create count shards (and their threads), each with an empty cmdHash
+cmdShardPool *cmdShardPoolCreate(unsigned int count, unsigned int ksize,
+                                 unsigned int msize);
+
+// Route a complete command (in the Redis protocol) to the shard that owns
+// key, blocking if that shard is too far behind.
+int cmdShardPoolAdd(cmdShardPool *pool, const char *key, size_t keylen,
+                    const char *cmd, size_t len);
+
+// Flush everything to the shards and wait for them to finish.  After this
+// each shard's cmd_hash holds its final aggregates, to be written after
+// whatever is in its out.
+int cmdShardPoolFinish(cmdShardPool *pool);
+
+void cmdShardPoolFree(cmdShardPool *pool);
+
+#endif
@@ -0,0 +1,90 @@
+/**
+ * Snapshots of what we've aggregated, so a run can pick up where it left
+ * off (or where an earlier one finished)
+ */
+
+#include "snapshot.h"
+#include "spill.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int cmdSnapshotSave(const char *path, cmdSnapshotHeader *hdr,
+                    const uint64_t *sizes, cmdHash *ht)
+{
+    char tmp[PATH_MAX];
+    FILE *fd;
+    int rv;
+
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -1;
+
+    memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+    hdr->version = SNAPSHOT_VERSION;
+
+    if((fd = fopen(tmp, "w")) == NULL)
+        return -1;
+
+    setvbuf(fd, NULL, _IOFBF, SPILL_IO_SIZE);
+
+    fwrite(hdr, sizeof(*hdr), 1, fd);
+    if(hdr->outputs)
+        fwrite(sizes, sizeof(*sizes), hdr->outputs, fd);
+
+    // Make sure it's all on disk before it replaces the last one
+    rv = cmdHashSave(ht, fd) < 0 || fflush(fd) != 0 || fsync(fileno(fd)) != 0 ? -1 : 0;
+
+    if(fclose(fd) != 0 || rv < 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+int cmdSnapshotLoad(const char *path, cmdSnapshotHeader *hdr, uint64_t *sizes,
+                    unsigned int max, cmdHash *ht)
+{
+    struct stat st;
+    size_t pos;
+    char *map;
+    int fd, rv = -1;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED)
+        return -1;
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    memcpy(hdr, map, sizeof(*hdr));
+    pos = sizeof(*hdr) + sizeof(*sizes) * hdr->outputs;
+
+    if(!memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) &&
+       hdr->version == SNAPSHOT_VERSION && (!sizes || hdr->outputs <= max) &&
+       pos <= (size_t)st.st_size)
+    {
+        if(sizes)
+            memcpy(sizes, map + sizeof(*hdr), sizeof(*sizes) * hdr->outputs);
+
+        rv = cmdHashLoad(ht, map + pos, st.st_size - pos);
+    }
+
+    munmap(map, st.st_size);
+
+    return rv;
+}
@@ -0,0 +1,45 @@
+#ifndef REDIS_CMD_SNAPSHOT_H
+#define REDIS_CMD_SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cmdhash.h"
+
+#define SNAPSHOT_MAGIC "BOSNAP\r\n"
+#define SNAPSHOT_VERSION 1
+
+/**
+ * A snapshot of everything a cmdHash is holding, and how far we'd got
+ * when we took it: the input we were on and how many of its bytes we'd
+ * aggregated, how many commands we'd read and written, and how big each
+ * of our outputs was.  The file is this header, a size for each output,
+ * and then every key as the same records a spilled run holds.  Snapshots
+ * are loaded by mapping them and adding those records straight from the
+ * mapping.
+ */
+typedef struct _cmdSnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t outputs;
+
+    uint32_t inputs;
+    uint32_t input;
+    uint64_t offset;
+
+    uint64_t commands_in;
+    uint64_t commands_out;
+    uint64_t flushed;
+} cmdSnapshotHeader;
+
+// Save a snapshot (sizes may be NULL if it has no outputs), replacing whatever
+// was at path only once it's complete
+int cmdSnapshotSave(const char *path, cmdSnapshotHeader *hdr,
+                    const uint64_t *sizes, cmdHash *ht);
+
+// Add what a snapshot holds to a cmdHash, filling in its header and, unless
+// sizes is NULL, up to max output sizes.  Fails if it has more than that.
+int cmdSnapshotLoad(const char *path, cmdSnapshotHeader *hdr, uint64_t *sizes,
+                    unsigned int max, cmdHash *ht);
+
+#endif
@@ -0,0 +1,834 @@
+/**
+ * Sorted run files, for aggregating more than fits in memory
+ */
+
+#include "spill.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Order by hash first, as it's cheap and nearly always decides
+ */
+static inline int __cmp(uint64_t ha, const char *a, size_t la,
+                        uint64_t hb, const char *b, size_t lb)
+{
+    if(ha != hb)
+        return ha < hb ? -1 : 1;
+    if(la != lb)
+        return la < lb ? -1 : 1;
+
+    return memcmp(a, b, la);
+}
+
+static int __cmp_key(const void *a, const void *b) {
+    const cmdKeyList *x = *(cmdKeyList * const *)a;
+    const cmdKeyList *y = *(cmdKeyList * const *)b;
+
+    return __cmp(x->hash, x->key, x->len, y->hash, y->key, y->len);
+}
+
+/**
+ * A member along with its interned string, which is what it's sorted by
+ */
+typedef struct _cmdSpillEntry {
+    const cmdInternStr *str;
+    const cmdMemberList *mem;
+} cmdSpillEntry;
+
+static int __cmp_member(const void *a, const void *b) {
+    const cmdInternStr *x = ((const cmdSpillEntry *)a)->str;
+    const cmdInternStr *y = ((const cmdSpillEntry *)b)->str;
+
+    return __cmp(x->hash, x->str, x->len, y->hash, y->str, y->len);
+}
+
+static inline int __cmp_run(const cmdSpillRun *a, const cmdSpillRun *b) {
+    uint32_t ta = TYPE_CLASS(a->rec.type), tb = TYPE_CLASS(b->rec.type);
+
+    if(ta != tb)
+        return ta < tb ? -1 : 1;
+
+    return __cmp(a->rec.hash, a->key, a->rec.len, b->rec.hash, b->key,
+                 b->rec.len);
+}
+
+cmdSpill *cmdSpillCreate(const char *dir, size_t memory) {
+    cmdSpill *sp;
+
+    if((sp = calloc(1, sizeof(cmdSpill))) == NULL)
+        return NULL;
+
+    snprintf(sp->dir, sizeof(sp->dir), "%s", dir && *dir ? dir : "/tmp");
+
+    // Every run we merge at once gets a buffer, and they share our budget
+    sp->io_size = memory / SPILL_MAX_FANIN;
+    if(sp->io_size > SPILL_IO_SIZE)
+        sp->io_size = SPILL_IO_SIZE;
+    else if(sp->io_size < SPILL_MIN_IO)
+        sp->io_size = SPILL_MIN_IO;
+
+    return sp;
+}
+
+void cmdSpillFree(cmdSpill *sp) {
+    if(!sp)
+        return;
+
+    cmdSpillReset(sp);
+
+    free(sp->runs);
+    free(sp);
+}
+
+void cmdSpillReset(cmdSpill *sp) {
+    unsigned int i;
+
+    // Our run files were unlinked when we made them, so closing is enough
+    for(i=0;i<sp->count;i++) {
+        fclose(sp->runs[i].fd);
+        free(sp->runs[i].key);
+        free(sp->runs[i].members);
+    }
+
+    sp->count = 0;
+    sp->written = 0;
+    sp->merged = 0;
+    sp->merged_count = 0;
+}
+
+FILE *cmdSpillOpen(const char *dir) {
+    char path[1024 + 32];
+    FILE *fd;
+    int fdn;
+
+    snprintf(path, sizeof(path), "%s/buffer-optimize.XXXXXX", dir && *dir ? dir : "/tmp");
+    if((fdn = mkstemp(path)) < 0)
+        return NULL;
+
+    // Nobody else needs to see it, and this way it can't be left behind
+    unlink(path);
+
+    if((fd = fdopen(fdn, "w+")) == NULL) {
+        close(fdn);
+        return NULL;
+    }
+
+    return fd;
+}
+
+static int __compact(cmdSpill *sp, unsigned int n);
+
+/**
+ * Create an anonymous run file in our directory
+ */
+static FILE *__run_open(cmdSpill *sp) {
+    FILE *fd;
+
+    if((fd = cmdSpillOpen(sp->dir)) == NULL)
+        return NULL;
+
+    setvbuf(fd, NULL, _IOFBF, sp->io_size);
+
+    return fd;
+}
+
+/**
+ * Write a key's record, and its members in sorted order
+ */
+static int __write_key(FILE *fd, cmdHashContainer *c, cmdType type,
+                       cmdKeyList *key, cmdSpillEntry **mems, unsigned int *cap)
+{
+    cmdSpillEntry *tmp;
+    cmdMemberList *mem;
+    cmdSpillRecord rec;
+    cmdSpillMember sm;
+    cmdTableIter it;
+    unsigned int j;
+
+    if(key->count > *cap) {
+        if((tmp = realloc(*mems, sizeof(**mems) * key->count)) == NULL)
+            return -1;
+        *mems = tmp;
+        *cap = key->count;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    memset(&sm, 0, sizeof(sm));
+
+    j = 0;
+    cmdTableIterInit(&it, &key->members);
+    while((mem = cmdTableNext(&it)) != NULL) {
+        (*mems)[j].str = cmdInternLookup(c->intern, mem->id);
+        (*mems)[j].mem = mem;
+        rec.size += sizeof(sm) + (*mems)[j++].str->len;
+    }
+
+    qsort(*mems, j, sizeof(**mems), __cmp_member);
+
+    rec.hash = key->hash;
+    rec.type = type;
+    rec.len = key->len;
+    rec.count = j;
+    rec.flags = c->integer ? SPILL_INTEGER : 0;
+
+    fwrite(&rec, sizeof(rec), 1, fd);
+    fwrite(key->key, 1, key->len, fd);
+
+    for(j=0;j<rec.count;j++) {
+        sm.hash = (*mems)[j].str->hash;
+        sm.len = (*mems)[j].str->len;
+        sm.flags = (*mems)[j].mem->flags;
+        sm.value = (*mems)[j].mem->value;
+
+        fwrite(&sm, sizeof(sm), 1, fd);
+        fwrite((*mems)[j].str->str, 1, sm.len, fd);
+    }
+
+    return 0;
+}
+
+/**
+ * A container's keys, in sorted order
+ */
+static cmdKeyList **__sorted_keys(cmdHashContainer *c) {
+    cmdKeyList **keys, *key;
+    cmdTableIter it;
+    unsigned int n = 0;
+
+    if((keys = malloc(sizeof(*keys) * (c->keys ? c->keys : 1))) == NULL)
+        return NULL;
+
+    cmdTableIterInit(&it, &c->keytable);
+    while((key = cmdTableNext(&it)) != NULL) {
+        keys[n++] = key;
+    }
+
+    qsort(keys, n, sizeof(*keys), __cmp_key);
+
+    return keys;
+}
+
+/**
+ * Write every key of a type, and of the other form of its counter if it
+ * has one, in sorted order.  No key is in both.
+ */
+static int __write_class(FILE *fd, cmdHash *ht, cmdType type) {
+    cmdHashContainer *a = ht->cmds[type], *b = NULL;
+    cmdKeyList **ka = NULL, **kb = NULL, *x, *y;
+    cmdSpillEntry *mems = NULL;
+    unsigned int i = 0, j = 0, cap = 0, nb = 0;
+    int rv = -1;
+
+    if(type + 1 < TYPE_COUNT && TYPE_CLASS(type + 1) == type) {
+        b = ht->cmds[type + 1];
+        nb = b->keys;
+    }
+
+    if(!a->keys && !nb)
+        return 0;
+
+    if((ka = __sorted_keys(a)) == NULL || (nb && (kb = __sorted_keys(b)) == NULL))
+        goto done;
+
+    while(i < a->keys || j < nb) {
+        x = i < a->keys ? ka[i] : NULL;
+        y = j < nb ? kb[j] : NULL;
+
+        if(y && (!x || __cmp_key(&y, &x) < 0)) {
+            if(__write_key(fd, b, type + 1, y, &mems, &cap) < 0)
+                goto done;
+            j++;
+        } else {
+            if(__write_key(fd, a, type, x, &mems, &cap) < 0)
+                goto done;
+            i++;
+        }
+    }
+
+    // Any failed write leaves the error flag set
+    rv = ferror(fd) ? -1 : 0;
+
+done:
+    free(ka);
+    free(kb);
+    free(mems);
+
+    return rv;
+}
+
+int cmdSpillWriteHash(FILE *fd, cmdHash *ht) {
+    int i;
+
+    // Containers are written in type order, so the run stays sorted
+    for(i=0;i<TYPE_COUNT;i++) {
+        if(TYPE_CLASS(i) == i && __write_class(fd, ht, i) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int cmdSpillWrite(cmdSpill *sp, cmdHash *ht) {
+    cmdSpillRun *runs;
+    FILE *fd;
+
+    if(sp->count == sp->size) {
+        runs = realloc(sp->runs, sizeof(cmdSpillRun) * (sp->size ? sp->size*2 : 8));
+        if(runs == NULL)
+            return -1;
+
+        sp->runs = runs;
+        sp->size = sp->size ? sp->size*2 : 8;
+    }
+
+    if((fd = __run_open(sp)) == NULL)
+        return -1;
+
+    if(cmdSpillWriteHash(fd, ht) < 0 || fflush(fd) != 0) {
+        fclose(fd);
+        return -1;
+    }
+
+    memset(&sp->runs[sp->count], 0, sizeof(cmdSpillRun));
+    sp->runs[sp->count++].fd = fd;
+    sp->written++;
+    sp->merged = 0;
+
+    // Once we have a full merge's worth of runs at a level they become one
+    // run at the next, so we never hold more than a few of them open
+    while(sp->count >= SPILL_MAX_FANIN &&
+          sp->runs[sp->count - SPILL_MAX_FANIN].level == sp->runs[sp->count - 1].level)
+    {
+        if(__compact(sp, SPILL_MAX_FANIN) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Grow a buffer to at least len bytes
+ */
+static inline int __reserve(char **buf, size_t *cap, size_t len) {
+    char *tmp;
+
+    if(len <= *cap)
+        return 0;
+
+    if((tmp = realloc(*buf, len)) == NULL)
+        return -1;
+
+    *buf = tmp;
+    *cap = len;
+
+    return 0;
+}
+
+/**
+ * Read a run's next record.  Returns 1 if we have one, 0 at the end of the
+ * run and -1 on error.
+ */
+static int __run_next(cmdSpillRun *r) {
+    if(fread(&r->rec, sizeof(r->rec), 1, r->fd) != 1)
+        return ferror(r->fd) ? -1 : 0;
+
+    if(__reserve(&r->key, &r->keycap, r->rec.len) < 0 ||
+       __reserve(&r->members, &r->memcap, r->rec.size) < 0)
+    {
+        return -1;
+    }
+
+    if(fread(r->key, 1, r->rec.len, r->fd) != r->rec.len ||
+       fread(r->members, 1, r->rec.size, r->fd) != r->rec.size)
+    {
+        return -1;
+    }
+
+    r->pos = 0;
+    r->left = r->rec.count;
+
+    return 1;
+}
+
+/**
+ * Min heap of runs, ordered by the record each is positioned on
+ */
+static void __heap_push(cmdSpillRun **heap, unsigned int *n, cmdSpillRun *r) {
+    unsigned int i = (*n)++, parent;
+
+    while(i) {
+        parent = (i-1)/2;
+        if(__cmp_run(heap[parent], r) <= 0)
+            break;
+
+        heap[i] = heap[parent];
+        i = parent;
+    }
+
+    heap[i] = r;
+}
+
+static cmdSpillRun *__heap_pop(cmdSpillRun **heap, unsigned int *n) {
+    cmdSpillRun *top = heap[0], *last = heap[--(*n)];
+    unsigned int i = 0, child;
+
+    while((child = 2*i+1) < *n) {
+        if(child+1 < *n && __cmp_run(heap[child+1], heap[child]) < 0)
+            child++;
+        if(__cmp_run(last, heap[child]) <= 0)
+            break;
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    if(*n)
+        heap[i] = last;
+
+    return top;
+}
+
+static inline void __peek(cmdSpillRun *r, cmdSpillMember *m, const char **str) {
+    memcpy(m, r->members + r->pos, sizeof(*m));
+    *str = r->members + r->pos + sizeof(*m);
+}
+
+/**
+ * Find the smallest member any run in a group is positioned on, and move
+ * those runs that have it past it.  The group is in the order its runs were
+ * written, so a value that was set replaces whatever came before it, and
+ * increments after it add to it.  Each run fit, but together an integer
+ * can overflow or a score come out as one Redis rejects, in which case we
+ * return -1.
+ */
+static int __group_next(cmdSpillRun **group, unsigned int n, cmdSpillMember *out,
+                        const char **str)
+{
+    int integer = group[0]->rec.flags & SPILL_INTEGER;
+    uint32_t type = group[0]->rec.type;
+    int set = type == TYPE_SADD || type == TYPE_PFADD;
+    cmdSpillMember m;
+    const char *s;
+    unsigned int i;
+    int found = 0, rv = 1;
+
+    for(i=0;i<n;i++) {
+        if(!group[i]->left)
+            continue;
+
+        __peek(group[i], &m, &s);
+        if(!found || __cmp(m.hash, s, m.len, out->hash, *str, out->len) < 0) {
+            *out = m;
+            *str = s;
+            found = 1;
+        }
+    }
+
+    if(!found)
+        return 0;
+
+    out->flags = 0;
+    out->value = 0;
+    for(i=0;i<n;i++) {
+        if(!group[i]->left)
+            continue;
+
+        __peek(group[i], &m, &s);
+        if(__cmp(m.hash, s, m.len, out->hash, *str, out->len))
+            continue;
+
+        // Set members carry their hit counts in value
+        if(set) {
+            out->value += m.value;
+        } else if(m.flags & MEMBER_SET) {
+            out->flags |= MEMBER_SET;
+            out->score = m.score;
+        } else if(integer) {
+            if(__builtin_add_overflow(out->value, m.value, &out->value))
+                rv = -1;
+        } else {
+            out->score += m.score;
+            if(isnan(out->score) || (type != TYPE_ZINCRBY && isinf(out->score)))
+                rv = -1;
+        }
+
+        group[i]->pos += sizeof(m) + m.len;
+        group[i]->left--;
+    }
+
+    return rv;
+}
+
+/**
+ * Move every run in a group back to the first member of its record
+ */
+static void __group_rewind(cmdSpillRun **group, unsigned int n) {
+    unsigned int i;
+
+    for(i=0;i<n;i++) {
+        group[i]->pos = 0;
+        group[i]->left = group[i]->rec.count;
+    }
+}
+
+/**
+ * Hand sink one part of a key: the union of a group's members, then the key
+ * itself, flagged with SPILL_PART if more of the key follows it.  Returns the
+ * number of commands written, or -1 on error.
+ */
+static int __group_part(cmdSpillRun **group, unsigned int n, int more,
+                        cmdSpillSink sink, void *arg)
+{
+    cmdSpillRecord rec = group[0]->rec;
+    const char *str = NULL;
+    cmdSpillMember m;
+
+    rec.flags = more ? rec.flags | SPILL_PART : rec.flags & ~SPILL_PART;
+
+    while(__group_next(group, n, &m, &str) == 1) {
+        if(sink(arg, &rec, group[0]->key, &m, str) < 0)
+            return -1;
+    }
+
+    return sink(arg, &rec, group[0]->key, NULL, NULL);
+}
+
+/**
+ * Hand a key to sink as the union of its runs' members, then the key
+ * itself.  If they can't all be combined, a run already holds the key in
+ * parts, or runs hold both forms of a counter for it, we hand over each
+ * run's parts of it in turn instead, so its commands are written in the
+ * order they came.  Returns the number of commands written, or -1 on error.
+ */
+static int __group_sink(cmdSpillRun **group, unsigned int n, cmdSpillSink sink,
+                        void *arg)
+{
+    const char *str = NULL;
+    cmdSpillMember m;
+    unsigned int i;
+    int rv = 0, cmds, more, total = 0;
+
+    // Both forms of a counter only combine with their own kind
+    for(i=0;i<n;i++) {
+        if(group[i]->rec.flags & SPILL_PART || group[i]->rec.type != group[0]->rec.type)
+            rv = -1;
+    }
+
+    // A run on its own always fits
+    if(rv == 0 && n > 1) {
+        while((rv = __group_next(group, n, &m, &str)) == 1)
+            ;
+
+        __group_rewind(group, n);
+    }
+
+    if(rv == 0)
+        return __group_part(group, n, 0, sink, arg);
+
+    for(i=0;i<n;i++) {
+        for(;;) {
+            more = (group[i]->rec.flags & SPILL_PART) || i < n-1;
+            if((cmds = __group_part(group + i, 1, more, sink, arg)) < 0)
+                return -1;
+
+            total += cmds;
+
+            if(!(group[i]->rec.flags & SPILL_PART))
+                break;
+
+            // The rest of the key follows straight after in the same run
+            if(__run_next(group[i]) != 1)
+                return -1;
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Put a group back into the order its runs were written
+ */
+static void __group_sort(cmdSpillRun **group, unsigned int n) {
+    cmdSpillRun *r;
+    unsigned int i, j;
+
+    for(i=1;i<n;i++) {
+        r = group[i];
+        for(j=i;j && group[j-1] > r;j--)
+            group[j] = group[j-1];
+        group[j] = r;
+    }
+}
+
+/**
+ * Move every run in a group past the key it's positioned on, including any
+ * more parts of it, without handing it to anyone
+ */
+static int __group_skip(cmdSpillRun **group, unsigned int n) {
+    unsigned int i;
+
+    for(i=0;i<n;i++) {
+        while(group[i]->rec.flags & SPILL_PART) {
+            if(__run_next(group[i]) != 1)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Merge count of our runs, starting with first, handing each key to sink
+ * unless we've been told to skip it
+ */
+static int __merge_runs(cmdSpill *sp, unsigned int first, unsigned int count,
+                        cmdSpillSink sink, void *arg, unsigned int *total)
+{
+    cmdSpillRun *runs = sp->runs + first;
+    cmdSpillRun **heap, **group, *r;
+    unsigned int i, n = 0, g;
+    int rv = -1, cmds;
+
+    *total = 0;
+
+    heap = malloc(sizeof(*heap) * count);
+    group = malloc(sizeof(*group) * count);
+    if(!heap || !group)
+        goto done;
+
+    // Start every run from its first record
+    for(i=0;i<count;i++) {
+        r = &runs[i];
+
+        if(fseek(r->fd, 0, SEEK_SET) != 0)
+            goto done;
+
+        switch(__run_next(r)) {
+            case -1:
+                goto done;
+            case 1:
+                __heap_push(heap, &n, r);
+                break;
+        }
+    }
+
+    while(n) {
+        // Pull every run positioned on the same key as the smallest one
+        g = 0;
+        group[g++] = __heap_pop(heap, &n);
+        while(n && !__cmp_run(heap[0], group[0]))
+            group[g++] = __heap_pop(heap, &n);
+
+        __group_sort(group, g);
+
+        if(sp->skip && sp->skip(sp->skip_arg, &group[0]->rec, group[0]->key)) {
+            if(__group_skip(group, g) < 0)
+                goto done;
+        } else {
+            if((cmds = __group_sink(group, g, sink, arg)) < 0)
+                goto done;
+
+            *total += cmds;
+        }
+
+        // Move those runs on to their next key
+        for(i=0;i<g;i++) {
+            switch(__run_next(group[i])) {
+                case -1:
+                    goto done;
+                case 1:
+                    __heap_push(heap, &n, group[i]);
+                    break;
+            }
+        }
+    }
+
+    rv = 0;
+
+done:
+    free(heap);
+    free(group);
+
+    return rv;
+}
+
+/**
+ * Where a merged key's members are gathered before it's written, since a
+ * record's size and member count come ahead of its members
+ */
+typedef struct _cmdSpillWriter {
+    FILE *fd;
+    char *buf;
+    size_t len, cap;
+    uint32_t count;
+} cmdSpillWriter;
+
+static int __write_sink(void *arg, const cmdSpillRecord *rec, const char *key,
+                        const cmdSpillMember *m, const char *member)
+{
+    cmdSpillWriter *w = arg;
+    cmdSpillRecord out;
+    size_t len;
+
+    if(m) {
+        len = w->len + sizeof(*m) + m->len;
+        if(len > w->cap && __reserve(&w->buf, &w->cap, len * 2) < 0)
+            return -1;
+
+        memcpy(w->buf + w->len, m, sizeof(*m));
+        memcpy(w->buf + w->len + sizeof(*m), member, m->len);
+        w->len += sizeof(*m) + m->len;
+        w->count++;
+
+        return 0;
+    }
+
+    out = *rec;
+    out.size = w->len;
+    out.count = w->count;
+
+    fwrite(&out, sizeof(out), 1, w->fd);
+    fwrite(key, 1, out.len, w->fd);
+    fwrite(w->buf, 1, w->len, w->fd);
+
+    w->len = w->count = 0;
+
+    return ferror(w->fd) ? -1 : 0;
+}
+
+/**
+ * Merge the last n of our runs into a single run one level up from them
+ */
+static int __compact(cmdSpill *sp, unsigned int n) {
+    cmdSpillWriter w = { NULL, NULL, 0, 0, 0 };
+    unsigned int i, first = sp->count - n, level, count;
+    int rv;
+
+    // Runs only ever get smaller towards the end, so the first is the biggest
+    level = sp->runs[first].level + 1;
+
+    if((w.fd = __run_open(sp)) == NULL)
+        return -1;
+
+    rv = __merge_runs(sp, first, n, __write_sink, &w, &count);
+    free(w.buf);
+
+    if(rv < 0 || fflush(w.fd) != 0) {
+        fclose(w.fd);
+        return -1;
+    }
+
+    for(i=first;i<sp->count;i++) {
+        fclose(sp->runs[i].fd);
+        free(sp->runs[i].key);
+        free(sp->runs[i].members);
+    }
+
+    memset(&sp->runs[first], 0, sizeof(cmdSpillRun));
+    sp->runs[first].fd = w.fd;
+    sp->runs[first].level = level;
+    sp->count = first + 1;
+
+    return 0;
+}
+
+/**
+ * Merge our smallest runs together until we have few enough to merge at once
+ */
+static int __merge_passes(cmdSpill *sp) {
+    unsigned int n;
+
+    while(sp->count > SPILL_MAX_FANIN) {
+        n = sp->count - SPILL_MAX_FANIN + 1;
+        if(__compact(sp, n < SPILL_MAX_FANIN ? n : SPILL_MAX_FANIN) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int cmdSpillMerge(cmdSpill *sp, cmdSpillSink sink, void *arg,
+                  unsigned int *count)
+{
+    if(__merge_passes(sp) < 0 ||
+       __merge_runs(sp, 0, sp->count, sink, arg, count) < 0)
+    {
+        return -1;
+    }
+
+    sp->merged = 1;
+    sp->merged_count = *count;
+
+    return 0;
+}
+
+int cmdSpillMergeTo(cmdSpill *sp, FILE *fd) {
+    cmdSpillWriter w = { fd, NULL, 0, 0, 0 };
+    unsigned int count;
+    int rv;
+
+    if(__merge_passes(sp) < 0)
+        return -1;
+
+    rv = __merge_runs(sp, 0, sp->count, __write_sink, &w, &count);
+    free(w.buf);
+
+    return rv;
+}
+
+int cmdSpillMergeKey(cmdSpill *sp, uint32_t type, uint64_t hash,
+                     const char *key, uint32_t len, cmdSpillSink sink,
+                     void *arg, unsigned int *count)
+{
+    cmdSpillRun **group, want, *r;
+    unsigned int i, g = 0;
+    int rv = -1, cmds;
+
+    *count = 0;
+
+    if(!sp->count)
+        return 0;
+
+    if((group = malloc(sizeof(*group) * sp->count)) == NULL)
+        return -1;
+
+    // Just enough of a run to compare the ones we read against
+    memset(&want, 0, sizeof(want));
+    want.rec.hash = hash;
+    want.rec.type = type;
+    want.rec.len = len;
+    want.key = (char *)key;
+
+    // Runs are sorted, so we can stop reading each at the key or past it
+    for(i=0;i<sp->count;i++) {
+        r = &sp->runs[i];
+
+        if(fseek(r->fd, 0, SEEK_SET) != 0)
+            goto done;
+
+        while((cmds = __run_next(r)) == 1 && __cmp_run(r, &want) < 0)
+            ;
+
+        if(cmds < 0)
+            goto done;
+        if(cmds == 1 && !__cmp_run(r, &want))
+            group[g++] = r;
+    }
+
+    if(g && (cmds = __group_sink(group, g, sink, arg)) < 0)
+        goto done;
+
+    *count = g ? cmds : 0;
+
+    // We've no idea what a merge would count now
+    sp->merged = 0;
+    rv = 0;
+
+done:
+    free(group);
+
+    return rv;
+}
@@ -0,0 +1,151 @@
+#ifndef REDIS_CMD_SPILL_H
+#define REDIS_CMD_SPILL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cmdhash.h"
+
+/**
+ * Smallest memory budget we'll honour, the bounds of each run's stdio buffer,
+ * and how many runs we'll merge at once
+ */
+#define SPILL_MIN_MEMORY (4*1024*1024)
+#define SPILL_IO_SIZE (1024*1024)
+#define SPILL_MIN_IO (16*1024)
+#define SPILL_MAX_FANIN 64
+
+/**
+ * Record header for one key in a run.  Records are sorted by TYPE_CLASS, then
+ * hash, length and bytes of the key, and size bytes of members (each a
+ * cmdSpillMember followed by its bytes, sorted the same way) follow the key.
+ * SPILL_INTEGER is set when member values are integers, and SPILL_PART when
+ * the next record is more of the same key, which it couldn't be combined with.
+ * Saved state also lists keys we pass through, as records flagged
+ * SPILL_PASSED with no members.
+ */
+#define SPILL_INTEGER 1
+#define SPILL_PART 2
+#define SPILL_PASSED 4
+
+typedef struct _cmdSpillRecord {
+    uint64_t hash;
+    uint64_t size;
+    uint32_t type;
+    uint32_t len;
+    uint32_t count;
+    uint32_t flags;
+} cmdSpillRecord;
+
+/**
+ * A member's flags and value are those of its cmdMemberList
+ */
+typedef struct _cmdSpillMember {
+    uint64_t hash;
+    uint32_t len;
+    uint32_t flags;
+    union {
+        double score;
+        long long value;
+    };
+} cmdSpillMember;
+
+/**
+ * Merge callback, given every member a key merges to and then a NULL member
+ * once the key is done.  Returns -1 on error, and otherwise the number of
+ * commands written once the key is done.
+ */
+typedef int (*cmdSpillSink)(void *arg, const cmdSpillRecord *rec,
+                            const char *key, const cmdSpillMember *m,
+                            const char *member);
+
+/**
+ * Whether a merge should leave a key out, as something already written
+ */
+typedef int (*cmdSpillSkip)(void *arg, const cmdSpillRecord *rec,
+                            const char *key);
+
+/**
+ * One run file, with the record we're currently positioned on while merging
+ */
+typedef struct _cmdSpillRun {
+    FILE *fd;
+
+    cmdSpillRecord rec;
+    char *key;
+    size_t keycap;
+
+    /**
+     * The record's members, and our position in them
+     */
+    char *members;
+    size_t memcap;
+    size_t pos;
+    uint32_t left;
+
+    /**
+     * How many merges deep this run is, zero for one we spilled ourselves
+     */
+    unsigned int level;
+} cmdSpillRun;
+
+/**
+ * Every run a cmdHash has spilled.  Run files are unlinked as soon as they
+ * are created, so they disappear once we close them.  Runs are merged into
+ * bigger ones as they pile up, so written counts every run we spilled.
+ */
+typedef struct _cmdSpill {
+    char dir[1024];
+    size_t io_size;
+
+    cmdSpillRun *runs;
+    unsigned int count;
+    unsigned int size;
+    unsigned int written;
+
+    /**
+     * Keys we leave out of every merge (and runs we merge into)
+     */
+    cmdSpillSkip skip;
+    void *skip_arg;
+
+    /**
+     * Command count from our last merge
+     */
+    int merged;
+    unsigned int merged_count;
+} cmdSpill;
+
+// Allocation, deallocation
+cmdSpill *cmdSpillCreate(const char *dir, size_t memory);
+void cmdSpillFree(cmdSpill *sp);
+
+// Create an anonymous file in dir (or /tmp), which is gone once it's closed
+FILE *cmdSpillOpen(const char *dir);
+
+// Remove every run, so we can spill into the same directory again
+void cmdSpillReset(cmdSpill *sp);
+
+// Write the contents of every container in a cmdHash as sorted records,
+// either to a file of our own or to a new run
+int cmdSpillWriteHash(FILE *fd, cmdHash *ht);
+int cmdSpillWrite(cmdSpill *sp, cmdHash *ht);
+
+// Merge every run, summing increments (or taking the last value set) and
+// unioning set members, handing each key to sink and totalling its counts.
+// We merge no more than SPILL_MAX_FANIN runs at once, merging our smallest
+// runs together first if we have more.
+int cmdSpillMerge(cmdSpill *sp, cmdSpillSink sink, void *arg,
+                  unsigned int *count);
+
+// Merge every run the same way, writing the keys to fd as sorted records
+int cmdSpillMergeTo(cmdSpill *sp, FILE *fd);
+
+// Merge just one key (along with the other form of its counter), so it
+// can be written out ahead of everything else.  Skipping it afterwards is
+// up to our skip callback.
+int cmdSpillMergeKey(cmdSpill *sp, uint32_t type, uint64_t hash,
+                     const char *key, uint32_t len, cmdSpillSink sink,
+                     void *arg, unsigned int *count);
+
+#endif
@@ -0,0 +1,277 @@
+/**
+ * Open addressing hash table with incremental rehashing
+ */
+
+#include "table.h"
+
+/**
+ * Round up to the next power of two, no larger than TABLE_MAX_SIZE
+ */
+static inline uint32_t __table_size(uint32_t size) {
+    uint32_t n = TABLE_MIN_SIZE;
+
+    while(n < size && n < TABLE_MAX_SIZE)
+        n <<= 1;
+
+    return n;
+}
+
+int cmdTableInit(cmdTable *t, uint32_t size) {
+    memset(t, 0, sizeof(cmdTable));
+
+    size = __table_size(size);
+
+    if((t->slots = calloc(size, sizeof(cmdTableSlot))) == NULL)
+        return -1;
+
+    t->mask = size-1;
+
+    return 0;
+}
+
+void cmdTableFree(cmdTable *t) {
+    free(t->slots);
+    free(t->old);
+    memset(t, 0, sizeof(cmdTable));
+}
+
+void cmdTableClear(cmdTable *t) {
+    // Items we hadn't migrated yet are gone too
+    free(t->old);
+    t->old = NULL;
+    t->oldmask = t->migrated = 0;
+
+    if(t->slots)
+        memset(t->slots, 0, ((size_t)t->mask + 1) * sizeof(cmdTableSlot));
+
+    t->used = 0;
+}
+
+/**
+ * Probe a slot array for an item
+ */
+static inline void *__probe(cmdTableSlot *slots, uint32_t mask, uint64_t hash,
+                            cmdTableMatch match, const char *str, size_t len)
+{
+    uint32_t i = hash & mask;
+
+    while(slots[i].item != NULL) {
+        if(slots[i].hash == hash && match(slots[i].item, str, len))
+            return slots[i].item;
+
+        i = (i+1) & mask;
+    }
+
+    return NULL;
+}
+
+void *cmdTableFind(cmdTable *t, uint64_t hash, cmdTableMatch match,
+                   const char *str, size_t len)
+{
+    void *item = NULL;
+
+    if(t->slots)
+        item = __probe(t->slots, t->mask, hash, match, str, len);
+
+    // Items that haven't been migrated yet are still in the old table.  We
+    // never remove anything from it, so its probe sequences are intact.
+    if(item == NULL && t->old)
+        item = __probe(t->old, t->oldmask, hash, match, str, len);
+
+    return item;
+}
+
+/**
+ * Place an item in the first free slot of its probe sequence
+ */
+static inline void __place(cmdTableSlot *slots, uint32_t mask, uint64_t hash,
+                           void *item)
+{
+    uint32_t i = hash & mask;
+
+    while(slots[i].item != NULL)
+        i = (i+1) & mask;
+
+    slots[i].hash = hash;
+    slots[i].item = item;
+}
+
+/**
+ * Move up to count slots from our old table into the new one
+ */
+static void __migrate(cmdTable *t, uint32_t count) {
+    cmdTableSlot *slot;
+
+    while(count-- && t->migrated <= t->oldmask) {
+        slot = &t->old[t->migrated++];
+        if(slot->item)
+            __place(t->slots, t->mask, slot->hash, slot->item);
+    }
+
+    // We're done with the old table once everything has moved
+    if(t->migrated > t->oldmask) {
+        free(t->old);
+        t->old = NULL;
+        t->oldmask = 0;
+        t->migrated = 0;
+    }
+}
+
+/**
+ * Start migrating into a table twice the size
+ */
+static int __grow(cmdTable *t) {
+    uint32_t size;
+    cmdTableSlot *slots;
+
+    // Doubling this table wouldn't fit in our mask
+    if(t->slots && t->mask >= UINT32_MAX / 2)
+        return -1;
+
+    size = t->slots ? (t->mask+1)*2 : TABLE_MIN_SIZE;
+
+    // Finish any migration that's still in progress first
+    if(t->old)
+        __migrate(t, t->oldmask+1);
+
+    if((slots = calloc(size, sizeof(cmdTableSlot))) == NULL)
+        return -1;
+
+    t->old = t->slots;
+    t->oldmask = t->mask;
+    t->migrated = 0;
+
+    t->slots = slots;
+    t->mask = size-1;
+
+    // Nothing to migrate if this was our first allocation
+    if(t->old == NULL)
+        t->oldmask = 0;
+
+    return 0;
+}
+
+int cmdTableInsert(cmdTable *t, uint64_t hash, void *item) {
+    // Grow if this insert would push us over our load factor
+    if(!t->slots || (uint64_t)(t->used+1)*100 > (uint64_t)(t->mask+1)*TABLE_MAX_LOAD) {
+        if(__grow(t) < 0)
+            return -1;
+    }
+
+    // Keep any migration moving along
+    if(t->old)
+        __migrate(t, TABLE_REHASH_STEP);
+
+    __place(t->slots, t->mask, hash, item);
+    t->used++;
+
+    return 0;
+}
+
+int cmdTableRemove(cmdTable *t, uint64_t hash, const void *item) {
+    uint32_t i, j, k;
+
+    if(!t->slots)
+        return -1;
+
+    // The old table's probe sequences must stay intact, so finish moving
+    // everything out of it before we take anything away.
+    if(t->old)
+        __migrate(t, t->oldmask+1);
+
+    for(i = hash & t->mask; t->slots[i].item != item; i = (i+1) & t->mask) {
+        if(t->slots[i].item == NULL)
+            return -1;
+    }
+
+    // Shift back anything later in the run that would no longer be found
+    // across the hole we're leaving.
+    for(j = (i+1) & t->mask; t->slots[j].item != NULL; j = (j+1) & t->mask) {
+        k = t->slots[j].hash & t->mask;
+
+        if(i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+
+    t->slots[i].item = NULL;
+    t->used--;
+
+    return 0;
+}
+
+size_t cmdTableMemory(const cmdTable *t) {
+    size_t slots = 0;
+
+    if(t->slots)
+        slots += (size_t)t->mask + 1;
+    if(t->old)
+        slots += (size_t)t->oldmask + 1;
+
+    return slots * sizeof(cmdTableSlot);
+}
+
+/**
+ * Add up how far each item in a slot array sits from its home slot
+ */
+static uint64_t __probes(const cmdTableSlot *slots, uint32_t mask, uint32_t from,
+                         uint32_t *max)
+{
+    uint64_t total = 0;
+    uint32_t i, len;
+
+    for(i=from;i<=mask;i++) {
+        if(slots[i].item == NULL)
+            continue;
+
+        len = ((i - (uint32_t)slots[i].hash) & mask) + 1;
+        if(len > *max)
+            *max = len;
+
+        total += len;
+    }
+
+    return total;
+}
+
+uint64_t cmdTableProbes(const cmdTable *t, uint32_t *max) {
+    uint64_t total = 0;
+
+    if(t->slots)
+        total += __probes(t->slots, t->mask, 0, max);
+    if(t->old)
+        total += __probes(t->old, t->oldmask, t->migrated, max);
+
+    return total;
+}
+
+void cmdTableIterInit(cmdTableIter *it, cmdTable *t) {
+    it->t = t;
+    it->pos = 0;
+    it->old = 0;
+}
+
+void *cmdTableNext(cmdTableIter *it) {
+    cmdTable *t = it->t;
+    void *item;
+
+    // Everything in our current slot array
+    while(!it->old && t->slots && it->pos <= t->mask) {
+        if((item = t->slots[it->pos++].item) != NULL)
+            return item;
+    }
+
+    // Then anything that hasn't been migrated out of the old one
+    if(!it->old) {
+        it->old = 1;
+        it->pos = t->migrated;
+    }
+
+    while(t->old && it->pos <= t->oldmask) {
+        if((item = t->old[it->pos++].item) != NULL)
+            return item;
+    }
+
+    return NULL;
+}
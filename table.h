@@ -0,0 +1,113 @@
+#ifndef REDIS_CMD_TABLE_H
+#define REDIS_CMD_TABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Smallest table we'll allocate
+ */
+#define TABLE_MIN_SIZE 4
+
+/**
+ * Largest table we'll start with.  Tables can still double past this
+ * by growing, up to the most slots a uint32_t mask can address.
+ */
+#define TABLE_MAX_SIZE (1U << 30)
+
+/**
+ * How many old slots we migrate for every insert while rehashing
+ */
+#define TABLE_REHASH_STEP 16
+
+/**
+ * Grow once the table is this full (out of 100)
+ */
+#define TABLE_MAX_LOAD 75
+
+/**
+ * A slot holds the item's full hash so we can skip non matching items
+ * without touching them, and so growing the table never has to rehash
+ * anything.  A NULL item marks an empty slot.
+ */
+typedef struct _cmdTableSlot {
+    uint64_t hash;
+    void *item;
+} cmdTableSlot;
+
+/**
+ * Open addressing (linear probing) hash table of pointers.  The table
+ * doesn't know anything about the items it stores, callers provide a
+ * match function to compare candidates that share a hash.
+ *
+ * When the table grows we keep the old slot array around and move a few
+ * of its items into the new one on every insert, rather than rehashing
+ * everything at once.
+ */
+typedef struct _cmdTable {
+    /**
+     * Slots, and the mask for their (power of two) size
+     */
+    cmdTableSlot *slots;
+    uint32_t mask;
+
+    /**
+     * Total items stored
+     */
+    uint32_t used;
+
+    /**
+     * Slot array we're migrating away from, its mask, and how many of its
+     * slots have been migrated so far.
+     */
+    cmdTableSlot *old;
+    uint32_t oldmask;
+    uint32_t migrated;
+} cmdTable;
+
+/**
+ * Iterator over every item in a table.  The table must not be modified
+ * while it is being iterated.
+ */
+typedef struct _cmdTableIter {
+    cmdTable *t;
+    uint32_t pos;
+    int old;
+} cmdTableIter;
+
+/**
+ * Returns nonzero if item is the one identified by str/len
+ */
+typedef int (*cmdTableMatch)(const void *item, const char *str, size_t len);
+
+// Create a table with room for at least size slots, and free it.  A table
+// that is zeroed out is also valid, and will allocate on first insert.
+int cmdTableInit(cmdTable *t, uint32_t size);
+void cmdTableFree(cmdTable *t);
+
+// Remove every item, keeping our slots
+void cmdTableClear(cmdTable *t);
+
+// Look up an item, returning NULL if it isn't there
+void *cmdTableFind(cmdTable *t, uint64_t hash, cmdTableMatch match,
+                   const char *str, size_t len);
+
+// Insert an item we know isn't in the table
+int cmdTableInsert(cmdTable *t, uint64_t hash, void *item);
+
+// Remove an item, returning -1 if it isn't in the table
+int cmdTableRemove(cmdTable *t, uint64_t hash, const void *item);
+
+// Bytes allocated for slots, including any old slots we're migrating from
+size_t cmdTableMemory(const cmdTable *t);
+
+// Slots we'd look at to find every item we hold, added up.  The most any
+// one item takes is kept in *max if it's more than what's there already.
+uint64_t cmdTableProbes(const cmdTable *t, uint32_t *max);
+
+// Iteration
+void cmdTableIterInit(cmdTableIter *it, cmdTable *t);
+void *cmdTableNext(cmdTableIter *it);
+
+#endif